@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# Copyright 2023, Quentin L. Barnes
+#
+# Time two builds of a utility on the corpus from mkcorpus and report
+# the speedup of the second over the first.
+#
+# Usage: bench.sh [-n runs] base_binary new_binary corpus_dir
+#
+# Each workload is run the given number of times (default 5) with
+# each binary, alternating between them, and the best wall clock time
+# is kept.  The utility is told apart by the binary's name.
+
+runs=5
+
+while getopts n: opt; do
+	case $opt in
+	n)	runs=$OPTARG ;;
+	*)	exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 3 ]; then
+	echo "Usage: $0 [-n runs] base_binary new_binary corpus_dir" >&2
+	exit 1
+fi
+
+base=$1
+new=$2
+corpus=$3
+
+case $(basename "$new") in
+stripcmd*)
+	workloads="
+cmd:	-qq -b $corpus/*.cmd
+report:	-b $corpus/*.cmd"
+	;;
+*)
+	workloads="
+large-old:	$corpus/large-old.asm
+large-new:	-c $corpus/large-new.asm
+strip-nums:	-s $corpus/large-old.asm
+parallel:	-j 0 $corpus/large-old.asm
+batch-tar:	-b $corpus/s*.asm"
+	;;
+esac
+
+
+# Run "$@" with output discarded, printing the elapsed nanoseconds.
+elapsed() {
+	start=$(date +%s%N)
+	"$@" >/dev/null 2>&1
+	end=$(date +%s%N)
+	echo $((end - start))
+}
+
+best() {
+	[ -z "$1" ] || [ "$2" -lt "$1" ] && echo "$2" || echo "$1"
+}
+
+secs() {
+	awk -v ns="$1" 'BEGIN { printf "%.3f", ns / 1e9 }'
+}
+
+ratio() {
+	awk -v b="$1" -v n="$2" 'BEGIN { printf "%.2f", b / n }'
+}
+
+
+printf '%s %s\n' "$(basename "$new")" "$(uname -sm)"
+printf 'Best of %d runs, seconds\n\n' "$runs"
+printf '%-12s %10s %10s %9s\n' workload base new speedup
+
+total_base=0
+total_new=0
+
+while IFS='	' read -r name args; do
+	[ -n "$name" ] || continue
+	name=${name%:}
+	b= n=
+	i=0
+	while [ $i -lt "$runs" ]; do
+		# shellcheck disable=SC2086
+		b=$(best "$b" "$(elapsed "$base" $args)")
+		# shellcheck disable=SC2086
+		n=$(best "$n" "$(elapsed "$new" $args)")
+		i=$((i + 1))
+	done
+	total_base=$((total_base + b))
+	total_new=$((total_new + n))
+	printf '%-12s %10s %10s %8sx\n' "$name" "$(secs $b)" "$(secs $n)" \
+		"$(ratio $b $n)"
+done <<EOF_WORKLOADS
+$workloads
+EOF_WORKLOADS
+
+printf '%-12s %10s %10s %8sx\n' total "$(secs $total_base)" \
+	"$(secs $total_new)" "$(ratio $total_base $total_new)"
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Write the benchmark and profile training corpus into a directory.
+ *
+ * The corpus is generated rather than stored so the repository stays
+ * small, and from a fixed seed so every build trains and measures on
+ * exactly the same bytes.  It holds:
+ *
+ *   large-old.asm	Big EDTASM file, older format with a file header
+ *   large-new.asm	Big EDTASM file, newer format (tab separators)
+ *   sNNN.asm		Small EDTASM files of both formats
+ *   cNNN.cmd		CMD files, most with trailing junk
+ *
+ * The source lines mimic real Z80 listings: labels, mnemonics with
+ * operands, full line comments and blank lines in about the mix found
+ * in the original Radio Shack sources.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+
+#define	LARGE_OLD_SIZE	(24L * 1024 * 1024)
+#define	LARGE_NEW_SIZE	(8L * 1024 * 1024)
+#define	NSMALL		200
+#define	NCMD		200
+
+
+static unsigned long	Seed = 0x54525338;	/* "TRS8" */
+
+static const char *const Mnemonics[] = {
+	"LD\tA,(HL)", "LD\t(IX+5),A", "LD\tHL,BUFFER", "LD\tDE,0", "LD\tB,10",
+	"INC\tHL", "DEC\tBC", "ADD\tA,C", "SUB\t'0'", "AND\t7FH", "OR\tA",
+	"CP\t0DH", "JR\tNZ,LOOP", "JR\tZ,DONE", "JP\tNZ,START", "DJNZ\tLOOP",
+	"CALL\t0033H", "CALL\tPRINT", "RET", "RET\tZ", "PUSH\tHL", "POP\tDE",
+	"EX\tDE,HL", "LDIR", "HALT", "DI", "EI", "OUT\t(0FFH),A",
+	"DEFM\t'HELLO, WORLD'", "DEFB\t0DH", "DEFW\tSTART", "DEFS\t256",
+	"EQU\t4000H", "ORG\t5200H", "END\tSTART"
+};
+
+static const char *const Labels[] = {
+	"START", "LOOP", "DONE", "PRINT", "BUFFER", "GETKEY", "CLS", "EXIT",
+	"NEXT", "SKIP"
+};
+
+static const char *const Comments[] = {
+	"; Print the message",
+	"; Wait for a key",
+	"; Copy the buffer down",
+	"; Convert to upper case",
+	"; *** MAIN LOOP ***",
+	";",
+	"; Return to DOS"
+};
+
+
+static unsigned long
+rnd(unsigned long n)
+{
+	Seed = Seed * 1103515245 + 12345;
+
+	return ((Seed >> 8) & 0xffffff) % n;
+}
+
+
+#define	PICK(a)	((a)[rnd(sizeof(a) / sizeof((a)[0]))])
+
+
+static void
+put_line(FILE *fp, unsigned long linenum, int sep)
+{
+	int	i;
+	char	digits[6];
+
+	sprintf(digits, "%05lu", linenum % 100000);
+	for (i = 0; i < 5; ++i)
+		putc(digits[i] | 0x80, fp);
+	putc(sep, fp);
+
+	switch (rnd(10)) {
+	case 0:
+		fputs(PICK(Comments), fp);
+		break;
+	case 1:
+		break;
+	case 2: case 3:
+		fprintf(fp, "%s\t%s", PICK(Labels), PICK(Mnemonics));
+		break;
+	default:
+		fprintf(fp, "\t%s", PICK(Mnemonics));
+		if (rnd(3) == 0)
+			fprintf(fp, "\t\t%s", PICK(Comments));
+		break;
+	}
+
+	putc(0x0d, fp);
+}
+
+
+static void
+write_edtasm(FILE *fp, long size, int newer)
+{
+	unsigned long	linenum = 0;
+
+	if (!newer) {
+		putc(0xd3, fp);
+		fputs("CORPUS", fp);
+	}
+
+	while (ftell(fp) < size)
+		put_line(fp, linenum += 10, newer ? '\t' : ' ');
+
+	putc(0x1a, fp);
+}
+
+
+static void
+write_cmd(FILE *fp)
+{
+	unsigned int	addr = 0x5200 + rnd(0x100) * 0x10;
+	unsigned int	xfer = addr;
+	int		nblocks = 1 + rnd(40);
+	int		i, len;
+
+	if (rnd(4)) {
+		fputc(0x05, fp);
+		fputc(6, fp);
+		fprintf(fp, "%-6.6s", PICK(Labels));
+	}
+
+	if (rnd(3) == 0) {
+		const char	*c = "Copyright 1985";
+
+		fputc(0x1f, fp);
+		fputc((int)strlen(c), fp);
+		fputs(c, fp);
+	}
+
+	for (i = 0; i < nblocks; ++i) {
+		len = rnd(4) ? 256 : 1 + rnd(256);
+		fputc(0x01, fp);
+		fputc((len + 2) & 0xff, fp);
+		fputc(addr & 0xff, fp);
+		fputc(addr >> 8, fp);
+		while (len--)
+			fputc(rnd(256), fp);
+		addr += 0x100;
+	}
+
+	fputc(0x02, fp);
+	fputc(0x02, fp);
+	fputc(xfer & 0xff, fp);
+	fputc(xfer >> 8, fp);
+
+	/* Junk left by DOSes that round files up to whole sectors. */
+	for (len = rnd(3) ? rnd(256) : 0; len > 0; --len)
+		fputc(rnd(256), fp);
+}
+
+
+static FILE *
+create(const char *dir, const char *name)
+{
+	char	path[4096];
+	FILE	*fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!(fp = fopen(path, "wb"))) {
+		fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+			path, strerror(errno), errno);
+		exit(3);
+	}
+
+	return fp;
+}
+
+
+static void
+finish(FILE *fp)
+{
+	if (ferror(fp) || fclose(fp) == EOF) {
+		fprintf(stderr, "Error writing corpus, %s (%d)\n",
+			strerror(errno), errno);
+		exit(3);
+	}
+}
+
+
+int
+main(int argc, char **argv)
+{
+	char	name[32];
+	FILE	*fp;
+	int	i;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s dir\n", argv[0]);
+		return 1;
+	}
+
+	fp = create(argv[1], "large-old.asm");
+	write_edtasm(fp, LARGE_OLD_SIZE, 0);
+	finish(fp);
+
+	fp = create(argv[1], "large-new.asm");
+	write_edtasm(fp, LARGE_NEW_SIZE, 1);
+	finish(fp);
+
+	for (i = 0; i < NSMALL; ++i) {
+		sprintf(name, "s%03d.asm", i);
+		fp = create(argv[1], name);
+		write_edtasm(fp, 1024 + rnd(48 * 1024), i & 1);
+		finish(fp);
+	}
+
+	for (i = 0; i < NCMD; ++i) {
+		sprintf(name, "c%03d.cmd", i);
+		fp = create(argv[1], name);
+		write_cmd(fp);
+		finish(fp);
+	}
+
+	return 0;
+}
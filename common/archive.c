@@ -0,0 +1,978 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Sequential tar and zip archive reading and writing.
+ *
+ * Archives are only ever read forwards so they can be streamed from a
+ * pipe.  Tar members are read straight out of the stream.  Zip members
+ * are found through their local file headers rather than the central
+ * directory at the end, and deflated members are inflated as they are
+ * read.  Each regular file member is returned whole in memory.
+ *
+ * Tar format: POSIX ustar headers, with GNU long names ('L') and pax
+ * extended headers ('x') supplying the "path" of the next member.
+ *
+ * Zip format: stored (0) and deflated (8) members, with or without a
+ * trailing data descriptor.  A stored member with a descriptor has no
+ * size up front, so it runs to the first signed descriptor whose sizes
+ * and CRC agree with the data before it.  Encrypted and Zip64 members
+ * are rejected.
+ *
+ * Written zip archives hold stored members only.  The sizes and CRC
+ * are known before each local header goes out so no data descriptors
+ * are needed, and the central directory is kept in memory until the
+ * end.  Zip64 end records and offsets are used once an archive passes
+ * 65535 entries or 4 GiB.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "archive.h"
+#include "inflate.h"
+
+
+#define	TAR_BLOCK	512
+
+#define	ZIP_LOCAL_SIG	0x04034b50
+#define	ZIP_DESC_SIG	0x08074b50
+#define	ZIP_CENTRAL_SIG	0x02014b50
+#define	ZIP_END_SIG	0x06054b50
+#define	ZIP64_END_SIG	0x06064b50
+#define	ZIP64_LOC_SIG	0x07064b50
+#define	ZIP64_EXTRA_ID	0x0001
+
+#define	ZIP_FL_ENCRYPTED	0x0001
+#define	ZIP_FL_DESCRIPTOR	0x0008
+
+#define	ZIP_STORED	0
+#define	ZIP_DEFLATED	8
+
+
+struct ar_reader {
+	FILE		*fp;
+	enum ar_format	format;
+
+	/* Bytes read while detecting the format, handed out first. */
+	unsigned char	pend[TAR_BLOCK];
+	size_t		pendlen;
+	size_t		pendoff;
+
+	char		*name;
+	size_t		namecap;
+	char		*longname;	/* Name for the next tar member */
+	unsigned char	*data;
+	size_t		datacap;
+
+	const char	*err;
+	int		done;
+};
+
+struct zip_entry {
+	char		*name;
+	uint32_t	crc;
+	uint32_t	size;
+	uint64_t	offset;
+	unsigned int	time;
+	unsigned int	date;
+	unsigned int	mode;
+};
+
+struct ar_writer {
+	FILE			*fp;
+	enum ar_format		format;
+
+	/* Zip only. */
+	uint64_t		offset;
+	struct zip_entry	*entries;
+	size_t			nentries;
+	size_t			entcap;		/* In bytes */
+};
+
+
+/* CRC-32 (IEEE 802.3) a nibble at a time from a constant table. */
+static uint32_t
+crc32_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	static const uint32_t	tab[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *buf++;
+		crc = (crc >> 4) ^ tab[crc & 0x0f];
+		crc = (crc >> 4) ^ tab[crc & 0x0f];
+	}
+
+	return ~crc;
+}
+
+
+static size_t
+ar_read(struct ar_reader *ar, void *buf, size_t len)
+{
+	size_t	n = 0;
+
+	if (ar->pendoff < ar->pendlen) {
+		n = ar->pendlen - ar->pendoff;
+		if (n > len)
+			n = len;
+		memcpy(buf, ar->pend + ar->pendoff, n);
+		ar->pendoff += n;
+	}
+
+	if (n < len)
+		n += fread((char *)buf + n, 1, len - n, ar->fp);
+
+	return n;
+}
+
+
+static int
+ar_skip(struct ar_reader *ar, size_t len)
+{
+	unsigned char	buf[TAR_BLOCK];
+
+	while (len > 0) {
+		size_t	n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (ar_read(ar, buf, n) != n)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+static int
+grow(void *bufp, size_t *capp, size_t need)
+{
+	void	*nbuf;
+	size_t	ncap = *capp ? *capp : 256;
+
+	if (need <= *capp)
+		return 0;
+
+	while (ncap < need)
+		ncap *= 2;
+
+	if (!(nbuf = realloc(*(void **)bufp, ncap)))
+		return -1;
+
+	*(void **)bufp = nbuf;
+	*capp = ncap;
+
+	return 0;
+}
+
+
+static int
+set_name(struct ar_reader *ar, const char *name, size_t len)
+{
+	if (grow(&ar->name, &ar->namecap, len + 1))
+		return -1;
+
+	memcpy(ar->name, name, len);
+	ar->name[len] = '\0';
+
+	return 0;
+}
+
+
+static unsigned int
+get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) |
+		((uint32_t)p[3] << 24);
+}
+
+
+/* Octal with optional space/NUL padding, or GNU base-256. */
+static unsigned long long
+tar_num(const unsigned char *p, size_t len)
+{
+	unsigned long long	val = 0;
+
+	if (*p & 0x80) {
+		val = *p++ & 0x3f;
+		while (--len)
+			val = (val << 8) | *p++;
+		return val;
+	}
+
+	while (len && *p == ' ') {
+		++p;
+		--len;
+	}
+	while (len && *p >= '0' && *p <= '7') {
+		val = (val << 3) | (*p++ - '0');
+		--len;
+	}
+
+	return val;
+}
+
+
+static int
+tar_cksum_ok(const unsigned char *hdr)
+{
+	unsigned long	sum = 0;
+	int		i;
+
+	for (i = 0; i < TAR_BLOCK; ++i)
+		sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+	return sum == tar_num(hdr + 148, 8);
+}
+
+
+static int
+all_zero(const unsigned char *p, size_t len)
+{
+	while (len--)
+		if (*p++)
+			return 0;
+	return 1;
+}
+
+
+/* Pick the "path" record out of a pax extended header, len bytes
+ * followed by a NUL.  Each record is "length keyword=value\n"; a
+ * malformed one ends the header. */
+static int
+pax_path(struct ar_reader *ar, const char *rec, size_t len)
+{
+	const char	*end = rec + len;
+
+	while (rec < end) {
+		char		*ep;
+		unsigned long	rlen = strtoul(rec, &ep, 10);
+
+		if (*ep != ' ' || rlen == 0 || rlen > (size_t)(end - rec) ||
+		    ep + 1 >= rec + rlen || rec[rlen - 1] != '\n')
+			return 0;
+
+		if (ep + 6 <= rec + rlen - 1 && !strncmp(ep + 1, "path=", 5)) {
+			const char	*val = ep + 6;
+			size_t		vlen = rec + rlen - 1 - val;
+
+			free(ar->longname);
+			if (!(ar->longname = malloc(vlen + 1)))
+				return -1;
+			memcpy(ar->longname, val, vlen);
+			ar->longname[vlen] = '\0';
+		}
+
+		rec += rlen;
+	}
+
+	return 0;
+}
+
+
+static int
+tar_next(struct ar_reader *ar, struct ar_member *m)
+{
+	unsigned char	hdr[TAR_BLOCK];
+
+	for (;;) {
+		unsigned long long	size;
+		size_t			n, padded;
+		int			type;
+
+		n = ar_read(ar, hdr, TAR_BLOCK);
+		if (n == 0 || all_zero(hdr, n)) {
+			/* Some writers omit the end-of-archive blocks. */
+			ar->done = 1;
+			return 0;
+		}
+		if (n != TAR_BLOCK) {
+			ar->err = "Truncated tar header";
+			return -1;
+		}
+		if (!tar_cksum_ok(hdr)) {
+			ar->err = "Bad tar header checksum";
+			return -1;
+		}
+
+		size = tar_num(hdr + 124, 12);
+		if (size > (size_t)-1 - TAR_BLOCK) {
+			ar->err = "Tar member too large";
+			return -1;
+		}
+		padded = (size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1);
+		type = hdr[156];
+
+		if (type == '0' || type == '\0' || type == '7' ||
+		    type == 'L' || type == 'x') {
+			if (grow(&ar->data, &ar->datacap, padded + 1)) {
+				ar->err = "Out of memory";
+				return -1;
+			}
+			if (ar_read(ar, ar->data, padded) != padded) {
+				ar->err = "Truncated tar member";
+				return -1;
+			}
+		} else {
+			if (ar_skip(ar, padded)) {
+				ar->err = "Truncated tar member";
+				return -1;
+			}
+			free(ar->longname);
+			ar->longname = NULL;
+			continue;
+		}
+
+		if (type == 'L') {
+			free(ar->longname);
+			if (!(ar->longname = malloc(size + 1))) {
+				ar->err = "Out of memory";
+				return -1;
+			}
+			memcpy(ar->longname, ar->data, size);
+			ar->longname[size] = '\0';
+			continue;
+		}
+
+		if (type == 'x') {
+			ar->data[size] = '\0';
+			if (pax_path(ar, (char *)ar->data, size)) {
+				ar->err = "Out of memory";
+				return -1;
+			}
+			continue;
+		}
+
+		if (ar->longname) {
+			if (set_name(ar, ar->longname, strlen(ar->longname)))
+				goto nomem;
+			free(ar->longname);
+			ar->longname = NULL;
+		} else if (!memcmp(hdr + 257, "ustar", 5) && hdr[345]) {
+			size_t	plen = strnlen((char *)hdr + 345, 155);
+			size_t	nlen = strnlen((char *)hdr, 100);
+
+			if (grow(&ar->name, &ar->namecap, plen + nlen + 2))
+				goto nomem;
+			memcpy(ar->name, hdr + 345, plen);
+			ar->name[plen] = '/';
+			memcpy(ar->name + plen + 1, hdr, nlen);
+			ar->name[plen + nlen + 1] = '\0';
+		} else if (set_name(ar, (char *)hdr,
+				    strnlen((char *)hdr, 100))) {
+			goto nomem;
+		}
+
+		m->name = ar->name;
+		m->data = ar->data;
+		m->size = size;
+		m->mtime = (long)tar_num(hdr + 136, 12);
+		m->mode = (unsigned int)tar_num(hdr + 100, 8) & 07777;
+
+		return 1;
+	}
+
+nomem:
+	ar->err = "Out of memory";
+	return -1;
+}
+
+
+static long
+dos_time(unsigned int time, unsigned int date)
+{
+	struct tm	tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = ((date >> 9) & 0x7f) + 80;
+	tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+	tm.tm_mday = date & 0x1f;
+	tm.tm_hour = (time >> 11) & 0x1f;
+	tm.tm_min = (time >> 5) & 0x3f;
+	tm.tm_sec = (time & 0x1f) * 2;
+	tm.tm_isdst = -1;
+
+	return (long)mktime(&tm);
+}
+
+
+/*
+ * Read a stored member whose size is only in the data descriptor after
+ * it, and that descriptor.  Returns the member's length, or -1.
+ */
+static long long
+zip_stored_desc(struct ar_reader *ar)
+{
+	const unsigned char	*p;
+	size_t			len = 0;
+	int			c;
+
+	for (;;) {
+		if (ar->pendoff < ar->pendlen)
+			c = ar->pend[ar->pendoff++];
+		else if ((c = getc(ar->fp)) == EOF) {
+			ar->err = "Truncated zip member";
+			return -1;
+		}
+		if (grow(&ar->data, &ar->datacap, len + 1)) {
+			ar->err = "Out of memory";
+			return -1;
+		}
+		ar->data[len++] = (unsigned char)c;
+
+		if (len < 16)
+			continue;
+		p = ar->data + len - 16;
+		if (get32(p) == ZIP_DESC_SIG && get32(p + 8) == len - 16 &&
+		    get32(p + 12) == len - 16 &&
+		    crc32_update(0, ar->data, len - 16) == get32(p + 4))
+			return (long long)(len - 16);
+	}
+}
+
+
+static int
+zip_next(struct ar_reader *ar, struct ar_member *m)
+{
+	unsigned char	hdr[26];
+	unsigned char	sig[4];
+
+	for (;;) {
+		unsigned int	flags, method, nlen, xlen;
+		uint32_t	crc, csize, usize;
+		size_t		len;
+
+		if (ar_read(ar, sig, 4) != 4) {
+			ar->err = "Truncated zip file";
+			return -1;
+		}
+
+		switch (get32(sig)) {
+		case ZIP_LOCAL_SIG:
+			break;
+		case ZIP_CENTRAL_SIG:
+		case ZIP_END_SIG:
+			ar->done = 1;
+			return 0;
+		default:
+			ar->err = "Bad zip local header";
+			return -1;
+		}
+
+		if (ar_read(ar, hdr, sizeof(hdr)) != sizeof(hdr)) {
+			ar->err = "Truncated zip local header";
+			return -1;
+		}
+
+		flags = get16(hdr + 2);
+		method = get16(hdr + 4);
+		crc = get32(hdr + 10);
+		csize = get32(hdr + 14);
+		usize = get32(hdr + 18);
+		nlen = get16(hdr + 22);
+		xlen = get16(hdr + 24);
+
+		if (grow(&ar->name, &ar->namecap, nlen + 1))
+			goto nomem;
+		if (ar_read(ar, ar->name, nlen) != nlen || ar_skip(ar, xlen)) {
+			ar->err = "Truncated zip local header";
+			return -1;
+		}
+		ar->name[nlen] = '\0';
+
+		if (flags & ZIP_FL_ENCRYPTED) {
+			ar->err = "Encrypted zip members are not supported";
+			return -1;
+		}
+		if (csize == 0xffffffff || usize == 0xffffffff) {
+			ar->err = "Zip64 members are not supported";
+			return -1;
+		}
+
+		if (method == ZIP_DEFLATED) {
+			int	err;
+
+			if (!(flags & ZIP_FL_DESCRIPTOR) &&
+			    grow(&ar->data, &ar->datacap, (size_t)usize + 1))
+				goto nomem;
+
+			err = inflate_stream(ar->fp, &ar->data, &len,
+						&ar->datacap);
+			if (err) {
+				ar->err = err == -3 ? "Out of memory" :
+					err == -1 ? "Truncated zip member" :
+					"Corrupt deflated zip member";
+				return -1;
+			}
+		} else if (method == ZIP_STORED &&
+			   (flags & ZIP_FL_DESCRIPTOR)) {
+			long long	n = zip_stored_desc(ar);
+
+			if (n < 0)
+				return -1;
+			len = (size_t)n;
+			crc = get32(ar->data + len + 4);
+			usize = (uint32_t)len;
+		} else if (method == ZIP_STORED) {
+			len = csize;
+			if (grow(&ar->data, &ar->datacap, len + 1))
+				goto nomem;
+			if (ar_read(ar, ar->data, len) != len) {
+				ar->err = "Truncated zip member";
+				return -1;
+			}
+		} else {
+			ar->err = "Unsupported zip compression method";
+			return -1;
+		}
+
+		/* A stored member's descriptor is read along with it. */
+		if ((flags & ZIP_FL_DESCRIPTOR) && method == ZIP_DEFLATED) {
+			unsigned char	desc[16];
+
+			if (ar_read(ar, desc, 12) != 12)
+				goto truncated;
+			if (get32(desc) == ZIP_DESC_SIG) {
+				if (ar_read(ar, desc + 12, 4) != 4)
+					goto truncated;
+				crc = get32(desc + 4);
+				usize = get32(desc + 12);
+			} else {
+				crc = get32(desc);
+				usize = get32(desc + 8);
+			}
+		}
+
+		if (len != usize || crc32_update(0, ar->data, len) != crc) {
+			ar->err = "Zip member failed CRC check";
+			return -1;
+		}
+
+		/* Directories. */
+		if (nlen > 0 && ar->name[nlen - 1] == '/')
+			continue;
+
+		m->name = ar->name;
+		m->data = ar->data;
+		m->size = len;
+		m->mtime = dos_time(get16(hdr + 6), get16(hdr + 8));
+		m->mode = 0644;
+
+		return 1;
+	}
+
+truncated:
+	ar->err = "Truncated zip data descriptor";
+	return -1;
+
+nomem:
+	ar->err = "Out of memory";
+	return -1;
+}
+
+
+struct ar_reader *
+ar_open(FILE *fp, const char **errmsg)
+{
+	struct ar_reader	*ar;
+
+	if (!(ar = calloc(1, sizeof(*ar)))) {
+		*errmsg = "Out of memory";
+		return NULL;
+	}
+	ar->fp = fp;
+
+	ar->pendlen = fread(ar->pend, 1, 4, fp);
+	if (ar->pendlen == 4 && ar->pend[0] == 'P' && ar->pend[1] == 'K' &&
+	    ((ar->pend[2] == 3 && ar->pend[3] == 4) ||
+	     (ar->pend[2] == 5 && ar->pend[3] == 6))) {
+		ar->format = AR_ZIP;
+		return ar;
+	}
+
+	ar->pendlen += fread(ar->pend + ar->pendlen, 1,
+				TAR_BLOCK - ar->pendlen, fp);
+	if (ar->pendlen == TAR_BLOCK &&
+	    (all_zero(ar->pend, TAR_BLOCK) || tar_cksum_ok(ar->pend))) {
+		ar->format = AR_TAR;
+		return ar;
+	}
+
+	free(ar);
+	*errmsg = "Not a tar or zip archive";
+
+	return NULL;
+}
+
+
+int
+ar_next(struct ar_reader *ar, struct ar_member *m)
+{
+	if (ar->err)
+		return -1;
+	if (ar->done)
+		return 0;
+
+	return ar->format == AR_ZIP ? zip_next(ar, m) : tar_next(ar, m);
+}
+
+
+const char *
+ar_error(const struct ar_reader *ar)
+{
+	return ar->err;
+}
+
+
+enum ar_format
+ar_format(const struct ar_reader *ar)
+{
+	return ar->format;
+}
+
+
+void
+ar_close(struct ar_reader *ar)
+{
+	free(ar->name);
+	free(ar->longname);
+	free(ar->data);
+	free(ar);
+}
+
+
+struct ar_writer *
+ar_create(FILE *fp, enum ar_format format)
+{
+	struct ar_writer	*aw;
+
+	if ((aw = calloc(1, sizeof(*aw)))) {
+		aw->fp = fp;
+		aw->format = format;
+	}
+
+	return aw;
+}
+
+
+/*
+ * Find the '/' at which a name too long for the ustar name field can
+ * be split into prefix and name, or NULL if there is none.
+ */
+
+static const char *
+name_split(const char *name)
+{
+	size_t		nlen = strlen(name);
+	const char	*slash;
+
+	for (slash = name; (slash = strchr(slash, '/')); ++slash)
+		if (slash - name <= 155 && name + nlen - slash - 1 <= 100)
+			return slash;
+
+	return NULL;
+}
+
+
+static void
+tar_header(unsigned char *hdr, const char *name, size_t size, long mtime,
+	   unsigned int mode, int type)
+{
+	size_t		nlen = strlen(name);
+	const char	*slash;
+	unsigned long	sum = 0;
+	int		i;
+
+	memset(hdr, 0, TAR_BLOCK);
+
+	if (nlen <= 100) {
+		memcpy(hdr, name, nlen);
+	} else if ((slash = name_split(name))) {
+		memcpy(hdr + 345, name, slash - name);
+		memcpy(hdr, slash + 1, name + nlen - slash - 1);
+	} else {
+		/* The caller has already written a GNU long name. */
+		memcpy(hdr, name, 100);
+	}
+
+	sprintf((char *)hdr + 100, "%07o", mode & 07777);
+	sprintf((char *)hdr + 108, "%07o", 0);
+	sprintf((char *)hdr + 116, "%07o", 0);
+	sprintf((char *)hdr + 124, "%011llo", (unsigned long long)size);
+	sprintf((char *)hdr + 136, "%011lo",
+		(unsigned long)(mtime < 0 ? 0 : mtime));
+	hdr[156] = type;
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+
+	memset(hdr + 148, ' ', 8);
+	for (i = 0; i < TAR_BLOCK; ++i)
+		sum += hdr[i];
+	sprintf((char *)hdr + 148, "%06lo", sum);
+}
+
+
+static int
+tar_write(FILE *fp, const unsigned char *hdr, const void *data, size_t size)
+{
+	static const unsigned char	zeros[TAR_BLOCK];
+	size_t				pad = -size & (TAR_BLOCK - 1);
+
+	if (fwrite(hdr, 1, TAR_BLOCK, fp) != TAR_BLOCK ||
+	    fwrite(data, 1, size, fp) != size ||
+	    fwrite(zeros, 1, pad, fp) != pad)
+		return -1;
+
+	return 0;
+}
+
+
+static void
+put16(unsigned char *p, unsigned int val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+}
+
+
+static void
+put32(unsigned char *p, uint32_t val)
+{
+	put16(p, val & 0xffff);
+	put16(p + 2, val >> 16);
+}
+
+
+static void
+put64(unsigned char *p, uint64_t val)
+{
+	put32(p, (uint32_t)val);
+	put32(p + 4, (uint32_t)(val >> 32));
+}
+
+
+static int
+zip_write(struct ar_writer *aw, const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, aw->fp) != len)
+		return -1;
+
+	aw->offset += len;
+
+	return 0;
+}
+
+
+static void
+to_dos_time(long mtime, unsigned int *time, unsigned int *date)
+{
+	time_t		t = mtime;
+	struct tm	*tm = localtime(&t);
+
+	if (!tm || tm->tm_year < 80) {
+		*time = 0;
+		*date = (1 << 5) | 1;
+		return;
+	}
+
+	*time = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+	*date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) |
+		tm->tm_mday;
+}
+
+
+static int
+zip_add(struct ar_writer *aw, const char *name, const void *data,
+	size_t size, long mtime, unsigned int mode)
+{
+	unsigned char		hdr[30];
+	struct zip_entry	*e;
+	size_t			nlen = strlen(name);
+
+	if (size >= 0xffffffff || nlen > 0xffff) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (grow(&aw->entries, &aw->entcap,
+		 (aw->nentries + 1) * sizeof(*e))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	e = &aw->entries[aw->nentries];
+	if (!(e->name = strdup(name))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	e->crc = crc32_update(0, data, size);
+	e->size = (uint32_t)size;
+	e->offset = aw->offset;
+	e->mode = mode;
+	to_dos_time(mtime, &e->time, &e->date);
+	++aw->nentries;
+
+	put32(hdr, ZIP_LOCAL_SIG);
+	put16(hdr + 4, 10);		/* Version needed: 1.0 */
+	put16(hdr + 6, 0);		/* Flags */
+	put16(hdr + 8, ZIP_STORED);
+	put16(hdr + 10, e->time);
+	put16(hdr + 12, e->date);
+	put32(hdr + 14, e->crc);
+	put32(hdr + 18, e->size);
+	put32(hdr + 22, e->size);
+	put16(hdr + 26, nlen);
+	put16(hdr + 28, 0);
+
+	if (zip_write(aw, hdr, sizeof(hdr)) || zip_write(aw, name, nlen) ||
+	    zip_write(aw, data, size))
+		return -1;
+
+	return 0;
+}
+
+
+static int
+zip_finish(struct ar_writer *aw)
+{
+	unsigned char	hdr[56];
+	uint64_t	cdoff = aw->offset;
+	uint64_t	cdsize;
+	size_t		i;
+	int		zip64 = aw->nentries >= 0xffff;
+
+	for (i = 0; i < aw->nentries; ++i) {
+		struct zip_entry	*e = &aw->entries[i];
+		size_t			nlen = strlen(e->name);
+		int			big = e->offset >= 0xffffffff;
+		unsigned char		extra[12];
+
+		put32(hdr, ZIP_CENTRAL_SIG);
+		put16(hdr + 4, (3 << 8) | (big ? 45 : 10));	/* Unix */
+		put16(hdr + 6, big ? 45 : 10);
+		put16(hdr + 8, 0);
+		put16(hdr + 10, ZIP_STORED);
+		put16(hdr + 12, e->time);
+		put16(hdr + 14, e->date);
+		put32(hdr + 16, e->crc);
+		put32(hdr + 20, e->size);
+		put32(hdr + 24, e->size);
+		put16(hdr + 28, nlen);
+		put16(hdr + 30, big ? sizeof(extra) : 0);
+		put16(hdr + 32, 0);		/* Comment length */
+		put16(hdr + 34, 0);		/* Disk number */
+		put16(hdr + 36, 0);		/* Internal attributes */
+		put32(hdr + 38, (uint32_t)(0100000 | (e->mode & 07777)) << 16);
+		put32(hdr + 42, big ? 0xffffffff : (uint32_t)e->offset);
+
+		put16(extra, ZIP64_EXTRA_ID);
+		put16(extra + 2, 8);
+		put64(extra + 4, e->offset);
+
+		if (zip_write(aw, hdr, 46) || zip_write(aw, e->name, nlen) ||
+		    (big && zip_write(aw, extra, sizeof(extra))))
+			return -1;
+
+		zip64 |= big;
+	}
+
+	cdsize = aw->offset - cdoff;
+	zip64 |= cdoff >= 0xffffffff;
+
+	if (zip64) {
+		uint64_t	end64 = aw->offset;
+
+		put32(hdr, ZIP64_END_SIG);
+		put64(hdr + 4, 44);		/* Size of the rest */
+		put16(hdr + 12, (3 << 8) | 45);
+		put16(hdr + 14, 45);
+		put32(hdr + 16, 0);		/* This disk */
+		put32(hdr + 20, 0);		/* Central directory disk */
+		put64(hdr + 24, aw->nentries);
+		put64(hdr + 32, aw->nentries);
+		put64(hdr + 40, cdsize);
+		put64(hdr + 48, cdoff);
+		if (zip_write(aw, hdr, 56))
+			return -1;
+
+		put32(hdr, ZIP64_LOC_SIG);
+		put32(hdr + 4, 0);
+		put64(hdr + 8, end64);
+		put32(hdr + 16, 1);		/* Total disks */
+		if (zip_write(aw, hdr, 20))
+			return -1;
+	}
+
+	put32(hdr, ZIP_END_SIG);
+	put16(hdr + 4, 0);
+	put16(hdr + 6, 0);
+	put16(hdr + 8, zip64 ? 0xffff : aw->nentries);
+	put16(hdr + 10, zip64 ? 0xffff : aw->nentries);
+	put32(hdr + 12, zip64 ? 0xffffffff : (uint32_t)cdsize);
+	put32(hdr + 16, zip64 ? 0xffffffff : (uint32_t)cdoff);
+	put16(hdr + 20, 0);			/* Comment length */
+
+	return zip_write(aw, hdr, 22);
+}
+
+
+int
+ar_add(struct ar_writer *aw, const char *name, const void *data,
+       size_t size, long mtime, unsigned int mode)
+{
+	unsigned char	hdr[TAR_BLOCK];
+
+	if (aw->format == AR_ZIP)
+		return zip_add(aw, name, data, size, mtime, mode);
+
+	if (strlen(name) > 100 && !name_split(name)) {
+		size_t	nlen = strlen(name) + 1;
+
+		tar_header(hdr, "././@LongLink", nlen, 0, 0644, 'L');
+		if (tar_write(aw->fp, hdr, name, nlen))
+			return -1;
+	}
+
+	tar_header(hdr, name, size, mtime, mode, '0');
+
+	return tar_write(aw->fp, hdr, data, size);
+}
+
+
+int
+ar_finish(struct ar_writer *aw)
+{
+	static const unsigned char	zeros[2 * TAR_BLOCK];
+	int				ret = 0;
+	size_t				i;
+
+	if (aw->format == AR_ZIP)
+		ret = zip_finish(aw);
+	else if (fwrite(zeros, 1, sizeof(zeros), aw->fp) != sizeof(zeros))
+		ret = -1;
+
+	if (fflush(aw->fp))
+		ret = -1;
+
+	for (i = 0; i < aw->nentries; ++i)
+		free(aw->entries[i].name);
+	free(aw->entries);
+	free(aw);
+
+	return ret;
+}
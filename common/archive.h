@@ -0,0 +1,59 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Sequential tar and zip archive reading and writing.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+enum ar_format {
+	AR_TAR,
+	AR_ZIP
+};
+
+/* A regular file member.  The name and data belong to the reader and
+ * stay valid until the next call to ar_next(). */
+struct ar_member {
+	const char	*name;
+	unsigned char	*data;
+	size_t		size;
+	long		mtime;
+	unsigned int	mode;
+};
+
+struct ar_reader;
+struct ar_writer;
+
+
+/*
+ * Start reading an archive from fp, which is only ever read forward
+ * so it may be a pipe.  The format is detected from the first bytes.
+ * Returns NULL with a message in *errmsg if it isn't a tar or zip file.
+ */
+struct ar_reader *ar_open(FILE *fp, const char **errmsg);
+
+/* Returns 1 with the next regular file in *m, 0 at the end of the
+ * archive or -1 on error (see ar_error()). */
+int ar_next(struct ar_reader *ar, struct ar_member *m);
+
+const char *ar_error(const struct ar_reader *ar);
+enum ar_format ar_format(const struct ar_reader *ar);
+void ar_close(struct ar_reader *ar);
+
+/*
+ * Write a ustar or zip (stored, no compression) archive to fp, which
+ * is only ever written forward so it may be a pipe.  ar_add() returns
+ * 0 or -1 on error; ar_finish() writes the end of the archive (the
+ * central directory for zip) and frees aw.
+ */
+struct ar_writer *ar_create(FILE *fp, enum ar_format format);
+int ar_add(struct ar_writer *aw, const char *name, const void *data,
+	   size_t size, long mtime, unsigned int mode);
+int ar_finish(struct ar_writer *aw);
+
+#endif
@@ -0,0 +1,815 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Batch processing of many inputs on worker threads.
+ *
+ * Inputs live in a ring of slots.  The calling thread fills slots with
+ * file names, or with member data read from archives, in input order.
+ * Worker threads claim filled slots, load the file if need be and run
+ * the conversion into memory.  A single writer thread takes finished
+ * slots strictly in input order and appends their results to the
+ * output, which has a large stdio buffer so entries go out in big
+ * writes.  A slot is refilled only once the writer is done with it,
+ * which bounds memory use however many inputs there are.
+ *
+ * With a journal, the producer skips inputs it records as finished
+ * and the writer adds each input it writes.  Every so often the writer
+ * flushes and fsync()s the output, then has the journal synced with
+ * the output's length as its mark, so a journaled input's result is
+ * always safely out.  A later run cuts the output back to the last
+ * mark and carries on writing it from there.
+ *
+ * All state lives in struct batch, so batches can run side by side.
+ * Nothing here exits: failures mark the batch failed, which stops
+ * further output and queueing, and batch_run() returns 3.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "archive.h"
+#include "batch.h"
+#include "journal.h"
+
+
+#define	BATCH_WRBUF		(1024 * 1024)
+#define	BATCH_NO_OUTPUT		UINT64_MAX	/* Mark of a check-only run */
+#define	BATCH_SLOTS_PER_JOB	4
+
+
+struct batch_item {
+	char		*name;
+	char		*path;		/* File to load, NULL if data is set */
+	unsigned char	*data;
+	size_t		size;
+	long		mtime;
+	unsigned int	mode;
+
+	char		*out;
+	size_t		outlen;
+	char		*rpt;
+	size_t		rptlen;
+	char		*err;
+	size_t		errlen;
+	const char	*fail;		/* Set if the job couldn't run */
+	uint64_t	key;		/* For the journal */
+	int		ret;
+	int		done;
+};
+
+struct batch {
+	const struct batch_opts	*opts;
+	struct ar_writer	*aw;
+	struct journal		*journal;
+	char			*name;		/* For suffixed_name() */
+	size_t			namecap;
+	int			ret;
+	int			failed;
+
+	struct batch_item	*ring;
+	unsigned long		cap;
+	unsigned long		produced;
+	unsigned long		claimed;
+	unsigned long		written;
+	int			eof;
+#ifdef HAVE_PTHREAD
+	int			threaded;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;	/* A slot was filled or eof set */
+	pthread_cond_t		done;	/* A slot was finished or eof set */
+	pthread_cond_t		space;	/* A slot was written */
+#endif
+};
+
+
+static void
+batch_fail(struct batch *b, const char *what)
+{
+	fprintf(b->opts->errfile, "%s, %s (%d)\n", what, strerror(errno),
+		errno);
+
+#ifdef HAVE_PTHREAD
+	if (b->threaded)
+		pthread_mutex_lock(&b->lock);
+#endif
+	b->failed = 1;
+#ifdef HAVE_PTHREAD
+	if (b->threaded)
+		pthread_mutex_unlock(&b->lock);
+#endif
+}
+
+
+static int
+batch_failed(struct batch *b)
+{
+	int	failed;
+
+#ifdef HAVE_PTHREAD
+	if (b->threaded)
+		pthread_mutex_lock(&b->lock);
+#endif
+	failed = b->failed;
+#ifdef HAVE_PTHREAD
+	if (b->threaded)
+		pthread_mutex_unlock(&b->lock);
+#endif
+
+	return failed;
+}
+
+
+enum batch_output
+batch_output_for(const char *name)
+{
+	size_t	len = strlen(name);
+
+	if (len > 4 && (!strcmp(name + len - 4, ".zip") ||
+			!strcmp(name + len - 4, ".ZIP")))
+		return BATCH_ZIP;
+
+	return BATCH_TAR;
+}
+
+
+/* Returns an exit status. */
+static int
+load_file(struct batch_item *it, FILE *err)
+{
+	struct stat	st;
+	FILE		*fp;
+	size_t		cap = 65536;
+	size_t		n;
+
+	if (!(fp = fopen(it->path, "r"))) {
+		fprintf(err, "Failed to open file, %s (%d)\n",
+			strerror(errno), errno);
+		return 2;
+	}
+
+	if (fstat(fileno(fp), &st) == 0) {
+		it->mtime = (long)st.st_mtime;
+		it->mode = st.st_mode & 07777;
+		if (S_ISREG(st.st_mode))
+			cap = st.st_size + 1;
+	}
+
+	if (!(it->data = malloc(cap)))
+		goto nomem;
+
+	for (it->size = 0; ; it->size += n) {
+		if (it->size == cap) {
+			unsigned char	*ndata;
+
+			if (!(ndata = realloc(it->data, cap *= 2)))
+				goto nomem;
+			it->data = ndata;
+		}
+
+		if ((n = fread(it->data + it->size, 1, cap - it->size, fp)) == 0)
+			break;
+	}
+
+	if (ferror(fp)) {
+		fprintf(err, "Failed to read file, %s (%d)\n",
+			strerror(errno), errno);
+		fclose(fp);
+		return 2;
+	}
+
+	fclose(fp);
+
+	return 0;
+
+nomem:
+	fprintf(err, "Out of memory loading file.\n");
+	fclose(fp);
+
+	return 3;
+}
+
+
+/* Runs on a worker thread. */
+static void
+run_item(const struct batch_opts *opts, struct batch_item *it)
+{
+	struct batch_job	job;
+
+	job.name = it->name;
+	job.arg = opts->arg;
+	job.data = NULL;
+	job.size = 0;
+	job.in = NULL;
+	job.out = NULL;
+	job.rpt = open_memstream(&it->rpt, &it->rptlen);
+	job.err = open_memstream(&it->err, &it->errlen);
+
+	if (!job.rpt || !job.err) {
+		it->fail = "Out of memory";
+		it->ret = 3;
+	} else if (!it->path || !(it->ret = load_file(it, job.err))) {
+		job.in = fmemopen(it->data, it->size, "r");
+		if (opts->output != BATCH_NONE)
+			job.out = open_memstream(&it->out, &it->outlen);
+
+		if (!job.in || (opts->output != BATCH_NONE && !job.out)) {
+			it->fail = "Out of memory";
+			it->ret = 3;
+		} else {
+			job.data = it->data;
+			job.size = it->size;
+			it->ret = opts->fn(&job);
+		}
+	}
+
+	if (job.in)
+		fclose(job.in);
+	if (job.out)
+		fclose(job.out);
+	if (job.rpt)
+		fclose(job.rpt);
+	if (job.err)
+		fclose(job.err);
+
+	free(it->data);
+	it->data = NULL;
+}
+
+
+/* it's archive entry name with the extension replaced by suffix, in
+ * a buffer that is reused for every entry. */
+static const char *
+suffixed_name(struct batch *b, const struct batch_item *it,
+	      const char *suffix)
+{
+	const char	*base = strrchr(it->name, '/');
+	const char	*dot;
+	size_t		stem, need;
+
+	base = base ? base + 1 : it->name;
+	dot = strrchr(base, '.');
+	stem = dot && dot != base ? (size_t)(dot - it->name) :
+				    strlen(it->name);
+	need = stem + strlen(suffix) + 1;
+
+	if (need > b->namecap) {
+		char	*n = realloc(b->name, need);
+
+		if (!n)
+			return NULL;
+		b->name = n;
+		b->namecap = need;
+	}
+	memcpy(b->name, it->name, stem);
+	strcpy(b->name + stem, suffix);
+
+	return b->name;
+}
+
+
+/* Whether the batch writes output a journal has to keep up with. */
+static int
+has_output(const struct batch_opts *opts)
+{
+	return opts->output != BATCH_NONE && opts->outfile;
+}
+
+
+/* Get what has been written so far onto disk, then the journal records
+ * saying so. */
+static void
+checkpoint(struct batch *b)
+{
+	const struct batch_opts	*opts = b->opts;
+	struct stat		st;
+	uint64_t		mark = BATCH_NO_OUTPUT;
+
+	if (has_output(opts)) {
+		if (fflush(opts->outfile) == EOF ||
+		    fstat(fileno(opts->outfile), &st) ||
+		    fsync(fileno(opts->outfile))) {
+			batch_fail(b, "Error writing output file");
+			return;
+		}
+		mark = (uint64_t)st.st_size;
+	}
+	if (opts->rptfile)
+		fflush(opts->rptfile);
+
+	if (journal_sync(b->journal, mark))
+		batch_fail(b, "Error writing journal");
+}
+
+
+/*
+ * Ready the output to carry on from where the journal's last run left
+ * it, cut back to its last mark.  That drops what was written after,
+ * for inputs not journaled that get done again, and the end of a tar
+ * archive that was finished.  So the output can only be a file, and
+ * not a zip archive, unreadable until its central directory is out.
+ * Returns an exit status.
+ */
+static int
+resume_output(struct batch *b)
+{
+	const struct batch_opts	*opts = b->opts;
+	struct stat		st;
+	uint64_t		mark;
+	int			marked = journal_mark(b->journal, &mark);
+
+	if (opts->output == BATCH_ZIP) {
+		fprintf(opts->errfile, "A journal can't go with zip output.\n");
+		return 1;
+	}
+	if (!has_output(opts)) {
+		if (!marked || mark == BATCH_NO_OUTPUT)
+			return 0;
+		fprintf(opts->errfile, "Journal '%s' is of a run with "
+			"output.\n", opts->journal);
+		return 1;
+	}
+	if (marked && mark == BATCH_NO_OUTPUT) {
+		fprintf(opts->errfile, "Journal '%s' is of a run without "
+			"output.\n", opts->journal);
+		return 1;
+	}
+	if (!marked)
+		mark = 0;
+
+	if (fstat(fileno(opts->outfile), &st) || !S_ISREG(st.st_mode)) {
+		fprintf(opts->errfile, "With a journal the output must be a "
+			"file.\n");
+		return 1;
+	}
+	if ((uint64_t)st.st_size < mark) {
+		fprintf(opts->errfile, "The output is shorter than journal "
+			"'%s' has it.\n", opts->journal);
+		return 1;
+	}
+	if (ftruncate(fileno(opts->outfile), (off_t)mark) ||
+	    fseeko(opts->outfile, (off_t)mark, SEEK_SET)) {
+		fprintf(opts->errfile, "Error writing output file, %s (%d)\n",
+			strerror(errno), errno);
+		return 3;
+	}
+
+	return 0;
+}
+
+
+/* Runs on the writer thread. */
+static void
+write_item(struct batch *b, struct batch_item *it)
+{
+	const struct batch_opts	*opts = b->opts;
+	const char		*name;
+
+	if (it->rptlen && opts->rptfile)
+		fwrite(it->rpt, 1, it->rptlen, opts->rptfile);
+	if (it->errlen)
+		fprintf(opts->errfile, "%s: %s", it->name, it->err);
+	if (it->fail)
+		fprintf(opts->errfile, "%s: %s.\n", it->name, it->fail);
+
+	switch (batch_failed(b) ? BATCH_NONE : opts->output) {
+	case BATCH_CONCAT:
+		if (it->outlen && fwrite(it->out, 1, it->outlen,
+					 opts->outfile) != it->outlen)
+			batch_fail(b, "Error writing output file");
+		break;
+
+	case BATCH_TAR:
+	case BATCH_ZIP:
+		if (it->ret != 0)
+			break;
+		name = opts->suffix ? suffixed_name(b, it, opts->suffix) :
+				      it->name;
+		if (!name || ar_add(b->aw, name, it->out, it->outlen,
+				    it->mtime, it->mode))
+			batch_fail(b, "Error writing output archive");
+		break;
+
+	case BATCH_NONE:
+		break;
+	}
+
+	if (it->ret > b->ret)
+		b->ret = it->ret;
+
+	/* A status of 3 is this run's trouble, worth another try. */
+	if (b->journal && !it->fail && it->ret < 3 && !batch_failed(b) &&
+	    journal_add(b->journal, it->key, it->ret))
+		checkpoint(b);
+
+	free(it->name);
+	free(it->path);
+	free(it->out);
+	free(it->rpt);
+	free(it->err);
+	memset(it, 0, sizeof(*it));
+}
+
+
+#ifdef HAVE_PTHREAD
+static void *
+worker(void *arg)
+{
+	struct batch		*b = arg;
+	struct batch_item	*it;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		while (b->claimed == b->produced && !b->eof)
+			pthread_cond_wait(&b->work, &b->lock);
+		if (b->claimed == b->produced)
+			break;
+
+		it = &b->ring[b->claimed++ % b->cap];
+		pthread_mutex_unlock(&b->lock);
+
+		run_item(b->opts, it);
+
+		pthread_mutex_lock(&b->lock);
+		it->done = 1;
+		pthread_cond_broadcast(&b->done);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+
+static void *
+writer(void *arg)
+{
+	struct batch		*b = arg;
+	struct batch_item	*it;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		while (b->written < b->produced ?
+		       !b->ring[b->written % b->cap].done : !b->eof)
+			pthread_cond_wait(&b->done, &b->lock);
+		if (b->written == b->produced)
+			break;
+
+		it = &b->ring[b->written % b->cap];
+		pthread_mutex_unlock(&b->lock);
+
+		write_item(b, it);
+
+		pthread_mutex_lock(&b->lock);
+		++b->written;
+		pthread_cond_signal(&b->space);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+#endif
+
+
+/* Wait for a free slot to fill in. */
+static struct batch_item *
+slot_get(struct batch *b)
+{
+#ifdef HAVE_PTHREAD
+	if (b->threaded) {
+		pthread_mutex_lock(&b->lock);
+		while (b->produced - b->written == b->cap)
+			pthread_cond_wait(&b->space, &b->lock);
+		pthread_mutex_unlock(&b->lock);
+	}
+#endif
+
+	return &b->ring[b->produced % b->cap];
+}
+
+
+/* Hand a filled slot over, or process it right away if unthreaded. */
+static void
+slot_put(struct batch *b)
+{
+#ifdef HAVE_PTHREAD
+	if (b->threaded) {
+		pthread_mutex_lock(&b->lock);
+		++b->produced;
+		pthread_cond_signal(&b->work);
+		pthread_mutex_unlock(&b->lock);
+		return;
+	}
+#endif
+
+	run_item(b->opts, &b->ring[b->produced % b->cap]);
+	write_item(b, &b->ring[b->produced++ % b->cap]);
+}
+
+
+/* Archive entry name for a file operand: no leading '/' or "./". */
+static const char *
+entry_name(const char *path)
+{
+	for (;;) {
+		if (path[0] == '/')
+			++path;
+		else if (path[0] == '.' && path[1] == '/')
+			path += 2;
+		else
+			return path;
+	}
+}
+
+
+/* The journal key of a file operand. */
+static uint64_t
+file_key(const char *path)
+{
+	struct stat	st;
+
+	if (stat(path, &st))
+		return journal_key(NULL, path, 0, 0);
+
+	return journal_key(NULL, path, (uint64_t)st.st_size,
+			   (long)st.st_mtime);
+}
+
+
+/* Whether the journal has key as finished, if so folding its status
+ * into *ret. */
+static int
+journaled(struct batch *b, uint64_t key, int *ret)
+{
+	int	st;
+
+	if ((st = journal_lookup(b->journal, key)) < 0)
+		return 0;
+	if (st > *ret)
+		*ret = st;
+
+	return 1;
+}
+
+
+/* Returns an exit status for problems with the archive itself, or of
+ * members an earlier run finished. */
+static int
+queue_archive(struct batch *b, const char *path)
+{
+	struct ar_reader	*ar;
+	struct ar_member	m;
+	const char		*errmsg;
+	FILE			*fp = stdin;
+	int			r = 0, ret = 0;
+
+	if (strcmp(path, "-") && !(fp = fopen(path, "r"))) {
+		fprintf(b->opts->errfile, "Failed to open file '%s', %s (%d)\n",
+			path, strerror(errno), errno);
+		return 2;
+	}
+
+	if (!(ar = ar_open(fp, &errmsg))) {
+		fprintf(b->opts->errfile, "%s: %s.\n", path, errmsg);
+		ret = 2;
+		goto out;
+	}
+
+	while (!batch_failed(b) && (r = ar_next(ar, &m)) > 0) {
+		struct batch_item	*it;
+		uint64_t		key = 0;
+
+		if (b->journal) {
+			key = journal_key(path, m.name, m.size, m.mtime);
+			if (journaled(b, key, &ret))
+				continue;
+		}
+
+		it = slot_get(b);
+		if (!(it->name = strdup(m.name)) ||
+		    !(it->data = malloc(m.size ? m.size : 1))) {
+			free(it->name);
+			it->name = NULL;
+			batch_fail(b, "Out of memory");
+			r = 0;
+			break;
+		}
+		memcpy(it->data, m.data, m.size);
+		it->size = m.size;
+		it->mtime = m.mtime;
+		it->mode = m.mode;
+		it->key = key;
+		slot_put(b);
+	}
+
+	if (r < 0) {
+		fprintf(b->opts->errfile, "%s: %s.\n", path, ar_error(ar));
+		ret = 2;
+	}
+
+	ar_close(ar);
+
+out:
+	if (fp != stdin)
+		fclose(fp);
+
+	return ret;
+}
+
+
+#ifdef HAVE_PTHREAD
+/* Let the threads drain the ring and finish. */
+static void
+stop_threads(struct batch *b, pthread_t *workers, int nworkers,
+	     pthread_t *wtid)
+{
+	int	i;
+
+	pthread_mutex_lock(&b->lock);
+	b->eof = 1;
+	pthread_cond_broadcast(&b->work);
+	pthread_cond_broadcast(&b->done);
+	pthread_mutex_unlock(&b->lock);
+
+	for (i = 0; i < nworkers; ++i)
+		pthread_join(workers[i], NULL);
+	if (wtid)
+		pthread_join(*wtid, NULL);
+}
+
+
+/*
+ * Start up to jobs workers and the writer.  Falls back to running
+ * unthreaded if that isn't possible.
+ */
+static void
+start_threads(struct batch *b, pthread_t *workers, int jobs,
+	      int *nworkers, pthread_t *wtid)
+{
+	int	n;
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->work, NULL);
+	pthread_cond_init(&b->done, NULL);
+	pthread_cond_init(&b->space, NULL);
+	b->threaded = 1;
+
+	for (n = 0; n < jobs; ++n)
+		if (pthread_create(&workers[n], NULL, worker, b))
+			break;
+
+	if (n > 0 && pthread_create(wtid, NULL, writer, b) == 0) {
+		*nworkers = n;
+		return;
+	}
+
+	stop_threads(b, workers, n, NULL);
+	b->eof = 0;
+	b->threaded = 0;
+	*nworkers = 0;
+}
+#endif
+
+
+int
+batch_run(const struct batch_opts *opts, char **operands, int noperands)
+{
+	struct batch	b;
+	const char	*errmsg;
+	int		jobs = opts->jobs;
+	int		i, ret = 0;
+#ifdef HAVE_PTHREAD
+	pthread_t	*workers = NULL;
+	pthread_t	wtid;
+	int		nworkers = 0;
+#endif
+
+	memset(&b, 0, sizeof(b));
+	b.opts = opts;
+
+	if (opts->outfile)
+		setvbuf(opts->outfile, NULL, _IOFBF, BATCH_WRBUF);
+
+	if (opts->journal &&
+	    !(b.journal = journal_open(opts->journal, &errmsg))) {
+		if (errmsg) {
+			fprintf(opts->errfile, "%s: %s.\n", opts->journal,
+				errmsg);
+			return 2;
+		}
+		fprintf(opts->errfile, "Failed to open journal '%s', %s (%d)\n",
+			opts->journal, strerror(errno), errno);
+		return 3;
+	}
+	if (b.journal && (ret = resume_output(&b))) {
+		journal_close(b.journal);
+		return ret;
+	}
+
+	if (opts->output == BATCH_TAR || opts->output == BATCH_ZIP) {
+		b.aw = ar_create(opts->outfile, opts->output == BATCH_ZIP ?
+						AR_ZIP : AR_TAR);
+		if (!b.aw) {
+			fprintf(opts->errfile, "Out of memory.\n");
+			if (b.journal)
+				journal_close(b.journal);
+			return 3;
+		}
+	}
+
+	if (jobs == 0)
+		jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1)
+		jobs = 1;
+
+	b.cap = 1;
+#ifdef HAVE_PTHREAD
+	if (jobs > 1 && (workers = calloc(jobs, sizeof(*workers))))
+		b.cap = jobs * BATCH_SLOTS_PER_JOB;
+#endif
+
+	if (!(b.ring = calloc(b.cap, sizeof(*b.ring)))) {
+		fprintf(opts->errfile, "Out of memory.\n");
+		b.failed = 1;
+		goto out;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (workers)
+		start_threads(&b, workers, jobs, &nworkers, &wtid);
+#endif
+
+	for (i = 0; i < noperands && !batch_failed(&b); ++i) {
+		const char	*path = operands[i];
+
+		if (opts->archives) {
+			int	r = queue_archive(&b, path);
+
+			if (r > ret)
+				ret = r;
+		} else {
+			struct batch_item	*it;
+			uint64_t		key = 0;
+
+			if (b.journal) {
+				key = file_key(path);
+				if (journaled(&b, key, &ret))
+					continue;
+			}
+
+			it = slot_get(&b);
+			if (!(it->name = strdup(entry_name(path))) ||
+			    !(it->path = strdup(path))) {
+				free(it->name);
+				it->name = NULL;
+				batch_fail(&b, "Out of memory");
+				break;
+			}
+			it->mode = 0644;
+			it->key = key;
+			slot_put(&b);
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	if (b.threaded) {
+		stop_threads(&b, workers, nworkers, &wtid);
+		b.threaded = 0;
+	}
+	if (workers) {
+		pthread_mutex_destroy(&b.lock);
+		pthread_cond_destroy(&b.work);
+		pthread_cond_destroy(&b.done);
+		pthread_cond_destroy(&b.space);
+	}
+#endif
+
+out:
+	/* The last mark goes before a tar archive's end, so the next run
+	 * writes over it.  Records not synced by now stay out; their
+	 * inputs get redone. */
+	if (b.journal && !b.failed)
+		checkpoint(&b);
+	if (b.journal && journal_close(b.journal) && !b.failed)
+		batch_fail(&b, "Error writing journal");
+
+	if (b.aw && ar_finish(b.aw) && !b.failed)
+		batch_fail(&b, "Error writing output archive");
+
+#ifdef HAVE_PTHREAD
+	free(workers);
+#endif
+	free(b.ring);
+	free(b.name);
+
+	if (b.failed)
+		return 3;
+
+	return b.ret > ret ? b.ret : ret;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Batch processing of many inputs on worker threads, with the results
+ * collected in input order into a tar or zip archive.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+
+enum batch_output {
+	BATCH_NONE,		/* Results are discarded */
+	BATCH_CONCAT,		/* Results are written one after another */
+	BATCH_TAR,		/* Each result is a tar archive entry */
+	BATCH_ZIP		/* Each result is a stored zip entry */
+};
+
+/*
+ * One input as handed to a batch_fn.  Everything written to out, rpt
+ * and err is held back and emitted in input order: out becomes the
+ * archive entry (out is NULL for BATCH_NONE), rpt goes to the batch's
+ * rptfile and err to its errfile, prefixed with the input's name.
+ * The streams belong to this job alone.
+ */
+struct batch_job {
+	const char		*name;
+	void			*arg;		/* The batch_opts arg */
+	const unsigned char	*data;		/* The input, also in in */
+	size_t			size;
+	FILE			*in;
+	FILE			*out;
+	FILE			*rpt;
+	FILE			*err;
+};
+
+/* Returns an exit status as for main(), 0 meaning success.  Only
+ * successful results are added to an output archive. */
+typedef int (*batch_fn)(struct batch_job *job);
+
+struct batch_opts {
+	batch_fn		fn;
+	void			*arg;		/* Passed on in each job */
+	int			jobs;		/* Worker threads, 0 = per CPU */
+	int			archives;	/* Operands are tar/zip files */
+	enum batch_output	output;
+	const char		*suffix;	/* Replaces archive entry names'
+						 * extensions, NULL keeps them */
+	FILE			*outfile;
+	FILE			*rptfile;	/* Reports, NULL discards */
+	FILE			*errfile;	/* Diagnostics */
+	const char		*journal;	/* File of finished inputs to
+						 * skip and add to, or NULL */
+};
+
+
+/* Pick BATCH_ZIP or BATCH_TAR from an output file's name. */
+enum batch_output batch_output_for(const char *name);
+
+/*
+ * Run opts->fn over every operand, or with opts->archives over every
+ * member of every operand ("-" is stdin).  Returns the worst exit
+ * status seen; failures of the batch itself (memory, threads, writing
+ * the output) are reported to opts->errfile and return 3.  Any number
+ * of batches may run at once.
+ *
+ * With opts->journal, inputs an earlier run finished are skipped, their
+ * status counting as before, and each input written with a status
+ * below 3 is added once the output holding it is synced, so a run
+ * that dies can be started again where it left off.  The output must
+ * then be a file opened without truncating it, or none, and not a zip
+ * archive; it is cut back to where the journal's last run had safely
+ * written it, and carried on from there.
+ */
+int batch_run(const struct batch_opts *opts, char **operands,
+	      int noperands);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Raw DEFLATE (RFC 1951) decoder.
+ *
+ * This is a small canonical Huffman decoder in the style of zlib's
+ * puff.c.  It is not fast, but the members it sees are tiny and it
+ * reads its input a byte at a time from a stdio stream, so a zip
+ * member can be inflated straight out of an archive being streamed
+ * from a pipe.  The whole output is kept in memory and serves as the
+ * back-reference window.
+ */
+
+#include <stdlib.h>
+#include <setjmp.h>
+
+#include "inflate.h"
+
+
+#define	MAXBITS		15	/* Longest code allowed */
+#define	MAXLCODES	286	/* Literal/length codes */
+#define	MAXDCODES	30	/* Distance codes */
+#define	MAXCODES	(MAXLCODES + MAXDCODES)
+#define	FIXLCODES	288	/* Literal/length codes in fixed table */
+
+
+struct inflate_state {
+	FILE		*in;
+	unsigned long	bitbuf;
+	int		bitcnt;
+
+	unsigned char	*out;
+	size_t		outlen;
+	size_t		outcap;
+
+	jmp_buf		env;
+};
+
+struct huffman {
+	short	*count;		/* Number of symbols of each length */
+	short	*symbol;	/* Symbols ordered by code */
+};
+
+
+static void
+out_byte(struct inflate_state *s, int ch)
+{
+	if (s->outlen == s->outcap) {
+		size_t		ncap = s->outcap ? s->outcap * 2 : 4096;
+		unsigned char	*nout = realloc(s->out, ncap);
+
+		if (!nout)
+			longjmp(s->env, -3);
+		s->out = nout;
+		s->outcap = ncap;
+	}
+
+	s->out[s->outlen++] = (unsigned char)ch;
+}
+
+
+static int
+bits(struct inflate_state *s, int need)
+{
+	unsigned long	val = s->bitbuf;
+	int		ch;
+
+	while (s->bitcnt < need) {
+		if ((ch = getc(s->in)) == EOF)
+			longjmp(s->env, -1);
+		val |= (unsigned long)ch << s->bitcnt;
+		s->bitcnt += 8;
+	}
+
+	s->bitbuf = val >> need;
+	s->bitcnt -= need;
+
+	return (int)(val & ((1UL << need) - 1));
+}
+
+
+static int
+stored(struct inflate_state *s)
+{
+	int	len, nlen, ch;
+
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+
+	len = bits(s, 16);
+	nlen = bits(s, 16);
+	if (len != (~nlen & 0xffff))
+		return -2;
+
+	while (len--) {
+		if ((ch = getc(s->in)) == EOF)
+			return -1;
+		out_byte(s, ch);
+	}
+
+	return 0;
+}
+
+
+static int
+decode(struct inflate_state *s, const struct huffman *h)
+{
+	int	code = 0, first = 0, index = 0;
+	int	len, count;
+
+	for (len = 1; len <= MAXBITS; ++len) {
+		code |= bits(s, 1);
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+
+	return -2;
+}
+
+
+/*
+ * Build a decoding table from code lengths.  Returns 0 for a complete
+ * code, a positive value for an incomplete one and negative if the
+ * lengths over-subscribe.
+ */
+
+static int
+construct(struct huffman *h, const short *length, int n)
+{
+	short	offs[MAXBITS + 1];
+	int	symbol, len, left;
+
+	for (len = 0; len <= MAXBITS; ++len)
+		h->count[len] = 0;
+	for (symbol = 0; symbol < n; ++symbol)
+		++h->count[length[symbol]];
+	if (h->count[0] == n)
+		return 0;
+
+	left = 1;
+	for (len = 1; len <= MAXBITS; ++len) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return left;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < MAXBITS; ++len)
+		offs[len + 1] = offs[len] + h->count[len];
+
+	for (symbol = 0; symbol < n; ++symbol)
+		if (length[symbol] != 0)
+			h->symbol[offs[length[symbol]]++] = symbol;
+
+	return left;
+}
+
+
+static int
+codes(struct inflate_state *s, const struct huffman *lencode,
+      const struct huffman *distcode)
+{
+	static const short lbase[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const short lext[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const short dbase[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577 };
+	static const short dext[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	int	symbol, len;
+	size_t	dist;
+
+	for (;;) {
+		symbol = decode(s, lencode);
+		if (symbol < 0)
+			return symbol;
+
+		if (symbol < 256) {
+			out_byte(s, symbol);
+		} else if (symbol == 256) {
+			return 0;
+		} else {
+			symbol -= 257;
+			if (symbol >= 29)
+				return -2;
+			len = lbase[symbol] + bits(s, lext[symbol]);
+
+			symbol = decode(s, distcode);
+			if (symbol < 0 || symbol >= 30)
+				return -2;
+			dist = dbase[symbol] + bits(s, dext[symbol]);
+			if (dist > s->outlen)
+				return -2;
+
+			while (len--)
+				out_byte(s, s->out[s->outlen - dist]);
+		}
+	}
+}
+
+
+/* The fixed tables are cheap enough to rebuild per block, which keeps
+ * the decoder free of shared state. */
+
+static int
+fixed(struct inflate_state *s)
+{
+	short		lengths[FIXLCODES];
+	short		lencnt[MAXBITS + 1], lensym[FIXLCODES];
+	short		distcnt[MAXBITS + 1], distsym[MAXDCODES];
+	struct huffman	lencode = { lencnt, lensym };
+	struct huffman	distcode = { distcnt, distsym };
+	int		symbol;
+
+	for (symbol = 0; symbol < 144; ++symbol)
+		lengths[symbol] = 8;
+	for (; symbol < 256; ++symbol)
+		lengths[symbol] = 9;
+	for (; symbol < 280; ++symbol)
+		lengths[symbol] = 7;
+	for (; symbol < FIXLCODES; ++symbol)
+		lengths[symbol] = 8;
+	construct(&lencode, lengths, FIXLCODES);
+
+	for (symbol = 0; symbol < MAXDCODES; ++symbol)
+		lengths[symbol] = 5;
+	construct(&distcode, lengths, MAXDCODES);
+
+	return codes(s, &lencode, &distcode);
+}
+
+
+static int
+dynamic(struct inflate_state *s)
+{
+	static const short order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14,
+		1, 15 };
+	short		lengths[MAXCODES];
+	short		lencnt[MAXBITS + 1], lensym[MAXLCODES];
+	short		distcnt[MAXBITS + 1], distsym[MAXDCODES];
+	struct huffman	lencode = { lencnt, lensym };
+	struct huffman	distcode = { distcnt, distsym };
+	int		nlen, ndist, ncode;
+	int		index, err;
+
+	nlen = bits(s, 5) + 257;
+	ndist = bits(s, 5) + 1;
+	ncode = bits(s, 4) + 4;
+	if (nlen > MAXLCODES || ndist > MAXDCODES)
+		return -2;
+
+	for (index = 0; index < ncode; ++index)
+		lengths[order[index]] = bits(s, 3);
+	for (; index < 19; ++index)
+		lengths[order[index]] = 0;
+
+	if (construct(&lencode, lengths, 19) != 0)
+		return -2;
+
+	for (index = 0; index < nlen + ndist; ) {
+		int	symbol, len, rep;
+
+		if ((symbol = decode(s, &lencode)) < 0)
+			return symbol;
+
+		if (symbol < 16) {
+			lengths[index++] = symbol;
+			continue;
+		}
+
+		len = 0;
+		if (symbol == 16) {
+			if (index == 0)
+				return -2;
+			len = lengths[index - 1];
+			rep = 3 + bits(s, 2);
+		} else if (symbol == 17) {
+			rep = 3 + bits(s, 3);
+		} else {
+			rep = 11 + bits(s, 7);
+		}
+
+		if (index + rep > nlen + ndist)
+			return -2;
+		while (rep--)
+			lengths[index++] = len;
+	}
+
+	if (lengths[256] == 0)
+		return -2;
+
+	err = construct(&lencode, lengths, nlen);
+	if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+		return -2;
+
+	err = construct(&distcode, lengths + nlen, ndist);
+	if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+		return -2;
+
+	return codes(s, &lencode, &distcode);
+}
+
+
+int
+inflate_stream(FILE *infile, unsigned char **outp, size_t *outlen,
+	       size_t *outcap)
+{
+	struct inflate_state	s;
+	int			last, type;
+	volatile int		err;
+
+	s.in = infile;
+	s.bitbuf = 0;
+	s.bitcnt = 0;
+	s.out = *outp;
+	s.outlen = 0;
+	s.outcap = *outcap;
+
+	if ((err = setjmp(s.env)) == 0) {
+		do {
+			last = bits(&s, 1);
+			type = bits(&s, 2);
+
+			switch (type) {
+			case 0:
+				err = stored(&s);
+				break;
+			case 1:
+				err = fixed(&s);
+				break;
+			case 2:
+				err = dynamic(&s);
+				break;
+			default:
+				err = -2;
+				break;
+			}
+		} while (!last && err == 0);
+	}
+
+	*outp = s.out;
+	*outlen = s.outlen;
+	*outcap = s.outcap;
+
+	return err;
+}
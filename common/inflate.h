@@ -0,0 +1,25 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Raw DEFLATE (RFC 1951) decoder used for reading zip members.
+ */
+
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+/*
+ * Inflate one raw DEFLATE stream read from infile, appending the
+ * result to *outp (a malloc()ed buffer of *outcap bytes, reallocated
+ * as needed).  On return *outlen holds the number of bytes produced.
+ *
+ * Returns 0 on success, -1 on truncated input, -2 on malformed data
+ * and -3 when out of memory.
+ */
+int inflate_stream(FILE *infile, unsigned char **outp, size_t *outlen,
+		   size_t *outcap);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Batch journals.
+ *
+ * The journal is a file of fixed size records appended to as inputs
+ * finish, after a 16 byte header ("TRS80JNL", then the version and the
+ * record size as 32-bit little-endian numbers).  A record is 16 bytes,
+ * little-endian: the input's key (an FNV-1a hash of its path, size and
+ * modification time, and of its member name for an archive member),
+ * its exit status, three zero bytes and a check word.
+ *
+ * Records are kept back and written in batches, every JOURNAL_BATCH
+ * records or JOURNAL_SECS seconds.  Each batch ends with a mark record
+ * (status JOURNAL_MARK) holding the caller's mark, the length of its
+ * output so far, and is followed by an fsync().  The batch code syncs
+ * its own output first, so an input in the journal always has its
+ * result safely written, and the output can be cut back to the last
+ * mark to carry on from there.  Records after the last mark, or from
+ * the first that fails its check, a torn one left by a run that died
+ * mid-write, count for nothing and are cut off.
+ *
+ * On opening, the file is mapped and its keys put in an open addressing
+ * hash set in anonymous mapped memory, at most half full, so a lookup
+ * is a probe or two and a few million records cost one pass over the
+ * file and no allocation per record.  The set holds what earlier runs
+ * finished and never changes after, so lookups need no locking.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+
+#define	JOURNAL_MAGIC	"TRS80JNL"
+#define	JOURNAL_VERSION	1
+#define	JOURNAL_HDR	16
+#define	JOURNAL_REC	16
+#define	JOURNAL_BATCH	4096		/* Records between syncs, at most */
+#define	JOURNAL_SECS	2		/* Seconds between syncs, at most */
+#define	JOURNAL_CHECK	0x4c4e524aUL	/* "JRNL" */
+#define	JOURNAL_MARK	0x80		/* Status byte of a mark record */
+
+/* A set entry: the key, less its low two bits, with the top bit set so
+ * no entry is zero, and the status in the low two bits. */
+#define	SET_KEY(k)	(((k) | (uint64_t)1 << 63) & ~(uint64_t)3)
+
+
+struct journal {
+	int		fd;
+	uint64_t	*set;
+	size_t		setcap;		/* A power of two */
+	size_t		pending;
+	time_t		synced;
+	int		marked;		/* Whether mark has been set */
+	uint64_t	mark;
+	unsigned char	buf[(JOURNAL_BATCH + 1) * JOURNAL_REC];
+};
+
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8 & 0xff;
+	p[2] = v >> 16 & 0xff;
+	p[3] = v >> 24 & 0xff;
+}
+
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[3] << 24;
+}
+
+
+static uint32_t
+check_word(uint64_t key, int status)
+{
+	return (uint32_t)key ^ (uint32_t)(key >> 32) ^ (uint32_t)status ^
+	       JOURNAL_CHECK;
+}
+
+
+static uint64_t
+fnv(uint64_t h, const unsigned char *p, size_t len)
+{
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+
+uint64_t
+journal_key(const char *archive, const char *name, uint64_t size,
+	    long mtime)
+{
+	uint64_t	h = 0xcbf29ce484222325ULL;
+	unsigned char	b[16];
+	int		i;
+
+	/* Each string up to and including its NUL. */
+	if (archive)
+		h = fnv(h, (const unsigned char *)archive, strlen(archive) + 1);
+	h = fnv(h, (const unsigned char *)name, strlen(name) + 1);
+
+	for (i = 0; i < 8; ++i) {
+		b[i] = size >> 8 * i & 0xff;
+		b[8 + i] = (uint64_t)mtime >> 8 * i & 0xff;
+	}
+
+	return fnv(h, b, sizeof(b));
+}
+
+
+static void
+set_add(struct journal *j, uint64_t key, int status)
+{
+	size_t	i = (size_t)(key ^ key >> 29) & (j->setcap - 1);
+
+	while (j->set[i] && (j->set[i] & ~(uint64_t)3) != SET_KEY(key))
+		i = (i + 1) & (j->setcap - 1);
+	j->set[i] = SET_KEY(key) | (uint64_t)status;
+}
+
+
+int
+journal_lookup(const struct journal *j, uint64_t key)
+{
+	size_t	i = (size_t)(key ^ key >> 29) & (j->setcap - 1);
+
+	for (; j->set[i]; i = (i + 1) & (j->setcap - 1))
+		if ((j->set[i] & ~(uint64_t)3) == SET_KEY(key))
+			return (int)(j->set[i] & 3);
+
+	return -1;
+}
+
+
+/* Whether the record at p is whole. */
+static int
+record_ok(const unsigned char *p)
+{
+	uint64_t	key = get32(p) | (uint64_t)get32(p + 4) << 32;
+
+	return (p[8] <= 2 || p[8] == JOURNAL_MARK) && !p[9] && !p[10] &&
+	       !p[11] && get32(p + 12) == check_word(key, p[8]);
+}
+
+
+/* Take in the records of the file, size bytes, up to its last mark,
+ * cutting off the rest.  Returns 0 or -1. */
+static int
+load(struct journal *j, off_t size, const char **errmsg)
+{
+	const unsigned char	*map = NULL, *p;
+	size_t			n = 0, i, keep = 0;
+
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+		if (map == MAP_FAILED)
+			return -1;
+		if (size < JOURNAL_HDR ||
+		    memcmp(map, JOURNAL_MAGIC, 8) ||
+		    get32(map + 8) != JOURNAL_VERSION ||
+		    get32(map + 12) != JOURNAL_REC) {
+			munmap((void *)map, size);
+			*errmsg = "Not a journal file";
+			errno = EINVAL;
+			return -1;
+		}
+		n = (size - JOURNAL_HDR) / JOURNAL_REC;
+	}
+
+	/* Up to and including the last good mark. */
+	for (i = 0; i < n; ++i) {
+		p = map + JOURNAL_HDR + i * JOURNAL_REC;
+		if (!record_ok(p))
+			break;
+		if (p[8] == JOURNAL_MARK) {
+			keep = i + 1;
+			j->marked = 1;
+			j->mark = get32(p) | (uint64_t)get32(p + 4) << 32;
+		}
+	}
+	n = keep;
+
+	for (j->setcap = 1024; j->setcap < 2 * n + 1; j->setcap *= 2)
+		;
+	j->set = mmap(NULL, j->setcap * sizeof(*j->set),
+		      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		      -1, 0);
+	if (j->set == MAP_FAILED) {
+		j->set = NULL;
+		if (map)
+			munmap((void *)map, size);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		p = map + JOURNAL_HDR + i * JOURNAL_REC;
+		if (p[8] != JOURNAL_MARK)
+			set_add(j, get32(p) | (uint64_t)get32(p + 4) << 32,
+				p[8]);
+	}
+
+	if (map)
+		munmap((void *)map, size);
+
+	if (size == 0) {
+		unsigned char	hdr[JOURNAL_HDR];
+
+		memcpy(hdr, JOURNAL_MAGIC, 8);
+		put32(hdr + 8, JOURNAL_VERSION);
+		put32(hdr + 12, JOURNAL_REC);
+		if (write(j->fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+		    fsync(j->fd))
+			return -1;
+	} else if (JOURNAL_HDR + n * JOURNAL_REC != (size_t)size) {
+		if (ftruncate(j->fd, JOURNAL_HDR + n * JOURNAL_REC))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+struct journal *
+journal_open(const char *path, const char **errmsg)
+{
+	struct journal	*j;
+	struct stat	st;
+	int		e;
+
+	*errmsg = NULL;
+	if (!(j = malloc(sizeof(*j))))
+		return NULL;
+	j->set = NULL;
+	j->pending = 0;
+	j->marked = 0;
+	j->mark = 0;
+	j->synced = time(NULL);
+
+	if ((j->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1) {
+		free(j);
+		return NULL;
+	}
+	if (fstat(j->fd, &st) || load(j, st.st_size, errmsg)) {
+		e = errno;
+		if (j->set)
+			munmap(j->set, j->setcap * sizeof(*j->set));
+		close(j->fd);
+		free(j);
+		errno = e;
+		return NULL;
+	}
+
+	return j;
+}
+
+
+int
+journal_mark(const struct journal *j, uint64_t *mark)
+{
+	*mark = j->mark;
+
+	return j->marked;
+}
+
+
+static void
+put_record(struct journal *j, uint64_t key, int status)
+{
+	unsigned char	*p = j->buf + j->pending++ * JOURNAL_REC;
+
+	put32(p, (uint32_t)key);
+	put32(p + 4, (uint32_t)(key >> 32));
+	p[8] = (unsigned char)status;
+	p[9] = p[10] = p[11] = 0;
+	put32(p + 12, check_word(key, status));
+}
+
+
+int
+journal_add(struct journal *j, uint64_t key, int status)
+{
+	put_record(j, key, status);
+
+	return j->pending == JOURNAL_BATCH ||
+	       time(NULL) - j->synced >= JOURNAL_SECS;
+}
+
+
+int
+journal_sync(struct journal *j, uint64_t mark)
+{
+	size_t	len, done = 0;
+	ssize_t	n;
+
+	if (j->pending == 0 && j->marked && j->mark == mark)
+		return 0;
+	put_record(j, mark, JOURNAL_MARK);
+	len = j->pending * JOURNAL_REC;
+
+	while (done < len) {
+		if ((n = write(j->fd, j->buf + done, len - done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	j->pending = 0;
+	j->synced = time(NULL);
+	j->marked = 1;
+	j->mark = mark;
+
+	return fsync(j->fd);
+}
+
+
+int
+journal_close(struct journal *j)
+{
+	int	ret = close(j->fd);
+
+	munmap(j->set, j->setcap * sizeof(*j->set));
+	free(j);
+
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * A journal of the inputs a batch has finished, so a run that died
+ * can be started again without redoing them.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+
+struct journal;
+
+
+/*
+ * Open the journal at path, creating it if need be, and take in what
+ * earlier runs finished.  Returns NULL with errno set, or with a
+ * message in *errmsg if the file isn't a journal.
+ */
+struct journal *journal_open(const char *path, const char **errmsg);
+
+/* The key of an input: a file, or a member name within an archive,
+ * of size bytes last modified at mtime, so a changed input is new. */
+uint64_t journal_key(const char *archive, const char *name, uint64_t size,
+		     long mtime);
+
+/* Set *mark to the mark of the last sync an earlier run made.  Returns
+ * 1, or 0 if there was none. */
+int journal_mark(const struct journal *j, uint64_t *mark);
+
+/* The status an earlier run finished key with, or -1.  Safe to call
+ * while another thread adds. */
+int journal_lookup(const struct journal *j, uint64_t key);
+
+/* Note key as finished with status 0, 1 or 2, to be written by the
+ * next journal_sync().  Returns 1 when that is due, and it must be
+ * done before adding more; else 0. */
+int journal_add(struct journal *j, uint64_t key, int status);
+
+/* Write out and fsync() what has been added, with mark, the length of
+ * the output it is safely in.  Returns 0 or -1. */
+int journal_sync(struct journal *j, uint64_t mark);
+
+/* Close, leaving out anything added since the last sync, whose results
+ * may not have been written.  Returns 0 or -1. */
+int journal_close(struct journal *j);
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Buffered output straight to a file descriptor.
+ *
+ * Output is gathered in OB_SIZE buffers aligned to a page and goes out
+ * in one write() per full buffer, or wherever the caller flushes.
+ * Callers that produce their output in place reserve room in the
+ * buffer, fill it and commit what they used, so nothing is copied on
+ * the way to write().
+ *
+ * With OB_DIRECT a regular file is written with O_DIRECT while whole
+ * buffers go out at aligned offsets, and normally from the first
+ * partial buffer on.
+ *
+ * With OB_SPLICE a pipe is handed each buffer by vmsplice() with
+ * SPLICE_F_GIFT rather than having it copied.  The pipe then refers to
+ * our pages, and they may even move on from it into another pipe by
+ * splice() or tee(), so a buffer given away is never written again: it
+ * is unmapped, which leaves the pages to the pipe, and fresh ones are
+ * mapped in its place.
+ */
+
+#ifdef HAVE_SPLICE
+#define	_GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SPLICE
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#include "outbuf.h"
+
+
+#define	OB_ALIGN	4096
+
+enum ob_mode {
+	OB_WRITE,		/* write() */
+	OB_STDIO,		/* fwrite() */
+	OB_VMSPLICE		/* vmsplice() */
+};
+
+struct outbuf {
+	enum ob_mode	mode;
+	int		fd;
+	FILE		*fp;
+	int		direct;		/* O_DIRECT is on */
+	int		error;
+	int		mapped;		/* mem is from mmap() */
+	void		*mem;		/* As allocated */
+	unsigned char	*buf;		/* mem aligned */
+	size_t		size;
+	size_t		len;
+};
+
+
+static void
+ob_release(struct outbuf *ob)
+{
+#ifdef HAVE_SPLICE
+	if (ob->mapped) {
+		munmap(ob->mem, ob->size);
+		ob->mem = NULL;
+		ob->mapped = 0;
+		return;
+	}
+#endif
+
+	free(ob->mem);
+	ob->mem = NULL;
+}
+
+
+/* Replace the buffer by one of size bytes. */
+static int
+ob_alloc(struct outbuf *ob, size_t size)
+{
+	ob_release(ob);
+	ob->size = size;
+
+#ifdef HAVE_SPLICE
+	if (ob->mode == OB_VMSPLICE) {
+		void	*p;
+
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		ob->mem = ob->buf = p;
+		ob->mapped = 1;
+		return 0;
+	}
+#endif
+
+	if (!(ob->mem = malloc(size + OB_ALIGN - 1)))
+		return -1;
+	ob->buf = (unsigned char *)
+		(((size_t)ob->mem + OB_ALIGN - 1) & ~(size_t)(OB_ALIGN - 1));
+
+	return 0;
+}
+
+
+/* Replace the buffer by a bigger one, keeping its contents. */
+static int
+ob_grow(struct outbuf *ob, size_t size)
+{
+	struct outbuf	old = *ob;
+
+	ob->mem = NULL;
+	ob->mapped = 0;
+	if (ob_alloc(ob, size)) {
+		ob_release(&old);
+		return -1;
+	}
+	memcpy(ob->buf, old.buf, ob->len);
+	ob_release(&old);
+
+	return 0;
+}
+
+
+static struct outbuf *
+ob_new(enum ob_mode mode, int fd, FILE *fp)
+{
+	struct outbuf	*ob;
+
+	if (!(ob = calloc(1, sizeof(*ob))))
+		return NULL;
+
+	ob->mode = mode;
+	ob->fd = fd;
+	ob->fp = fp;
+
+	if (ob_alloc(ob, OB_SIZE)) {
+		free(ob);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return ob;
+}
+
+
+struct outbuf *
+ob_fdopen(int fd, unsigned int flags)
+{
+	struct outbuf	*ob;
+	struct stat	st;
+	enum ob_mode	mode = OB_WRITE;
+
+	if (fstat(fd, &st))
+		return NULL;
+
+#ifdef HAVE_SPLICE
+	if ((flags & OB_SPLICE) && S_ISFIFO(st.st_mode)) {
+		/* A bigger pipe takes a buffer at a time, if we may. */
+		fcntl(fd, F_SETPIPE_SZ, OB_SIZE);
+		mode = OB_VMSPLICE;
+	}
+#endif
+
+	if (!(ob = ob_new(mode, fd, NULL)))
+		return NULL;
+
+#ifdef O_DIRECT
+	if ((flags & OB_DIRECT) && S_ISREG(st.st_mode) &&
+	    lseek(fd, 0, SEEK_CUR) % OB_ALIGN == 0) {
+		int	fl = fcntl(fd, F_GETFL);
+
+		if (fl != -1 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0)
+			ob->direct = 1;
+	}
+#else
+	(void)flags;
+#endif
+
+	return ob;
+}
+
+
+struct outbuf *
+ob_stream(FILE *fp)
+{
+	return ob_new(OB_STDIO, -1, fp);
+}
+
+
+#ifdef O_DIRECT
+static void
+ob_direct_off(struct outbuf *ob)
+{
+	int	fl = fcntl(ob->fd, F_GETFL);
+
+	if (fl != -1)
+		fcntl(ob->fd, F_SETFL, fl & ~O_DIRECT);
+	ob->direct = 0;
+}
+#endif
+
+
+static int
+ob_write_fd(struct outbuf *ob, const unsigned char *p, size_t n)
+{
+#ifdef O_DIRECT
+	/* Only whole blocks at aligned offsets, so the first short write
+	 * ends it. */
+	if (ob->direct && n % OB_ALIGN)
+		ob_direct_off(ob);
+#endif
+
+	while (n > 0) {
+		ssize_t	w = write(ob->fd, p, n);
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+#ifdef O_DIRECT
+			/* Not every file system takes O_DIRECT. */
+			if (errno == EINVAL && ob->direct) {
+				ob_direct_off(ob);
+				continue;
+			}
+#endif
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+
+	return 0;
+}
+
+
+#ifdef HAVE_SPLICE
+static int
+ob_vmsplice(struct outbuf *ob)
+{
+	const unsigned char	*p = ob->buf;
+	size_t			n = ob->len;
+
+	while (n > 0) {
+		struct iovec	iov;
+		ssize_t		w;
+
+		iov.iov_base = (void *)p;
+		iov.iov_len = n;
+		if ((w = vmsplice(ob->fd, &iov, 1, SPLICE_F_GIFT)) < 0) {
+			if (errno == EINTR)
+				continue;
+			/* If the pipe has none of this buffer yet, it can
+			 * be written and reused as usual from now on. */
+			if (p == ob->buf &&
+			    (errno == EINVAL || errno == ENOSYS)) {
+				ob->mode = OB_WRITE;
+				return ob_write_fd(ob, p, n);
+			}
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+
+	/* The pages are the pipe's now. */
+	return ob_alloc(ob, ob->size);
+}
+#endif
+
+
+/*
+ * Write out the buffer.  Unless all is set, O_DIRECT output keeps back
+ * the tail past the last whole block, moved to the front of the buffer,
+ * so that the next write starts aligned too.
+ */
+
+static int
+ob_drain(struct outbuf *ob, int all)
+{
+	size_t	n = ob->len;
+	int	r = 0;
+
+	if (ob->error) {
+		errno = ob->error;
+		return -1;
+	}
+
+	if (!all && ob->direct && n > OB_ALIGN)
+		n &= ~(size_t)(OB_ALIGN - 1);
+
+	if (n == 0)
+		return 0;
+
+	errno = 0;
+	switch (ob->mode) {
+	case OB_WRITE:
+		r = ob_write_fd(ob, ob->buf, n);
+		break;
+
+	case OB_STDIO:
+		if (fwrite(ob->buf, 1, n, ob->fp) != n)
+			r = -1;
+		break;
+
+	case OB_VMSPLICE:
+#ifdef HAVE_SPLICE
+		r = ob_vmsplice(ob);
+#endif
+		break;
+	}
+
+	if (r) {
+		ob->len = 0;
+		ob->error = errno ? errno : EIO;
+		errno = ob->error;
+		return r;
+	}
+
+	memmove(ob->buf, ob->buf + n, ob->len - n);
+	ob->len -= n;
+
+	return 0;
+}
+
+
+int
+ob_flush(struct outbuf *ob)
+{
+	return ob_drain(ob, 1);
+}
+
+
+unsigned char *
+ob_reserve(struct outbuf *ob, size_t n)
+{
+	if (ob->size - ob->len < n && ob_drain(ob, 0))
+		return NULL;
+
+	if (ob->error)
+		return NULL;
+
+	/* Rare enough to simply grow for good. */
+	if (n > ob->size - ob->len &&
+	    ob_grow(ob, (ob->len + n + OB_ALIGN - 1) &
+			~(size_t)(OB_ALIGN - 1))) {
+		ob->error = ENOMEM;
+		ob->size = 0;
+		return NULL;
+	}
+
+	return ob->buf + ob->len;
+}
+
+
+void
+ob_commit(struct outbuf *ob, size_t n)
+{
+	ob->len += n;
+}
+
+
+int
+ob_write(struct outbuf *ob, const void *buf, size_t n)
+{
+	const unsigned char	*p = buf;
+
+	while (n > 0) {
+		unsigned char	*q;
+		size_t		room;
+
+		if (!(q = ob_reserve(ob, 1)))
+			return -1;
+		room = ob->size - ob->len;
+		if (room > n)
+			room = n;
+		memcpy(q, p, room);
+		ob_commit(ob, room);
+		p += room;
+		n -= room;
+	}
+
+	return 0;
+}
+
+
+int
+ob_error(const struct outbuf *ob)
+{
+	return ob->error;
+}
+
+
+int
+ob_free(struct outbuf *ob)
+{
+	int	r = ob_flush(ob);
+	int	e = ob->error;
+
+#ifdef O_DIRECT
+	if (ob->direct)
+		ob_direct_off(ob);
+#endif
+	ob_release(ob);
+	free(ob);
+
+	errno = e;
+
+	return r;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Buffered output straight to a file descriptor, in large aligned
+ * buffers that are reused for the whole run.
+ */
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+#define	OB_SIZE		(1024 * 1024)	/* Bytes per buffer */
+
+#define	OB_DIRECT	0x01	/* Regular files: O_DIRECT for whole buffers */
+#define	OB_SPLICE	0x02	/* Pipes: vmsplice() buffers, don't copy */
+
+struct outbuf;
+
+
+/*
+ * Start buffering output to fd, which stays open and must not be
+ * written by anything else until ob_free().  Flags not supported by
+ * the build or by fd are ignored.  Returns NULL with errno set.
+ */
+struct outbuf *ob_fdopen(int fd, unsigned int flags);
+
+/* The same through a stdio stream, e.g. an in-memory one. */
+struct outbuf *ob_stream(FILE *fp);
+
+/*
+ * Returns room for at least n bytes, flushing first if there isn't
+ * that much left.  Up to n bytes may be put there and then made part
+ * of the output with ob_commit().  Returns NULL after a write error.
+ */
+unsigned char *ob_reserve(struct outbuf *ob, size_t n);
+void ob_commit(struct outbuf *ob, size_t n);
+
+/* Returns 0, or -1 after a write error. */
+int ob_write(struct outbuf *ob, const void *buf, size_t n);
+
+/* Write out everything buffered.  Returns 0, or -1 with errno set. */
+int ob_flush(struct outbuf *ob);
+
+/* The errno of the first failed write, 0 if there was none.  Once a
+ * write fails all later output is dropped. */
+int ob_error(const struct outbuf *ob);
+
+/* Flush and free ob, leaving the descriptor or stream open.  Returns
+ * 0, or -1 with errno set if anything failed to be written. */
+int ob_free(struct outbuf *ob);
+
+#endif
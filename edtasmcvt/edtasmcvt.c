@@ -37,6 +37,11 @@
  * https://www.trs-80.com/wordpress/tips/formats/#edasfile
  */
 
+#ifdef HAVE_PTHREAD
+#define	_GNU_SOURCE		/* pwritev() */
+#else
+#define	_POSIX_C_SOURCE	200809L
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -46,30 +51,80 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "trs80util.h"
+#include "outbuf.h"
+
+#ifdef HAVE_FMEMOPEN
+#include "batch.h"
+#endif
+
+#ifdef TRS80_MULTICALL
+#include "trs80.h"
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
 
-#define	HEADERCHAR	0xd3
 #define	EOLCHAR		0x0d
-#define	EOFCHAR		0x1a
 #define	LINENUMCHAR(c)	((c) >= 0xb0 && (c) <= 0xb9)
 
+#define	BLOCK_SIZE	(64 * 1024)
 
-enum edtasm_state {
-	ES_HDR,
-	ES_FNAME,
-	ES_LINENUM,
-	ES_LINETXT
-};
+#ifdef HAVE_FMEMOPEN
+#define	ARCHIVE_OPTS	"abJ:o:"
+#define	ARCHIVE_USAGE	"a"
+#else
+#define	ARCHIVE_OPTS	""
+#define	ARCHIVE_USAGE	""
+#endif
 
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
 
-/* Command line argument values. */
-FILE	*InputFile;
-FILE	*OutputFile;
-int	Cvt_Newer_Format;
-int	Show_File_Hdr;
-int	Show_Linenums;
+#ifdef HAVE_SPLICE
+#define	DIRECT_OPTS	"d"
+#else
+#define	DIRECT_OPTS	""
+#endif
+
+#define	OPTIONS		"cfms" ARCHIVE_OPTS DIRECT_OPTS JOBS_OPTS
+
+
+/*
+ * Everything one run needs, from the command line.  Nothing else is
+ * kept between calls, so runs and the jobs within them can go on side
+ * by side in one process.
+ */
+struct cvt_opts {
+	FILE		*infile;
+	FILE		*outfile;
+	FILE		*errfile;
+	unsigned int	flags;		/* TRS80_EDTASM_* */
+	unsigned int	obflags;	/* OB_* for outfile */
+	int		assemble;	/* -m: to a CMD file */
+	int		jobs;
+	int		archives;
+	int		batch;
+	const char	*batch_output;
+	const char	*journal;	/* Batch journal, or NULL */
+	char		**operands;
+	int		noperands;
+};
 
 
-void
+static void
 vfatal(int exitval, const char *fmsg, va_list ap)
 {
 	vfprintf(stderr, fmsg, ap);
@@ -77,7 +132,7 @@ vfatal(int exitval, const char *fmsg, va_list ap)
 }
 
 
-void
+static void
 fatal(int exitval, const char *fmsg, ...)
 {
 	va_list ap;
@@ -88,136 +143,690 @@ fatal(int exitval, const char *fmsg, ...)
 }
 
 
-void
+static void
 usage(const char *pgmname)
 {
 	static const char usage_str[] =
-		"Usage: %s [-cfs] [[edtasm_file] out_file]\n"
+		"Usage: %s [-" ARCHIVE_USAGE "cf" DIRECT_OPTS "ms]" JOBS_USAGE
+			" [[edtasm_file] out_file]\n"
+#ifdef HAVE_FMEMOPEN
+		"       %s -b [-acfms]" JOBS_USAGE
+			" [-J journal] [-o out_archive] edtasm_file...\n"
+#endif
 		"Options:\n"
+#ifdef HAVE_FMEMOPEN
+		"\t-a\tInput is a tar or zip archive "
+			"(out_file is a tar or zip archive)\n"
+		"\t-b\tBatch mode, convert every input into one archive\n"
+#endif
 		"\t-c\tConvert to newer format\n"
+#ifdef HAVE_SPLICE
+		"\t-d\tDirect output, O_DIRECT to a file or "
+			"vmsplice() to a pipe\n"
+#endif
 		"\t-f\tShow file header if present\n"
+		"\t-m\tAssemble into a CMD file instead of converting\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tDecode in parallel with jobs threads "
+			"(0 = one per CPU)\n"
+#endif
+#ifdef HAVE_FMEMOPEN
+		"\t-J\tSkip the inputs the journal has as done, and add to it\n"
+		"\t-o\tBatch output tar or zip (.zip) archive, "
+			"default tar to stdout\n"
+#endif
 		"\t-s\tStrip line numbers\n";
 
-	fatal(1, usage_str, pgmname);
+	fatal(1, usage_str, pgmname, pgmname);
 }
 
 
 static int
-process_file(FILE *infile, FILE *outfile, int show_hdr, int cvt_newerfmt)
+report_error(FILE *errfile, int status, const struct trs80_error *err)
 {
-	int			ch;
-	enum edtasm_state	state = ES_HDR;
-	int			fnc = 0;
-	int			lncc = 0;
-	int			tlcc = 0;
-
-	while ((ch = fgetc(infile)) != -1) {
-		if (state == ES_HDR) {
-			/* Look at first char to determine file format
-			 * and starting state. */
-			if (ch == HEADERCHAR) {
-				state = ES_FNAME;
-				continue;
-			} else if (LINENUMCHAR(ch)) {
-				state = ES_LINENUM;
-			} else {
-				fprintf(stderr, "Unexpected file format.\n");
-				return 2;
-			}
+	char	msg[128];
+
+	trs80_error_message(status, err, msg, sizeof(msg));
+	fprintf(errfile, "%s\n", msg);
+
+	return status == TRS80_E_NOMEM || status == TRS80_E_INVAL ? 3 : 2;
+}
+
+
+static int
+report_write_error(FILE *errfile, int e)
+{
+	fprintf(errfile, "Error writing output file, %s (%d)\n",
+		strerror(e), e);
+
+	return 3;
+}
+
+
+/*
+ * Decode len bytes at buf with decoder d, a block at a time, straight
+ * into the output buffer.  Diagnostics go to errfile.
+ */
+
+static int
+decode_buf(struct trs80_edtasm *d, const unsigned char *buf, size_t len,
+	   struct outbuf *ob, FILE *errfile)
+{
+	while (len > 0 && !(trs80_edtasm_where(d, NULL) & TRS80_EDTASM_EOF)) {
+		size_t			n = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+		size_t			outlen;
+		unsigned char		*out;
+		struct trs80_error	err;
+		int			st;
+
+		if (!(out = ob_reserve(ob, trs80_edtasm_bound(n))))
+			return report_write_error(errfile, ob_error(ob));
+
+		st = trs80_edtasm_decode(d, buf, n, (char *)out, &outlen,
+					 &err);
+		ob_commit(ob, outlen);
+		if (st != TRS80_OK)
+			return report_error(errfile, st, &err);
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Start buffered output to outfile, straight to its descriptor unless
+ * it is an in-memory stream.  Returns NULL after reporting why.
+ */
+
+static struct outbuf *
+open_output(FILE *outfile, unsigned int obflags, FILE *errfile)
+{
+	struct outbuf	*ob;
+	int		fd = fileno(outfile);
+
+	if (fd == -1) {
+		if ((ob = ob_stream(outfile)))
+			return ob;
+	} else if (fflush(outfile) == 0 && (ob = ob_fdopen(fd, obflags))) {
+		return ob;
+	}
+
+	report_write_error(errfile, errno);
+
+	return NULL;
+}
+
+
+/* Flush and free ob.  Returns ret, or 3 if output was lost. */
+static int
+close_output(struct outbuf *ob, int ret, FILE *errfile)
+{
+	if (ob_free(ob) && ret != 3)
+		ret = report_write_error(errfile, errno);
+
+	return ret;
+}
+
+
+/*
+ * Decode the whole of in into a malloc()ed buffer, which is returned
+ * in *outp even on a format error.  Diagnostics go to errfile.
+ */
+
+int
+edtasm_buffer(const unsigned char *in, size_t len, unsigned int flags,
+	      unsigned char **outp, size_t *outlenp, FILE *errfile)
+{
+	struct trs80_error	err;
+	int			st;
+
+	if (!(*outp = malloc(trs80_edtasm_bound(len)))) {
+		*outlenp = 0;
+		fprintf(errfile, "Out of memory.\n");
+		return 3;
+	}
+
+	st = trs80_edtasm_convert(in, len, flags, *outp, outlenp, &err);
+	if (st != TRS80_OK)
+		return report_error(errfile, st, &err);
+
+	return 0;
+}
+
+
+/*
+ * Assemble the whole of in, an EDTASM file or source text, with a.
+ * Diagnostics go to errfile.
+ */
+
+int
+asm_source(struct trs80_asm *a, const unsigned char *in, size_t len,
+	   FILE *errfile)
+{
+	struct trs80_asm_diag	diag;
+	int			st;
+
+	if (trs80_identify(in, len) == TRS80_TYPE_EDTASM)
+		st = trs80_asm_edtasm(a, in, len, &diag);
+	else
+		st = trs80_asm_text(a, (const char *)in, len, &diag);
+
+	if (st == TRS80_OK)
+		return 0;
+
+	if (st == TRS80_E_NOMEM) {
+		fprintf(errfile, "Out of memory.\n");
+		return 3;
+	}
+
+	if (diag.linenum)
+		fprintf(errfile, "Line %05lu: %s.\n", diag.linenum, diag.msg);
+	else
+		fprintf(errfile, "%s.\n", diag.msg);
+
+	return 2;
+}
+
+
+/* The same into a CMD file in a new malloc()ed buffer. */
+int
+asm_buffer(const unsigned char *in, size_t len, unsigned char **outp,
+	   size_t *outlenp, FILE *errfile)
+{
+	struct trs80_asm	*a;
+	int			ret;
+
+	*outp = NULL;
+	*outlenp = 0;
+
+	if (!(a = trs80_asm_new())) {
+		fprintf(errfile, "Out of memory.\n");
+		return 3;
+	}
+
+	if (!(ret = asm_source(a, in, len, errfile))) {
+		if ((*outp = malloc(trs80_asm_cmd_bound(a)))) {
+			trs80_asm_cmd(a, *outp, outlenp);
+		} else {
+			fprintf(errfile, "Out of memory.\n");
+			ret = 3;
 		}
+	}
 
-		switch (state) {
-		case ES_FNAME:
-			/* Process filename. */
-			if (show_hdr) {
-				if (fnc == 0)
-					fprintf(outfile, "FILENAME: ");
+	trs80_asm_free(a);
 
-				fprintf(outfile, "%c", ch);
-			}
+	return ret;
+}
 
-			if (fnc++ == 5) {
-				if (show_hdr) fprintf(outfile, "\n\n");
-				fnc = 0;
-				state = ES_LINENUM;
-			}
-			break;
 
-		case ES_LINENUM:
-			/* Process line number. */
-			if (LINENUMCHAR(ch)) {
-				if (Show_Linenums)
-					fprintf(outfile, "%c", ch & 0x7f);
-				if (++lncc == 5) {
-					lncc = 0;
-					state = ES_LINETXT;
-				}
-			} else if (ch == EOFCHAR) {
-				return 0;
-			} else {
-				fprintf(stderr, "Bad line number.\n");
-				return 2;
+/* Assemble len bytes at in onto outfile. */
+static int
+assemble_buf(const unsigned char *in, size_t len, FILE *outfile,
+	     FILE *errfile, unsigned int obflags)
+{
+	struct outbuf	*ob;
+	unsigned char	*out;
+	size_t		outlen;
+	int		ret;
+
+	if ((ret = asm_buffer(in, len, &out, &outlen, errfile)))
+		return ret;
+
+	if (!(ob = open_output(outfile, obflags, errfile))) {
+		free(out);
+		return 3;
+	}
+	if (ob_write(ob, out, outlen))
+		ret = report_write_error(errfile, ob_error(ob));
+	free(out);
+
+	return close_output(ob, ret, errfile);
+}
+
+
+/* Assemble all of infile, which is read in first, onto outfile. */
+static int
+assemble_file(FILE *infile, FILE *outfile, FILE *errfile,
+	      unsigned int obflags)
+{
+	unsigned char	*in = NULL;
+	size_t		len = 0, cap = 0, n;
+	int		ret;
+
+	do {
+		if (len == cap) {
+			unsigned char	*p;
+
+			cap = cap ? cap * 2 : BLOCK_SIZE;
+			if (!(p = realloc(in, cap))) {
+				free(in);
+				fprintf(errfile, "Out of memory.\n");
+				return 3;
 			}
+			in = p;
+		}
+		len += n = fread(in + len, 1, cap - len, infile);
+	} while (n > 0);
+
+	if (ferror(infile)) {
+		fprintf(errfile, "Error reading input file, %s (%d)\n",
+			strerror(errno), errno);
+		free(in);
+		return 3;
+	}
+
+	ret = assemble_buf(in, len, outfile, errfile, obflags);
+	free(in);
+
+	return ret;
+}
+
+
+/*
+ * Decode infile onto outfile, written as obflags asks if it has a
+ * descriptor.  Diagnostics go to errfile.
+ */
+
+static int
+process_file(FILE *infile, FILE *outfile, FILE *errfile, unsigned int flags,
+	     unsigned int obflags)
+{
+	struct trs80_edtasm	*d;
+	struct outbuf		*ob;
+	unsigned char		*in;
+	size_t			n;
+	int			ret = 0;
+
+	if (!(ob = open_output(outfile, obflags, errfile)))
+		return 3;
+
+	d = trs80_edtasm_new(flags);
+	in = malloc(BLOCK_SIZE);
+	if (!d || !in) {
+		fprintf(errfile, "Out of memory.\n");
+		ret = 3;
+		goto out;
+	}
+
+	while (!ret && (n = fread(in, 1, BLOCK_SIZE, infile)) > 0) {
+		ret = decode_buf(d, in, n, ob, errfile);
+		if (trs80_edtasm_where(d, NULL) & TRS80_EDTASM_EOF)
 			break;
+	}
+
+out:
+	free(in);
+	trs80_edtasm_free(d);
+
+	return close_output(ob, ret, errfile);
+}
+
+
+#ifdef HAVE_FMEMOPEN
+static int
+convert_job(struct batch_job *job)
+{
+	const struct cvt_opts	*o = job->arg;
+
+	if (o->assemble)
+		return assemble_buf(job->data, job->size, job->out, job->err,
+				    0);
+
+	return process_file(job->in, job->out, job->err, o->flags, 0);
+}
+
+
+/*
+ * Convert every input, or every file in every archive, through the
+ * batch machinery.  Archive output keeps the input names and leaves
+ * out files that fail to convert; plain output (an archive converted
+ * to stdout) is all the converted text one after another.  Assembled
+ * files are named with a .CMD extension.
+ */
+
+static int
+process_batch(const struct cvt_opts *o)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct batch_opts	opts;
+
+	opts.fn = convert_job;
+	opts.arg = (void *)o;
+	opts.jobs = o->jobs;
+	opts.archives = o->archives;
+	opts.suffix = o->assemble ? ".CMD" : NULL;
+	opts.outfile = o->outfile;
+	opts.rptfile = NULL;
+	opts.errfile = o->errfile;
+	opts.journal = o->journal;
+
+	if (o->batch)
+		opts.output = o->batch_output ?
+				batch_output_for(o->batch_output) : BATCH_TAR;
+	else if (o->noperands > 1)
+		opts.output = batch_output_for(o->operands[1]);
+	else
+		opts.output = BATCH_CONCAT;
+
+	if (!o->batch)
+		return batch_run(&opts, o->noperands ? o->operands :
+						       stdin_operand, 1);
+
+	return batch_run(&opts, o->operands, o->noperands);
+}
+#endif
+
+
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel decoding of a single large file.
+ *
+ * Every line ends with EOLCHAR and the next one starts with five line
+ * number digits and a separator, so the mapped input is cut just after
+ * a 0x0D followed by such a prefix and each chunk is decoded into memory
+ * on its own thread.  A cut is genuine only if the chunk before it
+ * stopped exactly at a line boundary.  Everything from the first bogus
+ * cut onwards is decoded again serially, continuing with the preceding
+ * chunk's decoder.  Decoded chunks are written out in order.
+ */
+
+#define	PAR_MIN_CHUNK	(1024 * 1024)
+#define	PAR_IOV_MAX	64
+
+struct par_chunk {
+	const unsigned char	*base;
+	size_t			len;
+	pthread_t		tid;
+	char			*out;
+	size_t			outlen;
+	char			err[128];
+	int			ret;
+	struct trs80_edtasm	*d;
+};
+
+
+static int
+is_line_start(const unsigned char *p, const unsigned char *end)
+{
+	int	i;
+
+	if (end - p < 6)
+		return 0;
+
+	for (i = 0; i < 5; ++i)
+		if (!LINENUMCHAR(p[i]))
+			return 0;
+
+	return p[5] == ' ' || p[5] == '\t';
+}
+
+
+/* Find the first candidate line start after an EOLCHAR at or past p. */
+static const unsigned char *
+find_cut(const unsigned char *p, const unsigned char *end)
+{
+	while ((p = memchr(p, EOLCHAR, end - p)) != NULL)
+		if (is_line_start(++p, end))
+			return p;
+
+	return end;
+}
+
+
+static void *
+par_decode(void *arg)
+{
+	struct par_chunk	*c = arg;
+	struct trs80_error	err;
+	int			st;
+
+	if (!(c->out = malloc(trs80_edtasm_bound(c->len)))) {
+		snprintf(c->err, sizeof(c->err),
+			 "Out of memory decoding chunk.");
+		c->ret = 3;
+		return NULL;
+	}
+
+	st = trs80_edtasm_decode(c->d, c->base, c->len, c->out, &c->outlen,
+				 &err);
+	if (st != TRS80_OK) {
+		trs80_error_message(st, &err, c->err, sizeof(c->err));
+		c->ret = 2;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Write chunks in order from the output's current offset.  Seekable
+ * outputs get pwritev() at each batch's precomputed offset, anything
+ * else plain writev().
+ */
+
+static int
+par_write(int fd, struct par_chunk *chunks, int nchunks)
+{
+	struct iovec	iov[PAR_IOV_MAX];
+	off_t		off;
+	int		seekable;
+	int		i, n;
+
+	off = lseek(fd, 0, SEEK_CUR);
+	seekable = (off != -1);
+
+	for (i = 0; i < nchunks; i += n) {
+		struct iovec	*v = iov;
+		int		nv;
 
-		case ES_LINETXT:
-			/* Process line text. */
-			if (tlcc++ == 0) {
-				if (ch == ' ' || ch == '\t') {
-					if (Show_Linenums) {
-						if (ch == ' ' &&
-						    (cvt_newerfmt == 1)) {
-						    	ch = '\t';
-						}
-						fprintf(outfile, "%c", ch);
-					}
-				} else {
-					fprintf(stderr, "Unexpected character "
-							"following line number "
-							"(%02x).\n", ch);
-					return 2;
-				}
-			} else if (ch == EOLCHAR) {
-				fprintf(outfile, "\n");
-				tlcc = 0;
-				state = ES_LINENUM;
-			} else {
-				fprintf(outfile, "%c", ch);
+		for (n = 0; n < PAR_IOV_MAX && i + n < nchunks; ++n) {
+			iov[n].iov_base = chunks[i + n].out;
+			iov[n].iov_len = chunks[i + n].outlen;
+		}
+
+		for (nv = n; nv > 0; ) {
+			ssize_t	w;
+
+			w = seekable ? pwritev(fd, v, nv, off) :
+				       writev(fd, v, nv);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
 			}
-			break;
 
-		default:
-			fprintf(stderr, "Bad state (%d, 0x%02x).\n",
-				state, ch);
-			return 3;
+			off += w;
+			while (nv > 0 && (size_t)w >= v->iov_len) {
+				w -= v->iov_len;
+				++v;
+				--nv;
+			}
+			if (nv > 0) {
+				v->iov_base = (char *)v->iov_base + w;
+				v->iov_len -= w;
+			}
 		}
 	}
 
+	if (seekable && lseek(fd, off, SEEK_SET) == -1)
+		return -1;
+
 	return 0;
 }
 
 
+/*
+ * Returns -1 if the input isn't worth decoding in parallel, otherwise
+ * the same as process_file().
+ */
+
+static int
+process_file_parallel(const struct cvt_opts *o)
+{
+	FILE			*infile = o->infile;
+	FILE			*outfile = o->outfile;
+	FILE			*errfile = o->errfile;
+	int			jobs = o->jobs;
+	struct stat		st;
+	unsigned char		*map;
+	const unsigned char	*p, *end;
+	struct par_chunk	*chunks;
+	int			nchunks, k;
+	int			ret;
+
+	if (fstat(fileno(infile), &st) || !S_ISREG(st.st_mode))
+		return -1;
+
+	if (jobs == 0)
+		jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > st.st_size / PAR_MIN_CHUNK)
+		jobs = st.st_size / PAR_MIN_CHUNK;
+	if (jobs < 2)
+		return -1;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			fileno(infile), 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (!(chunks = calloc(jobs, sizeof(*chunks)))) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	end = map + st.st_size;
+	for (p = map, nchunks = 0; nchunks < jobs && p < end; ++nchunks) {
+		const unsigned char	*cut = end;
+
+		if (nchunks < jobs - 1) {
+			cut = map + (size_t)st.st_size * (nchunks + 1) / jobs;
+			cut = find_cut(cut > p ? cut : p, end);
+		}
+
+		chunks[nchunks].base = p;
+		chunks[nchunks].len = cut - p;
+		p = cut;
+	}
+
+	for (k = 0; k < nchunks; ++k) {
+		if (!(chunks[k].d = trs80_edtasm_new(o->flags))) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	for (k = 0; k < nchunks; ++k)
+		if (pthread_create(&chunks[k].tid, NULL, par_decode,
+					&chunks[k]))
+			par_decode(&chunks[k]);
+
+	for (k = 0; k < nchunks; ++k)
+		if (chunks[k].tid)
+			pthread_join(chunks[k].tid, NULL);
+
+	/* Chunks up to and including k are good. */
+	for (k = 0; k < nchunks - 1; ++k)
+		if (chunks[k].ret || !(trs80_edtasm_where(chunks[k].d, NULL) &
+					TRS80_EDTASM_LINESTART))
+			break;
+
+	if (chunks[k].ret)
+		fprintf(errfile, "%s\n", chunks[k].err);
+	ret = chunks[k].ret;
+
+	if (fflush(outfile) || par_write(fileno(outfile), chunks, k + 1)) {
+		ret = report_write_error(errfile, errno);
+	} else if (ret == 0 && k < nchunks - 1) {
+		struct outbuf	*ob;
+
+		p = chunks[k + 1].base;
+		if (!(ob = open_output(outfile, o->obflags,
+				       errfile)))
+			ret = 3;
+		else
+			ret = close_output(ob, decode_buf(chunks[k].d, p,
+						end - p, ob, errfile), errfile);
+	}
+
+out:
+	for (k = 0; k < nchunks; ++k) {
+		free(chunks[k].out);
+		trs80_edtasm_free(chunks[k].d);
+	}
+	free(chunks);
+	munmap(map, st.st_size);
+
+	return ret;
+}
+#endif
+
+
 static int
-process_args(int argc, char **argv)
+process_args(struct cvt_opts *o, int argc, char **argv)
 {
 	int	opt;
 
-	Show_File_Hdr = 0;
-	Cvt_Newer_Format = 0;
-	Show_Linenums = 1;
+	memset(o, 0, sizeof(*o));
+	o->jobs = 1;
+	o->errfile = stderr;
 
-	while ((opt = getopt(argc, argv, "cfs")) != -1) {
+	while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
 		switch (opt) {
+#ifdef HAVE_FMEMOPEN
+		case 'a':
+			o->archives = 1;
+			break;
+
+		case 'b':
+			o->batch = 1;
+			break;
+
+		case 'J':
+			o->journal = optarg;
+			break;
+
+		case 'o':
+			o->batch_output = optarg;
+			break;
+#endif
+
 		case 'c':
-			Cvt_Newer_Format = 1;
+			o->flags |= TRS80_EDTASM_NEWER;
 			break;
 
+#ifdef HAVE_SPLICE
+		case 'd':
+			o->obflags |= OB_DIRECT | OB_SPLICE;
+			break;
+#endif
+
 		case 'f':
-			Show_File_Hdr = 1;
+			o->flags |= TRS80_EDTASM_HEADER;
 			break;
 
+		case 'm':
+			o->assemble = 1;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			char	*ep;
+			long	jobs = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || jobs < 0 || jobs > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				return -1;
+			}
+			o->jobs = (int)jobs;
+			break;
+		}
+#endif
+
 		case 's':
-			Show_Linenums = 0;
+			o->flags |= TRS80_EDTASM_NOLINENUMS;
 			break;
 
 		default:
@@ -226,17 +835,36 @@ process_args(int argc, char **argv)
 		}
 	}
 
-	if ((argc - optind) > 2) {
+	o->operands = argv + optind;
+	o->noperands = argc - optind;
+
+	if (o->batch && o->noperands == 0) {
+		fprintf(stderr, "No input files.\n\n");
+		return -1;
+	}
+
+	if (!o->batch && o->batch_output) {
+		fprintf(stderr, "Option -o requires -b.\n\n");
+		return -1;
+	}
+
+	if (o->journal && !o->batch && !o->archives) {
+		fprintf(stderr, "Option -J requires -a or -b.\n\n");
+		return -1;
+	}
+
+	if (!o->batch && o->noperands > 2) {
 		fprintf(stderr, "Too many operands.\n\n");
 		return -1;
 	}
 
-	if ((argc - optind) > 0) {
-		const char	*ifile = argv[optind];
+	/* Batch and archive inputs are opened as they are processed. */
+	if (o->noperands > 0 && !o->batch && !o->archives) {
+		const char	*ifile = o->operands[0];
 		FILE		*ifp;
 
 		if ((ifp = fopen(ifile, "r"))) {
-			InputFile = ifp;
+			o->infile = ifp;
 		} else {
 			fprintf(stderr,
 				"Failed to open file '%s', %s (%d)\n\n",
@@ -244,15 +872,17 @@ process_args(int argc, char **argv)
 			return -1;
 		}
 	} else {
-		InputFile = stdin;
+		o->infile = stdin;
 	}
 
-	if ((argc - optind) > 1) {
-		const char	*ofile = argv[optind+1];
+	if (o->batch ? o->batch_output != NULL : o->noperands > 1) {
+		const char	*ofile = o->batch ? o->batch_output :
+						    o->operands[1];
 		FILE		*ofp;
 
-		if ((ofp = fopen(ofile, "w+"))) {
-			OutputFile = ofp;
+		/* A journaled batch carries on the last run's output. */
+		if ((ofp = fopen(ofile, o->journal ? "a+" : "w+"))) {
+			o->outfile = ofp;
 		} else {
 			fprintf(stderr,
 				"Failed to open file '%s', %s (%d)\n\n",
@@ -260,7 +890,7 @@ process_args(int argc, char **argv)
 			return -1;
 		}
 	} else {
-		OutputFile = stdout;
+		o->outfile = stdout;
 	}
 
 	return 0;
@@ -268,34 +898,73 @@ process_args(int argc, char **argv)
 
 
 /*
- * Exit --
- * 	0: Success
- * 	1: User error (bad args)
- * 	2: Input file error (bad EDTASM file)
- * 	3: Internal error (bad programmer!)
+ * Carry out one run.  Returns an exit status as for main(), with any
+ * diagnostics written to o->errfile.
  */
 
-int
-main(int argc, char **argv)
+static int
+run(const struct cvt_opts *o)
 {
-	int	ret = 0;
+	int	ret = -1;
 
-	if (process_args(argc, argv))
-		usage(argv[0]);
+#ifdef HAVE_FMEMOPEN
+	if (o->batch || o->archives)
+		ret = process_batch(o);
+#endif
+
+	if (ret < 0 && o->assemble)
+		ret = assemble_file(o->infile, o->outfile, o->errfile,
+				    o->obflags);
+
+#ifdef HAVE_PTHREAD
+	if (ret < 0 && o->jobs != 1)
+		ret = process_file_parallel(o);
+#endif
 
-	ret = process_file(InputFile, OutputFile,
-				Show_File_Hdr, Cvt_Newer_Format);
+	if (ret < 0)
+		ret = process_file(o->infile, o->outfile, o->errfile,
+					o->flags, o->obflags);
 
 	if (ret == 0) {
 		/* We think we succeeded, but let's be sure. */
 
-		if (ferror(OutputFile))
-			fatal(3, "Error detected after writing output file.\n");
+		if (ferror(o->outfile)) {
+			fprintf(o->errfile,
+				"Error detected after writing output file.\n");
+			return 3;
+		}
 
-		if (fclose(OutputFile) == EOF)
-			fatal(3, "Error detected when closing output file, "
-					"%s (%d)\n", strerror(errno), errno);
+		if (fclose(o->outfile) == EOF) {
+			fprintf(o->errfile, "Error detected when closing "
+				"output file, %s (%d)\n",
+				strerror(errno), errno);
+			return 3;
+		}
 	}
 
 	return ret;
 }
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error (bad EDTASM file)
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+#ifdef TRS80_MULTICALL
+edtasmcvt_main(int argc, char **argv)
+#else
+main(int argc, char **argv)
+#endif
+{
+	struct cvt_opts	opts;
+
+	if (process_args(&opts, argc, argv))
+		usage(argv[0]);
+
+	return run(&opts);
+}
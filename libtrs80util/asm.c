@@ -0,0 +1,2149 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * A two-pass Z80 assembler for EDTASM source.
+ *
+ * The source lines are collected once, pointing into the caller's
+ * buffer, and parsed afresh on each pass.  Pass one sizes every line
+ * and defines the labels; pass two evaluates everything again with
+ * all symbols known and emits the code.  Symbols live in an open
+ * addressing hash table, and they and their names come from an arena
+ * that is freed in one go, so a file costs a handful of allocations
+ * however many symbols it has.
+ *
+ * Only what must be known to size the code has to be defined before
+ * use in pass one: ORG, DEFS and COND operands.  EQUs may refer
+ * forward; those left unknown by pass one are evaluated again until
+ * no more come out, before pass two starts.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	ARENA_CHUNK	(64 * 1024)
+#define	MIN_SYMS	1024		/* Hash table slots to start with */
+#define	MAX_OPERANDS	2		/* For instructions */
+
+#define	UC(c)		((c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 'A' : (c))
+#define	ISSPACE(c)	((c) == ' ' || (c) == '\t')
+#define	ISDIGIT(c)	((c) >= '0' && (c) <= '9')
+#define	ISALPHA(c)	(((c) >= 'A' && (c) <= 'Z') || \
+			 ((c) >= 'a' && (c) <= 'z'))
+#define	ISSYM1(c)	(ISALPHA(c) || (c) == '_' || (c) == '@' || (c) == '?')
+#define	ISSYM(c)	(ISSYM1(c) || ISDIGIT(c) || (c) == '$')
+
+
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	union {
+		long		l;
+		double		d;
+		void		*p;
+	}			data[1];
+};
+
+struct sym {
+	const char	*name;		/* Upper case, not NUL terminated */
+	size_t		len;
+	unsigned long	hash;
+	long		value;
+	unsigned char	known;		/* value is set */
+	unsigned char	redef;		/* DEFL, may be set again */
+	unsigned char	pass;		/* Last set in */
+};
+
+struct src_line {
+	const char	*text;
+	size_t		len;
+	unsigned long	linenum;
+	size_t		offset;
+	int		equ;		/* Reached EQU, pc is set */
+	unsigned int	pc;
+};
+
+struct trs80_asm {
+	struct arena_chunk	*arena;
+	struct src_line		*lines;
+	size_t			nlines;
+	size_t			linecap;
+	struct sym		**syms;
+	size_t			nsyms;
+	size_t			symcap;		/* A power of two */
+	unsigned char		*code;
+	size_t			codelen;
+	size_t			codecap;
+	struct trs80_asm_block	*blocks;
+	size_t			nblocks;
+	size_t			blockcap;
+	char			name[6];
+	int			has_name;
+	int			has_entry;
+	unsigned int		entry;
+
+	/* Assembly in progress. */
+	int			pass;
+	unsigned int		pc;
+	int			ended;
+	int			cond;		/* Open COND levels */
+	int			skip;		/* Of those, being skipped */
+	int			undef;		/* Unknown symbol seen */
+	const struct src_line	*line;
+	struct trs80_asm_diag	*diag;
+};
+
+
+/* A source line taken apart. */
+struct parsed {
+	const char	*label;
+	size_t		labellen;
+	const char	*op;
+	size_t		oplen;
+	const char	*args;		/* Less comment and trailing blanks */
+	const char	*argsend;
+};
+
+enum op_kind {
+	K_R8,		/* B C D E H L (HL) A: r */
+	K_IDX,		/* (IX+d) or (IY+d): pfx, v */
+	K_RP,		/* BC DE HL SP: r, or IX IY: r = 2 and pfx */
+	K_AF,
+	K_AFX,		/* AF' */
+	K_I,
+	K_R,
+	K_IND_BC,
+	K_IND_DE,
+	K_IND_SP,
+	K_IND_C,
+	K_IND_NN,	/* (nn): v */
+	K_IMM		/* nn: v */
+};
+
+struct operand {
+	enum op_kind	k;
+	int		r;
+	int		pfx;		/* 0, 0xDD or 0xFD */
+	long		v;
+	const char	*text;
+	size_t		len;
+};
+
+
+/*
+ * Arena.
+ */
+
+static void *
+arena_alloc(struct trs80_asm *a, size_t n)
+{
+	struct arena_chunk	*c = a->arena;
+	size_t			unit = sizeof(c->data[0]);
+	void			*p;
+
+	n = (n + unit - 1) / unit * unit;
+
+	if (!c || c->size - c->used < n) {
+		size_t	size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+
+		if (!(c = malloc(offsetof(struct arena_chunk, data) + size)))
+			return NULL;
+		c->next = a->arena;
+		c->size = size;
+		c->used = 0;
+		a->arena = c;
+	}
+
+	p = (char *)c->data + c->used;
+	c->used += n;
+
+	return p;
+}
+
+
+static void
+arena_free(struct trs80_asm *a)
+{
+	struct arena_chunk	*c, *next;
+
+	for (c = a->arena; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->arena = NULL;
+}
+
+
+/*
+ * Diagnostics.
+ */
+
+static int
+asm_error(struct trs80_asm *a, int status, const char *fmt, ...)
+{
+	va_list	ap;
+
+	if (a->diag) {
+		if (a->line) {
+			a->diag->linenum = a->line->linenum;
+			a->diag->offset = a->line->offset;
+		} else {
+			a->diag->linenum = 0;
+			a->diag->offset = 0;
+		}
+		va_start(ap, fmt);
+		vsnprintf(a->diag->msg, sizeof(a->diag->msg), fmt, ap);
+		va_end(ap);
+	}
+
+	return status;
+}
+
+
+static int
+nomem(struct trs80_asm *a)
+{
+	return asm_error(a, TRS80_E_NOMEM, "Out of memory");
+}
+
+
+/*
+ * Symbols.
+ */
+
+static unsigned long
+sym_hash(const char *name, size_t len)
+{
+	unsigned long	h = 2166136261UL;
+
+	while (len--) {
+		h ^= (unsigned char)UC(*name);
+		h = (h * 16777619UL) & 0xffffffffUL;
+		++name;
+	}
+
+	return h;
+}
+
+
+static int
+sym_equal(const struct sym *s, const char *name, size_t len)
+{
+	size_t	i;
+
+	if (s->len != len)
+		return 0;
+
+	for (i = 0; i < len; ++i)
+		if (s->name[i] != UC(name[i]))
+			return 0;
+
+	return 1;
+}
+
+
+static struct sym *
+sym_find(const struct trs80_asm *a, const char *name, size_t len)
+{
+	unsigned long	h = sym_hash(name, len);
+	size_t		i;
+	struct sym	*s;
+
+	if (!a->syms)
+		return NULL;
+
+	for (i = h & (a->symcap - 1); (s = a->syms[i]);
+	     i = (i + 1) & (a->symcap - 1))
+		if (s->hash == h && sym_equal(s, name, len))
+			return s;
+
+	return NULL;
+}
+
+
+static int
+sym_grow(struct trs80_asm *a)
+{
+	size_t		cap = a->symcap ? a->symcap * 2 : MIN_SYMS;
+	struct sym	**syms;
+	size_t		i, j;
+
+	if (!(syms = calloc(cap, sizeof(*syms))))
+		return -1;
+
+	for (i = 0; i < a->symcap; ++i) {
+		struct sym	*s = a->syms[i];
+
+		if (!s)
+			continue;
+		for (j = s->hash & (cap - 1); syms[j]; j = (j + 1) & (cap - 1))
+			;
+		syms[j] = s;
+	}
+
+	free(a->syms);
+	a->syms = syms;
+	a->symcap = cap;
+
+	return 0;
+}
+
+
+/* Find name, adding it unknown if it isn't there. */
+static struct sym *
+sym_enter(struct trs80_asm *a, const char *name, size_t len)
+{
+	struct sym	*s;
+	char		*n;
+	size_t		i;
+
+	if ((s = sym_find(a, name, len)))
+		return s;
+
+	if (a->nsyms * 2 >= a->symcap && sym_grow(a))
+		return NULL;
+
+	if (!(s = arena_alloc(a, sizeof(*s))) || !(n = arena_alloc(a, len)))
+		return NULL;
+
+	for (i = 0; i < len; ++i)
+		n[i] = UC(name[i]);
+	memset(s, 0, sizeof(*s));
+	s->name = n;
+	s->len = len;
+	s->hash = sym_hash(name, len);
+
+	for (i = s->hash & (a->symcap - 1); a->syms[i];
+	     i = (i + 1) & (a->symcap - 1))
+		;
+	a->syms[i] = s;
+	++a->nsyms;
+
+	return s;
+}
+
+
+/*
+ * Output.
+ */
+
+static int
+emit(struct trs80_asm *a, int byte)
+{
+	struct trs80_asm_block	*b;
+
+	if (a->pass == 2) {
+		b = a->nblocks ? &a->blocks[a->nblocks - 1] : NULL;
+
+		if (!b || b->addr + b->len != a->pc) {
+			if (a->nblocks == a->blockcap) {
+				size_t			cap;
+				struct trs80_asm_block	*nb;
+
+				cap = a->blockcap ? a->blockcap * 2 : 16;
+				if (!(nb = realloc(a->blocks,
+						   cap * sizeof(*nb))))
+					return nomem(a);
+				a->blocks = nb;
+				a->blockcap = cap;
+			}
+			b = &a->blocks[a->nblocks++];
+			b->addr = a->pc;
+			b->data = NULL;
+			b->len = 0;
+		}
+
+		if (a->codelen == a->codecap) {
+			unsigned char	*nc;
+			size_t		cap;
+
+			cap = a->codecap ? a->codecap * 2 : 4096;
+
+			if (!(nc = realloc(a->code, cap)))
+				return nomem(a);
+			a->code = nc;
+			a->codecap = cap;
+		}
+
+		a->code[a->codelen++] = byte;
+		++b->len;
+	}
+
+	a->pc = (a->pc + 1) & 0xffff;
+
+	return TRS80_OK;
+}
+
+
+/* Emit n bytes from a byte list. */
+static int
+emitn(struct trs80_asm *a, const int *bytes, int n)
+{
+	int	i, st;
+
+	for (i = 0; i < n; ++i)
+		if ((st = emit(a, bytes[i] & 0xff)))
+			return st;
+
+	return TRS80_OK;
+}
+
+
+/*
+ * Expressions.
+ */
+
+static const char *
+skip_space(const char *p, const char *e)
+{
+	while (p < e && ISSPACE(*p))
+		++p;
+
+	return p;
+}
+
+
+static int
+digit_value(int c)
+{
+	c = UC(c);
+	if (ISDIGIT(c))
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return 99;
+}
+
+
+static int
+number(struct trs80_asm *a, const char *p, size_t len, long *vp)
+{
+	int		base = 10;
+	unsigned long	v = 0;
+	size_t		i;
+
+	if (len > 1) {
+		switch (UC(p[len - 1])) {
+		case 'H':
+			base = 16;
+			--len;
+			break;
+		case 'O':
+		case 'Q':
+			base = 8;
+			--len;
+			break;
+		case 'B':
+			base = 2;
+			--len;
+			break;
+		case 'D':
+			base = 10;
+			--len;
+			break;
+		}
+	}
+
+	for (i = 0; i < len; ++i) {
+		int	d = digit_value(p[i]);
+
+		if (d >= base)
+			return asm_error(a, TRS80_E_SYNTAX,
+					 "Bad number '%.*s'", (int)len, p);
+		v = (v * base + d) & 0xffffffffUL;
+	}
+
+	*vp = (long)v;
+
+	return TRS80_OK;
+}
+
+
+static int expr(struct trs80_asm *a, const char **pp, const char *e,
+		int nested, long *vp);
+
+
+static int
+term(struct trs80_asm *a, const char **pp, const char *e, long *vp)
+{
+	const char	*p = skip_space(*pp, e);
+	const char	*q;
+	struct sym	*s;
+	int		st;
+
+	if (p == e)
+		return asm_error(a, TRS80_E_SYNTAX, "Missing operand");
+
+	if (*p == '(') {
+		++p;
+		if ((st = expr(a, &p, e, 1, vp)))
+			return st;
+		if (p == e || *p != ')')
+			return asm_error(a, TRS80_E_SYNTAX, "Missing ')'");
+		*pp = p + 1;
+		return TRS80_OK;
+	}
+
+	if (*p == '+' || *p == '-') {
+		int	neg = *p == '-';
+
+		++p;
+		if ((st = term(a, &p, e, vp)))
+			return st;
+		if (neg)
+			*vp = -*vp;
+		*pp = p;
+		return TRS80_OK;
+	}
+
+	if (e - p >= 5 && UC(p[1]) == 'N' && UC(p[2]) == 'O' &&
+	    UC(p[3]) == 'T' && p[0] == '.' && p[4] == '.') {
+		p += 5;
+		if ((st = term(a, &p, e, vp)))
+			return st;
+		*vp = ~*vp;
+		*pp = p;
+		return TRS80_OK;
+	}
+
+	if (*p == '\'') {
+		/* A character, '' being a quote. */
+		if (e - p >= 4 && p[1] == '\'' && p[2] == '\'' &&
+		    p[3] == '\'') {
+			*vp = '\'';
+			*pp = p + 4;
+			return TRS80_OK;
+		}
+		if (e - p >= 3 && p[2] == '\'') {
+			*vp = (unsigned char)p[1];
+			*pp = p + 3;
+			return TRS80_OK;
+		}
+		return asm_error(a, TRS80_E_SYNTAX, "Bad character constant");
+	}
+
+	if (*p == '$' && (p + 1 == e || digit_value(p[1]) > 15)) {
+		*vp = a->pc;
+		*pp = p + 1;
+		return TRS80_OK;
+	}
+
+	if (*p == '$') {
+		/* $ followed by hex digits. */
+		for (*vp = 0, q = ++p; q < e && digit_value(*q) < 16; ++q)
+			*vp = (*vp << 4 | digit_value(*q)) & 0xffffffffL;
+		*pp = q;
+		return TRS80_OK;
+	}
+
+	if (ISDIGIT(*p)) {
+		for (q = p; q < e && (ISDIGIT(*q) || ISALPHA(*q)); ++q)
+			;
+		*pp = q;
+		return number(a, p, q - p, vp);
+	}
+
+	if (!ISSYM1(*p))
+		return asm_error(a, TRS80_E_SYNTAX, "Unexpected '%c'", *p);
+
+	for (q = p; q < e && ISSYM(*q); ++q)
+		;
+	*pp = q;
+
+	if ((s = sym_find(a, p, q - p)) && s->known) {
+		*vp = s->value;
+		return TRS80_OK;
+	}
+
+	if (a->pass == 2)
+		return asm_error(a, TRS80_E_SYMBOL, "Undefined symbol '%.*s'",
+				 (int)(q - p), p);
+
+	a->undef = 1;
+	*vp = 0;
+
+	return TRS80_OK;
+}
+
+
+/* The binary operator at p, advancing past it, or 0. */
+static int
+binop(const char **pp, const char *e)
+{
+	static const struct {
+		const char	*name;
+		int		op;
+	} dot_ops[] = {
+		{ ".AND.", '&' },
+		{ ".OR.",  '!' },
+		{ ".XOR.", '^' },
+		{ ".MOD.", '%' },
+		{ ".SHL.", '<' },
+		{ ".SHR.", '>' },
+	};
+	const char	*p = skip_space(*pp, e);
+	size_t		i, j;
+
+	if (p == e)
+		return 0;
+
+	switch (*p) {
+	case '+': case '-': case '*': case '/':
+	case '&': case '!': case '<':
+		*pp = p + 1;
+		return *p;
+	case '.':
+		for (i = 0; i < sizeof(dot_ops) / sizeof(dot_ops[0]); ++i) {
+			const char	*n = dot_ops[i].name;
+			size_t		len = strlen(n);
+
+			if ((size_t)(e - p) < len)
+				continue;
+			for (j = 0; j < len && UC(p[j]) == n[j]; ++j)
+				;
+			if (j == len) {
+				*pp = p + len;
+				return dot_ops[i].op;
+			}
+		}
+		break;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Evaluate left to right up to e, or a ')' if nested.  Values are
+ * kept to 32 bits; callers check the range they need.
+ */
+
+static int
+expr(struct trs80_asm *a, const char **pp, const char *e, int nested,
+     long *vp)
+{
+	const char	*p = *pp;
+	long		v, w;
+	int		op, st;
+
+	if ((st = term(a, &p, e, &v)))
+		return st;
+
+	for (;;) {
+		const char	*q = skip_space(p, e);
+
+		if (q == e || (nested && *q == ')')) {
+			p = q;
+			break;
+		}
+
+		if (!(op = binop(&p, e)))
+			return asm_error(a, TRS80_E_SYNTAX, "Unexpected '%c'",
+					 *q);
+		if ((st = term(a, &p, e, &w)))
+			return st;
+
+		switch (op) {
+		case '+': v += w; break;
+		case '-': v -= w; break;
+		case '*': v *= w; break;
+		case '&': v &= w; break;
+		case '!': v |= w; break;
+		case '^': v ^= w; break;
+		case '>': v = (unsigned long)(v & 0xffffffffUL) >> (w & 31);
+			  break;
+		case '<':
+			if (w >= 0)
+				v = (unsigned long)v << (w & 31);
+			else
+				v = (unsigned long)(v & 0xffffffffUL) >>
+					(-w & 31);
+			break;
+		case '/':
+		case '%':
+			if (w == 0) {
+				if (a->undef)
+					break;
+				return asm_error(a, TRS80_E_RANGE,
+						 "Division by zero");
+			}
+			v = op == '/' ? v / w : v % w;
+			break;
+		}
+		v = (int32_t)(uint32_t)v;
+	}
+
+	*pp = p;
+	*vp = v;
+
+	return TRS80_OK;
+}
+
+
+/* Evaluate all of [p, e). */
+static int
+eval(struct trs80_asm *a, const char *p, const char *e, long *vp)
+{
+	int	st;
+
+	if ((st = expr(a, &p, e, 0, vp)))
+		return st;
+	if (skip_space(p, e) != e)
+		return asm_error(a, TRS80_E_SYNTAX, "Unexpected ')'");
+
+	return TRS80_OK;
+}
+
+
+/* Evaluate an operand that must be known in pass one too. */
+static int
+eval_now(struct trs80_asm *a, const char *p, const char *e, long *vp)
+{
+	int	st;
+
+	a->undef = 0;
+	if ((st = eval(a, p, e, vp)))
+		return st;
+	if (a->undef)
+		return asm_error(a, TRS80_E_SYMBOL, "Forward reference in "
+				 "'%.*s'", (int)(e - p), p);
+
+	return TRS80_OK;
+}
+
+
+static int
+check_byte(struct trs80_asm *a, long v)
+{
+	if (a->pass == 2 && (v < -256 || v > 255))
+		return asm_error(a, TRS80_E_RANGE, "Byte value out of range "
+				 "(%ld)", v);
+
+	return TRS80_OK;
+}
+
+
+static int
+check_word(struct trs80_asm *a, long v)
+{
+	if (a->pass == 2 && (v < -65536 || v > 65535))
+		return asm_error(a, TRS80_E_RANGE, "Word value out of range "
+				 "(%ld)", v);
+
+	return TRS80_OK;
+}
+
+
+/*
+ * Lines.
+ */
+
+/* The end of the operands: a ';' outside quotes, AF' not opening one. */
+static const char *
+args_end(const char *p, const char *e)
+{
+	const char	*start = p;
+	int		quoted = 0;
+
+	for (; p < e; ++p) {
+		if (*p == '\'') {
+			if (!quoted && p - start >= 2 && UC(p[-1]) == 'F' &&
+			    UC(p[-2]) == 'A' &&
+			    (p - start == 2 || !ISSYM(p[-3])))
+				continue;
+			quoted = !quoted;
+		} else if (*p == ';' && !quoted) {
+			break;
+		}
+	}
+
+	while (p > start && ISSPACE(p[-1]))
+		--p;
+
+	return p;
+}
+
+
+static int
+parse_line(struct trs80_asm *a, const char *p, const char *e,
+	   struct parsed *pl)
+{
+	memset(pl, 0, sizeof(*pl));
+
+	while (e > p && (e[-1] == '\r' || ISSPACE(e[-1])))
+		--e;
+
+	if (p == e || *p == ';' || *p == '*')
+		return TRS80_OK;
+
+	if (!ISSPACE(*p)) {
+		if (!ISSYM1(*p))
+			return asm_error(a, TRS80_E_SYNTAX, "Bad label");
+		for (pl->label = p; p < e && ISSYM(*p); ++p)
+			;
+		pl->labellen = p - pl->label;
+		if (p < e && *p == ':')
+			++p;
+		if (p < e && !ISSPACE(*p) && *p != ';')
+			return asm_error(a, TRS80_E_SYNTAX, "Bad label");
+	}
+
+	p = skip_space(p, e);
+	if (p == e || *p == ';')
+		return TRS80_OK;
+
+	for (pl->op = p; p < e && !ISSPACE(*p) && *p != ';'; ++p)
+		;
+	pl->oplen = p - pl->op;
+
+	pl->args = skip_space(p, e);
+	pl->argsend = args_end(pl->args, e);
+
+	return TRS80_OK;
+}
+
+
+/* Split off the next comma separated operand of [*pp, e). */
+static int
+next_arg(const char **pp, const char *e, const char **argp, size_t *lenp)
+{
+	const char	*p = skip_space(*pp, e), *q;
+	int		quoted = 0, depth = 0;
+
+	if (p == e)
+		return 0;
+
+	for (q = p; q < e; ++q) {
+		if (*q == '\'') {
+			if (!quoted && q - p == 2 && UC(p[0]) == 'A' &&
+			    UC(p[1]) == 'F')
+				continue;
+			quoted = !quoted;
+		} else if (!quoted) {
+			if (*q == '(')
+				++depth;
+			else if (*q == ')')
+				--depth;
+			else if (*q == ',' && depth == 0)
+				break;
+		}
+	}
+
+	*argp = p;
+	for (*lenp = q - p; *lenp > 0 && ISSPACE(p[*lenp - 1]); --*lenp)
+		;
+	*pp = q < e ? q + 1 : q;
+
+	return 1;
+}
+
+
+static int
+word_is(const char *p, size_t len, const char *w)
+{
+	size_t	i;
+
+	for (i = 0; i < len && w[i]; ++i)
+		if (UC(p[i]) != w[i])
+			return 0;
+
+	return i == len && !w[i];
+}
+
+
+/* Does ( at p match the ) ending [p, e)? */
+static int
+wrapped(const char *p, const char *e)
+{
+	int	depth = 0;
+	int	quoted = 0;
+
+	if (e - p < 2 || *p != '(' || e[-1] != ')')
+		return 0;
+
+	for (; p < e - 1; ++p) {
+		if (*p == '\'')
+			quoted = !quoted;
+		else if (!quoted && *p == '(')
+			++depth;
+		else if (!quoted && *p == ')' && --depth == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static int
+operand(struct trs80_asm *a, const char *p, size_t len, struct operand *o)
+{
+	static const char *const r8[] = {
+		"B", "C", "D", "E", "H", "L", NULL, "A"
+	};
+	static const char *const rp[] = { "BC", "DE", "HL", "SP" };
+	const char	*e = p + len;
+	int		i;
+
+	memset(o, 0, sizeof(*o));
+	o->text = p;
+	o->len = len;
+
+	for (i = 0; i < 8; ++i) {
+		if (r8[i] && word_is(p, len, r8[i])) {
+			o->k = K_R8;
+			o->r = i;
+			return TRS80_OK;
+		}
+	}
+	for (i = 0; i < 4; ++i) {
+		if (word_is(p, len, rp[i])) {
+			o->k = K_RP;
+			o->r = i;
+			return TRS80_OK;
+		}
+	}
+	if (word_is(p, len, "IX") || word_is(p, len, "IY")) {
+		o->k = K_RP;
+		o->r = 2;
+		o->pfx = UC(p[1]) == 'X' ? 0xdd : 0xfd;
+		return TRS80_OK;
+	}
+	if (word_is(p, len, "AF")) {
+		o->k = K_AF;
+		return TRS80_OK;
+	}
+	if (word_is(p, len, "AF'")) {
+		o->k = K_AFX;
+		return TRS80_OK;
+	}
+	if (word_is(p, len, "I")) {
+		o->k = K_I;
+		return TRS80_OK;
+	}
+	if (word_is(p, len, "R")) {
+		o->k = K_R;
+		return TRS80_OK;
+	}
+
+	if (!wrapped(p, e)) {
+		o->k = K_IMM;
+		return eval(a, p, e, &o->v);
+	}
+
+	/* Indirect. */
+	p = skip_space(p + 1, e - 1);
+	for (e = e - 1; e > p && ISSPACE(e[-1]); --e)
+		;
+	len = e - p;
+
+	if (word_is(p, len, "HL")) {
+		o->k = K_R8;
+		o->r = 6;
+	} else if (word_is(p, len, "BC")) {
+		o->k = K_IND_BC;
+	} else if (word_is(p, len, "DE")) {
+		o->k = K_IND_DE;
+	} else if (word_is(p, len, "SP")) {
+		o->k = K_IND_SP;
+	} else if (word_is(p, len, "C")) {
+		o->k = K_IND_C;
+	} else if (len >= 2 && UC(p[0]) == 'I' &&
+		   (UC(p[1]) == 'X' || UC(p[1]) == 'Y') &&
+		   (len == 2 || !ISSYM(p[2]))) {
+		const char	*q = skip_space(p + 2, e);
+
+		o->k = K_IDX;
+		o->r = 6;
+		o->pfx = UC(p[1]) == 'X' ? 0xdd : 0xfd;
+		if (q < e) {
+			int	st;
+
+			if (*q != '+' && *q != '-')
+				return asm_error(a, TRS80_E_SYNTAX,
+						 "Bad index '%.*s'",
+						 (int)o->len, o->text);
+			if ((st = eval(a, q, e, &o->v)))
+				return st;
+			if (a->pass == 2 && (o->v < -128 || o->v > 127))
+				return asm_error(a, TRS80_E_RANGE,
+						 "Index out of range (%ld)",
+						 o->v);
+		}
+	} else {
+		o->k = K_IND_NN;
+		return eval(a, p, e, &o->v);
+	}
+
+	return TRS80_OK;
+}
+
+
+/*
+ * Instructions.
+ */
+
+enum mnemonic {
+	M_ADC, M_ADD, M_AND, M_BIT, M_CALL, M_CCF, M_CP, M_CPD, M_CPDR,
+	M_CPI, M_CPIR, M_CPL, M_DAA, M_DEC, M_DI, M_DJNZ, M_EI, M_EX,
+	M_EXX, M_HALT, M_IM, M_IN, M_INC, M_IND, M_INDR, M_INI, M_INIR,
+	M_JP, M_JR, M_LD, M_LDD, M_LDDR, M_LDI, M_LDIR, M_NEG, M_NOP,
+	M_OR, M_OTDR, M_OTIR, M_OUT, M_OUTD, M_OUTI, M_POP, M_PUSH,
+	M_RES, M_RET, M_RETI, M_RETN, M_RL, M_RLA, M_RLC, M_RLCA, M_RLD,
+	M_RR, M_RRA, M_RRC, M_RRCA, M_RRD, M_RST, M_SBC, M_SCF, M_SET,
+	M_SLA, M_SRA, M_SRL, M_SUB, M_XOR,
+
+	/* Directives. */
+	D_COND, D_DB, D_DEFB, D_DEFL, D_DEFM, D_DEFS, D_DEFW, D_DM, D_DS,
+	D_DW, D_END, D_ENDC, D_EQU, D_LIST, D_NOLIST, D_ORG, D_PAGE,
+	D_SUBTTL, D_TITLE
+};
+
+/* In strcmp() order for bsearch(). */
+static const struct mnem {
+	const char	*name;
+	int		id;
+	int		code;		/* Opcode for the simple ones */
+} Mnemonics[] = {
+	{ "ADC",    M_ADC,    1 },	/* ALU: code is the operation */
+	{ "ADD",    M_ADD,    0 },
+	{ "AND",    M_AND,    4 },
+	{ "BIT",    M_BIT,    0x40 },
+	{ "CALL",   M_CALL,   0 },
+	{ "CCF",    M_CCF,    0x3f },
+	{ "COND",   D_COND,   0 },
+	{ "CP",     M_CP,     7 },
+	{ "CPD",    M_CPD,    0xeda9 },
+	{ "CPDR",   M_CPDR,   0xedb9 },
+	{ "CPI",    M_CPI,    0xeda1 },
+	{ "CPIR",   M_CPIR,   0xedb1 },
+	{ "CPL",    M_CPL,    0x2f },
+	{ "DAA",    M_DAA,    0x27 },
+	{ "DB",     D_DB,     0 },
+	{ "DEC",    M_DEC,    1 },
+	{ "DEFB",   D_DEFB,   0 },
+	{ "DEFL",   D_DEFL,   0 },
+	{ "DEFM",   D_DEFM,   0 },
+	{ "DEFS",   D_DEFS,   0 },
+	{ "DEFW",   D_DEFW,   0 },
+	{ "DI",     M_DI,     0xf3 },
+	{ "DJNZ",   M_DJNZ,   0x10 },
+	{ "DM",     D_DM,     0 },
+	{ "DS",     D_DS,     0 },
+	{ "DW",     D_DW,     0 },
+	{ "EI",     M_EI,     0xfb },
+	{ "END",    D_END,    0 },
+	{ "ENDC",   D_ENDC,   0 },
+	{ "EQU",    D_EQU,    0 },
+	{ "EX",     M_EX,     0 },
+	{ "EXX",    M_EXX,    0xd9 },
+	{ "HALT",   M_HALT,   0x76 },
+	{ "IM",     M_IM,     0 },
+	{ "IN",     M_IN,     0 },
+	{ "INC",    M_INC,    0 },
+	{ "IND",    M_IND,    0xedaa },
+	{ "INDR",   M_INDR,   0xedba },
+	{ "INI",    M_INI,    0xeda2 },
+	{ "INIR",   M_INIR,   0xedb2 },
+	{ "JP",     M_JP,     0 },
+	{ "JR",     M_JR,     0 },
+	{ "LD",     M_LD,     0 },
+	{ "LDD",    M_LDD,    0xeda8 },
+	{ "LDDR",   M_LDDR,   0xedb8 },
+	{ "LDI",    M_LDI,    0xeda0 },
+	{ "LDIR",   M_LDIR,   0xedb0 },
+	{ "LIST",   D_LIST,   0 },
+	{ "NEG",    M_NEG,    0xed44 },
+	{ "NOLIST", D_NOLIST, 0 },
+	{ "NOP",    M_NOP,    0x00 },
+	{ "OR",     M_OR,     6 },
+	{ "ORG",    D_ORG,    0 },
+	{ "OTDR",   M_OTDR,   0xedbb },
+	{ "OTIR",   M_OTIR,   0xedb3 },
+	{ "OUT",    M_OUT,    0 },
+	{ "OUTD",   M_OUTD,   0xedab },
+	{ "OUTI",   M_OUTI,   0xeda3 },
+	{ "PAGE",   D_PAGE,   0 },
+	{ "POP",    M_POP,    0xc1 },
+	{ "PUSH",   M_PUSH,   0xc5 },
+	{ "RES",    M_RES,    0x80 },
+	{ "RET",    M_RET,    0 },
+	{ "RETI",   M_RETI,   0xed4d },
+	{ "RETN",   M_RETN,   0xed45 },
+	{ "RL",     M_RL,     2 },	/* Shifts: code is the operation */
+	{ "RLA",    M_RLA,    0x17 },
+	{ "RLC",    M_RLC,    0 },
+	{ "RLCA",   M_RLCA,   0x07 },
+	{ "RLD",    M_RLD,    0xed6f },
+	{ "RR",     M_RR,     3 },
+	{ "RRA",    M_RRA,    0x1f },
+	{ "RRC",    M_RRC,    1 },
+	{ "RRCA",   M_RRCA,   0x0f },
+	{ "RRD",    M_RRD,    0xed67 },
+	{ "RST",    M_RST,    0 },
+	{ "SBC",    M_SBC,    3 },
+	{ "SCF",    M_SCF,    0x37 },
+	{ "SET",    M_SET,    0xc0 },
+	{ "SLA",    M_SLA,    4 },
+	{ "SRA",    M_SRA,    5 },
+	{ "SRL",    M_SRL,    7 },
+	{ "SUB",    M_SUB,    2 },
+	{ "SUBTTL", D_SUBTTL, 0 },
+	{ "TITLE",  D_TITLE,  0 },
+	{ "XOR",    M_XOR,    5 },
+};
+
+
+static const struct mnem *
+find_mnemonic(const char *p, size_t len)
+{
+	size_t	lo = 0, hi = sizeof(Mnemonics) / sizeof(Mnemonics[0]);
+	char	name[8];
+	size_t	i;
+
+	if (len >= sizeof(name))
+		return NULL;
+	for (i = 0; i < len; ++i)
+		name[i] = UC(p[i]);
+	name[len] = '\0';
+
+	while (lo < hi) {
+		size_t	mid = (lo + hi) / 2;
+		int	c = strcmp(name, Mnemonics[mid].name);
+
+		if (c == 0)
+			return &Mnemonics[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+
+static int
+condition(const struct operand *o)
+{
+	static const char *const cc[] = {
+		"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"
+	};
+	int	i;
+
+	for (i = 0; i < 8; ++i)
+		if (word_is(o->text, o->len, cc[i]))
+			return i;
+
+	return -1;
+}
+
+
+static int
+bad_operands(struct trs80_asm *a, const struct parsed *pl)
+{
+	return asm_error(a, TRS80_E_SYNTAX, "Bad operands for %.*s '%.*s'",
+			 (int)pl->oplen, pl->op,
+			 (int)(pl->argsend - pl->args), pl->args);
+}
+
+
+/* An r operand, possibly (IX+d): prefix, opcode, then displacement. */
+static int
+emit_r(struct trs80_asm *a, const struct operand *o, int opcode)
+{
+	if (o->k == K_IDX) {
+		int	b[3] = { o->pfx, opcode, (int)o->v };
+
+		return emitn(a, b, 3);
+	}
+
+	return emit(a, opcode);
+}
+
+
+/* A prefixed HL-using opcode: IX/IY get their prefix. */
+static int
+emit_pfx(struct trs80_asm *a, int pfx, int opcode)
+{
+	int	st;
+
+	if (pfx && (st = emit(a, pfx)))
+		return st;
+
+	return emit(a, opcode);
+}
+
+
+static int
+emit_word(struct trs80_asm *a, long v)
+{
+	int	st;
+
+	if ((st = check_word(a, v)) || (st = emit(a, v & 0xff)))
+		return st;
+
+	return emit(a, (v >> 8) & 0xff);
+}
+
+
+static int
+emit_byte(struct trs80_asm *a, long v)
+{
+	int	st;
+
+	if ((st = check_byte(a, v)))
+		return st;
+
+	return emit(a, v & 0xff);
+}
+
+
+static int
+emit_ed(struct trs80_asm *a, int opcode)
+{
+	int	b[2] = { 0xed, opcode };
+
+	return emitn(a, b, 2);
+}
+
+
+static int
+is_r(const struct operand *o)
+{
+	return o->k == K_R8 || o->k == K_IDX;
+}
+
+
+static int
+asm_ld(struct trs80_asm *a, const struct parsed *pl,
+       const struct operand *d, const struct operand *s)
+{
+	int	st;
+
+	if (is_r(d) && is_r(s)) {
+		if ((d->k == K_IDX || d->r == 6) &&
+		    (s->k == K_IDX || s->r == 6))
+			return bad_operands(a, pl);
+		return emit_r(a, d->k == K_IDX ? d : s,
+			      0x40 | d->r << 3 | s->r);
+	}
+
+	if (is_r(d) && s->k == K_IMM) {
+		if ((st = emit_r(a, d, 0x06 | d->r << 3)))
+			return st;
+		return emit_byte(a, s->v);
+	}
+
+	if (d->k == K_R8 && d->r == 7) {
+		switch (s->k) {
+		case K_IND_BC:
+			return emit(a, 0x0a);
+		case K_IND_DE:
+			return emit(a, 0x1a);
+		case K_IND_NN:
+			if ((st = emit(a, 0x3a)))
+				return st;
+			return emit_word(a, s->v);
+		case K_I:
+			return emit_ed(a, 0x57);
+		case K_R:
+			return emit_ed(a, 0x5f);
+		default:
+			break;
+		}
+	}
+
+	if (s->k == K_R8 && s->r == 7) {
+		switch (d->k) {
+		case K_IND_BC:
+			return emit(a, 0x02);
+		case K_IND_DE:
+			return emit(a, 0x12);
+		case K_IND_NN:
+			if ((st = emit(a, 0x32)))
+				return st;
+			return emit_word(a, d->v);
+		case K_I:
+			return emit_ed(a, 0x47);
+		case K_R:
+			return emit_ed(a, 0x4f);
+		default:
+			break;
+		}
+	}
+
+	if (d->k == K_RP && s->k == K_IMM) {
+		if ((st = emit_pfx(a, d->pfx, 0x01 | d->r << 4)))
+			return st;
+		return emit_word(a, s->v);
+	}
+
+	if (d->k == K_RP && s->k == K_IND_NN) {
+		if (d->r == 2)
+			st = emit_pfx(a, d->pfx, 0x2a);
+		else
+			st = emit_ed(a, 0x4b | d->r << 4);
+		return st ? st : emit_word(a, s->v);
+	}
+
+	if (d->k == K_IND_NN && s->k == K_RP) {
+		if (s->r == 2)
+			st = emit_pfx(a, s->pfx, 0x22);
+		else
+			st = emit_ed(a, 0x43 | s->r << 4);
+		return st ? st : emit_word(a, d->v);
+	}
+
+	if (d->k == K_RP && d->r == 3 && s->k == K_RP && s->r == 2)
+		return emit_pfx(a, s->pfx, 0xf9);
+
+	return bad_operands(a, pl);
+}
+
+
+static int
+asm_alu(struct trs80_asm *a, const struct parsed *pl, int id, int alu,
+	struct operand *ops, int nops)
+{
+	const struct operand	*s;
+	int			st;
+
+	/* 16 bit ADD, ADC and SBC. */
+	if ((id == M_ADD || id == M_ADC || id == M_SBC) && nops == 2 &&
+	    ops[0].k == K_RP && ops[0].r == 2 && ops[1].k == K_RP) {
+		if (ops[1].r == 2 && ops[1].pfx != ops[0].pfx)
+			return bad_operands(a, pl);
+		if (id == M_ADD)
+			return emit_pfx(a, ops[0].pfx, 0x09 | ops[1].r << 4);
+		if (ops[0].pfx)
+			return bad_operands(a, pl);
+		return emit_ed(a, (id == M_ADC ? 0x4a : 0x42) |
+				  ops[1].r << 4);
+	}
+
+	/* "A," is optional. */
+	if (nops == 2 && ops[0].k == K_R8 && ops[0].r == 7)
+		s = &ops[1];
+	else if (nops == 1)
+		s = &ops[0];
+	else
+		return bad_operands(a, pl);
+
+	if (is_r(s))
+		return emit_r(a, s, 0x80 | alu << 3 | s->r);
+
+	if (s->k == K_IMM) {
+		if ((st = emit(a, 0xc6 | alu << 3)))
+			return st;
+		return emit_byte(a, s->v);
+	}
+
+	return bad_operands(a, pl);
+}
+
+
+/* Shifts, rotates and BIT/RES/SET: CB prefixed. */
+static int
+asm_cb(struct trs80_asm *a, const struct parsed *pl, int opcode,
+       const struct operand *o)
+{
+	if (o->k == K_IDX) {
+		int	b[4] = { o->pfx, 0xcb, (int)o->v, opcode | 6 };
+
+		return emitn(a, b, 4);
+	}
+	if (o->k != K_R8)
+		return bad_operands(a, pl);
+
+	{
+		int	b[2] = { 0xcb, opcode | o->r };
+
+		return emitn(a, b, 2);
+	}
+}
+
+
+static int
+asm_branch(struct trs80_asm *a, const struct parsed *pl, int id,
+	   struct operand *ops, int nops)
+{
+	const struct operand	*t = &ops[nops - 1];
+	int			cc = nops == 2 ? condition(&ops[0]) : -1;
+	int			st;
+
+	if (nops == 2 && cc < 0)
+		return bad_operands(a, pl);
+
+	switch (id) {
+	case M_JP:
+		if (nops == 1 && t->k == K_R8 && t->r == 6)
+			return emit(a, 0xe9);
+		if (nops == 1 && t->k == K_IDX && t->v == 0)
+			return emit_pfx(a, t->pfx, 0xe9);
+		/* FALLTHROUGH */
+	case M_CALL:
+		if (t->k != K_IMM)
+			return bad_operands(a, pl);
+		if (id == M_JP)
+			st = emit(a, cc < 0 ? 0xc3 : 0xc2 | cc << 3);
+		else
+			st = emit(a, cc < 0 ? 0xcd : 0xc4 | cc << 3);
+		return st ? st : emit_word(a, t->v);
+
+	case M_JR:
+	case M_DJNZ: {
+		long	disp;
+
+		if (t->k != K_IMM || cc > 3 || (id == M_DJNZ && nops != 1))
+			return bad_operands(a, pl);
+		if (id == M_DJNZ)
+			st = emit(a, 0x10);
+		else
+			st = emit(a, cc < 0 ? 0x18 : 0x20 | cc << 3);
+		if (st)
+			return st;
+		disp = t->v - (long)((a->pc + 1) & 0xffff);
+		if (disp > 0x7fff)
+			disp -= 0x10000;
+		else if (disp < -0x8000)
+			disp += 0x10000;
+		if (a->pass == 2 && (disp < -128 || disp > 127))
+			return asm_error(a, TRS80_E_RANGE, "Relative jump out "
+					 "of range (%ld)", disp);
+		return emit(a, disp & 0xff);
+	}
+	}
+
+	return bad_operands(a, pl);
+}
+
+
+static int
+assemble_insn(struct trs80_asm *a, const struct parsed *pl,
+	      const struct mnem *m)
+{
+	struct operand	ops[MAX_OPERANDS];
+	const char	*p = pl->args, *arg[MAX_OPERANDS + 1];
+	size_t		len[MAX_OPERANDS + 1];
+	int		nops = 0, i, st;
+	int		id = m->id;
+
+	while (nops <= MAX_OPERANDS && next_arg(&p, pl->argsend, &arg[nops],
+						&len[nops]))
+		++nops;
+	if (nops > MAX_OPERANDS)
+		return bad_operands(a, pl);
+
+	for (i = 0; i < nops; ++i) {
+		/* Condition codes would read as registers or symbols. */
+		if ((i == 0 && nops == 2 &&
+		     (id == M_JP || id == M_JR || id == M_CALL)) ||
+		    id == M_RET) {
+			memset(&ops[i], 0, sizeof(ops[i]));
+			ops[i].text = arg[i];
+			ops[i].len = len[i];
+			continue;
+		}
+		if ((st = operand(a, arg[i], len[i], &ops[i])))
+			return st;
+	}
+
+	if (m->code > 0xff) {
+		if (nops)
+			return bad_operands(a, pl);
+		return emit_ed(a, m->code & 0xff);
+	}
+
+	switch (id) {
+	case M_NOP: case M_RLCA: case M_RRCA: case M_RLA: case M_RRA:
+	case M_DAA: case M_CPL: case M_SCF: case M_CCF: case M_HALT:
+	case M_EXX: case M_DI: case M_EI:
+		if (nops)
+			return bad_operands(a, pl);
+		return emit(a, m->code);
+
+	case M_LD:
+		if (nops != 2)
+			return bad_operands(a, pl);
+		return asm_ld(a, pl, &ops[0], &ops[1]);
+
+	case M_ADD: case M_ADC: case M_SUB: case M_SBC:
+	case M_AND: case M_XOR: case M_OR: case M_CP:
+		return asm_alu(a, pl, id, m->code, ops, nops);
+
+	case M_INC:
+	case M_DEC:
+		if (nops != 1)
+			return bad_operands(a, pl);
+		if (is_r(&ops[0]))
+			return emit_r(a, &ops[0], (id == M_INC ? 0x04 : 0x05) |
+					   ops[0].r << 3);
+		if (ops[0].k == K_RP)
+			return emit_pfx(a, ops[0].pfx,
+					(id == M_INC ? 0x03 : 0x0b) |
+					ops[0].r << 4);
+		return bad_operands(a, pl);
+
+	case M_PUSH:
+	case M_POP:
+		if (nops != 1)
+			return bad_operands(a, pl);
+		if (ops[0].k == K_AF)
+			return emit(a, m->code | 0x30);
+		if (ops[0].k == K_RP && ops[0].r != 3)
+			return emit_pfx(a, ops[0].pfx,
+					m->code | ops[0].r << 4);
+		return bad_operands(a, pl);
+
+	case M_EX:
+		if (nops != 2)
+			return bad_operands(a, pl);
+		if (ops[0].k == K_RP && ops[0].r == 1 &&
+		    ops[1].k == K_RP && ops[1].r == 2 && !ops[1].pfx)
+			return emit(a, 0xeb);
+		if (ops[0].k == K_AF && ops[1].k == K_AFX)
+			return emit(a, 0x08);
+		if (ops[0].k == K_IND_SP && ops[1].k == K_RP &&
+		    ops[1].r == 2)
+			return emit_pfx(a, ops[1].pfx, 0xe3);
+		return bad_operands(a, pl);
+
+	case M_RLC: case M_RRC: case M_RL: case M_RR:
+	case M_SLA: case M_SRA: case M_SRL:
+		if (nops != 1)
+			return bad_operands(a, pl);
+		return asm_cb(a, pl, m->code << 3, &ops[0]);
+
+	case M_BIT: case M_RES: case M_SET:
+		if (nops != 2 || ops[0].k != K_IMM)
+			return bad_operands(a, pl);
+		if (a->pass == 2 && (ops[0].v < 0 || ops[0].v > 7))
+			return asm_error(a, TRS80_E_RANGE, "Bit number out of "
+					 "range (%ld)", ops[0].v);
+		return asm_cb(a, pl, m->code | (ops[0].v & 7) << 3, &ops[1]);
+
+	case M_JP: case M_JR: case M_CALL: case M_DJNZ:
+		if (nops < 1)
+			return bad_operands(a, pl);
+		return asm_branch(a, pl, id, ops, nops);
+
+	case M_RET:
+		if (nops == 0)
+			return emit(a, 0xc9);
+		if (nops == 1 && (st = condition(&ops[0])) >= 0)
+			return emit(a, 0xc0 | st << 3);
+		return bad_operands(a, pl);
+
+	case M_RST:
+		if (nops != 1 || ops[0].k != K_IMM)
+			return bad_operands(a, pl);
+		if (a->pass == 2 && (ops[0].v & ~0x38L))
+			return asm_error(a, TRS80_E_RANGE, "Bad restart "
+					 "address (%ld)", ops[0].v);
+		return emit(a, 0xc7 | (ops[0].v & 0x38));
+
+	case M_IM:
+		if (nops != 1 || ops[0].k != K_IMM)
+			return bad_operands(a, pl);
+		if (a->pass == 2 && (ops[0].v < 0 || ops[0].v > 2))
+			return asm_error(a, TRS80_E_RANGE, "Bad interrupt "
+					 "mode (%ld)", ops[0].v);
+		return emit_ed(a, ops[0].v == 0 ? 0x46 :
+				  ops[0].v == 1 ? 0x56 : 0x5e);
+
+	case M_IN:
+		if (nops != 2 || ops[0].k != K_R8 || ops[0].r == 6)
+			return bad_operands(a, pl);
+		if (ops[1].k == K_IND_C)
+			return emit_ed(a, 0x40 | ops[0].r << 3);
+		if (ops[0].r == 7 && ops[1].k == K_IND_NN) {
+			if ((st = emit(a, 0xdb)))
+				return st;
+			return emit_byte(a, ops[1].v);
+		}
+		return bad_operands(a, pl);
+
+	case M_OUT:
+		if (nops != 2 || ops[1].k != K_R8 || ops[1].r == 6)
+			return bad_operands(a, pl);
+		if (ops[0].k == K_IND_C)
+			return emit_ed(a, 0x41 | ops[1].r << 3);
+		if (ops[1].r == 7 && ops[0].k == K_IND_NN) {
+			if ((st = emit(a, 0xd3)))
+				return st;
+			return emit_byte(a, ops[0].v);
+		}
+		return bad_operands(a, pl);
+	}
+
+	return bad_operands(a, pl);
+}
+
+
+/*
+ * Directives.
+ */
+
+/* Set a label, catching duplicates in pass one and phase errors. */
+static int
+define(struct trs80_asm *a, const struct parsed *pl, long v, int redef)
+{
+	struct sym	*s;
+
+	if (!(s = sym_enter(a, pl->label, pl->labellen)))
+		return nomem(a);
+
+	if (s->pass == a->pass && !(s->redef && redef))
+		return asm_error(a, TRS80_E_SYMBOL, "Duplicate symbol '%.*s'",
+				 (int)pl->labellen, pl->label);
+	if (a->pass == 2 && !redef && s->known && s->value != v)
+		return asm_error(a, TRS80_E_SYMBOL, "Phase error at '%.*s'",
+				 (int)pl->labellen, pl->label);
+
+	s->value = v;
+	s->known = 1;
+	s->redef = redef;
+	s->pass = a->pass;
+
+	return TRS80_OK;
+}
+
+
+/* A quoted string of other than one character, which DEFB takes as
+ * its characters rather than a value. */
+static int
+is_string(const char *p, size_t len)
+{
+	size_t	i;
+
+	if (len < 2 || p[0] != '\'' || p[len - 1] != '\'')
+		return 0;
+
+	for (i = 1; i < len - 1; ++i) {
+		if (p[i] == '\'') {
+			if (p[i + 1] != '\'' || i + 1 == len - 1)
+				return 0;
+			++i;
+		}
+	}
+
+	/* 'c' and '''' are values. */
+	return !(len == 3 || (len == 4 && p[1] == '\''));
+}
+
+
+static int
+asm_data(struct trs80_asm *a, const struct parsed *pl, int words)
+{
+	const char	*p = pl->args, *arg;
+	size_t		len, i;
+	long		v;
+	int		st;
+
+	if (p == pl->argsend)
+		return bad_operands(a, pl);
+
+	while (next_arg(&p, pl->argsend, &arg, &len)) {
+		if (!words && is_string(arg, len)) {
+			for (i = 1; i < len - 1; ++i) {
+				if ((st = emit(a, (unsigned char)arg[i])))
+					return st;
+				if (arg[i] == '\'')
+					++i;
+			}
+			continue;
+		}
+		if ((st = eval(a, arg, arg + len, &v)))
+			return st;
+		if ((st = words ? emit_word(a, v) : emit_byte(a, v)))
+			return st;
+	}
+
+	return TRS80_OK;
+}
+
+
+static int
+assemble_line(struct trs80_asm *a, struct src_line *l)
+{
+	const struct mnem	*m = NULL;
+	struct parsed		pl;
+	long			v;
+	int			st;
+
+	a->line = l;
+	a->undef = 0;
+
+	if ((st = parse_line(a, l->text, l->text + l->len, &pl)))
+		return a->skip ? TRS80_OK : st;
+
+	if (pl.op && !(m = find_mnemonic(pl.op, pl.oplen)) && !a->skip)
+		return asm_error(a, TRS80_E_SYNTAX, "Unknown instruction "
+				 "'%.*s'", (int)pl.oplen, pl.op);
+
+	/* Conditional assembly. */
+	if (m && m->id == D_COND) {
+		++a->cond;
+		if (a->skip) {
+			++a->skip;
+			return TRS80_OK;
+		}
+		if ((st = eval_now(a, pl.args, pl.argsend, &v)))
+			return st;
+		if (!v)
+			a->skip = 1;
+		return TRS80_OK;
+	}
+	if (m && m->id == D_ENDC) {
+		if (!a->cond)
+			return asm_error(a, TRS80_E_SYNTAX,
+					 "ENDC without COND");
+		--a->cond;
+		if (a->skip)
+			--a->skip;
+		return TRS80_OK;
+	}
+	if (a->skip)
+		return TRS80_OK;
+
+	if (m && (m->id == D_EQU || m->id == D_DEFL)) {
+		if (!pl.label)
+			return asm_error(a, TRS80_E_SYNTAX,
+					 "%.*s needs a label",
+					 (int)pl.oplen, pl.op);
+		if ((st = eval(a, pl.args, pl.argsend, &v)))
+			return st;
+		if (m->id == D_EQU) {
+			l->equ = 1;
+			l->pc = a->pc;
+		}
+		if (a->undef) {
+			/* Left for later, but taken. */
+			struct sym	*s;
+
+			if (!(s = sym_enter(a, pl.label, pl.labellen)))
+				return nomem(a);
+			if (s->pass == 1)
+				return asm_error(a, TRS80_E_SYMBOL,
+						 "Duplicate symbol '%.*s'",
+						 (int)pl.labellen, pl.label);
+			s->pass = 1;
+			s->redef = m->id == D_DEFL;
+			return TRS80_OK;
+		}
+		return define(a, &pl, v, m->id == D_DEFL);
+	}
+
+	if (m && m->id == D_ORG) {
+		if ((st = eval_now(a, pl.args, pl.argsend, &v)))
+			return st;
+		if (v < 0 || v > 0xffff)
+			return asm_error(a, TRS80_E_RANGE,
+					 "Bad origin (%ld)", v);
+		a->pc = v;
+	}
+
+	if (pl.label && (st = define(a, &pl, a->pc, 0)))
+		return st;
+
+	if (!m)
+		return TRS80_OK;
+
+	switch (m->id) {
+	case D_ORG:
+	case D_LIST:
+	case D_NOLIST:
+	case D_PAGE:
+	case D_SUBTTL:
+	case D_TITLE:
+		return TRS80_OK;
+
+	case D_DEFB:
+	case D_DB:
+	case D_DEFM:
+	case D_DM:
+		return asm_data(a, &pl, 0);
+
+	case D_DEFW:
+	case D_DW:
+		return asm_data(a, &pl, 1);
+
+	case D_DEFS:
+	case D_DS:
+		if ((st = eval_now(a, pl.args, pl.argsend, &v)))
+			return st;
+		if (v < 0 || v > 0xffff)
+			return asm_error(a, TRS80_E_RANGE, "Bad storage size "
+					 "(%ld)", v);
+		a->pc = (a->pc + v) & 0xffff;
+		return TRS80_OK;
+
+	case D_END:
+		a->ended = 1;
+		if (pl.args == pl.argsend)
+			return TRS80_OK;
+		if ((st = eval(a, pl.args, pl.argsend, &v)))
+			return st;
+		if ((st = check_word(a, v)))
+			return st;
+		a->has_entry = 1;
+		a->entry = v & 0xffff;
+		return TRS80_OK;
+	}
+
+	return assemble_insn(a, &pl, m);
+}
+
+
+/* Settle EQUs that referred forward, for as long as that helps. */
+static int
+resolve_equs(struct trs80_asm *a)
+{
+	struct parsed	pl;
+	struct sym	*s;
+	size_t		i;
+	int		progress, st;
+	long		v;
+
+	do {
+		progress = 0;
+		for (i = 0; i < a->nlines; ++i) {
+			if (!a->lines[i].equ)
+				continue;
+			a->line = &a->lines[i];
+			parse_line(a, a->line->text,
+				   a->line->text + a->line->len, &pl);
+			s = sym_find(a, pl.label, pl.labellen);
+			if (s->known)
+				continue;
+			a->pc = a->line->pc;
+			a->undef = 0;
+			if ((st = eval(a, pl.args, pl.argsend, &v)))
+				return st;
+			if (!a->undef) {
+				s->value = v;
+				s->known = 1;
+				progress = 1;
+			}
+		}
+	} while (progress);
+
+	return TRS80_OK;
+}
+
+
+static int
+run_pass(struct trs80_asm *a, int pass)
+{
+	size_t	i;
+	int	st;
+
+	a->pass = pass;
+	a->pc = 0;
+	a->ended = 0;
+	a->cond = 0;
+	a->skip = 0;
+	a->line = NULL;
+
+	for (i = 0; i < a->nlines && !a->ended; ++i)
+		if ((st = assemble_line(a, &a->lines[i])))
+			return st;
+
+	if (a->cond)
+		return asm_error(a, TRS80_E_SYNTAX, "Missing ENDC");
+
+	return TRS80_OK;
+}
+
+
+static void
+reset(struct trs80_asm *a)
+{
+	arena_free(a);
+	free(a->syms);
+	a->syms = NULL;
+	a->nsyms = 0;
+	a->symcap = 0;
+	a->nlines = 0;
+	a->codelen = 0;
+	a->nblocks = 0;
+	a->has_name = 0;
+	a->has_entry = 0;
+	a->entry = 0;
+	a->diag = NULL;
+	a->line = NULL;
+}
+
+
+static int
+assemble(struct trs80_asm *a)
+{
+	size_t	i, off;
+	int	st;
+
+	if (!a->syms && sym_grow(a))
+		return nomem(a);
+
+	if ((st = run_pass(a, 1)) || (st = resolve_equs(a)) ||
+	    (st = run_pass(a, 2))) {
+		a->nblocks = 0;
+		a->has_entry = 0;
+		return st;
+	}
+
+	for (i = off = 0; i < a->nblocks; ++i) {
+		a->blocks[i].data = a->code + off;
+		off += a->blocks[i].len;
+	}
+
+	return TRS80_OK;
+}
+
+
+static int
+add_line(struct trs80_asm *a, const char *text, size_t len,
+	 unsigned long linenum, size_t offset)
+{
+	struct src_line	*l;
+
+	if (a->nlines == a->linecap) {
+		size_t		cap = a->linecap ? a->linecap * 2 : 256;
+		struct src_line	*nl;
+
+		if (!(nl = realloc(a->lines, cap * sizeof(*nl))))
+			return nomem(a);
+		a->lines = nl;
+		a->linecap = cap;
+	}
+
+	l = &a->lines[a->nlines++];
+	l->text = text;
+	l->len = len;
+	l->linenum = linenum;
+	l->offset = offset;
+	l->equ = 0;
+	l->pc = 0;
+
+	return TRS80_OK;
+}
+
+
+/*
+ * Interface.
+ */
+
+struct trs80_asm *
+trs80_asm_new(void)
+{
+	return calloc(1, sizeof(struct trs80_asm));
+}
+
+
+void
+trs80_asm_free(struct trs80_asm *a)
+{
+	if (!a)
+		return;
+
+	reset(a);
+	free(a->lines);
+	free(a->code);
+	free(a->blocks);
+	free(a);
+}
+
+
+static int
+collect_header(void *arg, const char name[6])
+{
+	struct trs80_asm	*a = arg;
+
+	memcpy(a->name, name, sizeof(a->name));
+	a->has_name = 1;
+
+	return 0;
+}
+
+
+static int
+collect_line(void *arg, const struct trs80_edtasm_line *line)
+{
+	return add_line(arg, line->text, line->len, line->linenum,
+			line->offset);
+}
+
+
+int
+trs80_asm_edtasm(struct trs80_asm *a, const void *buf, size_t len,
+		 struct trs80_asm_diag *diag)
+{
+	static const struct trs80_edtasm_visitor	v = {
+		collect_header, collect_line
+	};
+	struct trs80_error	err;
+	int			st;
+
+	reset(a);
+	a->diag = diag;
+
+	if ((st = trs80_edtasm_visit(buf, len, &v, a, &err))) {
+		if (st != TRS80_E_NOMEM && diag) {
+			size_t	n;
+
+			/* Messages here go without the full stop. */
+			diag->linenum = 0;
+			diag->offset = err.offset;
+			trs80_error_message(st, &err, diag->msg,
+					    sizeof(diag->msg));
+			if ((n = strlen(diag->msg)) && diag->msg[n - 1] == '.')
+				diag->msg[n - 1] = '\0';
+		}
+		return st;
+	}
+
+	return assemble(a);
+}
+
+
+int
+trs80_asm_text(struct trs80_asm *a, const char *text, size_t len,
+	       struct trs80_asm_diag *diag)
+{
+	const char	*p = text, *e = text + len;
+	unsigned long	n = 0;
+	int		st;
+
+	reset(a);
+	a->diag = diag;
+
+	while (p < e) {
+		const char	*eol = memchr(p, '\n', e - p);
+		const char	*q = p, *t;
+		unsigned long	num = 0;
+
+		if (!eol)
+			eol = e;
+		++n;
+
+		/* An optional line number and its separator. */
+		for (t = p; t < eol && t - p < 5 && ISDIGIT(*t); ++t)
+			num = num * 10 + (*t - '0');
+		if (t - p == 5 && (t == eol || ISSPACE(*t))) {
+			q = t < eol ? t + 1 : t;
+		} else {
+			num = n;
+		}
+
+		if ((st = add_line(a, q, eol - q, num, p - text)))
+			return st;
+		p = eol < e ? eol + 1 : e;
+	}
+
+	return assemble(a);
+}
+
+
+size_t
+trs80_asm_blocks(const struct trs80_asm *a,
+		 const struct trs80_asm_block **blocks)
+{
+	*blocks = a->blocks;
+
+	return a->nblocks;
+}
+
+
+int
+trs80_asm_entry(const struct trs80_asm *a, unsigned int *addr)
+{
+	if (!a->has_entry)
+		return 0;
+	*addr = a->entry;
+
+	return 1;
+}
+
+
+int
+trs80_asm_symbol(const struct trs80_asm *a, const char *name,
+		 unsigned int *value)
+{
+	struct sym	*s = sym_find(a, name, strlen(name));
+
+	if (!s || !s->known)
+		return 0;
+	*value = s->value & 0xffff;
+
+	return 1;
+}
+
+
+size_t
+trs80_asm_cmd_bound(const struct trs80_asm *a)
+{
+	size_t	n = 8 + 4;		/* Name and transfer records */
+	size_t	i;
+
+	for (i = 0; i < a->nblocks; ++i)
+		n += a->blocks[i].len + (a->blocks[i].len + 255) / 256 * 4;
+
+	return n;
+}
+
+
+int
+trs80_asm_cmd(const struct trs80_asm *a, void *out, size_t *outlen)
+{
+	unsigned char	*q = out;
+	unsigned int	xfer;
+	size_t		i;
+
+	if (a->has_name) {
+		*q++ = 0x05;
+		*q++ = 6;
+		memcpy(q, a->name, 6);
+		q += 6;
+	}
+
+	for (i = 0; i < a->nblocks; ++i) {
+		const unsigned char	*p = a->blocks[i].data;
+		size_t			left = a->blocks[i].len;
+		unsigned int		addr = a->blocks[i].addr;
+
+		while (left > 0) {
+			size_t	n = left > 256 ? 256 : left;
+
+			/* A length of 0, 1 or 2 means 256, 257 or 258. */
+			*q++ = 0x01;
+			*q++ = (n + 2) & 0xff;
+			*q++ = addr & 0xff;
+			*q++ = (addr >> 8) & 0xff;
+			memcpy(q, p, n);
+			q += n;
+			p += n;
+			left -= n;
+			addr = (addr + n) & 0xffff;
+		}
+	}
+
+	if (a->has_entry)
+		xfer = a->entry;
+	else
+		xfer = a->nblocks ? a->blocks[0].addr : 0;
+	*q++ = 0x02;
+	*q++ = 2;
+	*q++ = xfer & 0xff;
+	*q++ = (xfer >> 8) & 0xff;
+
+	*outlen = q - (unsigned char *)out;
+
+	return TRS80_OK;
+}
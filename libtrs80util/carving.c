@@ -0,0 +1,198 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Carving: finding EDTASM and CMD files in raw bytes, such as a disk
+ * image whose directory is gone.
+ *
+ * The find_sig kernel skips, a vector at a time, to the next byte that
+ * could start a file: a CMD record type, an EDTASM header or a run of
+ * EDTASM line number digits.  Each candidate is then run through the
+ * same parsers the converters use, with stricter checks on top, since
+ * in random bytes a short chain of records or a line can turn up by
+ * chance:
+ *
+ *   - A CMD file has to parse to its transfer record with at least one
+ *     load block on the way, and transfer either into what it loads or
+ *     back to DOS.
+ *
+ *   - An EDTASM file needs a printable name if it has a header, and
+ *     lines of printable text with line numbers going up.  It ends at
+ *     its end of file marker; without one, a run of enough good lines
+ *     is still taken, marked truncated, up to the last of them.
+ *
+ * A file found is skipped over, so files never overlap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+#include "kernels.h"
+
+
+#define	HEADERCHAR	0xd3
+#define	EOLCHAR		0x0d
+#define	EOFCHAR		0x1a
+#define	DIGIT(c)	((c) >= 0xb0 && (c) <= 0xb9)
+
+#define	DOS_EXIT	0x402d
+
+#define	EDTASM_MAX	(4 * 1024 * 1024)	/* Largest EDTASM file */
+#define	MIN_TRUNC_LINES	8		/* Lines for an unterminated file */
+#define	STOP		1		/* A visitor's "not a good line" */
+
+
+struct cmd_check {
+	unsigned long	nloads;
+	unsigned int	lo;		/* Lowest load address */
+	unsigned long	hi;		/* Past the highest loaded byte */
+};
+
+struct edtasm_check {
+	unsigned long	nlines;
+	unsigned long	last;		/* Line number */
+	size_t		end;		/* Past the last good line */
+};
+
+
+static int
+printable(const unsigned char *p, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i)
+		if ((p[i] < 0x20 && p[i] != '\t') || p[i] > 0x7e)
+			return 0;
+
+	return 1;
+}
+
+
+static int
+cmd_record(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct cmd_check	*c = arg;
+
+	if (rec->type == TRS80_CMD_LOADBLK) {
+		if (c->nloads++ == 0 || rec->addr < c->lo)
+			c->lo = rec->addr;
+		if (rec->addr + rec->len > c->hi)
+			c->hi = rec->addr + rec->len;
+	}
+
+	return 0;
+}
+
+
+/* The length of the CMD file at p, 0 if there isn't one. */
+static size_t
+check_cmd(const unsigned char *p, size_t n)
+{
+	struct cmd_check	c;
+	struct trs80_cmd_info	info;
+
+	memset(&c, 0, sizeof(c));
+	if (trs80_cmd_parse(p, n, cmd_record, &c, &info, NULL) != TRS80_OK ||
+	    !info.has_xfer || info.truncated || !c.nloads)
+		return 0;
+
+	if (info.xfer_addr != DOS_EXIT &&
+	    (info.xfer_addr < c.lo || info.xfer_addr >= c.hi))
+		return 0;
+
+	return info.end;
+}
+
+
+static int
+edtasm_line(void *arg, const struct trs80_edtasm_line *line)
+{
+	struct edtasm_check	*c = arg;
+
+	if (!line->terminated || (c->nlines && line->linenum <= c->last) ||
+	    !printable((const unsigned char *)line->text, line->len))
+		return STOP;
+
+	++c->nlines;
+	c->last = line->linenum;
+	c->end = line->offset + 6 + line->len + 1;
+
+	return 0;
+}
+
+
+/* The length of the EDTASM file at p, 0 if there isn't one. */
+static size_t
+check_edtasm(const unsigned char *p, size_t n, int *truncated)
+{
+	static const struct trs80_edtasm_visitor	v = { NULL, edtasm_line };
+	struct edtasm_check	c;
+
+	if (n > EDTASM_MAX)
+		n = EDTASM_MAX;
+
+	memset(&c, 0, sizeof(c));
+	if (p[0] == HEADERCHAR) {
+		if (n < 7 || !printable(p + 1, 6))
+			return 0;
+		c.end = 7;
+	}
+
+	trs80_edtasm_visit(p, n, &v, &c, NULL);
+	if (!c.nlines)
+		return 0;
+
+	*truncated = c.end >= n || p[c.end] != EOFCHAR;
+	if (!*truncated)
+		return c.end + 1;
+
+	return c.nlines >= MIN_TRUNC_LINES ? c.end : 0;
+}
+
+
+int
+trs80_carve(const void *buf, size_t len, size_t from, size_t to,
+	    trs80_carve_fn fn, void *arg)
+{
+	const unsigned char	*base = buf;
+	size_t			pos = from;
+	int			ret;
+
+	if (to > len)
+		to = len;
+
+	while (pos < to) {
+		struct trs80_carved	c;
+		const unsigned char	*p;
+		size_t			scan = to + 4 < len ? to + 4 : len;
+
+		pos += trs80_k.find_sig(base + pos, scan - pos);
+		if (pos >= to)
+			break;
+
+		p = base + pos;
+		c.offset = pos;
+		c.len = 0;
+		c.truncated = 0;
+
+		if (*p == HEADERCHAR ||
+		    (DIGIT(*p) && (pos == 0 || p[-1] != EOLCHAR))) {
+			c.type = TRS80_TYPE_EDTASM;
+			c.len = check_edtasm(p, len - pos, &c.truncated);
+		} else if (!DIGIT(*p)) {
+			c.type = TRS80_TYPE_CMD;
+			c.len = check_cmd(p, len - pos);
+		}
+
+		if (!c.len) {
+			++pos;
+			continue;
+		}
+
+		if ((ret = fn(arg, &c)))
+			return ret;
+		pos += c.len;
+	}
+
+	return 0;
+}
@@ -0,0 +1,735 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Cassettes: WAVE files, demodulating tape recordings into CAS images,
+ * and the recordings in a CAS image.
+ *
+ * The demodulator runs the samples through a Schmitt trigger, each
+ * rising edge a cycle of a 1500 baud tape or a pulse of a 500 baud
+ * one, and times the edges.  The kernels skip a vector of samples at
+ * a time to the next one past the trigger's level, so the per-sample
+ * cost is a compare; everything else is per edge.  The levels sit a
+ * quarter (500 baud) or an eighth (1500 baud) of the signal's swing
+ * either side of its middle, taken over blocks of samples and
+ * following a louder signal at once and a quieter one over a few
+ * blocks.  Edge times are interpolated to 1/256
+ * of a sample.
+ *
+ * Both speeds come down to intervals between edges that are short or
+ * long, the long about twice the short.  A 1500 baud interval is a
+ * bit, short for 1.  At 500 baud they are timed from the clock pulses:
+ * a short one is a data pulse, making the bit a 1, and a long one the
+ * next clock pulse.  The decoder hunts for a run of leader intervals
+ * of either speed, locks on, taking the short and long times from the
+ * leader, and shifts bits in until the sync byte turns up; then every
+ * eight bits is a byte.  Short and long follow the tape as it goes, so
+ * stretched tape decodes, and over three long intervals without an
+ * edge is taken as the end of the recording.
+ *
+ * SYSTEM tape format, after the sync byte:
+ *   0x55, 6 character name
+ *   0x3C, count (0 = 256), address (LSB first), data, checksum of the
+ *	address and data bytes; repeated
+ *   0x78, transfer address (LSB first)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trs80util.h"
+#include "kernels.h"
+
+
+#define	MIN_RATE	8000
+#define	MAX_RATE	1000000
+
+#define	BLOCK		512		/* Samples per level update */
+#define	FLOOR		256		/* Swing below which is silence */
+#define	FRAC		256		/* Edge times in 1/FRAC samples */
+
+#define	LEADER_EDGES	96		/* Leader intervals to lock on */
+#define	SYNC_BITS	(8 * (TRS80_CAS_LEADER + 256))
+
+#define	SYSTEM_NAME	0x55
+#define	SYSTEM_BLOCK	0x3c
+#define	SYSTEM_XFER	0x78
+#define	HEADERCHAR	0xd3
+
+#define	MIN_LEADER	16		/* Leader bytes before a sync byte */
+
+#define	LE16(p)		((p)[0] | (p)[1] << 8)
+#define	LE32(p)		((size_t)LE16(p) | (size_t)LE16((p) + 2) << 16)
+
+
+enum cas_state {
+	CS_HUNT,		/* For a leader */
+	CS_SYNC,		/* For the sync byte */
+	CS_DATA
+};
+
+struct trs80_cas {
+	unsigned int		rate;
+	unsigned int		want;		/* Baud asked for, 0 either */
+	unsigned int		baud;		/* Locked on to */
+	enum cas_state		state;
+
+	/* The trigger. */
+	int			env_min, env_max;
+	int			blk_min, blk_max;
+	unsigned int		blk_fill;
+	int			lo, hi;
+	int			high;		/* Past hi since lo */
+	int			prev;		/* The last sample */
+
+	/* Timing, in 1/FRAC samples. */
+	unsigned long long	now;		/* Samples before this call */
+	unsigned long long	last;		/* The last edge */
+	unsigned long long	fall;		/* The last falling edge */
+	int			have_edge;
+	unsigned long		s, l;		/* Short and long intervals */
+
+	unsigned int		hunt_baud;
+	unsigned int		hunt_count;
+	unsigned int		hunt_misses;
+	unsigned long long	hunt_sum;
+
+	int			half;		/* 500 baud: data pulse seen */
+	unsigned int		shift;
+	unsigned int		nbits;
+};
+
+
+/*
+ * WAVE files.
+ */
+
+int
+trs80_wav_parse(const void *buf, size_t len, struct trs80_wav *wav)
+{
+	const unsigned char	*p = buf;
+	size_t			pos = 12;
+	int			have_fmt = 0;
+
+	memset(wav, 0, sizeof(*wav));
+
+	if (len < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+		return TRS80_E_FORMAT;
+
+	while (len - pos >= 8) {
+		size_t	size = LE32(p + pos + 4);
+
+		if (!memcmp(p + pos, "data", 4)) {
+			if (!have_fmt)
+				break;
+			wav->offset = pos + 8;
+			wav->len = size;
+			return TRS80_OK;
+		}
+
+		if (!memcmp(p + pos, "fmt ", 4)) {
+			const unsigned char	*f = p + pos + 8;
+			unsigned int		tag;
+
+			if (size < 16 || len - pos - 8 < size)
+				break;
+			tag = LE16(f);
+			/* WAVE_FORMAT_EXTENSIBLE has it in its GUID. */
+			if (tag == 0xfffe && size >= 40)
+				tag = LE16(f + 24);
+			wav->channels = LE16(f + 2);
+			wav->rate = (unsigned int)LE32(f + 4);
+			wav->bits = LE16(f + 14);
+			if (tag != 1 || !wav->channels || !wav->rate ||
+			    (wav->bits != 8 && wav->bits != 16))
+				break;
+			have_fmt = 1;
+		}
+
+		if (len - pos - 8 < size + (size & 1))
+			break;
+		pos += 8 + size + (size & 1);
+	}
+
+	return TRS80_E_FORMAT;
+}
+
+
+size_t
+trs80_wav_samples(const struct trs80_wav *wav, const void *in, size_t len,
+		  short *out)
+{
+	const unsigned char	*p = in;
+	size_t			frame = wav->channels * (wav->bits / 8);
+	size_t			n = len / frame, i;
+
+	if (wav->bits == 8) {
+		for (i = 0; i < n; ++i, p += frame)
+			out[i] = (short)((*p - 128) * 256);
+		return n;
+	}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (frame == 2) {
+		memcpy(out, p, n * 2);
+		return n;
+	}
+#endif
+	for (i = 0; i < n; ++i, p += frame)
+		out[i] = (short)(uint16_t)LE16(p);
+
+	return n;
+}
+
+
+/*
+ * Demodulating.
+ */
+
+static void
+hunt_reset(struct trs80_cas *d)
+{
+	d->state = CS_HUNT;
+	d->baud = 0;
+	d->hunt_baud = 0;
+	d->hunt_count = 0;
+	d->hunt_misses = 0;
+	d->hunt_sum = 0;
+}
+
+
+struct trs80_cas *
+trs80_cas_new(unsigned int rate, unsigned int baud)
+{
+	struct trs80_cas	*d;
+
+	if (rate < MIN_RATE || rate > MAX_RATE ||
+	    (baud != 0 && baud != 500 && baud != 1500))
+		return NULL;
+
+	if ((d = calloc(1, sizeof(*d)))) {
+		d->rate = rate;
+		d->want = baud;
+		d->lo = -32768;
+		d->hi = 32767;
+		hunt_reset(d);
+	}
+
+	return d;
+}
+
+
+void
+trs80_cas_free(struct trs80_cas *d)
+{
+	free(d);
+}
+
+
+size_t
+trs80_cas_bound(size_t n)
+{
+	/*
+	 * A bit takes at least three samples at the lowest rate, and
+	 * locking on to a recording more than a leader's worth.
+	 */
+	return n + TRS80_CAS_LEADER + 1;
+}
+
+
+/* Update the trigger levels for the next n samples at p. */
+static void
+levels(struct trs80_cas *d, const short *p, size_t n)
+{
+	unsigned int	baud = d->baud ? d->baud : d->want;
+	int		min, max, swing, mid, band;
+
+	trs80_k.sample_range(p, n, &min, &max);
+
+	if (d->blk_fill == 0 || min < d->blk_min)
+		d->blk_min = min;
+	if (d->blk_fill == 0 || max > d->blk_max)
+		d->blk_max = max;
+	if (d->blk_min < d->env_min)
+		d->env_min = d->blk_min;
+	if (d->blk_max > d->env_max)
+		d->env_max = d->blk_max;
+
+	if ((d->blk_fill += n) >= BLOCK) {
+		d->env_min += (d->blk_min - d->env_min) / 4;
+		d->env_max -= (d->env_max - d->blk_max) / 4;
+		d->blk_fill = 0;
+	}
+
+	swing = d->env_max - d->env_min;
+	mid = d->env_min + swing / 2;
+	if (swing < FLOOR) {
+		d->lo = -32768;
+		d->hi = 32767;
+		return;
+	}
+
+	/* Pulses want levels well clear of the noise between them;
+	 * cycles are timed best near their zero crossings. */
+	band = baud == 500 ? swing / 4 : baud == 1500 ? swing / 8 : swing / 6;
+	d->lo = mid - band;
+	d->hi = mid + band;
+}
+
+
+/* Shift in a bit, putting out the leader or a byte as it completes. */
+static unsigned char *
+push(struct trs80_cas *d, int bit, unsigned char *op)
+{
+	int	sync = d->baud == 500 ? 0xa5 : 0x7f;
+
+	d->shift = (d->shift << 1 | bit) & 0xff;
+
+	if (d->state == CS_SYNC) {
+		if ((int)d->shift == sync) {
+			memset(op, d->baud == 500 ? 0x00 : 0x55,
+			       TRS80_CAS_LEADER);
+			op += TRS80_CAS_LEADER;
+			*op++ = sync;
+			d->state = CS_DATA;
+			d->nbits = 0;
+		} else if (++d->nbits > SYNC_BITS)
+			hunt_reset(d);
+		return op;
+	}
+
+	if (++d->nbits == 8) {
+		*op++ = d->shift;
+		d->nbits = 0;
+	}
+
+	return op;
+}
+
+
+/*
+ * The recording is over.  Its last bit has no edge after it to time,
+ * so if it would finish a byte take it from what there is: at 500 baud
+ * whether a data pulse followed the last clock pulse, at 1500 the
+ * length of the last half cycle.
+ */
+static unsigned char *
+finish(struct trs80_cas *d, unsigned char *op)
+{
+	if (d->state == CS_DATA && d->nbits == 7) {
+		if (d->baud == 500)
+			op = push(d, d->half, op);
+		else
+			op = push(d, d->fall > d->last &&
+				  2 * (d->fall - d->last) < (d->s + d->l) / 2,
+				  op);
+	}
+	hunt_reset(d);
+
+	return op;
+}
+
+
+/*
+ * Look for a run of leader intervals of one speed to lock on to.
+ * Returns 0 to have the edge ignored, as the odd noise spike between
+ * two 500 baud clock pulses.
+ */
+static int
+hunt(struct trs80_cas *d, unsigned long x)
+{
+	unsigned long	us;
+	unsigned int	baud = 0;
+
+	us = (unsigned long)((unsigned long long)x * 1000000 /
+			     ((unsigned long long)d->rate * FRAC));
+
+	if (d->hunt_baud == 500 && us < 1400 &&
+	    d->hunt_misses < d->hunt_count / 8) {
+		++d->hunt_misses;
+		return 0;
+	}
+
+	/* 500: 0x00 bytes, 2 ms apart.  1500: 0x55, alternately
+	 * 0.42 and 0.83 ms.  Either 30% off. */
+	if (d->want != 1500 && us >= 1400 && us <= 2800)
+		baud = 500;
+	else if (d->want != 500 && us >= 220 && us <= 1150)
+		baud = 1500;
+
+	if (baud != d->hunt_baud) {
+		d->hunt_baud = baud;
+		d->hunt_count = 0;
+		d->hunt_sum = 0;
+	}
+	if (!baud)
+		return 1;
+
+	d->hunt_sum += x;
+	if (++d->hunt_count < LEADER_EDGES)
+		return 1;
+
+	d->baud = baud;
+	if (baud == 500) {
+		d->l = (unsigned long)(d->hunt_sum / d->hunt_count);
+		d->s = d->l / 2;
+	} else {
+		unsigned long	pair;
+
+		pair = (unsigned long)(2 * d->hunt_sum / d->hunt_count);
+		d->s = pair / 3;
+		d->l = pair - d->s;
+	}
+	d->state = CS_SYNC;
+	d->shift = 0;
+	d->nbits = 0;
+	d->half = 0;
+
+	return 1;
+}
+
+
+/* A rising edge at time t. */
+static unsigned char *
+edge(struct trs80_cas *d, unsigned long long t, unsigned char *op)
+{
+	unsigned long	x, refractory;
+	int		is_short, bit;
+
+	if (!d->have_edge) {
+		d->have_edge = 1;
+		d->last = t;
+		return op;
+	}
+
+	/* Ringing after a pulse isn't another one. */
+	if (d->state == CS_HUNT)
+		refractory = (unsigned long)((unsigned long long)d->rate *
+					     FRAC / 5000);
+	else
+		refractory = d->s / 2;
+	if (t - d->last < refractory)
+		return op;
+
+	x = (unsigned long)(t - d->last < 0xffffffffUL ? t - d->last :
+							 0xffffffffUL);
+
+	if (d->state == CS_HUNT) {
+		if (hunt(d, x))
+			d->last = t;
+		return op;
+	}
+
+	if (x > 3 * d->l) {
+		d->last = t;
+		return finish(d, op);
+	}
+
+	/*
+	 * At 500 baud every interval is timed from a clock pulse.  A pulse
+	 * within a quarter of a short interval of the middle of the bit is
+	 * the data pulse, one within a quarter of a long interval of the
+	 * end the next clock pulse, and anything else noise.
+	 */
+	is_short = x < (d->s + d->l) / 2;
+	if (d->baud == 500 && x < d->l - d->l / 4) {
+		if (!d->half && x > d->s - d->s / 4 && x < d->s + d->s / 4) {
+			d->half = 1;
+			d->s = d->s + x / 16 - d->s / 16;
+		}
+		return op;
+	}
+	d->last = t;
+
+	/* Follow the tape's speed. */
+	if (is_short)
+		d->s = d->s + x / 16 - d->s / 16;
+	else
+		d->l = d->l + x / 16 - d->l / 16;
+
+	if (d->baud == 1500)
+		return push(d, is_short, op);
+
+	bit = d->half;
+	d->half = 0;
+
+	return push(d, bit, op);
+}
+
+
+/* When the level was crossed, between sample i and the one before. */
+static unsigned long long
+crossing(const struct trs80_cas *d, const short *samples, size_t i,
+	 int level)
+{
+	unsigned long long	t = (d->now + i) * FRAC, back;
+	int			prev = i ? samples[i - 1] : d->prev;
+	int			cur = samples[i];
+
+	/* The one before may be past it too if the levels just moved. */
+	if ((prev > level) == (cur > level))
+		return t;
+	back = (unsigned long long)((cur - level) * FRAC / (cur - prev));
+
+	return t >= back ? t - back : 0;
+}
+
+
+int
+trs80_cas_decode(struct trs80_cas *d, const short *samples, size_t n,
+		 void *out, size_t *outlen)
+{
+	unsigned char	*op = out;
+	size_t		i = 0;
+
+	while (i < n) {
+		size_t	end = i + (BLOCK - d->blk_fill);
+		int	pulses;
+
+		if (end > n)
+			end = n;
+		levels(d, samples + i, end - i);
+
+		/*
+		 * Pulses are caught going either way out of the band, in
+		 * case the sampling missed one half; the other half is
+		 * then too soon after to count.  Cycles are timed from
+		 * their rising edges.
+		 */
+		pulses = (d->baud ? d->baud : d->want) == 500;
+
+		while (i < end) {
+			if (pulses) {
+				i += trs80_k.find_outside(samples + i, end - i,
+							  d->lo, d->hi);
+				if (i == end)
+					break;
+				op = edge(d, crossing(d, samples, i,
+						      samples[i] > d->hi ?
+						      d->hi : d->lo), op);
+				++i;
+				continue;
+			}
+
+			if (d->high) {
+				i += trs80_k.find_outside(samples + i, end - i,
+							  d->lo, 32767);
+				if (i < end) {
+					d->high = 0;
+					d->fall = (d->now + i) * FRAC;
+				}
+				continue;
+			}
+
+			i += trs80_k.find_outside(samples + i, end - i,
+						  -32768, d->hi);
+			if (i == end)
+				break;
+			d->high = 1;
+			op = edge(d, crossing(d, samples, i, d->hi), op);
+		}
+
+		if (d->state == CS_DATA &&
+		    (d->now + end) * FRAC - d->last > 3 * d->l)
+			op = finish(d, op);
+	}
+
+	if (n)
+		d->prev = samples[n - 1];
+	d->now += n;
+	*outlen = op - (unsigned char *)out;
+
+	return TRS80_OK;
+}
+
+
+/*
+ * CAS images.
+ */
+
+/* Bytes in a complete SYSTEM recording, or 0. */
+static size_t
+system_len(const unsigned char *p, size_t len)
+{
+	size_t	pos = 7;
+
+	if (len < 7 || p[0] != SYSTEM_NAME)
+		return 0;
+
+	while (pos < len) {
+		if (p[pos] == SYSTEM_XFER)
+			return len - pos >= 3 ? pos + 3 : 0;
+		if (p[pos] != SYSTEM_BLOCK || len - pos < 2)
+			return 0;
+		pos += 4 + (p[pos + 1] ? p[pos + 1] : 256) + 1;
+	}
+
+	return 0;
+}
+
+
+/* Offset of the first sync byte at or after pos behind a leader, with
+ * *leader the offset of its leader; len if there is none. */
+static size_t
+next_sync(const unsigned char *p, size_t len, size_t pos, size_t *leader)
+{
+	size_t	run = 0;
+	int	prev = -1;
+
+	for (; pos < len; ++pos) {
+		if (run >= MIN_LEADER &&
+		    ((p[pos] == 0xa5 && prev == 0x00) ||
+		     (p[pos] == 0x7f && prev == 0x55))) {
+			*leader = pos - run;
+			return pos;
+		}
+		if (p[pos] == prev)
+			++run;
+		else {
+			prev = p[pos];
+			run = 1;
+		}
+	}
+
+	*leader = len;
+	return len;
+}
+
+
+static void
+cas_name(struct trs80_cas_file *f, const unsigned char *name, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n && name[i] >= 0x20 && name[i] < 0x7f; ++i)
+		f->name[i] = name[i];
+	while (i > 0 && f->name[i - 1] == ' ')
+		--i;
+	f->name[i] = '\0';
+}
+
+
+int
+trs80_cas_files(const void *buf, size_t len, trs80_cas_file_fn fn,
+		void *arg)
+{
+	const unsigned char	*p = buf;
+	size_t			leader, sync;
+	int			ret;
+
+	sync = next_sync(p, len, 0, &leader);
+
+	while (sync < len) {
+		struct trs80_cas_file	f;
+		size_t			start = sync + 1, end, n;
+
+		memset(&f, 0, sizeof(f));
+		f.baud = p[sync] == 0xa5 ? 500 : 1500;
+		f.offset = leader;
+		f.data = p + start;
+
+		if ((n = system_len(f.data, len - start))) {
+			end = start + n;
+			sync = next_sync(p, len, end, &leader);
+		} else {
+			sync = next_sync(p, len, start, &leader);
+			end = leader;
+			/* A longer leader than ours starts with data. */
+			if (sync < len && sync - leader > TRS80_CAS_LEADER)
+				end += sync - leader - TRS80_CAS_LEADER;
+		}
+		f.len = end - start;
+
+		if (n) {
+			f.kind = TRS80_CAS_SYSTEM;
+			cas_name(&f, f.data + 1, 6);
+		} else if (f.len >= 4 && f.data[0] == HEADERCHAR &&
+			   f.data[1] == HEADERCHAR &&
+			   f.data[2] == HEADERCHAR) {
+			f.kind = TRS80_CAS_BASIC;
+			cas_name(&f, f.data + 3, 1);
+		} else if (f.len >= 7 && f.data[0] == HEADERCHAR) {
+			f.kind = TRS80_CAS_EDTASM;
+			cas_name(&f, f.data + 1, 6);
+		}
+
+		if ((ret = fn(arg, &f)))
+			return ret;
+	}
+
+	return TRS80_OK;
+}
+
+
+int
+trs80_cas_cmd(const void *data, size_t len, void *out, size_t *outlen,
+	      struct trs80_error *err)
+{
+	const unsigned char	*p = data;
+	unsigned char		*op = out;
+	size_t			pos = 7;
+	int			ret = TRS80_E_FORMAT;
+
+	*outlen = 0;
+
+	if (len < 7 || p[0] != SYSTEM_NAME) {
+		pos = 0;
+		goto fail;
+	}
+
+	*op++ = TRS80_CMD_FNAMEREC;
+	*op++ = 6;
+	memcpy(op, p + 1, 6);
+	op += 6;
+
+	while (pos < len) {
+		size_t		n, i;
+		unsigned int	sum;
+
+		if (p[pos] == SYSTEM_XFER) {
+			if (len - pos < 3)
+				goto fail;
+			*op++ = TRS80_CMD_XFERADDR;
+			*op++ = 2;
+			*op++ = p[pos + 1];
+			*op++ = p[pos + 2];
+			*outlen = op - (unsigned char *)out;
+			return TRS80_OK;
+		}
+
+		if (p[pos] != SYSTEM_BLOCK) {
+			ret = TRS80_E_HEADER;
+			goto fail;
+		}
+		if (len - pos < 4)
+			goto fail;
+		n = p[pos + 1] ? p[pos + 1] : 256;
+		if (len - pos - 4 < n + 1)
+			goto fail;
+
+		sum = p[pos + 2] + p[pos + 3];
+		for (i = 0; i < n; ++i)
+			sum += p[pos + 4 + i];
+		if ((sum & 0xff) != p[pos + 4 + n]) {
+			pos += 4 + n;
+			ret = TRS80_E_CHECKSUM;
+			goto fail;
+		}
+
+		/* The CMD length byte counts the address: 254 is 0. */
+		*op++ = TRS80_CMD_LOADBLK;
+		*op++ = (n + 2) & 0xff;
+		memcpy(op, p + pos + 2, 2 + n);
+		op += 2 + n;
+		pos += 4 + n + 1;
+	}
+
+fail:
+	if (err) {
+		err->offset = pos < len ? pos : len;
+		err->byte = pos < len ? p[pos] : -1;
+	}
+	*outlen = op - (unsigned char *)out;
+
+	return ret;
+}
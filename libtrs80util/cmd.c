@@ -0,0 +1,422 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Parse a TRS-80 CMD file.
+ *
+ * Some TRS-80 DOSes did not keep accurate end-of-file markers which
+ * could result in trailing bytes.
+ *
+ * File name records are supposed to be up to 6 characters long, but
+ * have found them much longer and being used like comment records.
+ *
+ * Has support for comment records marked with 0x1f.  According to
+ * docs I found, comment records are limited to 127 characters, but
+ * I've found CMD files with records that exceed that, so I'll assume
+ * a new limit of 255.  Could they have a size of 0 represent 256?
+ *
+ * LS-DOS also keeps several programs in one file, as a partitioned
+ * data set (a PDS, its members found by name) or as ISAM overlays
+ * (found by number).  Such a library starts with a directory, a PDS
+ * header record (0x06) or straight away ISAM entries (0x08), with an
+ * entry per member giving where its records start as a triad: the
+ * byte in the sector, then the sector's number in the file, low byte
+ * first.  Each member is an ordinary CMD file ending in a transfer or
+ * an end-of-member record (0x04), so only the last member's end is
+ * the end of the library.  Patched libraries may carry patch name
+ * records (0x07) and yanked blocks (0x10), laid out as load blocks but
+ * not loaded.  What else these records may hold is passed over.  These
+ * records are only taken with TRS80_CMD_LSDOS, and the directory's only
+ * in a library, so a stray one in an ordinary CMD file is still a bad
+ * header byte.
+ *
+ * Writing one goes the other way from a memory image: each run of
+ * loaded addresses becomes as few load blocks as it can, 256 bytes
+ * apiece and the rest in the last, in address order.  A run carrying
+ * on from FFFF to 0000 is written as one, wrapping as the loader does,
+ * so the same image always gives the same bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	BLK_LEN(n)	((n) < 3 ? (n) + 254 : (n) - 2)
+#define	LEN_BYTE(n)	(((n) + 2) & 0xff)	/* The inverse */
+
+/* Where a directory entry's triad at p says its member starts. */
+#define	TRIAD(p)	(((size_t)((p)[1] | (p)[2] << 8) << 8) + (p)[0])
+
+#define	PDS_ENTRY_LEN	11		/* Name, triad */
+#define	ISAM_ENTRY_LEN	6		/* Number, transfer address, triad */
+
+
+/* How long a directory entry of type must be, 0 if it isn't one. */
+static size_t
+entry_len(int type)
+{
+	switch (type) {
+	case TRS80_CMD_PDSENTRY:
+		return PDS_ENTRY_LEN;
+	case TRS80_CMD_ISAMENTRY:
+		return ISAM_ENTRY_LEN;
+	default:
+		return 0;
+	}
+}
+
+
+/* Where the triad of the entry with data at p says its member is. */
+static size_t
+entry_offset(int type, const unsigned char *p)
+{
+	return TRIAD(p + (type == TRS80_CMD_PDSENTRY ? 8 : 3));
+}
+
+
+/* Whether a record of type may turn up.  LS-DOS members may also hold
+ * end-of-member, patch name and yanked records, and only a library
+ * those of a directory. */
+static int
+record_ok(int type, unsigned int flags, int library)
+{
+	switch (type) {
+	case TRS80_CMD_LOADBLK:
+	case TRS80_CMD_XFERADDR:
+	case TRS80_CMD_FNAMEREC:
+	case TRS80_CMD_COMMREC:
+		return 1;
+	case TRS80_CMD_ENDMEMBER:
+	case TRS80_CMD_PATCHNAME:
+	case TRS80_CMD_YANKED:
+		return (flags & TRS80_CMD_LSDOS) != 0;
+	default:
+		return library;
+	}
+}
+
+
+int
+trs80_cmd_parse(const void *buf, size_t len, trs80_cmd_visit_fn fn,
+		void *arg, struct trs80_cmd_info *info,
+		struct trs80_error *err)
+{
+	return trs80_cmd_parse_flags(buf, len, 0, fn, arg, info, err);
+}
+
+
+int
+trs80_cmd_parse_flags(const void *buf, size_t len, unsigned int flags,
+		      trs80_cmd_visit_fn fn, void *arg,
+		      struct trs80_cmd_info *info, struct trs80_error *err)
+{
+	const unsigned char	*base = buf;
+	struct trs80_cmd_info	dummy;
+	size_t			pos = 0, last = 0;
+	int			library, ret;
+
+	if (!info)
+		info = &dummy;
+	memset(info, 0, sizeof(*info));
+
+	/* A library goes on to the end of the member starting last. */
+	library = (flags & TRS80_CMD_LSDOS) && len > 0 &&
+		  (base[0] == TRS80_CMD_PDSHEADER ||
+		   base[0] == TRS80_CMD_ISAMENTRY);
+
+	while (pos < len) {
+		struct trs80_cmd_record	rec;
+		size_t			left = len - pos;
+
+		rec.type = base[pos];
+		rec.offset = pos;
+		rec.addr = 0;
+		rec.data = NULL;
+		rec.len = 0;
+
+		if (!record_ok(rec.type, flags, library)) {
+			ret = TRS80_E_HEADER;
+			goto bad;
+		}
+
+		switch (rec.type) {
+		case TRS80_CMD_LOADBLK:
+		case TRS80_CMD_YANKED:
+			if (left < 4)
+				goto truncated;
+			rec.len = BLK_LEN(base[pos + 1]);
+			rec.addr = base[pos + 2] | (base[pos + 3] << 8);
+			rec.data = base + pos + 4;
+			rec.avail = left - 4 < rec.len ? left - 4 : rec.len;
+			if (fn && (ret = fn(arg, &rec)))
+				return ret;
+			if (rec.avail < rec.len)
+				goto truncated;
+			pos += 4 + rec.len;
+			break;
+
+		case TRS80_CMD_XFERADDR:
+			if (left < 4)
+				goto truncated;
+			rec.addr = base[pos + 2] | (base[pos + 3] << 8);
+			rec.avail = 0;
+			if (fn && (ret = fn(arg, &rec)))
+				return ret;
+			if (base[pos + 1] != 2) {
+				pos += 3;
+				ret = TRS80_E_XFERLEN;
+				goto bad;
+			}
+			pos += 4;
+			if (!info->has_xfer) {
+				info->has_xfer = 1;
+				info->xfer_addr = rec.addr;
+			}
+			if (library && rec.offset < last)
+				break;
+			info->end = pos;
+			info->extra = len - pos;
+			return TRS80_OK;
+
+		case TRS80_CMD_ENDMEMBER:
+		case TRS80_CMD_FNAMEREC:
+		case TRS80_CMD_PDSHEADER:
+		case TRS80_CMD_PATCHNAME:
+		case TRS80_CMD_ISAMENTRY:
+		case TRS80_CMD_ISAMEND:
+		case TRS80_CMD_PDSENTRY:
+		case TRS80_CMD_PDSEND:
+		case TRS80_CMD_COMMREC:
+			if (left < 2)
+				goto truncated;
+			rec.len = base[pos + 1];
+			if (left - 2 < rec.len)
+				goto truncated;
+			if (rec.len < entry_len(rec.type)) {
+				++pos;
+				ret = TRS80_E_RANGE;
+				goto bad;
+			}
+			rec.data = base + pos + 2;
+			rec.avail = rec.len;
+			if (fn && (ret = fn(arg, &rec)))
+				return ret;
+			pos += 2 + rec.len;
+			if (entry_len(rec.type) &&
+			    entry_offset(rec.type, rec.data) > last)
+				last = entry_offset(rec.type, rec.data);
+			if (rec.type != TRS80_CMD_ENDMEMBER ||
+			    (library && rec.offset < last))
+				break;
+			info->end = pos;
+			info->extra = len - pos;
+			return TRS80_OK;
+
+		default:
+			ret = TRS80_E_HEADER;
+			goto bad;
+		}
+	}
+
+	/* A library ending before its last member has is cut short. */
+	if (library && last > 0)
+		goto truncated;
+
+	info->end = len;
+
+	return TRS80_OK;
+
+truncated:
+	info->end = len;
+	info->truncated = 1;
+
+	return TRS80_OK;
+
+bad:
+	info->end = pos + 1;
+	if (err) {
+		err->offset = pos;
+		err->byte = ret == TRS80_E_XFERLEN ? base[pos - 2] : base[pos];
+	}
+
+	return ret;
+}
+
+
+int
+trs80_cmd_members(const void *buf, size_t len, trs80_cmd_member_fn fn,
+		  void *arg, struct trs80_error *err)
+{
+	const unsigned char	*base = buf;
+	struct trs80_cmd_member	m;
+	size_t			pos = 0, i;
+	int			ret;
+
+	if (len == 0 || (base[0] != TRS80_CMD_PDSHEADER &&
+			 base[0] != TRS80_CMD_ISAMENTRY))
+		return TRS80_E_FORMAT;
+
+	memset(&m, 0, sizeof(m));
+
+	/* Up to the end of the directory, or whatever else follows it. */
+	while (pos + 2 <= len && pos + 2 + base[pos + 1] <= len) {
+		const unsigned char	*p = base + pos + 2;
+		int			type = base[pos];
+
+		if (type == TRS80_CMD_ISAMEND || type == TRS80_CMD_PDSEND)
+			return TRS80_OK;
+		if (type != TRS80_CMD_PDSHEADER &&
+		    type != TRS80_CMD_PATCHNAME &&
+		    type != TRS80_CMD_FNAMEREC &&
+		    type != TRS80_CMD_COMMREC && !entry_len(type))
+			return TRS80_OK;
+
+		if (entry_len(type)) {
+			if (base[pos + 1] < entry_len(type)) {
+				ret = TRS80_E_RANGE;
+				goto bad;
+			}
+			m.type = type;
+			m.entry = pos;
+			m.offset = entry_offset(type, p);
+			if (type == TRS80_CMD_PDSENTRY) {
+				memcpy(m.name, p, 8);
+				for (i = 8; i > 0 && m.name[i - 1] == ' '; --i)
+					;
+				m.name[i] = '\0';
+				m.number = 0;
+				m.xfer_addr = 0;
+			} else {
+				m.name[0] = '\0';
+				m.number = p[0];
+				m.xfer_addr = p[1] | p[2] << 8;
+			}
+
+			/* Members come after the directory. */
+			if (m.offset <= pos || m.offset >= len) {
+				ret = TRS80_E_RANGE;
+				goto bad;
+			}
+			if (fn && (ret = fn(arg, &m)))
+				return ret;
+			++m.index;
+		}
+
+		pos += 2 + base[pos + 1];
+	}
+
+	return TRS80_OK;
+
+bad:
+	if (err) {
+		err->offset = pos;
+		err->byte = base[pos];
+	}
+
+	return ret;
+}
+
+
+int
+trs80_cmd_strip(const void *buf, size_t len, void *out, size_t *outlen,
+		struct trs80_error *err)
+{
+	struct trs80_cmd_info	info;
+	int			ret;
+
+	ret = trs80_cmd_parse(buf, len, NULL, NULL, &info, err);
+	memcpy(out, buf, info.end);
+	*outlen = info.end;
+
+	return ret;
+}
+
+
+/* Put out a name or comment record, if there is text for one. */
+static unsigned char *
+put_text(unsigned char *q, int type, const char *text)
+{
+	size_t	n = text ? strlen(text) : 0;
+
+	if (n) {
+		*q++ = (unsigned char)type;
+		*q++ = (unsigned char)n;
+		memcpy(q, text, n);
+		q += n;
+	}
+
+	return q;
+}
+
+
+/* Put out the n bytes loaded from addr as load blocks. */
+static unsigned char *
+put_run(unsigned char *q, const struct trs80_image *img, unsigned int addr,
+	size_t n)
+{
+	while (n > 0) {
+		size_t	k = n > 256 ? 256 : n, i;
+
+		*q++ = TRS80_CMD_LOADBLK;
+		*q++ = LEN_BYTE(k);
+		*q++ = addr & 0xff;
+		*q++ = addr >> 8 & 0xff;
+		for (i = 0; i < k; ++i)
+			*q++ = img->mem[(addr + i) & (TRS80_IMAGE_SIZE - 1)];
+		addr = (addr + k) & (TRS80_IMAGE_SIZE - 1);
+		n -= k;
+	}
+
+	return q;
+}
+
+
+int
+trs80_cmd_write(const struct trs80_image *img, const char *name,
+		const char *comment, void *out, size_t *outlen)
+{
+	unsigned char	*q = out;
+	unsigned int	addr, first = 0, start;
+
+	if ((name && strlen(name) > 255) ||
+	    (comment && strlen(comment) > 255))
+		return TRS80_E_RANGE;
+
+	q = put_text(q, TRS80_CMD_FNAMEREC, name);
+	q = put_text(q, TRS80_CMD_COMMREC, comment);
+
+	/* A run through 0000 from FFFF is left for the end. */
+	if (TRS80_IMAGE_LOADED(img, 0) &&
+	    TRS80_IMAGE_LOADED(img, TRS80_IMAGE_SIZE - 1))
+		while (first < TRS80_IMAGE_SIZE &&
+		       TRS80_IMAGE_LOADED(img, first))
+			++first;
+
+	if (first == TRS80_IMAGE_SIZE)
+		q = put_run(q, img, 0, TRS80_IMAGE_SIZE);
+	else {
+		for (addr = first; addr < TRS80_IMAGE_SIZE;) {
+			if (!TRS80_IMAGE_LOADED(img, addr)) {
+				++addr;
+				continue;
+			}
+			for (start = addr; addr < TRS80_IMAGE_SIZE &&
+					   TRS80_IMAGE_LOADED(img, addr); ++addr)
+				;
+			q = put_run(q, img, start, addr - start +
+				    (addr == TRS80_IMAGE_SIZE ? first : 0));
+		}
+	}
+
+	if (img->has_xfer) {
+		*q++ = TRS80_CMD_XFERADDR;
+		*q++ = 2;
+		*q++ = img->xfer_addr & 0xff;
+		*q++ = img->xfer_addr >> 8 & 0xff;
+	}
+
+	*outlen = q - (unsigned char *)out;
+
+	return TRS80_OK;
+}
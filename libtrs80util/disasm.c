@@ -0,0 +1,433 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * A Z80 disassembler.
+ *
+ * Opcodes are taken apart by their octal fields, x (bits 7-6), y (5-3)
+ * and z (2-0), with y split again into p (5-4) and q (3), the way the
+ * instruction set is laid out, rather than listed in tables of 256.
+ * An index prefix turns HL into IX or IY and (HL) into (IX+d); where it
+ * would do anything else, such as make H and L the halves of IX, the
+ * prefix is shown alone as a byte and the instruction after it starts
+ * afresh, as the CPU would run it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	TEXT_MAX	32
+
+
+static const char *const R[8] = {
+	"B", "C", "D", "E", "H", "L", "(HL)", "A"
+};
+static const char *const RP[4] = { "BC", "DE", "HL", "SP" };
+static const char *const RP2[4] = { "BC", "DE", "HL", "AF" };
+static const char *const CC[8] = {
+	"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"
+};
+static const char *const ALU[8] = {
+	"ADD A,", "ADC A,", "SUB ", "SBC A,", "AND ", "XOR ", "OR ", "CP "
+};
+static const char *const ROT[8] = {
+	"RLC", "RRC", "RL", "RR", "SLA", "SRA", "SLL", "SRL"
+};
+static const char *const ACC[8] = {
+	"RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF"
+};
+static const char *const BLOCK[4][4] = {
+	{ "LDI", "CPI", "INI", "OUTI" },
+	{ "LDD", "CPD", "IND", "OUTD" },
+	{ "LDIR", "CPIR", "INIR", "OTIR" },
+	{ "LDDR", "CPDR", "INDR", "OTDR" }
+};
+
+
+struct dis {
+	const unsigned char	*mem;
+	unsigned int		addr;
+	unsigned int		n;		/* Bytes taken so far */
+	const char		*ix;		/* "IX", "IY" or NULL */
+	int			used_hl;	/* HL as a pair */
+	int			used_h;		/* H or L */
+	int			used_m;		/* (HL) */
+	char			m[16];		/* (HL) or (IX+d) */
+	char			num[2][8];	/* Operands, for opcodes with
+						 * two */
+};
+
+
+static unsigned int
+fetch(struct dis *s)
+{
+	return s->mem[(s->addr + s->n++) & (TRS80_IMAGE_SIZE - 1)];
+}
+
+
+/* v in hex as the assembler writes it: 0FFH, 05H, 5200H. */
+static const char *
+hex(char *buf, unsigned int v, int digits)
+{
+	snprintf(buf + 1, 7, "%0*XH", digits, v);
+	if (buf[1] >= 'A') {
+		buf[0] = '0';
+		return buf;
+	}
+
+	return buf + 1;
+}
+
+
+static const char *
+byte_arg(struct dis *s, int i)
+{
+	return hex(s->num[i], fetch(s), 2);
+}
+
+
+static const char *
+word_arg(struct dis *s, int i)
+{
+	unsigned int	lo = fetch(s);
+
+	return hex(s->num[i], lo | fetch(s) << 8, 4);
+}
+
+
+/* A JR or DJNZ target, from the displacement. */
+static const char *
+rel_arg(struct dis *s)
+{
+	int	d = (signed char)fetch(s);
+
+	return hex(s->num[0], (s->addr + s->n + d) & (TRS80_IMAGE_SIZE - 1),
+		   4);
+}
+
+
+/* The 8 bit register i; (HL) under a prefix takes its displacement. */
+static const char *
+reg(struct dis *s, int i)
+{
+	if (i == 6) {
+		if (s->ix && !s->used_m) {
+			int	d = (signed char)fetch(s);
+
+			snprintf(s->m, sizeof(s->m), "(%s%c%02XH)", s->ix,
+				 d < 0 ? '-' : '+', d < 0 ? -d : d);
+		} else if (!s->ix)
+			strcpy(s->m, "(HL)");
+		s->used_m = 1;
+		return s->m;
+	}
+	if (i == 4 || i == 5)
+		s->used_h = 1;
+
+	return R[i];
+}
+
+
+static const char *
+hl(struct dis *s)
+{
+	s->used_hl = 1;
+
+	return s->ix ? s->ix : "HL";
+}
+
+
+static const char *
+rp(struct dis *s, int p)
+{
+	return p == 2 ? hl(s) : RP[p];
+}
+
+
+static const char *
+rp2(struct dis *s, int p)
+{
+	return p == 2 ? hl(s) : RP2[p];
+}
+
+
+/* After CB, or DD CB d or FD CB d. */
+static int
+dis_cb(struct dis *s, char *out)
+{
+	unsigned int	op;
+	const char	*r;
+	int		x, y;
+
+	/* The indexed forms put the displacement before the opcode. */
+	if (s->ix) {
+		r = reg(s, 6);
+		op = fetch(s);
+		if ((op & 7) != 6)
+			return -1;
+	} else {
+		op = fetch(s);
+		r = reg(s, op & 7);
+	}
+	x = op >> 6;
+	y = op >> 3 & 7;
+
+	if (x == 0)
+		sprintf(out, "%s %s", ROT[y], r);
+	else
+		sprintf(out, "%s %d,%s",
+			x == 1 ? "BIT" : x == 2 ? "RES" : "SET", y, r);
+
+	return 0;
+}
+
+
+/* After ED; HL is plain HL here, whatever came before. */
+static int
+dis_ed(struct dis *s, char *out)
+{
+	static const char	im[8] = { 0, 0, 1, 2, 0, 0, 1, 2 };
+	static const char *const misc[6] = {
+		"LD I,A", "LD R,A", "LD A,I", "LD A,R", "RRD", "RLD"
+	};
+	unsigned int	op = fetch(s);
+	int		x = op >> 6, y = op >> 3 & 7, z = op & 7;
+	int		p = y >> 1, q = y & 1;
+
+	if (x == 2 && z <= 3 && y >= 4) {
+		strcpy(out, BLOCK[y - 4][z]);
+		return 0;
+	}
+	if (x != 1) {
+		sprintf(out, "DEFB 0EDH,%s", hex(s->num[0], op, 2));
+		return 0;
+	}
+
+	switch (z) {
+	case 0:
+		sprintf(out, "IN %s,(C)", y == 6 ? "F" : R[y]);
+		break;
+	case 1:
+		sprintf(out, "OUT (C),%s", y == 6 ? "0" : R[y]);
+		break;
+	case 2:
+		sprintf(out, "%s HL,%s", q ? "ADC" : "SBC", RP[p]);
+		break;
+	case 3:
+		if (q)
+			sprintf(out, "LD %s,(%s)", RP[p], word_arg(s, 0));
+		else
+			sprintf(out, "LD (%s),%s", word_arg(s, 0), RP[p]);
+		break;
+	case 4:
+		strcpy(out, "NEG");
+		break;
+	case 5:
+		strcpy(out, y == 1 ? "RETI" : "RETN");
+		break;
+	case 6:
+		sprintf(out, "IM %d", im[y]);
+		break;
+	default:
+		if (y < 6)
+			strcpy(out, misc[y]);
+		else
+			sprintf(out, "DEFB 0EDH,%s", hex(s->num[0], op, 2));
+		break;
+	}
+
+	return 0;
+}
+
+
+/* One instruction, after any index prefix.  -1 if the prefix doesn't
+ * apply to it. */
+static int
+dis_op(struct dis *s, char *out)
+{
+	unsigned int	op = fetch(s);
+	int		x = op >> 6, y = op >> 3 & 7, z = op & 7;
+	int		p = y >> 1, q = y & 1;
+	const char	*a, *b;
+
+	switch (x) {
+	case 0:
+		switch (z) {
+		case 0:
+			if (y == 0)
+				strcpy(out, "NOP");
+			else if (y == 1)
+				strcpy(out, "EX AF,AF'");
+			else if (y == 2)
+				sprintf(out, "DJNZ %s", rel_arg(s));
+			else if (y == 3)
+				sprintf(out, "JR %s", rel_arg(s));
+			else
+				sprintf(out, "JR %s,%s", CC[y - 4],
+					rel_arg(s));
+			break;
+		case 1:
+			a = rp(s, p);
+			if (q)
+				sprintf(out, "ADD %s,%s", hl(s), a);
+			else
+				sprintf(out, "LD %s,%s", a, word_arg(s, 0));
+			break;
+		case 2:
+			a = p == 0 ? "(BC)" : p == 1 ? "(DE)" : NULL;
+			if (!a) {
+				sprintf(s->m, "(%s)", word_arg(s, 1));
+				a = s->m;
+			}
+			b = p == 2 ? hl(s) : "A";
+			if (q)
+				sprintf(out, "LD %s,%s", b, a);
+			else
+				sprintf(out, "LD %s,%s", a, b);
+			break;
+		case 3:
+			sprintf(out, "%s %s", q ? "DEC" : "INC", rp(s, p));
+			break;
+		case 4:
+		case 5:
+			sprintf(out, "%s %s", z == 4 ? "INC" : "DEC",
+				reg(s, y));
+			break;
+		case 6:
+			a = reg(s, y);
+			sprintf(out, "LD %s,%s", a, byte_arg(s, 0));
+			break;
+		default:
+			strcpy(out, ACC[y]);
+			break;
+		}
+		break;
+
+	case 1:
+		if (y == 6 && z == 6) {
+			strcpy(out, "HALT");
+			break;
+		}
+		/* LD H,(IX+d) loads the real H. */
+		if (s->ix && (y == 6 || z == 6)) {
+			a = y == 6 ? reg(s, 6) : R[y];
+			b = z == 6 ? reg(s, 6) : R[z];
+		} else {
+			a = reg(s, y);
+			b = reg(s, z);
+		}
+		sprintf(out, "LD %s,%s", a, b);
+		break;
+
+	case 2:
+		sprintf(out, "%s%s", ALU[y], reg(s, z));
+		break;
+
+	default:
+		switch (z) {
+		case 0:
+			sprintf(out, "RET %s", CC[y]);
+			break;
+		case 1:
+			if (!q)
+				sprintf(out, "POP %s", rp2(s, p));
+			else if (p == 0)
+				strcpy(out, "RET");
+			else if (p == 1)
+				strcpy(out, "EXX");
+			else if (p == 2)
+				sprintf(out, "JP (%s)", hl(s));
+			else
+				sprintf(out, "LD SP,%s", hl(s));
+			break;
+		case 2:
+			sprintf(out, "JP %s,%s", CC[y], word_arg(s, 0));
+			break;
+		case 3:
+			switch (y) {
+			case 0:
+				sprintf(out, "JP %s", word_arg(s, 0));
+				break;
+			case 1:
+				return dis_cb(s, out);
+			case 2:
+				sprintf(out, "OUT (%s),A", byte_arg(s, 0));
+				break;
+			case 3:
+				sprintf(out, "IN A,(%s)", byte_arg(s, 0));
+				break;
+			case 4:
+				sprintf(out, "EX (SP),%s", hl(s));
+				break;
+			case 5:
+				strcpy(out, "EX DE,HL");
+				break;
+			default:
+				strcpy(out, y == 6 ? "DI" : "EI");
+				break;
+			}
+			break;
+		case 4:
+			sprintf(out, "CALL %s,%s", CC[y], word_arg(s, 0));
+			break;
+		case 5:
+			if (!q)
+				sprintf(out, "PUSH %s", rp2(s, p));
+			else if (p == 0)
+				sprintf(out, "CALL %s", word_arg(s, 0));
+			else
+				return -1;	/* Another prefix */
+			break;
+		case 6:
+			sprintf(out, "%s%s", ALU[y], byte_arg(s, 0));
+			break;
+		default:
+			sprintf(out, "RST %s", hex(s->num[0], y * 8, 2));
+			break;
+		}
+		break;
+	}
+
+	/* Under a prefix, only IX, IY and (IX+d) are real. */
+	if (s->ix && ((s->used_h && !s->used_m) ||
+		      (!s->used_hl && !s->used_m)))
+		return -1;
+
+	return 0;
+}
+
+
+int
+trs80_z80_disasm(const unsigned char *mem, unsigned int addr, char *buf,
+		 size_t size)
+{
+	struct dis	s;
+	char		line[TEXT_MAX];
+	unsigned int	op;
+	int		ret;
+
+	memset(&s, 0, sizeof(s));
+	s.mem = mem;
+	s.addr = addr & (TRS80_IMAGE_SIZE - 1);
+
+	op = mem[s.addr];
+	if (op == 0xed) {
+		s.n = 1;
+		ret = dis_ed(&s, line);
+	} else if (op == 0xdd || op == 0xfd) {
+		s.n = 1;
+		s.ix = op == 0xdd ? "IX" : "IY";
+		ret = dis_op(&s, line);
+		if (ret) {
+			s.n = 1;
+			sprintf(line, "DEFB %s", hex(s.num[0], op, 2));
+		}
+	} else
+		ret = dis_op(&s, line);
+
+	snprintf(buf, size, "%s", line);
+
+	return (int)s.n;
+}
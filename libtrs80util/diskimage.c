@@ -0,0 +1,985 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Disk images: reading and writing the files on JV1 and JV3 images of
+ * LDOS format floppies, all in memory.
+ *
+ * A JV1 image is the sectors of a single sided, single density disk,
+ * ten 256 byte sectors a track, one track after another.  A JV3 image
+ * starts with a block of 2901 three byte sector headers (cylinder,
+ * sector, flags) and a write protect byte, followed by the sectors'
+ * data in the same order; if every header is in use another such block
+ * may follow the data.  Unused headers are 0xFF.
+ *
+ * The directory is one cylinder, given by byte 2 of the boot sector,
+ * with sectors numbered on from side 0 to side 1:
+ *   Sector 0	GAT: a byte per cylinder with a bit set for each granule
+ *		in use, unused bits set; at 0x60 the same for granules
+ *		locked out; at 0xCB the DOS version, 0xCC cylinders over
+ *		35, 0xCD granules per cylinder less 1 (0x20 two sided,
+ *		0x40 double density), 0xCE the master password hash,
+ *		0xD0 the disk name and 0xD8 its date, 0xE0 the AUTO
+ *		command.
+ *   Sector 1	HIT: a byte per directory entry, the hash of its file
+ *		name or 0 if free.  An entry's place in the HIT, its
+ *		DEC, is its entry number in the sector times 32 plus its
+ *		sector less 2.
+ *   Sector 2-	Directory entries, 32 bytes each:
+ *		  0	  Attributes: 0x10 in use, 0x40 system, 0x08
+ *			  invisible, 0x80 an extension of another entry
+ *		  1	  In an extension, the DEC of the file's entry
+ *		  3	  EOF: the byte offset in the last sector
+ *		  4	  Record length (0 = 256)
+ *		  5-15	  Name and extension, padded with spaces
+ *		  16-19	  Update and access password hashes
+ *		  20-21	  ERN: the sector of the end of file, so the
+ *			  file is ERN * 256 + EOF bytes long
+ *		  22-29	  Four extents: the cylinder, then the granule
+ *			  in it times 32 plus the granules less 1; 0xFF
+ *			  after the last
+ *		  30-31	  0xFE and the DEC of an extension entry holding
+ *			  the next four extents, or 0xFF 0xFF
+ * Single density granules are 5 sectors, 2 a track; double density
+ * ones 6 sectors, 3 a track.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	SECTOR		256
+
+#define	JV1_SECTORS	10
+#define	JV1_TRACK	(JV1_SECTORS * SECTOR)
+
+#define	JV3_HEADERS	2901			/* Sector headers a block */
+#define	JV3_BLOCK	(JV3_HEADERS * 3 + 1)	/* And write protect byte */
+#define	JV3_FREE	0xff
+#define	JV3_DD		0x80			/* Double density */
+#define	JV3_DAM		0x60			/* Data address mark */
+#define	JV3_DIRDAM	0x20			/* 0xFA SD, 0xF8 DD */
+#define	JV3_SIDE	0x10
+#define	JV3_SIZE	0x03
+
+#define	MAX_CYLS	0x60			/* GAT bytes */
+#define	MAX_SIDES	2
+#define	MAX_SECTORS	32			/* A track */
+#define	MAX_DIRSECS	32			/* DEC sector bits */
+#define	MAX_GRANULES	(MAX_CYLS * 8)
+
+#define	GAT_LOCKOUT	0x60
+#define	GAT_VERSION	0xcb
+#define	GAT_CYLS	0xcc
+#define	GAT_CONFIG	0xcd
+#define	GAT_PASSWORD	0xce
+#define	GAT_NAME	0xd0
+#define	GAT_DATE	0xd8
+#define	GAT_AUTO	0xe0
+
+#define	DIR_ENTRY	32
+#define	DIR_ATTR	0
+#define	DIR_FPDE	1
+#define	DIR_EOF		3
+#define	DIR_LRL		4
+#define	DIR_NAME	5
+#define	DIR_UPDATE	16
+#define	DIR_ACCESS	18
+#define	DIR_ERN		20
+#define	DIR_EXTENTS	22
+#define	DIR_LINK	30
+
+#define	EXTENTS		4			/* An entry */
+#define	EXTENT_MAX	32			/* Granules */
+#define	EXTENT_END	0xfe			/* 0xFE link, 0xFF end */
+
+#define	ATTR_FXDE	0x80
+#define	ATTR_SYS	0x40
+#define	ATTR_INUSE	0x10
+#define	ATTR_INVIS	0x08
+
+#define	LDOS_VERSION	0x51
+#define	BLANK_PASSWORD	0x4296
+#define	MASTER_PASSWORD	0x42e0			/* "PASSWORD" */
+
+#define	NONE		((size_t)-1)
+
+
+struct trs80_disk {
+	unsigned char	*buf;		/* The image */
+	size_t		len;
+	int		format;		/* TRS80_DISK_JV1 or _JV3 */
+	unsigned int	cyls;
+	unsigned int	sides;
+	unsigned int	spt;		/* Sectors a track */
+	size_t		*map;		/* Offset of each sector, or NONE */
+	unsigned int	dircyl;
+	unsigned int	gpc;		/* Granules a cylinder */
+	unsigned int	gsize;		/* Sectors a granule */
+	unsigned int	ndir;		/* Directory entry sectors */
+	unsigned char	*gat;
+	unsigned char	*hit;
+};
+
+struct extent {
+	unsigned int	start;		/* Granule number on the disk */
+	unsigned int	count;
+};
+
+
+/*
+ * Sectors.
+ */
+
+/* Sector rel of cylinder cyl, counting on from side 0 to side 1. */
+static unsigned char *
+sector(const struct trs80_disk *d, unsigned int cyl, unsigned int rel)
+{
+	size_t	off;
+
+	if (cyl >= d->cyls || rel >= d->spt * d->sides)
+		return NULL;
+
+	off = d->map[(cyl * d->sides + rel / d->spt) * d->spt + rel % d->spt];
+
+	return off == NONE ? NULL : d->buf + off;
+}
+
+
+static int
+granule_exists(const struct trs80_disk *d, unsigned int gran)
+{
+	unsigned int	cyl = gran / d->gpc, i;
+
+	for (i = 0; i < d->gsize; ++i)
+		if (!sector(d, cyl, gran % d->gpc * d->gsize + i))
+			return 0;
+
+	return 1;
+}
+
+
+static int
+granule_free(const struct trs80_disk *d, const unsigned char *gat,
+	     unsigned int gran)
+{
+	unsigned int	cyl = gran / d->gpc, bit = 1 << gran % d->gpc;
+
+	return !(gat[cyl] & bit) && !(gat[GAT_LOCKOUT + cyl] & bit) &&
+	       granule_exists(d, gran);
+}
+
+
+static unsigned char *
+dir_entry(const struct trs80_disk *d, unsigned int dec)
+{
+	unsigned char	*p;
+
+	if ((dec & 0x1f) >= d->ndir ||
+	    !(p = sector(d, d->dircyl, (dec & 0x1f) + 2)))
+		return NULL;
+
+	return p + (dec >> 5) * DIR_ENTRY;
+}
+
+
+/*
+ * Opening images.
+ */
+
+static int
+jv3_size(int flags, int used)
+{
+	static const int	used_size[] = { 256, 128, 1024, 512 };
+	static const int	free_size[] = { 512, 1024, 128, 256 };
+
+	return used ? used_size[flags & JV3_SIZE] : free_size[flags & JV3_SIZE];
+}
+
+
+/*
+ * Walk a JV3 image's headers, calling fn (if not NULL) with each 256
+ * byte sector in use.  Returns the number of them, or -1 if the image
+ * isn't one.
+ */
+static long
+jv3_walk(const unsigned char *buf, size_t len,
+	 void (*fn)(void *arg, const unsigned char *hdr, size_t off),
+	 void *arg)
+{
+	size_t	pos = 0;
+	long	count = 0;
+	int	block;
+
+	for (block = 0; block < 2 && pos + JV3_BLOCK <= len; ++block) {
+		size_t	data = pos + JV3_BLOCK;
+		int	i, full = 1;
+
+		for (i = 0; i < JV3_HEADERS; ++i) {
+			const unsigned char	*h = buf + pos + i * 3;
+			int			size;
+
+			if (h[0] == JV3_FREE) {
+				data += jv3_size(h[2], 0);
+				full = 0;
+				continue;
+			}
+			size = jv3_size(h[2], 1);
+			if (h[0] >= MAX_CYLS || h[1] >= MAX_SECTORS ||
+			    data + size > len)
+				return -1;
+			if (size == SECTOR) {
+				if (fn)
+					fn(arg, h, data);
+				++count;
+			}
+			data += size;
+		}
+
+		if (!full || data >= len)
+			break;
+		pos = data;
+	}
+
+	return count;
+}
+
+
+static void
+jv3_geometry(void *arg, const unsigned char *h, size_t off)
+{
+	struct trs80_disk	*d = arg;
+
+	(void)off;
+	if (h[0] >= d->cyls)
+		d->cyls = h[0] + 1;
+	if (h[1] >= d->spt)
+		d->spt = h[1] + 1;
+	if (h[2] & JV3_SIDE)
+		d->sides = 2;
+}
+
+
+static void
+jv3_map(void *arg, const unsigned char *h, size_t off)
+{
+	struct trs80_disk	*d = arg;
+	size_t			*m;
+
+	m = &d->map[(h[0] * d->sides + !!(h[2] & JV3_SIDE)) * d->spt + h[1]];
+	if (*m == NONE)
+		*m = off;
+}
+
+
+/* Map the sectors of the image in d->buf.  Returns a status. */
+static int
+map_image(struct trs80_disk *d)
+{
+	size_t	n, i;
+
+	d->cyls = 0;
+	d->sides = 1;
+	d->spt = 0;
+	if (jv3_walk(d->buf, d->len, NULL, NULL) > 0) {
+		d->format = TRS80_DISK_JV3;
+		jv3_walk(d->buf, d->len, jv3_geometry, d);
+	} else if (d->len > 0 && d->len % JV1_TRACK == 0 &&
+		   d->len / JV1_TRACK <= MAX_CYLS) {
+		d->format = TRS80_DISK_JV1;
+		d->cyls = d->len / JV1_TRACK;
+		d->spt = JV1_SECTORS;
+	} else
+		return TRS80_E_FORMAT;
+
+	n = (size_t)d->cyls * d->sides * d->spt;
+	if (!(d->map = malloc(n * sizeof(*d->map))))
+		return TRS80_E_NOMEM;
+	for (i = 0; i < n; ++i)
+		d->map[i] = d->format == TRS80_DISK_JV1 ? i * SECTOR : NONE;
+	if (d->format == TRS80_DISK_JV3)
+		jv3_walk(d->buf, d->len, jv3_map, d);
+
+	return TRS80_OK;
+}
+
+
+/* Find the directory of a mapped image.  Returns a status. */
+static int
+find_directory(struct trs80_disk *d)
+{
+	const unsigned char	*boot = sector(d, 0, 0);
+	unsigned int		per_side;
+
+	if (!boot || boot[2] >= d->cyls)
+		return TRS80_E_FORMAT;
+	d->dircyl = boot[2];
+
+	/* Double density tracks have 18 sectors, in threes. */
+	per_side = d->spt % 3 == 0 ? 3 : 2;
+	d->gpc = per_side * d->sides;
+	d->gsize = d->spt / per_side;
+	d->ndir = d->spt * d->sides - 2;
+	if (d->ndir > MAX_DIRSECS)
+		d->ndir = MAX_DIRSECS;
+
+	if (d->gpc > 8 || d->gsize == 0 ||
+	    !(d->gat = sector(d, d->dircyl, 0)) ||
+	    !(d->hit = sector(d, d->dircyl, 1)))
+		return TRS80_E_FORMAT;
+
+	return TRS80_OK;
+}
+
+
+int
+trs80_disk_open(struct trs80_disk **dp, const void *buf, size_t len)
+{
+	struct trs80_disk	*d;
+	int			ret;
+
+	*dp = NULL;
+	if (!(d = calloc(1, sizeof(*d))) || !(d->buf = malloc(len ? len : 1))) {
+		free(d);
+		return TRS80_E_NOMEM;
+	}
+	memcpy(d->buf, buf, len);
+	d->len = len;
+
+	if ((ret = map_image(d)) || (ret = find_directory(d))) {
+		trs80_disk_free(d);
+		return ret;
+	}
+
+	*dp = d;
+
+	return TRS80_OK;
+}
+
+
+void
+trs80_disk_free(struct trs80_disk *d)
+{
+	if (d) {
+		free(d->map);
+		free(d->buf);
+		free(d);
+	}
+}
+
+
+void
+trs80_disk_geometry(const struct trs80_disk *d, struct trs80_disk_geometry *g)
+{
+	g->format = d->format;
+	g->cylinders = d->cyls;
+	g->sides = d->sides;
+	g->sectors = d->spt;
+}
+
+
+const void *
+trs80_disk_image(const struct trs80_disk *d, size_t *len)
+{
+	*len = d->len;
+
+	return d->buf;
+}
+
+
+/*
+ * Names.
+ */
+
+/* "NAME/EXT" or "NAME.EXT" as the 11 bytes of a directory entry. */
+static int
+dos_name(const char *name, unsigned char fname[11])
+{
+	int	i, n = 0, max = 8;
+
+	memset(fname, ' ', 11);
+	for (i = 0; name[i]; ++i) {
+		int	ch = name[i];
+
+		if ((ch == '/' || ch == '.') && max == 8 && n > 0) {
+			n = 8;
+			max = 11;
+			continue;
+		}
+		if (ch >= 'a' && ch <= 'z')
+			ch -= 'a' - 'A';
+		if (n == max || !((ch >= 'A' && ch <= 'Z') ||
+				  (ch >= '0' && ch <= '9' && n != 0 && n != 8)))
+			return TRS80_E_INVAL;
+		fname[n++] = ch;
+	}
+
+	return n > 0 && n != 8 ? TRS80_OK : TRS80_E_INVAL;
+}
+
+
+static unsigned char
+name_hash(const unsigned char fname[11])
+{
+	unsigned int	h = 0;
+	int		i;
+
+	for (i = 0; i < 11; ++i) {
+		h ^= fname[i];
+		h = ((h << 1) | (h >> 7)) & 0xff;
+	}
+
+	return h ? h : 1;
+}
+
+
+/* The DEC of the file named fname, or -1. */
+static int
+find_file(const struct trs80_disk *d, const unsigned char fname[11])
+{
+	unsigned char	h = name_hash(fname);
+	unsigned int	dec;
+
+	for (dec = 0; dec < SECTOR; ++dec) {
+		const unsigned char	*e;
+
+		if (d->hit[dec] != h || !(e = dir_entry(d, dec)))
+			continue;
+		if ((e[DIR_ATTR] & (ATTR_INUSE | ATTR_FXDE)) == ATTR_INUSE &&
+		    !memcmp(e + DIR_NAME, fname, 11))
+			return (int)dec;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Extents.
+ */
+
+/*
+ * Call fn with each extent of the file whose entry is dec, and with
+ * each extension entry's DEC if fxde is not NULL.  Returns a status.
+ */
+static int
+walk_extents(const struct trs80_disk *d, unsigned int dec,
+	     int (*fn)(void *arg, const struct extent *x),
+	     void (*fxde)(void *arg, unsigned int dec), void *arg)
+{
+	const unsigned char	*e = dir_entry(d, dec);
+	int			links = 0, ret;
+
+	while (e) {
+		struct extent	x;
+		int		i;
+
+		for (i = 0; i < EXTENTS; ++i) {
+			const unsigned char	*p = e + DIR_EXTENTS + i * 2;
+
+			if (p[0] >= EXTENT_END)
+				return TRS80_OK;
+			x.start = p[0] * d->gpc + (p[1] >> 5);
+			x.count = (p[1] & 0x1f) + 1;
+			if (p[0] >= d->cyls || (p[1] >> 5) >= d->gpc)
+				return TRS80_E_FORMAT;
+			if (fn && (ret = fn(arg, &x)))
+				return ret;
+		}
+
+		if (e[DIR_LINK] != EXTENT_END)
+			return TRS80_OK;
+		if (++links > MAX_DIRSECS * 8)
+			return TRS80_E_FORMAT;
+		if (fxde)
+			fxde(arg, e[DIR_LINK + 1]);
+		if (!(e = dir_entry(d, e[DIR_LINK + 1])) ||
+		    !(e[DIR_ATTR] & ATTR_FXDE))
+			return TRS80_E_FORMAT;
+	}
+
+	return TRS80_E_FORMAT;
+}
+
+
+struct release {
+	const struct trs80_disk	*d;
+	unsigned char		*gat;
+	unsigned char		*hit;
+};
+
+static int
+release_extent(void *arg, const struct extent *x)
+{
+	struct release	*r = arg;
+	unsigned int	g;
+
+	for (g = x->start; g < x->start + x->count; ++g)
+		if (g / r->d->gpc < r->d->cyls)
+			r->gat[g / r->d->gpc] &= ~(1 << g % r->d->gpc);
+
+	return 0;
+}
+
+
+static void
+release_fxde(void *arg, unsigned int dec)
+{
+	struct release	*r = arg;
+
+	r->hit[dec] = 0;
+}
+
+
+/*
+ * Allocate granules for n sectors in gat: one run if there is room for
+ * it anywhere, otherwise runs as they come.  Returns the number of
+ * extents, or -1 if there aren't enough granules free.
+ */
+static int
+allocate(const struct trs80_disk *d, unsigned char *gat, size_t sectors,
+	 struct extent *xs)
+{
+	unsigned int	need = (sectors + d->gsize - 1) / d->gsize;
+	unsigned int	total = d->cyls * d->gpc, g, run = 0, start = 0;
+	int		n = 0;
+
+	if (need == 0)
+		return 0;
+
+	for (g = 0; g < total && run < need; ++g) {
+		if (!granule_free(d, gat, g)) {
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			start = g;
+	}
+	if (run == need) {
+		xs[0].start = start;
+		xs[0].count = need;
+		n = 1;
+	} else {
+		for (g = 0; g < total && need > 0; ++g) {
+			if (!granule_free(d, gat, g))
+				continue;
+			if (n > 0 && xs[n - 1].start + xs[n - 1].count == g &&
+			    xs[n - 1].count < EXTENT_MAX)
+				++xs[n - 1].count;
+			else {
+				xs[n].start = g;
+				xs[n++].count = 1;
+			}
+			--need;
+		}
+		if (need > 0)
+			return -1;
+	}
+
+	/* Runs longer than an extent holds are split. */
+	for (g = 0; g < (unsigned int)n; ++g) {
+		while (xs[g].count > EXTENT_MAX) {
+			memmove(&xs[g + 1], &xs[g], (n - g) * sizeof(*xs));
+			xs[g].count = EXTENT_MAX;
+			xs[g + 1].start += EXTENT_MAX;
+			xs[g + 1].count -= EXTENT_MAX;
+			++n;
+			++g;
+		}
+	}
+
+	for (g = 0; g < (unsigned int)n; ++g) {
+		unsigned int	i;
+
+		for (i = xs[g].start; i < xs[g].start + xs[g].count; ++i)
+			gat[i / d->gpc] |= 1 << i % d->gpc;
+	}
+
+	return n;
+}
+
+
+/* The first free DEC in hit, or -1. */
+static int
+free_dec(const struct trs80_disk *d, const unsigned char *hit)
+{
+	unsigned int	dec;
+
+	for (dec = 0; dec < SECTOR; ++dec)
+		if (hit[dec] == 0 && dir_entry(d, dec))
+			return (int)dec;
+
+	return -1;
+}
+
+
+static void
+put_extents(const struct trs80_disk *d, unsigned char *e,
+	    const struct extent *xs, int n)
+{
+	int	i;
+
+	memset(e + DIR_EXTENTS, 0xff, EXTENTS * 2 + 2);	/* And link */
+	for (i = 0; i < n; ++i) {
+		e[DIR_EXTENTS + i * 2] = xs[i].start / d->gpc;
+		e[DIR_EXTENTS + i * 2 + 1] = (xs[i].start % d->gpc) << 5 |
+					     (xs[i].count - 1);
+	}
+}
+
+
+/*
+ * Files.
+ */
+
+int
+trs80_disk_write(struct trs80_disk *d, const char *name, const void *data,
+		 size_t len)
+{
+	struct extent		xs[MAX_GRANULES];
+	unsigned char		fname[11], gat[SECTOR], hit[SECTOR], h;
+	unsigned char		*e;
+	const unsigned char	*p = data;
+	int			old, n, i, decs[MAX_GRANULES / EXTENTS + 1];
+	int			nent, ret;
+	size_t			sectors = (len + SECTOR - 1) / SECTOR;
+
+	if ((ret = dos_name(name, fname)))
+		return ret;
+	if (len / SECTOR > 0xffff)
+		return TRS80_E_FULL;
+	h = name_hash(fname);
+
+	/* Plan on copies of the GAT and HIT, so a file that won't fit
+	 * leaves the disk as it was. */
+	memcpy(gat, d->gat, SECTOR);
+	memcpy(hit, d->hit, SECTOR);
+	if ((old = find_file(d, fname)) >= 0) {
+		struct release	r = { d, gat, hit };
+
+		if ((ret = walk_extents(d, old, release_extent, release_fxde,
+					&r)))
+			return ret;
+		hit[old] = 0;
+	}
+
+	if ((n = allocate(d, gat, sectors, xs)) < 0)
+		return TRS80_E_FULL;
+	nent = n <= EXTENTS ? 1 : (n + EXTENTS - 1) / EXTENTS;
+	for (i = 0; i < nent; ++i) {
+		if (i == 0 && old >= 0)
+			decs[i] = old;
+		else if ((decs[i] = free_dec(d, hit)) < 0)
+			return TRS80_E_FULL;
+		hit[decs[i]] = h;
+	}
+
+	/* It fits: free any extension entries no longer used, then write
+	 * the data and the entries. */
+	for (i = 0; i < SECTOR; ++i)
+		if (d->hit[i] && !hit[i] && (e = dir_entry(d, i)))
+			memset(e, 0, DIR_ENTRY);
+	memcpy(d->gat, gat, SECTOR);
+	memcpy(d->hit, hit, SECTOR);
+
+	for (i = 0; i < n; ++i) {
+		unsigned int	s = xs[i].start * d->gsize;
+		unsigned int	last = (xs[i].start + xs[i].count) * d->gsize;
+
+		for (; s < last && len > 0; ++s) {
+			unsigned char	*sp;
+			size_t		k = len < SECTOR ? len : SECTOR;
+
+			sp = sector(d, s / (d->gsize * d->gpc),
+				    s % (d->gsize * d->gpc));
+			memcpy(sp, p, k);
+			memset(sp + k, 0, SECTOR - k);
+			p += k;
+			len -= k;
+		}
+	}
+	len = p - (const unsigned char *)data;
+
+	for (i = 0; i < nent; ++i) {
+		int	first = i * EXTENTS;
+
+		e = dir_entry(d, decs[i]);
+		memset(e, 0, DIR_ENTRY);
+		if (i == 0) {
+			e[DIR_ATTR] = ATTR_INUSE;
+			e[DIR_EOF] = len % SECTOR;
+			memcpy(e + DIR_NAME, fname, 11);
+			e[DIR_UPDATE] = e[DIR_ACCESS] = BLANK_PASSWORD & 0xff;
+			e[DIR_UPDATE + 1] = e[DIR_ACCESS + 1] =
+				BLANK_PASSWORD >> 8;
+			e[DIR_ERN] = (len / SECTOR) & 0xff;
+			e[DIR_ERN + 1] = (len / SECTOR) >> 8;
+		} else {
+			e[DIR_ATTR] = ATTR_FXDE | ATTR_INUSE;
+			e[DIR_FPDE] = decs[0];
+		}
+		put_extents(d, e, xs + first,
+			    n - first < EXTENTS ? n - first : EXTENTS);
+		if (i < nent - 1) {
+			e[DIR_LINK] = EXTENT_END;
+			e[DIR_LINK + 1] = decs[i + 1];
+		}
+	}
+
+	return TRS80_OK;
+}
+
+
+struct gather {
+	const struct trs80_disk	*d;
+	unsigned char		*out;
+	size_t			len;		/* Still to copy */
+	unsigned int		granules;
+};
+
+static int
+gather_extent(void *arg, const struct extent *x)
+{
+	struct gather	*gt = arg;
+	unsigned int	s, per_cyl = gt->d->gsize * gt->d->gpc;
+
+	gt->granules += x->count;
+	if (!gt->out)
+		return 0;
+
+	for (s = x->start * gt->d->gsize;
+	     s < (x->start + x->count) * gt->d->gsize && gt->len > 0; ++s) {
+		const unsigned char	*sp = sector(gt->d, s / per_cyl,
+						     s % per_cyl);
+		size_t			k = gt->len < SECTOR ? gt->len : SECTOR;
+
+		if (!sp)
+			return TRS80_E_FORMAT;
+		memcpy(gt->out, sp, k);
+		gt->out += k;
+		gt->len -= k;
+	}
+
+	return 0;
+}
+
+
+static size_t
+file_len(const unsigned char *e)
+{
+	return (size_t)(e[DIR_ERN] | e[DIR_ERN + 1] << 8) * SECTOR + e[DIR_EOF];
+}
+
+
+int
+trs80_disk_files(const struct trs80_disk *d, trs80_disk_file_fn fn,
+		 void *arg)
+{
+	unsigned int	dec;
+	int		ret;
+
+	for (dec = 0; dec < SECTOR; ++dec) {
+		const unsigned char	*e = dir_entry(d, dec);
+		struct trs80_disk_file	f;
+		struct gather		gt;
+		int			i, n;
+
+		if (!d->hit[dec] || !e ||
+		    (e[DIR_ATTR] & (ATTR_INUSE | ATTR_FXDE)) != ATTR_INUSE)
+			continue;
+
+		for (i = n = 0; i < 8 && e[DIR_NAME + i] != ' '; ++i)
+			f.name[n++] = e[DIR_NAME + i];
+		for (i = 8; i < 11 && e[DIR_NAME + i] != ' '; ++i) {
+			if (i == 8)
+				f.name[n++] = '/';
+			f.name[n++] = e[DIR_NAME + i];
+		}
+		f.name[n] = '\0';
+		f.len = file_len(e);
+		f.attr = e[DIR_ATTR];
+
+		memset(&gt, 0, sizeof(gt));
+		gt.d = d;
+		if ((ret = walk_extents(d, dec, gather_extent, NULL, &gt)))
+			return ret;
+		f.granules = gt.granules;
+
+		if ((ret = fn(arg, &f)))
+			return ret;
+	}
+
+	return TRS80_OK;
+}
+
+
+int
+trs80_disk_read(const struct trs80_disk *d, const char *name, void *out,
+		size_t *outlen)
+{
+	unsigned char	fname[11];
+	struct gather	gt;
+	int		dec, ret;
+
+	if ((ret = dos_name(name, fname)))
+		return ret;
+	if ((dec = find_file(d, fname)) < 0)
+		return TRS80_E_NOFILE;
+
+	memset(&gt, 0, sizeof(gt));
+	gt.d = d;
+	gt.out = out;
+	gt.len = file_len(dir_entry(d, dec));
+	*outlen = gt.len;
+	if ((ret = walk_extents(d, dec, gather_extent, NULL, &gt)))
+		return ret;
+
+	/* The extents ran out before the end of file. */
+	return gt.len ? TRS80_E_FORMAT : TRS80_OK;
+}
+
+
+unsigned int
+trs80_disk_free_granules(const struct trs80_disk *d)
+{
+	unsigned int	g, n = 0;
+
+	for (g = 0; g < d->cyls * d->gpc; ++g)
+		n += granule_free(d, d->gat, g);
+
+	return n;
+}
+
+
+/*
+ * New images.
+ */
+
+/* A system file's entry, taking up the granules from start. */
+static void
+put_system(struct trs80_disk *d, unsigned int dec, const char *name,
+	   unsigned int start, unsigned int count, unsigned int sectors)
+{
+	unsigned char	*e = dir_entry(d, dec);
+	struct extent	x;
+
+	memset(e, 0, DIR_ENTRY);
+	e[DIR_ATTR] = ATTR_SYS | ATTR_INUSE | ATTR_INVIS | 6;
+	memcpy(e + DIR_NAME, name, 11);
+	e[DIR_UPDATE] = e[DIR_ACCESS] = BLANK_PASSWORD & 0xff;
+	e[DIR_UPDATE + 1] = e[DIR_ACCESS + 1] = BLANK_PASSWORD >> 8;
+	e[DIR_ERN] = sectors;
+	x.start = start;
+	x.count = count;
+	put_extents(d, e, &x, 1);
+	d->hit[dec] = name_hash(e + DIR_NAME);
+}
+
+
+static void
+pad(unsigned char *p, const char *s, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i)
+		p[i] = s && *s ? *s++ : ' ';
+}
+
+
+int
+trs80_disk_new(struct trs80_disk **dp, const struct trs80_disk_geometry *g,
+	       const char *name, const char *date)
+{
+	struct trs80_disk	*d;
+	unsigned char		*p;
+	unsigned int		nsec, i, c;
+	size_t			len;
+	int			ret;
+
+	*dp = NULL;
+	if (g->cylinders < 2 || g->cylinders > MAX_CYLS ||
+	    (g->format == TRS80_DISK_JV1 &&
+	     (g->sides != 1 || g->sectors != JV1_SECTORS)) ||
+	    (g->format == TRS80_DISK_JV3 &&
+	     (g->sides < 1 || g->sides > MAX_SIDES ||
+	      (g->sectors != JV1_SECTORS && g->sectors != 18))) ||
+	    (g->format != TRS80_DISK_JV1 && g->format != TRS80_DISK_JV3))
+		return TRS80_E_INVAL;
+
+	nsec = g->cylinders * g->sides * g->sectors;
+	len = (size_t)nsec * SECTOR;
+	if (g->format == TRS80_DISK_JV3)
+		len += (nsec + JV3_HEADERS - 1) / JV3_HEADERS * JV3_BLOCK;
+
+	if (!(d = calloc(1, sizeof(*d))) || !(d->buf = malloc(len))) {
+		free(d);
+		return TRS80_E_NOMEM;
+	}
+	d->len = len;
+	memset(d->buf, 0xe5, len);
+
+	/* Each JV3 block's headers, followed by their sectors. */
+	p = d->buf;
+	for (i = 0; g->format == TRS80_DISK_JV3 && i < nsec; ++i) {
+		unsigned int	s = i % g->sectors;
+		unsigned int	side = i / g->sectors % g->sides;
+
+		c = i / g->sectors / g->sides;
+		if (i % JV3_HEADERS == 0) {
+			if (i)
+				p += JV3_BLOCK + (size_t)JV3_HEADERS * SECTOR;
+			memset(p, 0xff, JV3_BLOCK);
+		}
+		p[i % JV3_HEADERS * 3] = c;
+		p[i % JV3_HEADERS * 3 + 1] = s;
+		p[i % JV3_HEADERS * 3 + 2] =
+			(g->sectors == 18 ? JV3_DD : 0) |
+			(side ? JV3_SIDE : 0) |
+			(c == g->cylinders / 2 ? JV3_DIRDAM : 0);
+	}
+
+	if ((ret = map_image(d))) {
+		trs80_disk_free(d);
+		return ret;
+	}
+
+	/* The boot sector points at the directory, in the middle. */
+	p = sector(d, 0, 0);
+	memset(p, 0, SECTOR);
+	p[1] = 0xfe;
+	p[2] = d->cyls / 2;
+	p[3] = 0x18;			/* JR $: not a system disk */
+	p[4] = 0xfe;
+
+	if ((ret = find_directory(d))) {
+		trs80_disk_free(d);
+		return ret;
+	}
+	for (i = 0; i < d->spt * d->sides; ++i)
+		memset(sector(d, d->dircyl, i), 0, SECTOR);
+
+	for (c = 0; c < MAX_CYLS; ++c)
+		d->gat[c] = d->gat[GAT_LOCKOUT + c] =
+			c < d->cyls ? 0xff << d->gpc : 0xff;
+	d->gat[GAT_VERSION] = LDOS_VERSION;
+	d->gat[GAT_CYLS] = d->cyls > 35 ? d->cyls - 35 : 0;
+	d->gat[GAT_CONFIG] = (d->gpc - 1) | (d->sides == 2 ? 0x20 : 0) |
+			     (d->spt == 18 ? 0x40 : 0);
+	d->gat[GAT_PASSWORD] = MASTER_PASSWORD & 0xff;
+	d->gat[GAT_PASSWORD + 1] = MASTER_PASSWORD >> 8;
+	pad(d->gat + GAT_NAME, name ? name : "DATA", 8);
+	pad(d->gat + GAT_DATE, date ? date : "00/00/00", 8);
+	d->gat[GAT_AUTO] = 0x0d;
+
+	/* The boot granule and the directory cylinder are in use. */
+	d->gat[0] |= 1;
+	d->gat[d->dircyl] = 0xff;
+	put_system(d, 0x00, "BOOT    SYS", 0, 1, d->gsize);
+	put_system(d, 0x01, "DIR     SYS", d->dircyl * d->gpc, d->gpc,
+		   d->spt * d->sides);
+
+	*dp = d;
+
+	return TRS80_OK;
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Decode TRS-80 EDTASM format files to plain text.
+ *
+ * The TRS-80 EDTASM file format has at least two known variations.
+ *
+ * The first variation is an older format first used when EDTASM moved
+ * from cassette based to disk files.  It's identical except for the
+ * starting cassette head block (256 zeros + 0xA5).
+ *
+ * The second, newer format came along later, unclear when and
+ * if its different aspects evolved differently.
+ *
+ * The first format starts with a filename header which is absent
+ * in the later format starting directly with a line format.
+ *
+ * Header format:
+ *   Bytes	Value	Definition
+ *   0x00	0xD3	Marker of start of filename
+ *   0x01-0x06		ASCII file name.  If shorter than 6 character,
+ *   			filename is padded with spaces [0x20]
+ *
+ * Line format:
+ *   Bytes	Value	   Definition
+ *   0x00-0x04	0xB0-0xB9  5 digit line number in base 10 (0-9), but with
+ *   			   their high bit set.
+ *   0x05	0x20|0x09  Older format the character immediately following
+ *   			   the line number is a space [0x20].  The newer
+ *   			   format has a tab [0x09].
+ *   0x06-*		   Assembly directives and comments
+ *   End	0x0D	   End of Line character [0x0D]
+ *
+ * The line format repeats indefinitely until end of file.  The End of
+ * File is marked with a 0x1A character.
+ *
+ * https://www.trs-80.com/wordpress/tips/formats/#edasfile
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+#include "kernels.h"
+
+
+#define	HEADERCHAR	0xd3
+#define	EOLCHAR		0x0d
+#define	EOFCHAR		0x1a
+#define	LINENUMCHAR(c)	((c) >= 0xb0 && (c) <= 0xb9)
+
+#define	FNAME_PREFIX	"FILENAME: "
+
+
+enum edtasm_state {
+	ES_HDR,
+	ES_FNAME,
+	ES_LINENUM,
+	ES_LINETXT,
+	ES_EOF
+};
+
+struct trs80_edtasm {
+	unsigned int		flags;
+	enum edtasm_state	state;
+	int			fnc;
+	int			lncc;
+	int			tlcc;
+	size_t			offset;
+};
+
+
+size_t
+trs80_edtasm_bound(size_t inlen)
+{
+	/* The 7 byte header becomes "FILENAME: " + name + "\n\n". */
+	return inlen + sizeof(FNAME_PREFIX) + 1;
+}
+
+
+static void
+edtasm_init(struct trs80_edtasm *d, unsigned int flags)
+{
+	memset(d, 0, sizeof(*d));
+	d->flags = flags;
+	d->state = ES_HDR;
+}
+
+
+struct trs80_edtasm *
+trs80_edtasm_new(unsigned int flags)
+{
+	struct trs80_edtasm	*d;
+
+	if ((d = malloc(sizeof(*d))))
+		edtasm_init(d, flags);
+
+	return d;
+}
+
+
+void
+trs80_edtasm_free(struct trs80_edtasm *d)
+{
+	free(d);
+}
+
+
+int
+trs80_edtasm_decode(struct trs80_edtasm *d, const void *in, size_t inlen,
+		    void *out, size_t *outlen, struct trs80_error *err)
+{
+	const unsigned char	*ip = in, *iend = ip + inlen;
+	unsigned char		*op = out;
+	int			show_linenums;
+	int			ret = TRS80_OK;
+
+	show_linenums = !(d->flags & TRS80_EDTASM_NOLINENUMS);
+
+	while (ip < iend && d->state != ES_EOF) {
+		int	ch = *ip;
+
+		if (d->state == ES_HDR) {
+			/* Look at first char to determine file format
+			 * and starting state. */
+			if (ch == HEADERCHAR) {
+				d->state = ES_FNAME;
+				++ip;
+				continue;
+			} else if (LINENUMCHAR(ch)) {
+				d->state = ES_LINENUM;
+			} else {
+				ret = TRS80_E_FORMAT;
+				break;
+			}
+		}
+
+		switch (d->state) {
+		case ES_FNAME:
+			/* Process filename. */
+			if (d->flags & TRS80_EDTASM_HEADER) {
+				if (d->fnc == 0) {
+					memcpy(op, FNAME_PREFIX,
+						sizeof(FNAME_PREFIX) - 1);
+					op += sizeof(FNAME_PREFIX) - 1;
+				}
+				*op++ = ch;
+			}
+
+			if (d->fnc++ == 5) {
+				if (d->flags & TRS80_EDTASM_HEADER) {
+					*op++ = '\n';
+					*op++ = '\n';
+				}
+				d->fnc = 0;
+				d->state = ES_LINENUM;
+			}
+			break;
+
+		case ES_LINENUM:
+			/* Process line number. */
+			if (LINENUMCHAR(ch)) {
+				if (show_linenums)
+					*op++ = ch & 0x7f;
+				if (++d->lncc == 5) {
+					d->lncc = 0;
+					d->state = ES_LINETXT;
+				}
+			} else if (ch == EOFCHAR) {
+				d->state = ES_EOF;
+			} else {
+				ret = TRS80_E_LINENUM;
+			}
+			break;
+
+		case ES_LINETXT:
+			/* Process line text. */
+			if (d->tlcc == 0) {
+				if (ch != ' ' && ch != '\t') {
+					ret = TRS80_E_SEPARATOR;
+					break;
+				}
+				if (show_linenums) {
+					if (ch == ' ' &&
+					    (d->flags & TRS80_EDTASM_NEWER))
+						ch = '\t';
+					*op++ = ch;
+				}
+				d->tlcc = 1;
+			} else if (ch == EOLCHAR) {
+				*op++ = '\n';
+				d->tlcc = 0;
+				d->state = ES_LINENUM;
+			} else {
+				/* Copy the rest of the line in one go. */
+				size_t	n;
+
+				n = trs80_k.copy_until(op, ip, iend - ip,
+						       EOLCHAR);
+				op += n;
+				ip += n;
+				continue;
+			}
+			break;
+
+		default:
+			ret = TRS80_E_INVAL;
+			break;
+		}
+
+		if (ret != TRS80_OK)
+			break;
+		++ip;
+	}
+
+	d->offset += ip - (const unsigned char *)in;
+	*outlen = op - (unsigned char *)out;
+
+	if (ret != TRS80_OK && err) {
+		err->offset = d->offset;
+		err->byte = *ip;
+	}
+
+	return ret;
+}
+
+
+unsigned int
+trs80_edtasm_where(const struct trs80_edtasm *d, size_t *offset)
+{
+	unsigned int	where = 0;
+
+	if (offset)
+		*offset = d->offset;
+
+	if (d->state == ES_EOF)
+		where |= TRS80_EDTASM_EOF;
+	else if (d->state == ES_LINENUM && d->lncc == 0)
+		where |= TRS80_EDTASM_LINESTART;
+
+	return where;
+}
+
+
+int
+trs80_edtasm_convert(const void *in, size_t inlen, unsigned int flags,
+		     void *out, size_t *outlen, struct trs80_error *err)
+{
+	struct trs80_edtasm	d;
+
+	edtasm_init(&d, flags);
+
+	return trs80_edtasm_decode(&d, in, inlen, out, outlen, err);
+}
+
+
+int
+trs80_edtasm_visit(const void *buf, size_t len,
+		   const struct trs80_edtasm_visitor *v, void *arg,
+		   struct trs80_error *err)
+{
+	const unsigned char	*p = buf, *end = p + len;
+	int			ret;
+
+	if (p == end)
+		return TRS80_OK;
+
+	if (*p == HEADERCHAR) {
+		if (end - p < 7)
+			return TRS80_OK;
+		if (v->header && (ret = v->header(arg, (const char *)p + 1)))
+			return ret;
+		p += 7;
+	} else if (!LINENUMCHAR(*p)) {
+		ret = TRS80_E_FORMAT;
+		goto bad;
+	}
+
+	while (p < end && *p != EOFCHAR) {
+		struct trs80_edtasm_line	line;
+		int				i;
+
+		line.offset = p - (const unsigned char *)buf;
+		line.linenum = 0;
+		for (i = 0; i < 5; ++i, ++p) {
+			if (p == end)
+				return TRS80_OK;
+			if (!LINENUMCHAR(*p)) {
+				ret = TRS80_E_LINENUM;
+				goto bad;
+			}
+			line.linenum = line.linenum * 10 + (*p & 0x0f);
+		}
+
+		if (p == end)
+			return TRS80_OK;
+		if (*p != ' ' && *p != '\t') {
+			ret = TRS80_E_SEPARATOR;
+			goto bad;
+		}
+		line.sep = *p++;
+
+		line.text = (const char *)p;
+		line.len = trs80_k.find(p, end - p, EOLCHAR);
+		line.terminated = (p + line.len < end);
+		p += line.len + line.terminated;
+
+		if (v->line && (ret = v->line(arg, &line)))
+			return ret;
+	}
+
+	return TRS80_OK;
+
+bad:
+	if (err) {
+		err->offset = p - (const unsigned char *)buf;
+		err->byte = *p;
+	}
+
+	return ret;
+}
+
+
+/*
+ * Text to EDTASM.
+ */
+
+size_t
+trs80_edtasm_encode_bound(size_t len)
+{
+	/* The header, and at worst a 7 byte line for each newline. */
+	return 7 + 7 * (len + 1) + 1;
+}
+
+
+/* The length of a leading "nnnnn" and separator, or 0 if none. */
+static size_t
+text_linenum(const unsigned char *p, size_t len, unsigned long *linenum)
+{
+	size_t	i;
+
+	if (len < 6 || (p[5] != ' ' && p[5] != '\t'))
+		return 0;
+
+	*linenum = 0;
+	for (i = 0; i < 5; ++i) {
+		if (p[i] < '0' || p[i] > '9')
+			return 0;
+		*linenum = *linenum * 10 + (p[i] - '0');
+	}
+
+	return 6;
+}
+
+
+int
+trs80_edtasm_encode(const void *in, size_t inlen, const char *name,
+		    unsigned int flags, void *out, size_t *outlen,
+		    struct trs80_error *err)
+{
+	const unsigned char	*p = in, *end = p + inlen;
+	unsigned char		*op = out;
+	unsigned long		last = 0;
+	size_t			n;
+	int			ret = TRS80_OK;
+
+	/* The header edtasmcvt -f puts out names the file. */
+	n = sizeof(FNAME_PREFIX) - 1;
+	if (inlen > n && !memcmp(p, FNAME_PREFIX, n)) {
+		const unsigned char	*nl;
+
+		p += n;
+		nl = p + trs80_k.find(p, end - p, '\n');
+		if (!name) {
+			*op++ = HEADERCHAR;
+			for (n = 0; n < 6; ++n)
+				*op++ = p + n < nl && p[n] != '\r' ?
+					p[n] : ' ';
+		}
+		p = nl + (nl < end);
+		if (p < end && *p == '\r')
+			++p;
+		if (p < end && *p == '\n')
+			++p;
+	}
+	if (name) {
+		*op++ = HEADERCHAR;
+		for (n = 0; n < 6; ++n) {
+			int	ch = *name ? *name++ : ' ';
+
+			*op++ = ch >= 'a' && ch <= 'z' ? ch - 'a' + 'A' : ch;
+		}
+	}
+
+	while (p < end) {
+		unsigned long	linenum;
+		size_t		len = trs80_k.find(p, end - p, '\n');
+		size_t		i, skip;
+
+		n = len < (size_t)(end - p) ? len + 1 : len;
+		if (len > 0 && p[len - 1] == '\r')
+			--len;
+
+		if ((skip = text_linenum(p, len, &linenum)) == 0)
+			linenum = last + 10;
+		if (linenum > 99999) {
+			ret = TRS80_E_LINENUM;
+			break;
+		}
+		last = linenum;
+
+		for (i = 5; i-- > 0; linenum /= 10)
+			op[i] = 0xb0 + linenum % 10;
+		op[5] = flags & TRS80_EDTASM_NEWER ? '\t' : ' ';
+		op += 6;
+
+		for (i = skip; i < len; ++i) {
+			if (p[i] >= 0x80 || p[i] == EOLCHAR ||
+			    p[i] == EOFCHAR) {
+				ret = TRS80_E_FORMAT;
+				break;
+			}
+			*op++ = p[i];
+		}
+		if (ret != TRS80_OK) {
+			p += i;
+			break;
+		}
+		*op++ = EOLCHAR;
+		p += n;
+	}
+
+	if (ret != TRS80_OK) {
+		if (err) {
+			err->offset = p - (const unsigned char *)in;
+			err->byte = p < end ? *p : -1;
+		}
+		return ret;
+	}
+
+	*op++ = EOFCHAR;
+	*outlen = op - (unsigned char *)out;
+
+	return TRS80_OK;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Load Intel HEX files into memory images.
+ *
+ * Each record is a line ":LLAAAATTDD...CC" of hex digits: LL data
+ * bytes for address AAAA, record type TT, the data, and a checksum
+ * making the bytes sum to zero.  Types 00 (data) and 01 (end of file)
+ * are all an 8080 or Z80 assembler needs; 02 and 04 set the upper bits
+ * of addresses for bigger machines and 03 and 05 give a start address,
+ * which are taken as long as everything stays within 64K.  Lines
+ * may end in CR LF or LF, and empty lines are passed over.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	MAX_DATA	255
+
+
+enum ihex_type {
+	IHEX_DATA,
+	IHEX_EOF,
+	IHEX_SEGMENT,		/* Extended segment address */
+	IHEX_START_SEGMENT,
+	IHEX_LINEAR,		/* Extended linear address */
+	IHEX_START_LINEAR
+};
+
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+
+/* The byte in hex at p, or -1. */
+static int
+hexbyte(const unsigned char *p)
+{
+	int	hi = hexval(p[0]), lo = hexval(p[1]);
+
+	return hi < 0 || lo < 0 ? -1 : hi << 4 | lo;
+}
+
+
+static int
+fail(struct trs80_error *err, int status, size_t offset, int byte)
+{
+	if (err) {
+		err->offset = offset;
+		err->byte = byte;
+	}
+
+	return status;
+}
+
+
+int
+trs80_ihex_load(struct trs80_image *img, const void *buf, size_t len,
+		struct trs80_error *err)
+{
+	const unsigned char	*base = buf;
+	unsigned char		rec[4 + MAX_DATA + 1];
+	unsigned long		upper = 0, addr;
+	size_t			pos = 0, end, n, i;
+	int			b, sum;
+
+	while (pos < len) {
+		const unsigned char	*p = base + pos;
+		const unsigned char	*nl = memchr(p, '\n', len - pos);
+
+		end = nl ? (size_t)(nl - base) : len;
+		n = end - pos;
+		if (n > 0 && p[n - 1] == '\r')
+			--n;
+		if (n == 0) {
+			pos = end + 1;
+			continue;
+		}
+
+		/* ':' then pairs of digits, at least the five bytes every
+		 * record has and as many as its length byte says. */
+		if (p[0] != ':' || n < 11 || (n - 1) % 2)
+			return fail(err, TRS80_E_SYNTAX, pos, p[0]);
+		if ((b = hexbyte(p + 1)) < 0 || (n - 1) / 2 != 5u + b)
+			return fail(err, TRS80_E_SYNTAX, pos, p[1]);
+		for (i = 0; i < (n - 1) / 2; ++i) {
+			if ((b = hexbyte(p + 1 + 2 * i)) < 0)
+				return fail(err, TRS80_E_SYNTAX,
+					    pos + 1 + 2 * i, p[1 + 2 * i]);
+			rec[i] = (unsigned char)b;
+		}
+		for (sum = 0, i = 0; i < 5u + rec[0]; ++i)
+			sum += rec[i];
+		if (sum & 0xff)
+			return fail(err, TRS80_E_CHECKSUM, pos,
+				    rec[4 + rec[0]]);
+
+		addr = upper + (rec[1] << 8 | rec[2]);
+		switch (rec[3]) {
+		case IHEX_DATA:
+			if (addr + rec[0] > TRS80_IMAGE_SIZE)
+				return fail(err, TRS80_E_RANGE, pos, rec[3]);
+			trs80_image_load(img, (unsigned int)addr, rec + 4,
+					 rec[0]);
+			break;
+
+		case IHEX_EOF:
+			return TRS80_OK;
+
+		case IHEX_SEGMENT:
+		case IHEX_LINEAR:
+			if (rec[0] != 2)
+				return fail(err, TRS80_E_SYNTAX, pos, rec[0]);
+			upper = (unsigned long)(rec[4] << 8 | rec[5]) <<
+				(rec[3] == IHEX_SEGMENT ? 4 : 16);
+			break;
+
+		case IHEX_START_SEGMENT:
+		case IHEX_START_LINEAR:
+			if (rec[0] != 4)
+				return fail(err, TRS80_E_SYNTAX, pos, rec[0]);
+			if (rec[3] == IHEX_START_SEGMENT)
+				addr = ((unsigned long)(rec[4] << 8 | rec[5]) <<
+					4) + (rec[6] << 8 | rec[7]);
+			else
+				addr = (unsigned long)rec[4] << 24 |
+				       (unsigned long)rec[5] << 16 |
+				       rec[6] << 8 | rec[7];
+			if (addr >= TRS80_IMAGE_SIZE)
+				return fail(err, TRS80_E_RANGE, pos, rec[3]);
+			img->has_xfer = 1;
+			img->xfer_addr = (unsigned int)addr;
+			break;
+
+		default:
+			return fail(err, TRS80_E_HEADER, pos, rec[3]);
+		}
+
+		pos = end + 1;
+	}
+
+	return TRS80_OK;
+}
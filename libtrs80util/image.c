@@ -0,0 +1,238 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * 64K memory images of loaded programs, and comparing them.
+ *
+ * The comparison goes 64 addresses at a time.  A group's loaded bits
+ * from each image and the mask of bytes that differ, from a vector
+ * compare, give a 64 bit mask for each kind of range; where both images
+ * have all of the group loaded and the same, or neither has any, the
+ * whole group extends the current range at once, and otherwise the
+ * group's runs are read off the masks a run at a time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trs80util.h"
+#include "kernels.h"
+
+
+#define	GROUP		64
+
+
+void
+trs80_image_clear(struct trs80_image *img)
+{
+	memset(img->loaded, 0, sizeof(img->loaded));
+	img->has_xfer = 0;
+	img->xfer_addr = 0;
+}
+
+
+/* Mark [addr, addr + n) loaded, within the image. */
+static void
+mark(struct trs80_image *img, unsigned int addr, size_t n)
+{
+	for (; n > 0 && (addr & 7); ++addr, --n)
+		img->loaded[addr >> 3] |= 1 << (addr & 7);
+
+	memset(&img->loaded[addr >> 3], 0xff, n >> 3);
+	addr += n & ~(size_t)7;
+
+	for (n &= 7; n > 0; ++addr, --n)
+		img->loaded[addr >> 3] |= 1 << (addr & 7);
+}
+
+
+void
+trs80_image_load(struct trs80_image *img, unsigned int addr,
+		 const void *data, size_t len)
+{
+	const unsigned char	*p = data;
+
+	addr &= TRS80_IMAGE_SIZE - 1;
+
+	/* More than 64K only leaves its last 64K. */
+	if (len > TRS80_IMAGE_SIZE) {
+		p += len - TRS80_IMAGE_SIZE;
+		addr = (addr + len - TRS80_IMAGE_SIZE) &
+			(TRS80_IMAGE_SIZE - 1);
+		len = TRS80_IMAGE_SIZE;
+	}
+
+	while (len > 0) {
+		size_t	n = TRS80_IMAGE_SIZE - addr;
+
+		if (n > len)
+			n = len;
+		memcpy(&img->mem[addr], p, n);
+		mark(img, addr, n);
+		p += n;
+		len -= n;
+		addr = 0;
+	}
+}
+
+
+static int
+load_record(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct trs80_image	*img = arg;
+
+	switch (rec->type) {
+	case TRS80_CMD_LOADBLK:
+		trs80_image_load(img, rec->addr, rec->data, rec->avail);
+		break;
+
+	case TRS80_CMD_XFERADDR:
+		img->has_xfer = 1;
+		img->xfer_addr = rec->addr;
+		break;
+	}
+
+	return 0;
+}
+
+
+int
+trs80_image_cmd(struct trs80_image *img, const void *buf, size_t len,
+		struct trs80_error *err)
+{
+	return trs80_cmd_parse(buf, len, load_record, img, NULL, err);
+}
+
+
+void
+trs80_image_asm(struct trs80_image *img, const struct trs80_asm *a)
+{
+	const struct trs80_asm_block	*b;
+	size_t				i, n;
+
+	n = trs80_asm_blocks(a, &b);
+	for (i = 0; i < n; ++i)
+		trs80_image_load(img, b[i].addr, b[i].data, b[i].len);
+
+	img->has_xfer = 1;
+	if (!trs80_asm_entry(a, &img->xfer_addr))
+		img->xfer_addr = n ? b[0].addr : 0;
+}
+
+
+struct walk {
+	trs80_range_fn		fn;
+	void			*arg;
+	struct trs80_range	r;	/* Open range, len 0 if none */
+};
+
+
+/* Extend the open range by n addresses of kind, or start a new one. */
+static int
+extend(struct walk *w, int kind, unsigned int addr, unsigned int n)
+{
+	int	ret;
+
+	if (w->r.len && (w->r.kind != kind || w->r.start + w->r.len != addr)) {
+		if ((ret = w->fn(w->arg, &w->r)))
+			return ret;
+		w->r.len = 0;
+	}
+
+	if (!w->r.len) {
+		w->r.kind = kind;
+		w->r.start = addr;
+	}
+	w->r.len += n;
+
+	return 0;
+}
+
+
+/* The loaded bits of the group at addr, bit i for addr + i. */
+static uint64_t
+group_bits(const unsigned char *loaded, unsigned int addr)
+{
+	uint64_t	v = 0;
+	int		i;
+
+	for (i = GROUP / 8 - 1; i >= 0; --i)
+		v = v << 8 | loaded[(addr >> 3) + i];
+
+	return v;
+}
+
+
+static int
+ctz64(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	int	n = 0;
+
+	for (; !(v & 1); v >>= 1)
+		++n;
+	return n;
+#endif
+}
+
+
+int
+trs80_image_compare(const struct trs80_image *a, const struct trs80_image *b,
+		    trs80_range_fn fn, void *arg)
+{
+	struct walk	w;
+	unsigned int	addr, i;
+	int		ret;
+
+	w.fn = fn;
+	w.arg = arg;
+	w.r.len = 0;
+
+	for (addr = 0; addr < TRS80_IMAGE_SIZE; addr += GROUP) {
+		uint64_t	la = group_bits(a->loaded, addr);
+		uint64_t	lb = group_bits(b->loaded, addr);
+		uint64_t	both = la & lb, any = la | lb, diff = 0;
+		uint64_t	mask[4];	/* By enum trs80_range_kind */
+
+		if (any == 0)
+			continue;
+
+		if (both)
+			diff = trs80_k.diff64(&a->mem[addr], &b->mem[addr]) &
+				both;
+		if (both == ~(uint64_t)0 && diff == 0) {
+			if ((ret = extend(&w, TRS80_RANGE_SAME, addr, GROUP)))
+				return ret;
+			continue;
+		}
+
+		mask[TRS80_RANGE_SAME] = both & ~diff;
+		mask[TRS80_RANGE_DIFFER] = diff;
+		mask[TRS80_RANGE_ONLY_A] = la & ~lb;
+		mask[TRS80_RANGE_ONLY_B] = lb & ~la;
+
+		for (i = 0; i < GROUP && (any >> i); ) {
+			uint64_t	rest;
+			int		kind;
+
+			i += ctz64(any >> i);
+			for (kind = 0; !(mask[kind] >> i & 1); ++kind)
+				;
+
+			/* Ones shift in above the run unless it goes to the
+			 * end of the group from its start. */
+			rest = ~(mask[kind] >> i);
+			if ((ret = extend(&w, kind, addr + i,
+					  rest ? ctz64(rest) : GROUP - i)))
+				return ret;
+			i += rest ? ctz64(rest) : GROUP - i;
+		}
+	}
+
+	if (w.r.len)
+		return fn(arg, &w.r);
+
+	return 0;
+}
@@ -0,0 +1,968 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Byte scanning and copying kernels, the sample scanning ones for
+ * cassette audio and a byte compare for memory images, with runtime
+ * CPU dispatch.
+ *
+ * Every variant is compiled into every build, the SIMD ones with
+ * per-function target attributes, so one binary per architecture
+ * still runs at full speed on newer CPUs.  A constructor picks the
+ * best the CPU and OS support before main() runs; until then, and on
+ * other architectures, the portable versions are used.  Setting
+ * TRS80_CPU to one of the variant names caps the choice, which is
+ * handy for testing and benchmarking.
+ *
+ * SSE4.2 is detected and reported but has no variant of its own:
+ * PCMPESTRI is slower than PCMPEQB for finding a single byte value.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trs80util.h"
+#include "kernels.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define	KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define	KERNELS_NEON
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+
+/*
+ * Portable versions, a word at a time.
+ */
+
+#define	ONES	((uint64_t)0x0101010101010101ULL)
+#define	HIGHS	((uint64_t)0x8080808080808080ULL)
+#define	HAS_ZERO(x)	(((x) - ONES) & ~(x) & HIGHS)
+
+static size_t
+copy_until_generic(unsigned char *dst, const unsigned char *src, size_t n,
+		   int c)
+{
+	uint64_t	pat = ONES * (unsigned char)c;
+	size_t		i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint64_t	w;
+
+		memcpy(&w, src + i, 8);
+		if (HAS_ZERO(w ^ pat))
+			break;
+		memcpy(dst + i, &w, 8);
+	}
+
+	for (; i < n && src[i] != c; ++i)
+		dst[i] = src[i];
+
+	return i;
+}
+
+
+static size_t
+find_generic(const unsigned char *p, size_t n, int c)
+{
+	const unsigned char	*q = memchr(p, c, n);
+
+	return q ? (size_t)(q - p) : n;
+}
+
+
+/* The bytes that can start a CMD file or an EDTASM file's header, and
+ * EDTASM line number digits.  See find_sig in kernels.h. */
+#define	SIG_BYTE(c)	((c) == 0x01 || (c) == 0x05 || (c) == 0x1f || \
+			 (c) == 0xd3)
+#define	SIG_DIGIT(c)	((unsigned char)((c) - 0xb0) <= 9)
+#define	SIG_RUN		5
+
+static size_t
+find_sig_generic(const unsigned char *p, size_t n)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i) {
+		if (SIG_BYTE(p[i]))
+			return i;
+		if (SIG_DIGIT(p[i]) && i + SIG_RUN <= n &&
+		    SIG_DIGIT(p[i + 1]) && SIG_DIGIT(p[i + 2]) &&
+		    SIG_DIGIT(p[i + 3]) && SIG_DIGIT(p[i + 4]))
+			return i;
+	}
+
+	return n;
+}
+
+
+static size_t
+find_outside_generic(const short *p, size_t n, int lo, int hi)
+{
+	size_t	i;
+
+	for (i = 0; i < n; ++i)
+		if (p[i] < lo || p[i] > hi)
+			return i;
+
+	return n;
+}
+
+
+static void
+sample_range_generic(const short *p, size_t n, int *min, int *max)
+{
+	int	lo = p[0], hi = p[0];
+	size_t	i;
+
+	for (i = 1; i < n; ++i) {
+		if (p[i] < lo)
+			lo = p[i];
+		if (p[i] > hi)
+			hi = p[i];
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+
+static uint64_t
+diff64_generic(const unsigned char *a, const unsigned char *b)
+{
+	uint64_t	m = 0;
+	int		i, k;
+
+	for (i = 0; i < 64; i += 8) {
+		uint64_t	x, y;
+
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x == y)
+			continue;
+		for (k = i; k < i + 8; ++k)
+			if (a[k] != b[k])
+				m |= (uint64_t)1 << k;
+	}
+
+	return m;
+}
+
+
+#ifdef KERNELS_X86
+/* Clear the upper halves of the vector registers on the way out of the
+ * AVX kernels, and before they fall back to SSE for a tail.  GCC only
+ * does this itself from -O2 up, and SSE code run with dirty upper
+ * halves pays for it on every vector instruction, which costs more
+ * than the wider loads save. */
+#define	AVX_RETURN(x)	do {						\
+				size_t	r_ = (x);			\
+									\
+				_mm256_zeroupper();			\
+				return r_;				\
+			} while (0)
+
+__attribute__((target("sse2")))
+static size_t
+copy_until_sse2(unsigned char *dst, const unsigned char *src, size_t n,
+		int c)
+{
+	const __m128i	pat = _mm_set1_epi8((char)c);
+	size_t		i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i		v = _mm_loadu_si128((const __m128i *)(src + i));
+		unsigned int	m;
+
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pat));
+		if (m) {
+			memcpy(dst + i, src + i, __builtin_ctz(m));
+			return i + __builtin_ctz(m);
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+
+	return i + copy_until_generic(dst + i, src + i, n - i, c);
+}
+
+
+__attribute__((target("sse2")))
+static size_t
+find_sse2(const unsigned char *p, size_t n, int c)
+{
+	const __m128i	pat = _mm_set1_epi8((char)c);
+	size_t		i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i		v = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned int	m;
+
+		if ((m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pat))))
+			return i + __builtin_ctz(m);
+	}
+
+	return i + find_generic(p + i, n - i, c);
+}
+
+
+/* Lanes of v that are line number digits, 0xB0 to 0xB9. */
+#define	DIGITS_SSE2(v) \
+	_mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8((v), b0), nine), \
+		       _mm_sub_epi8((v), b0))
+
+/* The signature bytes are compared for directly; a run of digits is
+ * the AND of the digit lanes of five loads a byte apart. */
+__attribute__((target("sse2")))
+static size_t
+find_sig_sse2(const unsigned char *p, size_t n)
+{
+	const __m128i	c01 = _mm_set1_epi8(0x01), c05 = _mm_set1_epi8(0x05);
+	const __m128i	c1f = _mm_set1_epi8(0x1f);
+	const __m128i	cd3 = _mm_set1_epi8((char)0xd3);
+	const __m128i	b0 = _mm_set1_epi8((char)0xb0), nine = _mm_set1_epi8(9);
+	size_t		i = 0;
+
+	for (; i + 16 + SIG_RUN - 1 <= n; i += 16) {
+		const __m128i	*q = (const __m128i *)(p + i);
+		__m128i		v = _mm_loadu_si128(q), m, d;
+		unsigned int	bits;
+
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c01),
+					      _mm_cmpeq_epi8(v, c05)),
+				 _mm_or_si128(_mm_cmpeq_epi8(v, c1f),
+					      _mm_cmpeq_epi8(v, cd3)));
+		d = DIGITS_SSE2(v);
+		if (_mm_movemask_epi8(d)) {
+			__m128i	w;
+
+			w = _mm_loadu_si128((const __m128i *)(p + i + 1));
+			d = _mm_and_si128(d, DIGITS_SSE2(w));
+			w = _mm_loadu_si128((const __m128i *)(p + i + 2));
+			d = _mm_and_si128(d, DIGITS_SSE2(w));
+			w = _mm_loadu_si128((const __m128i *)(p + i + 3));
+			d = _mm_and_si128(d, DIGITS_SSE2(w));
+			w = _mm_loadu_si128((const __m128i *)(p + i + 4));
+			d = _mm_and_si128(d, DIGITS_SSE2(w));
+			m = _mm_or_si128(m, d);
+		}
+		if ((bits = _mm_movemask_epi8(m)))
+			return i + __builtin_ctz(bits);
+	}
+
+	return i + find_sig_generic(p + i, n - i);
+}
+
+
+/* Two mask bits per 16 bit lane. */
+__attribute__((target("sse2")))
+static size_t
+find_outside_sse2(const short *p, size_t n, int lo, int hi)
+{
+	const __m128i	vlo = _mm_set1_epi16((short)lo);
+	const __m128i	vhi = _mm_set1_epi16((short)hi);
+	size_t		i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i		v = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned int	m;
+
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi16(v, vlo),
+						   _mm_cmpgt_epi16(v, vhi)));
+		if (m)
+			return i + (__builtin_ctz(m) >> 1);
+	}
+
+	return i + find_outside_generic(p + i, n - i, lo, hi);
+}
+
+
+/* Fold the eight lanes of lo and hi down to one. */
+__attribute__((target("sse2")))
+static void
+range_fold_sse2(__m128i lo, __m128i hi, int *min, int *max)
+{
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 8));
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 4));
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 2));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 8));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 4));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 2));
+
+	*min = (short)_mm_extract_epi16(lo, 0);
+	*max = (short)_mm_extract_epi16(hi, 0);
+}
+
+
+__attribute__((target("sse2")))
+static void
+sample_range_sse2(const short *p, size_t n, int *min, int *max)
+{
+	__m128i	lo, hi;
+	size_t	i;
+	int	tmin, tmax;
+
+	if (n < 8) {
+		sample_range_generic(p, n, min, max);
+		return;
+	}
+
+	lo = hi = _mm_loadu_si128((const __m128i *)p);
+	for (i = 8; i + 8 <= n; i += 8) {
+		__m128i	v = _mm_loadu_si128((const __m128i *)(p + i));
+
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+	}
+	range_fold_sse2(lo, hi, min, max);
+
+	if (i < n) {
+		sample_range_generic(p + i, n - i, &tmin, &tmax);
+		if (tmin < *min)
+			*min = tmin;
+		if (tmax > *max)
+			*max = tmax;
+	}
+}
+
+
+__attribute__((target("sse2")))
+static uint64_t
+diff64_sse2(const unsigned char *a, const unsigned char *b)
+{
+	uint64_t	m = 0;
+	int		i;
+
+	for (i = 0; i < 64; i += 16) {
+		__m128i		x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i		y = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned int	eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+		m |= (uint64_t)(~eq & 0xffff) << i;
+	}
+
+	return m;
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+copy_until_avx2(unsigned char *dst, const unsigned char *src, size_t n,
+		int c)
+{
+	const __m256i	pat = _mm256_set1_epi8((char)c);
+	size_t		i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i		v = _mm256_loadu_si256((const __m256i *)
+							(src + i));
+		unsigned int	m;
+
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat));
+		if (m) {
+			memcpy(dst + i, src + i, __builtin_ctz(m));
+			AVX_RETURN(i + __builtin_ctz(m));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+
+	_mm256_zeroupper();
+	return i + copy_until_sse2(dst + i, src + i, n - i, c);
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+find_avx2(const unsigned char *p, size_t n, int c)
+{
+	const __m256i	pat = _mm256_set1_epi8((char)c);
+	size_t		i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		unsigned int	m;
+
+		if ((m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat))))
+			AVX_RETURN(i + __builtin_ctz(m));
+	}
+
+	_mm256_zeroupper();
+	return i + find_sse2(p + i, n - i, c);
+}
+
+
+#define	DIGITS_AVX2(v) \
+	_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8((v), b0), nine), \
+			  _mm256_sub_epi8((v), b0))
+
+__attribute__((target("avx2")))
+static size_t
+find_sig_avx2(const unsigned char *p, size_t n)
+{
+	const __m256i	c01 = _mm256_set1_epi8(0x01);
+	const __m256i	c05 = _mm256_set1_epi8(0x05);
+	const __m256i	c1f = _mm256_set1_epi8(0x1f);
+	const __m256i	cd3 = _mm256_set1_epi8((char)0xd3);
+	const __m256i	b0 = _mm256_set1_epi8((char)0xb0);
+	const __m256i	nine = _mm256_set1_epi8(9);
+	size_t		i = 0;
+
+	for (; i + 32 + SIG_RUN - 1 <= n; i += 32) {
+		__m256i		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i		m, d;
+		unsigned int	bits;
+
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c01),
+						    _mm256_cmpeq_epi8(v, c05)),
+				    _mm256_or_si256(_mm256_cmpeq_epi8(v, c1f),
+						    _mm256_cmpeq_epi8(v, cd3)));
+		d = DIGITS_AVX2(v);
+		if (_mm256_movemask_epi8(d)) {
+			int	k;
+
+			for (k = 1; k < SIG_RUN; ++k) {
+				__m256i	w = _mm256_loadu_si256(
+					(const __m256i *)(p + i + k));
+
+				d = _mm256_and_si256(d, DIGITS_AVX2(w));
+			}
+			m = _mm256_or_si256(m, d);
+		}
+		if ((bits = _mm256_movemask_epi8(m)))
+			AVX_RETURN(i + __builtin_ctz(bits));
+	}
+
+	_mm256_zeroupper();
+	return i + find_sig_sse2(p + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+find_outside_avx2(const short *p, size_t n, int lo, int hi)
+{
+	const __m256i	vlo = _mm256_set1_epi16((short)lo);
+	const __m256i	vhi = _mm256_set1_epi16((short)hi);
+	size_t		i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		unsigned int	m;
+
+		m = _mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpgt_epi16(vlo, v),
+				_mm256_cmpgt_epi16(v, vhi)));
+		if (m)
+			AVX_RETURN(i + (__builtin_ctz(m) >> 1));
+	}
+
+	_mm256_zeroupper();
+	return i + find_outside_sse2(p + i, n - i, lo, hi);
+}
+
+
+__attribute__((target("avx2")))
+static void
+sample_range_avx2(const short *p, size_t n, int *min, int *max)
+{
+	__m256i	lo, hi;
+	__m128i	lo4, hi4;
+	size_t	i;
+	int	tmin, tmax;
+
+	if (n < 16) {
+		sample_range_sse2(p, n, min, max);
+		return;
+	}
+
+	lo = hi = _mm256_loadu_si256((const __m256i *)p);
+	for (i = 16; i + 16 <= n; i += 16) {
+		__m256i	v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+		lo = _mm256_min_epi16(lo, v);
+		hi = _mm256_max_epi16(hi, v);
+	}
+	lo = _mm256_min_epi16(lo, _mm256_permute2x128_si256(lo, lo, 1));
+	hi = _mm256_max_epi16(hi, _mm256_permute2x128_si256(hi, hi, 1));
+	lo4 = _mm256_castsi256_si128(lo);
+	hi4 = _mm256_castsi256_si128(hi);
+	_mm256_zeroupper();
+	range_fold_sse2(lo4, hi4, min, max);
+
+	if (i < n) {
+		sample_range_sse2(p + i, n - i, &tmin, &tmax);
+		if (tmin < *min)
+			*min = tmin;
+		if (tmax > *max)
+			*max = tmax;
+	}
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t
+diff64_avx2(const unsigned char *a, const unsigned char *b)
+{
+	__m256i		x0 = _mm256_loadu_si256((const __m256i *)a);
+	__m256i		y0 = _mm256_loadu_si256((const __m256i *)b);
+	__m256i		x1 = _mm256_loadu_si256((const __m256i *)(a + 32));
+	__m256i		y1 = _mm256_loadu_si256((const __m256i *)(b + 32));
+	uint64_t	eq;
+
+	eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0)) |
+	     (uint64_t)(uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(x1, y1)) << 32;
+	_mm256_zeroupper();
+
+	return ~eq;
+}
+
+
+/* Masked loads and stores handle the tail without a scalar loop. */
+__attribute__((target("avx512bw")))
+static size_t
+copy_until_avx512bw(unsigned char *dst, const unsigned char *src, size_t n,
+		    int c)
+{
+	const __m512i	pat = _mm512_set1_epi8((char)c);
+	size_t		i;
+
+	for (i = 0; i < n; i += 64) {
+		__mmask64	lanes = ~(__mmask64)0;
+		__mmask64	m;
+		__m512i		v;
+
+		if (n - i < 64)
+			lanes = ((__mmask64)1 << (n - i)) - 1;
+
+		v = _mm512_maskz_loadu_epi8(lanes, src + i);
+		m = _mm512_mask_cmpeq_epi8_mask(lanes, v, pat);
+		if (m) {
+			lanes = ((__mmask64)1 << __builtin_ctzll(m)) - 1;
+			_mm512_mask_storeu_epi8(dst + i, lanes, v);
+			AVX_RETURN(i + __builtin_ctzll(m));
+		}
+		_mm512_mask_storeu_epi8(dst + i, lanes, v);
+	}
+
+	AVX_RETURN(n);
+}
+
+
+__attribute__((target("avx512bw")))
+static size_t
+find_avx512bw(const unsigned char *p, size_t n, int c)
+{
+	const __m512i	pat = _mm512_set1_epi8((char)c);
+	size_t		i;
+
+	for (i = 0; i < n; i += 64) {
+		__mmask64	lanes = ~(__mmask64)0;
+		__mmask64	m;
+
+		if (n - i < 64)
+			lanes = ((__mmask64)1 << (n - i)) - 1;
+
+		m = _mm512_mask_cmpeq_epi8_mask(lanes,
+				_mm512_maskz_loadu_epi8(lanes, p + i), pat);
+		if (m)
+			AVX_RETURN(i + __builtin_ctzll(m));
+	}
+
+	AVX_RETURN(n);
+}
+
+
+__attribute__((target("avx512bw")))
+static size_t
+find_sig_avx512bw(const unsigned char *p, size_t n)
+{
+	const __m512i	c01 = _mm512_set1_epi8(0x01);
+	const __m512i	c05 = _mm512_set1_epi8(0x05);
+	const __m512i	c1f = _mm512_set1_epi8(0x1f);
+	const __m512i	cd3 = _mm512_set1_epi8((char)0xd3);
+	const __m512i	b0 = _mm512_set1_epi8((char)0xb0);
+	const __m512i	nine = _mm512_set1_epi8(9);
+	size_t		i = 0;
+
+	for (; i + 64 + SIG_RUN - 1 <= n; i += 64) {
+		__m512i		v = _mm512_loadu_si512(p + i);
+		__mmask64	m, d;
+
+		m = _mm512_cmpeq_epi8_mask(v, c01) |
+		    _mm512_cmpeq_epi8_mask(v, c05) |
+		    _mm512_cmpeq_epi8_mask(v, c1f) |
+		    _mm512_cmpeq_epi8_mask(v, cd3);
+		d = _mm512_cmple_epu8_mask(_mm512_sub_epi8(v, b0), nine);
+		if (d) {
+			int	k;
+
+			for (k = 1; k < SIG_RUN; ++k)
+				d &= _mm512_cmple_epu8_mask(_mm512_sub_epi8(
+					_mm512_loadu_si512(p + i + k), b0),
+					nine);
+			m |= d;
+		}
+		if (m)
+			AVX_RETURN(i + __builtin_ctzll(m));
+	}
+
+	return i + find_sig_avx2(p + i, n - i);
+}
+
+
+__attribute__((target("avx512bw")))
+static size_t
+find_outside_avx512bw(const short *p, size_t n, int lo, int hi)
+{
+	const __m512i	vlo = _mm512_set1_epi16((short)lo);
+	const __m512i	vhi = _mm512_set1_epi16((short)hi);
+	size_t		i;
+
+	for (i = 0; i < n; i += 32) {
+		__mmask32	lanes = ~(__mmask32)0;
+		__mmask32	m;
+		__m512i		v;
+
+		if (n - i < 32)
+			lanes = ((__mmask32)1 << (n - i)) - 1;
+
+		v = _mm512_maskz_loadu_epi16(lanes, p + i);
+		m = _mm512_mask_cmplt_epi16_mask(lanes, v, vlo) |
+		    _mm512_mask_cmpgt_epi16_mask(lanes, v, vhi);
+		if (m)
+			AVX_RETURN(i + __builtin_ctz(m));
+	}
+
+	AVX_RETURN(n);
+}
+
+
+__attribute__((target("avx512bw")))
+static void
+sample_range_avx512bw(const short *p, size_t n, int *min, int *max)
+{
+	__m512i	lo, hi;
+	__m256i	lo2, hi2;
+	__m128i	lo4, hi4;
+	size_t	i;
+	int	tmin, tmax;
+
+	if (n < 32) {
+		sample_range_avx2(p, n, min, max);
+		return;
+	}
+
+	lo = hi = _mm512_loadu_si512(p);
+	for (i = 32; i + 32 <= n; i += 32) {
+		__m512i	v = _mm512_loadu_si512(p + i);
+
+		lo = _mm512_min_epi16(lo, v);
+		hi = _mm512_max_epi16(hi, v);
+	}
+	lo2 = _mm256_min_epi16(_mm512_castsi512_si256(lo),
+			       _mm512_extracti64x4_epi64(lo, 1));
+	hi2 = _mm256_max_epi16(_mm512_castsi512_si256(hi),
+			       _mm512_extracti64x4_epi64(hi, 1));
+	lo2 = _mm256_min_epi16(lo2, _mm256_permute2x128_si256(lo2, lo2, 1));
+	hi2 = _mm256_max_epi16(hi2, _mm256_permute2x128_si256(hi2, hi2, 1));
+	lo4 = _mm256_castsi256_si128(lo2);
+	hi4 = _mm256_castsi256_si128(hi2);
+	_mm256_zeroupper();
+	range_fold_sse2(lo4, hi4, min, max);
+
+	if (i < n) {
+		sample_range_avx2(p + i, n - i, &tmin, &tmax);
+		if (tmin < *min)
+			*min = tmin;
+		if (tmax > *max)
+			*max = tmax;
+	}
+}
+
+
+__attribute__((target("avx512bw")))
+static uint64_t
+diff64_avx512bw(const unsigned char *a, const unsigned char *b)
+{
+	uint64_t	m;
+
+	m = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a),
+				    _mm512_loadu_si512(b));
+	_mm256_zeroupper();
+
+	return m;
+}
+#endif
+
+
+#ifdef KERNELS_NEON
+/* A 64 bit mask with 4 bits per byte lane of a comparison result. */
+static inline uint64_t
+neon_mask(uint8x16_t eq)
+{
+	uint8x8_t	nib = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+
+	return vget_lane_u64(vreinterpret_u64_u8(nib), 0);
+}
+
+
+static size_t
+copy_until_neon(unsigned char *dst, const unsigned char *src, size_t n,
+		int c)
+{
+	const uint8x16_t	pat = vdupq_n_u8((uint8_t)c);
+	size_t			i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t	v = vld1q_u8(src + i);
+		uint64_t	m = neon_mask(vceqq_u8(v, pat));
+
+		if (m) {
+			memcpy(dst + i, src + i, __builtin_ctzll(m) >> 2);
+			return i + (__builtin_ctzll(m) >> 2);
+		}
+		vst1q_u8(dst + i, v);
+	}
+
+	return i + copy_until_generic(dst + i, src + i, n - i, c);
+}
+
+
+static size_t
+find_neon(const unsigned char *p, size_t n, int c)
+{
+	const uint8x16_t	pat = vdupq_n_u8((uint8_t)c);
+	size_t			i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint64_t	m = neon_mask(vceqq_u8(vld1q_u8(p + i), pat));
+
+		if (m)
+			return i + (__builtin_ctzll(m) >> 2);
+	}
+
+	return i + find_generic(p + i, n - i, c);
+}
+
+
+static size_t
+find_sig_neon(const unsigned char *p, size_t n)
+{
+	const uint8x16_t	b0 = vdupq_n_u8(0xb0), nine = vdupq_n_u8(9);
+	size_t			i = 0;
+
+	for (; i + 16 + SIG_RUN - 1 <= n; i += 16) {
+		uint8x16_t	v = vld1q_u8(p + i), m, d;
+		uint64_t	bits;
+		int		k;
+
+		m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x01)),
+				      vceqq_u8(v, vdupq_n_u8(0x05))),
+			     vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x1f)),
+				      vceqq_u8(v, vdupq_n_u8(0xd3))));
+		d = vcleq_u8(vsubq_u8(v, b0), nine);
+		if (neon_mask(d)) {
+			for (k = 1; k < SIG_RUN; ++k)
+				d = vandq_u8(d, vcleq_u8(vsubq_u8(
+					vld1q_u8(p + i + k), b0), nine));
+			m = vorrq_u8(m, d);
+		}
+		if ((bits = neon_mask(m)))
+			return i + (__builtin_ctzll(bits) >> 2);
+	}
+
+	return i + find_sig_generic(p + i, n - i);
+}
+
+
+static size_t
+find_outside_neon(const short *p, size_t n, int lo, int hi)
+{
+	const int16x8_t	vlo = vdupq_n_s16((short)lo);
+	const int16x8_t	vhi = vdupq_n_s16((short)hi);
+	size_t		i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		int16x8_t	v = vld1q_s16(p + i);
+		uint64_t	m;
+
+		m = neon_mask(vreinterpretq_u8_u16(vorrq_u16(
+				vcltq_s16(v, vlo), vcgtq_s16(v, vhi))));
+		if (m)
+			return i + (__builtin_ctzll(m) >> 3);
+	}
+
+	return i + find_outside_generic(p + i, n - i, lo, hi);
+}
+
+
+static void
+sample_range_neon(const short *p, size_t n, int *min, int *max)
+{
+	int16x8_t	lo, hi;
+	size_t		i;
+	int		tmin, tmax;
+
+	if (n < 8) {
+		sample_range_generic(p, n, min, max);
+		return;
+	}
+
+	lo = hi = vld1q_s16(p);
+	for (i = 8; i + 8 <= n; i += 8) {
+		int16x8_t	v = vld1q_s16(p + i);
+
+		lo = vminq_s16(lo, v);
+		hi = vmaxq_s16(hi, v);
+	}
+	*min = vminvq_s16(lo);
+	*max = vmaxvq_s16(hi);
+
+	if (i < n) {
+		sample_range_generic(p + i, n - i, &tmin, &tmax);
+		if (tmin < *min)
+			*min = tmin;
+		if (tmax > *max)
+			*max = tmax;
+	}
+}
+
+
+/* Each differing lane keeps its own bit of a byte, and the eight lanes
+ * of each half add up to that half's mask. */
+static uint64_t
+diff64_neon(const unsigned char *a, const unsigned char *b)
+{
+	static const uint8_t	bit[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+	};
+	const uint8x16_t	weights = vld1q_u8(bit);
+	uint64_t		m = 0;
+	int			i;
+
+	for (i = 0; i < 64; i += 16) {
+		uint8x16_t	eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		uint8x16_t	ne = vandq_u8(vmvnq_u8(eq), weights);
+
+		m |= (uint64_t)vaddv_u8(vget_low_u8(ne)) << i |
+		     (uint64_t)vaddv_u8(vget_high_u8(ne)) << (i + 8);
+	}
+
+	return m;
+}
+#endif
+
+
+/* Best first.  Each needs all of its features. */
+static const struct kernel_set {
+	struct trs80_kernels	k;
+	unsigned int		needs;
+} Kernel_Sets[] = {
+#ifdef KERNELS_X86
+	{ { "avx512bw", copy_until_avx512bw, find_avx512bw,
+	    find_sig_avx512bw, find_outside_avx512bw,
+	    sample_range_avx512bw, diff64_avx512bw }, TRS80_CPU_AVX512BW },
+	{ { "avx2", copy_until_avx2, find_avx2, find_sig_avx2,
+	    find_outside_avx2, sample_range_avx2, diff64_avx2 },
+	  TRS80_CPU_AVX2 },
+	{ { "sse2", copy_until_sse2, find_sse2, find_sig_sse2,
+	    find_outside_sse2, sample_range_sse2, diff64_sse2 },
+	  TRS80_CPU_SSE2 },
+#endif
+#ifdef KERNELS_NEON
+	{ { "neon", copy_until_neon, find_neon, find_sig_neon,
+	    find_outside_neon, sample_range_neon, diff64_neon },
+	  TRS80_CPU_NEON },
+#endif
+	{ { "generic", copy_until_generic, find_generic, find_sig_generic,
+	    find_outside_generic, sample_range_generic, diff64_generic }, 0 }
+};
+
+#define	NSETS	(sizeof(Kernel_Sets) / sizeof(Kernel_Sets[0]))
+
+struct trs80_kernels	trs80_k = { "generic", copy_until_generic,
+				    find_generic, find_sig_generic,
+				    find_outside_generic,
+				    sample_range_generic, diff64_generic };
+
+static unsigned int	Cpu_Features;
+
+
+static unsigned int
+detect_features(void)
+{
+	unsigned int	f = 0;
+
+#ifdef KERNELS_X86
+	/* These also check the OS saves the wider registers. */
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		f |= TRS80_CPU_SSE2;
+	if (__builtin_cpu_supports("sse4.2"))
+		f |= TRS80_CPU_SSE42;
+	if (__builtin_cpu_supports("avx2"))
+		f |= TRS80_CPU_AVX2;
+	if (__builtin_cpu_supports("avx512bw"))
+		f |= TRS80_CPU_AVX512BW;
+#endif
+
+#ifdef KERNELS_NEON
+#if defined(__linux__) && defined(HWCAP_ASIMD)
+	if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+		f |= TRS80_CPU_NEON;
+#else
+	f |= TRS80_CPU_NEON;		/* Part of the base ARMv8-A ISA */
+#endif
+#endif
+
+	return f;
+}
+
+
+__attribute__((constructor))
+static void
+kernels_init(void)
+{
+	const char	*cap = getenv("TRS80_CPU");
+	size_t		i;
+
+	Cpu_Features = detect_features();
+
+	/* Skip past anything better than the cap. */
+	for (i = 0; cap && i < NSETS; ++i)
+		if (!strcmp(cap, Kernel_Sets[i].k.name))
+			break;
+	if (!cap || i == NSETS)
+		i = 0;
+
+	for (; i < NSETS; ++i) {
+		unsigned int	needs = Kernel_Sets[i].needs;
+
+		if ((Cpu_Features & needs) == needs) {
+			trs80_k = Kernel_Sets[i].k;
+			break;
+		}
+	}
+}
+
+
+unsigned int
+trs80_cpu_features(void)
+{
+	return Cpu_Features;
+}
+
+
+const char *
+trs80_kernels_name(void)
+{
+	return trs80_k.name;
+}
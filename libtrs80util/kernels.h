@@ -0,0 +1,46 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Byte and sample scanning kernels, picked at load time for the CPU
+ * the library runs on.  Internal to the library.
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct trs80_kernels {
+	const char	*name;
+
+	/* Copy src to dst up to but not including the first byte c.
+	 * Returns the number of bytes copied, n if there is no c. */
+	size_t	(*copy_until)(unsigned char *dst, const unsigned char *src,
+			      size_t n, int c);
+
+	/* Offset of the first byte c in p, n if there is none. */
+	size_t	(*find)(const unsigned char *p, size_t n, int c);
+
+	/* Offset of the first byte in p that may start a file for
+	 * carving: 0x01, 0x05 or 0x1F for a CMD file, 0xD3 for an EDTASM
+	 * header, or the first of five EDTASM line number digits
+	 * (0xB0-0xB9) all within n.  n if there is none. */
+	size_t	(*find_sig)(const unsigned char *p, size_t n);
+
+	/* Offset of the first sample in p below lo or above hi, n if
+	 * there is none.  lo and hi are within the range of a short. */
+	size_t	(*find_outside)(const short *p, size_t n, int lo, int hi);
+
+	/* The smallest and largest of n > 0 samples. */
+	void	(*sample_range)(const short *p, size_t n, int *min,
+				int *max);
+
+	/* Which of the 64 bytes at a and b differ, bit i for a[i]. */
+	uint64_t (*diff64)(const unsigned char *a, const unsigned char *b);
+};
+
+extern struct trs80_kernels	trs80_k;
+
+#endif
@@ -0,0 +1,2 @@
+# The library's objects, for the utilities that build its sources in.
+lib_objs = edtasm.o cmd.o util.o kernels.o asm.o image.o z80.o snapshot.o carving.o cassette.o diskimage.o disasm.o packer.o ihex.o patcher.o
@@ -0,0 +1,481 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Self-extracting CMD files.
+ *
+ * The packed data is a stream of tokens, each a control byte c and
+ * what follows it:
+ *
+ *	00		The end
+ *	01-7F		c literal bytes follow
+ *	80 lo hi	Carry on putting bytes at hi:lo
+ *	81-FF lo hi	Copy c - 7EH (3 to 129) bytes from hi:lo bytes back
+ *
+ * A copy reads what has already been put out, a byte at a time, so
+ * one reaching back less than its length repeats what it reaches: the
+ * Z80's LDIR does exactly that, and the depacker is little more than
+ * an LDIR for each token.  The stream starts with an 80 token for the
+ * first range of addresses the image loads and has another for each
+ * range after; copies don't reach back out of their range.
+ *
+ * Tokens are chosen by optimal parsing: with the longest match at each
+ * position found through hash chains, the cheapest way to the end of
+ * a range is worked out backwards from there, a literal run being a
+ * byte dearer than its literals and a copy always three bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	USER_LOW	0x5200		/* Where DOS leaves memory free */
+#define	DOS_STACK	0x41e0		/* Where it leaves the stack */
+#define	STACK_USE	12		/* The program's return address and
+					 * what the depacker pushes */
+
+#define	MIN_MATCH	4		/* Shorter ones save nothing */
+#define	MAX_MATCH	129
+#define	MAX_RUN		127		/* Literals in a token */
+#define	CHAIN		256		/* Matches tried at each position */
+
+#define	HASH_BITS	13
+#define	HASH_SIZE	(1 << HASH_BITS)
+
+#define	NO_COST		0xffffffffu
+
+/* Where the depacker's operands are. */
+#define	STUB_DATA	5
+#define	STUB_START	59
+#define	STUB_LEN	61
+
+/*
+ * The depacker.  It keeps the registers DOS left for the program, which
+ * may look for its command line through HL, and calls nothing, and
+ * only its two operands depend on where it goes.
+ */
+static const unsigned char Stub[STUB_LEN] = {
+	0xf5, 0xc5, 0xd5, 0xe5,	/*	 PUSH AF; PUSH BC; PUSH DE; PUSH HL */
+	0x21, 0x00, 0x00,	/*	 LD HL,data */
+	0x7e,			/* NEXT: LD A,(HL) */
+	0x23,			/*	 INC HL */
+	0xd6, 0x80,		/*	 SUB 80H */
+	0x38, 0x18,		/*	 JR C,LIT */
+	0x28, 0x21,		/*	 JR Z,SEG */
+	0xc6, 0x02,		/*	 ADD A,2 */
+	0x4f,			/*	 LD C,A */
+	0x06, 0x00,		/*	 LD B,0 */
+	0x7e,			/*	 LD A,(HL) */
+	0x23,			/*	 INC HL */
+	0xe5,			/*	 PUSH HL */
+	0x66,			/*	 LD H,(HL) */
+	0x6f,			/*	 LD L,A */
+	0x7b,			/*	 LD A,E */
+	0x95,			/*	 SUB L */
+	0x6f,			/*	 LD L,A */
+	0x7a,			/*	 LD A,D */
+	0x9c,			/*	 SBC A,H */
+	0x67,			/*	 LD H,A */
+	0xed, 0xb0,		/*	 LDIR */
+	0xe1,			/*	 POP HL */
+	0x23,			/*	 INC HL */
+	0x18, 0xe2,		/*	 JR NEXT */
+	0xc6, 0x80,		/* LIT:	 ADD A,80H */
+	0x28, 0x0d,		/*	 JR Z,DONE */
+	0x4f,			/*	 LD C,A */
+	0x06, 0x00,		/*	 LD B,0 */
+	0xed, 0xb0,		/*	 LDIR */
+	0x18, 0xd7,		/*	 JR NEXT */
+	0x5e,			/* SEG:	 LD E,(HL) */
+	0x23,			/*	 INC HL */
+	0x56,			/*	 LD D,(HL) */
+	0x23,			/*	 INC HL */
+	0x18, 0xd1,		/*	 JR NEXT */
+	0xe1, 0xd1, 0xc1, 0xf1,	/* DONE: POP HL; POP DE; POP BC; POP AF */
+	0xc3, 0x00, 0x00	/*	 JP start */
+};
+
+
+struct lz {
+	int		head[HASH_SIZE];
+	int		*prev;
+	unsigned short	*mlen;		/* Longest match at each position */
+	unsigned short	*mdist;
+	unsigned int	*cost;		/* Cheapest to the end from here */
+	unsigned char	*run;		/* Literals the cheapest starts with,
+					 * 0 for a copy */
+	unsigned char	*copy;		/* Length of the cheapest copy */
+};
+
+
+static int
+lz_init(struct lz *z)
+{
+	size_t	n = TRS80_IMAGE_SIZE + 1;
+
+	z->prev = malloc(n * sizeof(*z->prev));
+	z->mlen = malloc(n * sizeof(*z->mlen));
+	z->mdist = malloc(n * sizeof(*z->mdist));
+	z->cost = malloc(n * sizeof(*z->cost));
+	z->run = malloc(n);
+	z->copy = malloc(n);
+
+	return z->prev && z->mlen && z->mdist && z->cost && z->run &&
+	       z->copy;
+}
+
+
+static void
+lz_free(struct lz *z)
+{
+	free(z->prev);
+	free(z->mlen);
+	free(z->mdist);
+	free(z->cost);
+	free(z->run);
+	free(z->copy);
+}
+
+
+static unsigned int
+hash3(const unsigned char *p)
+{
+	return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >>
+	       (32 - HASH_BITS);
+}
+
+
+/* The longest match at each position of src[0, n). */
+static void
+find_matches(struct lz *z, const unsigned char *src, size_t n)
+{
+	size_t	i;
+
+	memset(z->head, 0xff, sizeof(z->head));
+
+	for (i = 0; i < n; ++i) {
+		size_t		max = n - i < MAX_MATCH ? n - i : MAX_MATCH;
+		size_t		best = 0, dist = 0;
+		unsigned int	h;
+		int		j, depth;
+
+		z->mlen[i] = 0;
+		if (n - i < 3)
+			continue;
+
+		h = hash3(src + i);
+		for (j = z->head[h], depth = CHAIN; j >= 0 && depth-- > 0;
+		     j = z->prev[j]) {
+			const unsigned char	*a = src + j, *b = src + i;
+			size_t			len;
+
+			if (max < MIN_MATCH || a[best] != b[best])
+				continue;
+			for (len = 0; len < max && a[len] == b[len]; ++len)
+				;
+			if (len > best) {
+				best = len;
+				dist = i - j;
+				if (best == max)
+					break;
+			}
+		}
+		z->prev[i] = z->head[h];
+		z->head[h] = (int)i;
+
+		if (best >= MIN_MATCH) {
+			z->mlen[i] = (unsigned short)best;
+			z->mdist[i] = (unsigned short)dist;
+		}
+	}
+}
+
+
+/* Pack the n bytes at src, to go at addr, onto out.  Returns the
+ * bytes put out. */
+static size_t
+pack_range(struct lz *z, const unsigned char *src, size_t n,
+	   unsigned int addr, unsigned char *out)
+{
+	unsigned char	*q = out;
+	size_t		i;
+
+	find_matches(z, src, n);
+
+	z->cost[n] = 0;
+	for (i = n; i-- > 0;) {
+		unsigned int	best = NO_COST, c;
+		size_t		len, k;
+
+		for (len = MIN_MATCH; len <= z->mlen[i]; ++len)
+			if ((c = 3 + z->cost[i + len]) < best) {
+				best = c;
+				z->copy[i] = (unsigned char)len;
+			}
+
+		z->run[i] = 0;
+		for (k = 1; k <= MAX_RUN && i + k <= n; ++k)
+			if ((c = 1 + k + z->cost[i + k]) < best) {
+				best = c;
+				z->run[i] = (unsigned char)k;
+			}
+		z->cost[i] = best;
+	}
+
+	*q++ = 0x80;
+	*q++ = addr & 0xff;
+	*q++ = addr >> 8 & 0xff;
+
+	for (i = 0; i < n;) {
+		size_t	k = z->run[i];
+
+		if (k) {
+			*q++ = (unsigned char)k;
+			memcpy(q, src + i, k);
+			q += k;
+			i += k;
+		} else {
+			*q++ = (unsigned char)(0x80 + z->copy[i] - 2);
+			*q++ = z->mdist[i] & 0xff;
+			*q++ = z->mdist[i] >> 8;
+			i += z->copy[i];
+		}
+	}
+
+	return q - out;
+}
+
+
+/* Whether [addr, addr + n) is free of what img loads and its transfer
+ * address, and within 64K. */
+static int
+fits(const struct trs80_image *img, unsigned int addr, size_t n)
+{
+	size_t	i;
+
+	if (addr + n > TRS80_IMAGE_SIZE)
+		return 0;
+	if (img->xfer_addr >= addr && img->xfer_addr < addr + n)
+		return 0;
+
+	for (i = 0; i < n; ++i)
+		if (TRS80_IMAGE_LOADED(img, addr + i))
+			return 0;
+
+	return 1;
+}
+
+
+/* The lowest address from USER_LOW with n free bytes, or
+ * TRS80_PACK_ANY. */
+static unsigned int
+find_room(const struct trs80_image *img, size_t n)
+{
+	unsigned int	addr;
+	size_t		room = 0;
+
+	for (addr = USER_LOW; addr < TRS80_IMAGE_SIZE; ++addr) {
+		if (TRS80_IMAGE_LOADED(img, addr) || addr == img->xfer_addr)
+			room = 0;
+		else if (++room == n)
+			return addr + 1 - (unsigned int)n;
+	}
+
+	return TRS80_PACK_ANY;
+}
+
+
+int
+trs80_image_pack(const struct trs80_image *img, unsigned int addr,
+		 void *out, size_t *outlen)
+{
+	struct lz	z;
+	unsigned char	*buf, *p, *q = out;
+	size_t		n, left;
+	unsigned int	a, end;
+	int		ret = TRS80_OK;
+
+	if (!img->has_xfer || (addr != TRS80_PACK_ANY &&
+			       addr >= TRS80_IMAGE_SIZE))
+		return TRS80_E_INVAL;
+
+	/* Unpacking over the stack would lose the registers kept there. */
+	for (a = DOS_STACK - STACK_USE; a < DOS_STACK; ++a)
+		if (TRS80_IMAGE_LOADED(img, a))
+			return TRS80_E_RANGE;
+
+	/* Literal runs cost a byte in 127 and each range three, so the
+	 * stream can be bigger than the image by a good deal, though
+	 * never so much that the depacker still fits in. */
+	if (!(buf = malloc(STUB_LEN + TRS80_IMAGE_SIZE * 3)))
+		return TRS80_E_NOMEM;
+	if (!lz_init(&z)) {
+		lz_free(&z);
+		free(buf);
+		return TRS80_E_NOMEM;
+	}
+
+	memcpy(buf, Stub, STUB_LEN);
+	p = buf + STUB_LEN;
+	for (a = 0; a < TRS80_IMAGE_SIZE; a = end) {
+		if (!TRS80_IMAGE_LOADED(img, a)) {
+			end = a + 1;
+			continue;
+		}
+		for (end = a; end < TRS80_IMAGE_SIZE &&
+			      TRS80_IMAGE_LOADED(img, end); ++end)
+			;
+		p += pack_range(&z, img->mem + a, end - a, a, p);
+	}
+	*p++ = 0x00;
+	n = p - buf;
+	lz_free(&z);
+
+	if (addr == TRS80_PACK_ANY) {
+		if (n >= TRS80_IMAGE_SIZE ||
+		    (addr = find_room(img, n)) == TRS80_PACK_ANY) {
+			ret = TRS80_E_RANGE;
+			goto out;
+		}
+	} else if (!fits(img, addr, n)) {
+		ret = TRS80_E_RANGE;
+		goto out;
+	}
+
+	buf[STUB_DATA] = (addr + STUB_LEN) & 0xff;
+	buf[STUB_DATA + 1] = (addr + STUB_LEN) >> 8 & 0xff;
+	buf[STUB_START] = img->xfer_addr & 0xff;
+	buf[STUB_START + 1] = img->xfer_addr >> 8 & 0xff;
+
+	for (p = buf, left = n, a = addr; left > 0;) {
+		size_t	k = left > 256 ? 256 : left;
+
+		/* A length of 0, 1 or 2 means 256, 257 or 258. */
+		*q++ = 0x01;
+		*q++ = (k + 2) & 0xff;
+		*q++ = a & 0xff;
+		*q++ = a >> 8 & 0xff;
+		memcpy(q, p, k);
+		q += k;
+		p += k;
+		left -= k;
+		a += (unsigned int)k;
+	}
+	*q++ = 0x02;
+	*q++ = 2;
+	*q++ = addr & 0xff;
+	*q++ = addr >> 8 & 0xff;
+
+	*outlen = q - (unsigned char *)out;
+
+out:
+	free(buf);
+
+	return ret;
+}
+
+
+struct reader {
+	const struct trs80_image *img;
+	unsigned int	src;
+	size_t		left;		/* Bytes the stream may yet take */
+	unsigned char	done[TRS80_IMAGE_SIZE / 8];	/* Put out */
+};
+
+
+/* The next byte of the stream, if it was loaded and not since
+ * overwritten. */
+static int
+next_byte(struct reader *r)
+{
+	unsigned int	a = r->src;
+
+	if (!r->left || !TRS80_IMAGE_LOADED(r->img, a) ||
+	    r->done[a >> 3] >> (a & 7) & 1)
+		return -1;
+	r->src = a + 1;
+	--r->left;
+
+	return r->img->mem[a];
+}
+
+
+static void
+put_byte(struct trs80_image *img, struct reader *r, unsigned int *dst,
+	 unsigned int v)
+{
+	img->mem[*dst] = (unsigned char)v;
+	r->done[*dst >> 3] |= 1 << (*dst & 7);
+	*dst = (*dst + 1) & (TRS80_IMAGE_SIZE - 1);
+}
+
+
+int
+trs80_image_unpack(struct trs80_image *img, const void *buf, size_t len,
+		   struct trs80_error *err)
+{
+	struct reader	*r;
+	unsigned int	stub, dst = 0, a;
+	int		c, lo, hi, ret;
+	size_t		n;
+
+	if ((ret = trs80_image_cmd(img, buf, len, err)))
+		return ret;
+
+	stub = img->xfer_addr;
+	if (!img->has_xfer || stub + STUB_LEN >= TRS80_IMAGE_SIZE)
+		return TRS80_E_FORMAT;
+	for (n = 0; n < STUB_LEN; ++n) {
+		if (!TRS80_IMAGE_LOADED(img, stub + n))
+			return TRS80_E_FORMAT;
+		if (n == STUB_START || n == STUB_START + 1)
+			continue;
+		if (n == STUB_DATA || n == STUB_DATA + 1) {
+			if (img->mem[stub + n] != ((stub + STUB_LEN) >>
+						   (n - STUB_DATA) * 8 & 0xff))
+				return TRS80_E_FORMAT;
+		} else if (img->mem[stub + n] != Stub[n])
+			return TRS80_E_FORMAT;
+	}
+
+	if (!(r = calloc(1, sizeof(*r))))
+		return TRS80_E_NOMEM;
+	r->img = img;
+	r->src = stub + STUB_LEN;
+	r->left = TRS80_IMAGE_SIZE - r->src;
+
+	while ((c = next_byte(r)) > 0) {
+		if (c < 0x80) {
+			for (; c > 0 && (lo = next_byte(r)) >= 0; --c)
+				put_byte(img, r, &dst, lo);
+			if (c)
+				break;
+			continue;
+		}
+		if ((lo = next_byte(r)) < 0 || (hi = next_byte(r)) < 0)
+			break;
+		if (c == 0x80) {
+			dst = lo | hi << 8;
+			continue;
+		}
+		a = (dst - (lo | hi << 8)) & (TRS80_IMAGE_SIZE - 1);
+		for (c -= 0x7e; c > 0; --c) {
+			put_byte(img, r, &dst, img->mem[a]);
+			a = (a + 1) & (TRS80_IMAGE_SIZE - 1);
+		}
+	}
+
+	/* The depacker and its data were only there to be run. */
+	if (c == 0) {
+		for (a = stub; a < r->src; ++a)
+			img->loaded[a >> 3] &= ~(1 << (a & 7));
+		for (a = 0; a < TRS80_IMAGE_SIZE / 8; ++a)
+			img->loaded[a] |= r->done[a];
+		img->xfer_addr = img->mem[stub + STUB_START] |
+				 img->mem[stub + STUB_START + 1] << 8;
+	}
+	free(r);
+
+	return c == 0 ? TRS80_OK : TRS80_E_FORMAT;
+}
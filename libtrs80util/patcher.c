@@ -0,0 +1,535 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Apply LS-DOS style patches to CMD files in place.
+ *
+ * A patch file has a patch per line, as PATCH takes them:
+ *
+ *	Drr,bb=hh hh ...	Put the bytes at byte bb of record rr
+ *	Frr,bb=hh hh ...	Check the bytes there are these first
+ *	X'aaaa'=hh hh ...	Put the bytes where the program loads aaaa
+ *
+ * with the numbers in hex, the data as hex bytes or "quoted text", and
+ * blank lines and lines starting with a period passed over.  F'aaaa'
+ * checks the bytes the program loads at aaaa the same way.
+ *
+ * PATCH itself adds an X patch to the end of the file as a block of
+ * its own; here it goes into the load blocks already there, so the
+ * file keeps its size and layout and a patch to an address nothing
+ * loads is an error.  Every D and F patch must fall in load block
+ * data, never on a record header.  The load blocks are indexed twice:
+ * in file order, which is offset order, and sorted by address.  A file
+ * position or an address is then a binary search away, an address
+ * looking only at blocks starting within the 256 bytes before it.
+ * Where several blocks load an address, an X patch goes into each of
+ * them and an F patch checks the one loaded last.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "trs80util.h"
+
+
+#define	MAX_BLOCK	256		/* Load block data */
+
+
+struct patch_line {
+	int		kind;		/* 'D', 'F' or 'X' */
+	int		memory;		/* pos is an address, not an offset */
+	size_t		pos;
+	unsigned long	linenum;
+	size_t		data;		/* Of its bytes, in bytes[] */
+	size_t		len;
+};
+
+struct trs80_patch {
+	struct patch_line	*lines;
+	size_t			nlines;
+	size_t			lines_cap;
+	unsigned char		*bytes;
+	size_t			nbytes;
+	size_t			bytes_cap;
+};
+
+/* A run of load block data: where it loads and where it is. */
+struct block {
+	unsigned int	addr;
+	size_t		len;
+	size_t		off;
+};
+
+struct block_index {
+	struct block	*by_off;	/* In file order */
+	size_t		n;
+	struct block	*by_addr;	/* Sorted, wrapping blocks split */
+	size_t		naddr;
+	size_t		cap;
+};
+
+
+struct trs80_patch *
+trs80_patch_new(void)
+{
+	return calloc(1, sizeof(struct trs80_patch));
+}
+
+
+void
+trs80_patch_free(struct trs80_patch *p)
+{
+	if (p) {
+		free(p->lines);
+		free(p->bytes);
+		free(p);
+	}
+}
+
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+
+/* A hex number of at most max at *pp, moving past it, or -1. */
+static long
+hexnum(const unsigned char **pp, const unsigned char *end, long max)
+{
+	const unsigned char	*p = *pp;
+	long			v = 0;
+	int			d;
+
+	if (p == end || hexval(*p) < 0)
+		return -1;
+	for (; p < end && (d = hexval(*p)) >= 0; ++p)
+		if ((v = v * 16 + d) > max)
+			return -1;
+	*pp = p;
+
+	return v;
+}
+
+
+static int
+add_byte(struct trs80_patch *p, int b)
+{
+	if (p->nbytes == p->bytes_cap) {
+		size_t		cap = p->bytes_cap ? p->bytes_cap * 2 : 1024;
+		unsigned char	*n = realloc(p->bytes, cap);
+
+		if (!n)
+			return -1;
+		p->bytes = n;
+		p->bytes_cap = cap;
+	}
+	p->bytes[p->nbytes++] = (unsigned char)b;
+
+	return 0;
+}
+
+
+static const unsigned char *
+skip_blanks(const unsigned char *p, const unsigned char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+
+	return p;
+}
+
+
+/*
+ * Parse the line from p to end into l, its data going onto p's bytes.
+ * Returns a status, with *at the character it stopped at.
+ */
+
+static int
+parse_line(struct trs80_patch *pt, struct patch_line *l,
+	   const unsigned char *p, const unsigned char *end,
+	   const unsigned char **at)
+{
+	long	v, b;
+
+	l->kind = toupper(*p++);
+	if (l->kind != 'D' && l->kind != 'F' && l->kind != 'X')
+		goto syntax;
+
+	p = skip_blanks(p, end);
+	if (p < end && *p == '\'') {
+		++p;
+		if (l->kind == 'D' || (v = hexnum(&p, end, 0xffff)) < 0 ||
+		    p == end || *p++ != '\'')
+			goto syntax;
+		l->memory = 1;
+		l->pos = (size_t)v;
+	} else {
+		if (l->kind == 'X' || (v = hexnum(&p, end, 0xffff)) < 0)
+			goto syntax;
+		p = skip_blanks(p, end);
+		if (p == end || *p++ != ',')
+			goto syntax;
+		p = skip_blanks(p, end);
+		if ((b = hexnum(&p, end, 0xff)) < 0)
+			goto syntax;
+		l->memory = 0;
+		l->pos = (size_t)v * 256 + b;
+	}
+
+	p = skip_blanks(p, end);
+	if (p == end || *p++ != '=')
+		goto syntax;
+
+	l->data = pt->nbytes;
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			++p;
+		if (p == end)
+			break;
+		if (*p == '"') {
+			for (++p; p < end && *p != '"'; ++p)
+				if (add_byte(pt, *p))
+					return TRS80_E_NOMEM;
+			if (p == end)
+				goto syntax;
+			++p;
+		} else if (p + 1 < end && hexval(p[0]) >= 0 &&
+			   hexval(p[1]) >= 0) {
+			if (add_byte(pt, hexval(p[0]) << 4 | hexval(p[1])))
+				return TRS80_E_NOMEM;
+			p += 2;
+		} else {
+			goto syntax;
+		}
+	}
+	l->len = pt->nbytes - l->data;
+	if (l->len == 0)
+		goto syntax;
+
+	return TRS80_OK;
+
+syntax:
+	*at = p < end ? p : end - 1;
+
+	return TRS80_E_SYNTAX;
+}
+
+
+int
+trs80_patch_read(struct trs80_patch *p, const void *text, size_t len,
+		 struct trs80_patch_diag *diag)
+{
+	const unsigned char	*base = text, *s = base, *end = base + len;
+	unsigned long		linenum = 0;
+
+	p->nlines = 0;
+	p->nbytes = 0;
+
+	while (s < end) {
+		const unsigned char	*nl = memchr(s, '\n', end - s);
+		const unsigned char	*e = nl ? nl : end, *at;
+		struct patch_line	l;
+		int			st;
+
+		++linenum;
+		if (e > s && e[-1] == '\r')
+			--e;
+		s = skip_blanks(s, e);
+		if (s == e || *s == '.') {
+			s = nl ? nl + 1 : end;
+			continue;
+		}
+
+		memset(&l, 0, sizeof(l));
+		l.linenum = linenum;
+		if ((st = parse_line(p, &l, s, e, &at))) {
+			if (diag) {
+				diag->linenum = linenum;
+				diag->offset = st == TRS80_E_SYNTAX ?
+					       (size_t)(at - base) : 0;
+			}
+			return st;
+		}
+
+		if (p->nlines == p->lines_cap) {
+			size_t			cap = p->lines_cap ?
+						      p->lines_cap * 2 : 64;
+			struct patch_line	*n;
+
+			if (!(n = realloc(p->lines, cap * sizeof(*n))))
+				return TRS80_E_NOMEM;
+			p->lines = n;
+			p->lines_cap = cap;
+		}
+		p->lines[p->nlines++] = l;
+		s = nl ? nl + 1 : end;
+	}
+
+	return TRS80_OK;
+}
+
+
+size_t
+trs80_patch_count(const struct trs80_patch *p)
+{
+	return p->nlines;
+}
+
+
+/*
+ * The block index.
+ */
+
+static int
+add_block(struct block_index *ix, unsigned int addr, size_t len,
+	  size_t off)
+{
+	if (ix->n == ix->cap) {
+		size_t		cap = ix->cap ? ix->cap * 2 : 256;
+		struct block	*n = realloc(ix->by_off, cap * sizeof(*n));
+
+		if (!n)
+			return -1;
+		ix->by_off = n;
+		ix->cap = cap;
+	}
+	ix->by_off[ix->n].addr = addr;
+	ix->by_off[ix->n].len = len;
+	ix->by_off[ix->n].off = off;
+	++ix->n;
+
+	return 0;
+}
+
+
+static int
+index_record(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct block_index	*ix = arg;
+
+	if (rec->type != TRS80_CMD_LOADBLK || rec->avail == 0)
+		return 0;
+
+	return add_block(ix, rec->addr, rec->avail, rec->offset + 4) ?
+	       TRS80_E_NOMEM : 0;
+}
+
+
+static int
+by_addr(const void *a, const void *b)
+{
+	const struct block	*x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+
+static int
+build_index(struct block_index *ix, const unsigned char *buf, size_t len,
+	    struct trs80_patch_diag *diag)
+{
+	struct trs80_error	err;
+	size_t			i, n;
+	int			st;
+
+	memset(ix, 0, sizeof(*ix));
+	st = trs80_cmd_parse(buf, len, index_record, ix, NULL, &err);
+	if (st != TRS80_OK) {
+		if (diag) {
+			diag->linenum = 0;
+			diag->offset = st == TRS80_E_NOMEM ? 0 : err.offset;
+		}
+		return st;
+	}
+
+	/* A block running on past FFFF is in two pieces by address. */
+	if (ix->n && !(ix->by_addr = malloc(2 * ix->n * sizeof(struct block))))
+		return TRS80_E_NOMEM;
+	for (i = 0; i < ix->n; ++i) {
+		const struct block	*b = &ix->by_off[i];
+
+		ix->by_addr[ix->naddr++] = *b;
+		if (b->addr + b->len > TRS80_IMAGE_SIZE) {
+			n = TRS80_IMAGE_SIZE - b->addr;
+			ix->by_addr[ix->naddr - 1].len = n;
+			ix->by_addr[ix->naddr].addr = 0;
+			ix->by_addr[ix->naddr].len = b->len - n;
+			ix->by_addr[ix->naddr].off = b->off + n;
+			++ix->naddr;
+		}
+	}
+	qsort(ix->by_addr, ix->naddr, sizeof(struct block), by_addr);
+
+	return TRS80_OK;
+}
+
+
+/* Returns 1 if the byte at file offset off is load block data. */
+static int
+in_data(const struct block_index *ix, size_t off)
+{
+	size_t	lo = 0, hi = ix->n;
+
+	/* The last block starting at or before off. */
+	while (lo < hi) {
+		size_t	mid = lo + (hi - lo) / 2;
+
+		if (ix->by_off[mid].off <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > 0 && off < ix->by_off[lo - 1].off + ix->by_off[lo - 1].len;
+}
+
+
+/* The first block by address that may load addr. */
+static size_t
+first_for(const struct block_index *ix, unsigned int addr)
+{
+	unsigned int	from = addr >= MAX_BLOCK ? addr - (MAX_BLOCK - 1) : 0;
+	size_t		lo = 0, hi = ix->naddr;
+
+	while (lo < hi) {
+		size_t	mid = lo + (hi - lo) / 2;
+
+		if (ix->by_addr[mid].addr < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/*
+ * Put len bytes at the address addr in every block loading them, or
+ * if check, compare them with those loaded last.  Returns a status,
+ * with *bad the file offset of a byte that doesn't match.
+ */
+
+static int
+at_addr(const struct block_index *ix, unsigned char *buf, unsigned int addr,
+	const unsigned char *data, size_t len, int check, size_t *bad)
+{
+	size_t	i, j, at, last;
+
+	for (i = 0; i < len; ++i) {
+		unsigned int	a = (addr + i) & (TRS80_IMAGE_SIZE - 1);
+
+		/* Later in the file is loaded later. */
+		last = (size_t)-1;
+		for (j = first_for(ix, a); j < ix->naddr &&
+					   ix->by_addr[j].addr <= a; ++j) {
+			const struct block	*b = &ix->by_addr[j];
+
+			if (a >= b->addr + b->len)
+				continue;
+			at = b->off + (a - b->addr);
+			if (last == (size_t)-1 || at > last)
+				last = at;
+			if (!check)
+				buf[at] = data[i];
+		}
+		if (last == (size_t)-1) {
+			*bad = a;
+			return TRS80_E_RANGE;
+		}
+		if (check && buf[last] != data[i]) {
+			*bad = last;
+			return TRS80_E_MISMATCH;
+		}
+	}
+
+	return TRS80_OK;
+}
+
+
+/* The same at the file offset off. */
+static int
+at_offset(const struct block_index *ix, unsigned char *buf, size_t off,
+	  const unsigned char *data, size_t len, int check, size_t *bad)
+{
+	size_t	i;
+
+	for (i = 0; i < len; ++i) {
+		if (!in_data(ix, off + i)) {
+			*bad = off + i;
+			return TRS80_E_RANGE;
+		}
+		if (check && buf[off + i] != data[i]) {
+			*bad = off + i;
+			return TRS80_E_MISMATCH;
+		}
+		if (!check)
+			buf[off + i] = data[i];
+	}
+
+	return TRS80_OK;
+}
+
+
+int
+trs80_patch_apply(const struct trs80_patch *p, void *buf, size_t len,
+		  size_t *changed, struct trs80_patch_diag *diag)
+{
+	struct block_index	ix;
+	unsigned char		*orig;
+	size_t			i, bad = 0, n = 0;
+	int			st;
+
+	if ((st = build_index(&ix, buf, len, diag)))
+		goto out;
+	if (!(orig = malloc(len ? len : 1))) {
+		st = TRS80_E_NOMEM;
+		goto out;
+	}
+	memcpy(orig, buf, len);
+
+	for (i = 0; i < p->nlines; ++i) {
+		const struct patch_line	*l = &p->lines[i];
+		const unsigned char	*data = p->bytes + l->data;
+		int			check = l->kind == 'F';
+
+		st = l->memory ?
+		     at_addr(&ix, buf, (unsigned int)l->pos, data, l->len,
+			     check, &bad) :
+		     at_offset(&ix, buf, l->pos, data, l->len, check, &bad);
+		if (st) {
+			if (diag) {
+				diag->linenum = l->linenum;
+				diag->offset = bad;
+			}
+			memcpy(buf, orig, len);
+			break;
+		}
+	}
+
+	if (st == TRS80_OK) {
+		for (i = 0; i < len; ++i)
+			n += ((unsigned char *)buf)[i] != orig[i];
+		if (changed)
+			*changed = n;
+	}
+	free(orig);
+
+out:
+	free(ix.by_off);
+	free(ix.by_addr);
+
+	return st;
+}
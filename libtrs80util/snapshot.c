@@ -0,0 +1,110 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Snapshots: a loaded program and the CPU about to run it, in one
+ * file an emulator can resume from without booting DOS to LOAD it.
+ *
+ * The format, all numbers little-endian:
+ *
+ *	Offset	Size	Contents
+ *	0	8	"TRS80SNP"
+ *	8	1	Format version, 1
+ *	9	1	Zero
+ *	10	2	Header size, 64
+ *	12	24	AF BC DE HL IX IY SP PC AF' BC' DE' HL', 2 bytes each
+ *	36	5	I R IFF1 IFF2 IM, 1 byte each
+ *	41	23	Zero
+ *	64	65536	Memory, 0000H to FFFFH
+ *	65600	8192	A bit per address set for the bytes the program
+ *			loaded, LSB first; the rest of memory is zero and
+ *			is meant to be left as the emulator has it
+ *
+ * Readers should take the header size from the file and ignore
+ * anything in the header past what they know.
+ */
+
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	HEADER_SIZE	64
+#define	SNAP_VERSION	1
+
+/* Where DOS leaves SP when it runs a program, and its exit. */
+#define	DOS_STACK	0x41e0
+#define	DOS_EXIT	0x402d
+
+
+void
+trs80_image_start(struct trs80_image *img, struct trs80_z80_regs *regs)
+{
+	unsigned char	ret[2] = { DOS_EXIT & 0xff, DOS_EXIT >> 8 };
+
+	memset(regs, 0, sizeof(*regs));
+	regs->pc = img->has_xfer ? img->xfer_addr : 0;
+	regs->sp = DOS_STACK - 2;
+	trs80_image_load(img, regs->sp, ret, sizeof(ret));
+}
+
+
+static unsigned char *
+put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8 & 0xff;
+
+	return p + 2;
+}
+
+
+void
+trs80_image_snapshot(const struct trs80_image *img,
+		     const struct trs80_z80_regs *regs, void *out)
+{
+	unsigned char	*p = out, *q;
+	unsigned int	addr;
+
+	memset(p, 0, HEADER_SIZE);
+	memcpy(p, "TRS80SNP", 8);
+	p[8] = SNAP_VERSION;
+	put16(p + 10, HEADER_SIZE);
+
+	q = p + 12;
+	q = put16(q, regs->af);
+	q = put16(q, regs->bc);
+	q = put16(q, regs->de);
+	q = put16(q, regs->hl);
+	q = put16(q, regs->ix);
+	q = put16(q, regs->iy);
+	q = put16(q, regs->sp);
+	q = put16(q, regs->pc);
+	q = put16(q, regs->af2);
+	q = put16(q, regs->bc2);
+	q = put16(q, regs->de2);
+	q = put16(q, regs->hl2);
+	*q++ = regs->i;
+	*q++ = regs->r;
+	*q++ = regs->iff1 != 0;
+	*q++ = regs->iff2 != 0;
+	*q = regs->im;
+
+	/* Only what was loaded: the image's other bytes mean nothing. */
+	p += HEADER_SIZE;
+	for (addr = 0; addr < TRS80_IMAGE_SIZE; addr += 8) {
+		unsigned int	bits = img->loaded[addr >> 3];
+
+		if (bits == 0xff)
+			memcpy(&p[addr], &img->mem[addr], 8);
+		else if (bits == 0)
+			memset(&p[addr], 0, 8);
+		else {
+			int	i;
+
+			for (i = 0; i < 8; ++i)
+				p[addr + i] = bits >> i & 1 ?
+					      img->mem[addr + i] : 0;
+		}
+	}
+	memcpy(p + TRS80_IMAGE_SIZE, img->loaded, sizeof(img->loaded));
+}
@@ -0,0 +1,851 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * libtrs80util -- TRS-80 EDTASM decoding and CMD file parsing.
+ *
+ * The library's only global state is one read-only table of CPU
+ * dispatched kernels, chosen when it is loaded (and capped by the
+ * TRS80_CPU environment variable).  Everything else lives in caller
+ * supplied buffers and caller owned objects such as decoders.  Errors
+ * are returned as negative status codes, never by printing or
+ * exiting, so it is safe to use from many threads at once.
+ *
+ * ABI: symbols are versioned (see libtrs80util.map) and structures in
+ * this header are only ever extended in a new major version.
+ */
+
+#ifndef TRS80UTIL_H
+#define TRS80UTIL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(TRS80UTIL_BUILD) && defined(__GNUC__)
+#define	TRS80_API	__attribute__((visibility("default")))
+#else
+#define	TRS80_API
+#endif
+
+#define	TRS80UTIL_VERSION_MAJOR	1
+#define	TRS80UTIL_VERSION_MINOR	15
+
+
+/* Status codes. */
+enum trs80_status {
+	TRS80_OK		=   0,
+	TRS80_E_FORMAT		=  -1,	/* Unexpected EDTASM file format */
+	TRS80_E_LINENUM		=  -2,	/* Bad EDTASM line number */
+	TRS80_E_SEPARATOR	=  -3,	/* Bad character after line number */
+	TRS80_E_HEADER		=  -4,	/* Unexpected CMD record type */
+	TRS80_E_XFERLEN		=  -5,	/* Bad CMD transfer record length */
+	TRS80_E_SPACE		=  -6,	/* Output buffer too small */
+	TRS80_E_NOMEM		=  -7,
+	TRS80_E_INVAL		=  -8,
+	TRS80_E_SYNTAX		=  -9,	/* Bad assembler source line (1.3) */
+	TRS80_E_SYMBOL		= -10,	/* Undefined or duplicate symbol */
+	TRS80_E_RANGE		= -11,	/* Value out of range */
+	TRS80_E_CHECKSUM	= -12,	/* Bad cassette block (1.8) */
+	TRS80_E_FULL		= -13,	/* Disk or directory full (1.9) */
+	TRS80_E_NOFILE		= -14,	/* No such file on the disk */
+	TRS80_E_MISMATCH	= -15	/* Patch find bytes differ (1.14) */
+};
+
+/* Where a format error was found. */
+struct trs80_error {
+	size_t		offset;		/* Of the offending byte */
+	int		byte;		/* Its value (CMD: the length byte) */
+};
+
+
+TRS80_API unsigned int trs80util_version(void);	/* (major << 16) | minor */
+
+TRS80_API const char *trs80_strerror(int status);
+
+/* Format the message the command line tools print for status, e.g.
+ * "Bad line number.".  Returns the snprintf() result. */
+TRS80_API int trs80_error_message(int status, const struct trs80_error *err,
+				  char *buf, size_t size);
+
+
+/*
+ * EDTASM to text.
+ */
+
+#define	TRS80_EDTASM_NEWER	0x01	/* Tab after line numbers */
+#define	TRS80_EDTASM_HEADER	0x02	/* Show the file name header */
+#define	TRS80_EDTASM_NOLINENUMS	0x04	/* Strip line numbers */
+
+/* Decoder position, see trs80_edtasm_where(). */
+#define	TRS80_EDTASM_LINESTART	0x01	/* Between lines */
+#define	TRS80_EDTASM_EOF	0x02	/* End of file marker seen */
+
+struct trs80_edtasm;
+
+/* Output needed to decode inlen bytes, however they are split up. */
+TRS80_API size_t trs80_edtasm_bound(size_t inlen);
+
+TRS80_API struct trs80_edtasm *trs80_edtasm_new(unsigned int flags);
+TRS80_API void trs80_edtasm_free(struct trs80_edtasm *d);
+
+/*
+ * Decode the next inlen bytes of a file into out, which must have room
+ * for trs80_edtasm_bound(inlen) bytes; *outlen is set to the number
+ * produced, including the text decoded before any error.  Input after
+ * the end of file marker is ignored.
+ */
+TRS80_API int trs80_edtasm_decode(struct trs80_edtasm *d, const void *in,
+				  size_t inlen, void *out, size_t *outlen,
+				  struct trs80_error *err);
+
+/* TRS80_EDTASM_* position flags, and the bytes consumed so far. */
+TRS80_API unsigned int trs80_edtasm_where(const struct trs80_edtasm *d,
+					  size_t *offset);
+
+/* Whole buffer to buffer: trs80_edtasm_new(), _decode() and _free(). */
+TRS80_API int trs80_edtasm_convert(const void *in, size_t inlen,
+				   unsigned int flags, void *out,
+				   size_t *outlen, struct trs80_error *err);
+
+struct trs80_edtasm_line {
+	size_t			offset;		/* Of the line number */
+	unsigned long		linenum;
+	int			sep;		/* ' ' or '\t' */
+	const char		*text;		/* Not NUL terminated */
+	size_t			len;
+	int			terminated;	/* Ended by 0x0D */
+};
+
+struct trs80_edtasm_visitor {
+	/* Either may be NULL.  A non-zero return stops the walk and is
+	 * returned by trs80_edtasm_visit(). */
+	int	(*header)(void *arg, const char name[6]);
+	int	(*line)(void *arg, const struct trs80_edtasm_line *line);
+};
+
+TRS80_API int trs80_edtasm_visit(const void *buf, size_t len,
+				 const struct trs80_edtasm_visitor *v,
+				 void *arg, struct trs80_error *err);
+
+/*
+ * Text to EDTASM (1.9).  Lines keep a leading five digit line number
+ * and its separator, others are numbered on by 10 from the line
+ * before.  The file gets a header if name (up to 6 characters) is not
+ * NULL, or if the text starts with the header trs80_edtasm_decode()
+ * shows, and ends with the end of file marker.  out must have room for
+ * trs80_edtasm_encode_bound(inlen) bytes.  TRS80_EDTASM_NEWER puts a
+ * tab after the line numbers instead of a space.
+ */
+TRS80_API size_t trs80_edtasm_encode_bound(size_t inlen);
+TRS80_API int trs80_edtasm_encode(const void *in, size_t inlen,
+				  const char *name, unsigned int flags,
+				  void *out, size_t *outlen,
+				  struct trs80_error *err);
+
+
+/*
+ * CMD files.
+ */
+
+enum trs80_cmd_type {
+	TRS80_CMD_LOADBLK	= 0x01,
+	TRS80_CMD_XFERADDR	= 0x02,
+	TRS80_CMD_ENDMEMBER	= 0x04,		/* LS-DOS libraries (1.13) */
+	TRS80_CMD_FNAMEREC	= 0x05,
+	TRS80_CMD_PDSHEADER	= 0x06,		/* LS-DOS libraries (1.13) */
+	TRS80_CMD_PATCHNAME	= 0x07,
+	TRS80_CMD_ISAMENTRY	= 0x08,
+	TRS80_CMD_ISAMEND	= 0x0a,
+	TRS80_CMD_PDSENTRY	= 0x0c,
+	TRS80_CMD_PDSEND	= 0x0e,
+	TRS80_CMD_YANKED	= 0x10,		/* A load block not loaded */
+	TRS80_CMD_COMMREC	= 0x1f		/* L/LS-DOS specific */
+};
+
+struct trs80_cmd_record {
+	int			type;		/* enum trs80_cmd_type */
+	size_t			offset;		/* Of the type byte */
+	unsigned int		addr;		/* Load or transfer address */
+	const unsigned char	*data;		/* Load data or the record's */
+	size_t			len;		/* Declared data length */
+	size_t			avail;		/* Data present (< len only if
+						 * the file ends early) */
+};
+
+struct trs80_cmd_info {
+	size_t		end;		/* Bytes a stripped copy keeps */
+	size_t		extra;		/* Bytes after the transfer record */
+	int		has_xfer;
+	unsigned int	xfer_addr;
+	int		truncated;	/* Input ended inside a record */
+};
+
+/* A non-zero return stops the walk and is returned by the parser. */
+typedef int (*trs80_cmd_visit_fn)(void *arg,
+				  const struct trs80_cmd_record *rec);
+
+/*
+ * Walk the records of a CMD file, calling fn (if not NULL) for each.
+ * A load block is visited as soon as its header is complete, name and
+ * comment records once their text is, and the transfer record before
+ * its length is checked.  On a format error info->end still covers
+ * the bytes up to and including the offending one.  A file ends at
+ * its transfer record.  Only load block, transfer, file name and
+ * comment records are taken; any other is TRS80_E_HEADER.
+ */
+TRS80_API int trs80_cmd_parse(const void *buf, size_t len,
+			      trs80_cmd_visit_fn fn, void *arg,
+			      struct trs80_cmd_info *info,
+			      struct trs80_error *err);
+
+/* trs80_cmd_parse_flags() flags (1.15). */
+#define	TRS80_CMD_LSDOS		0x01	/* LS-DOS library records */
+
+/*
+ * trs80_cmd_parse() with flags.  With TRS80_CMD_LSDOS, end-of-member,
+ * patch name and yanked records are taken too, and a file also ends at
+ * an end-of-member record.  An LS-DOS library (one starting with a PDS
+ * header or ISAM entry) may hold directory records as well, and ends
+ * at the end of the member its directory puts last, info->xfer_addr
+ * being the first member's.  A directory entry too short for its
+ * fields is TRS80_E_RANGE.
+ */
+TRS80_API int trs80_cmd_parse_flags(const void *buf, size_t len,
+				    unsigned int flags,
+				    trs80_cmd_visit_fn fn, void *arg,
+				    struct trs80_cmd_info *info,
+				    struct trs80_error *err);
+
+/* Copy buf less any trailing junk to out (room for len bytes). */
+TRS80_API int trs80_cmd_strip(const void *buf, size_t len, void *out,
+			      size_t *outlen, struct trs80_error *err);
+
+
+/*
+ * Telling formats apart (1.1).
+ */
+
+enum trs80_type {
+	TRS80_TYPE_UNKNOWN,
+	TRS80_TYPE_EDTASM,
+	TRS80_TYPE_CMD
+};
+
+/* An EDTASM file that decodes cleanly or a CMD file that parses
+ * cleanly up to its transfer record. */
+TRS80_API int trs80_identify(const void *buf, size_t len);
+
+TRS80_API const char *trs80_type_name(int type);
+
+
+/*
+ * CPU dispatch (1.2).  The scanning and copying kernels are picked
+ * for the CPU when the library loads; TRS80_CPU in the environment
+ * (generic, sse2, avx2, avx512bw, neon) caps the choice.
+ */
+
+#define	TRS80_CPU_SSE2		0x01
+#define	TRS80_CPU_SSE42		0x02
+#define	TRS80_CPU_AVX2		0x04
+#define	TRS80_CPU_AVX512BW	0x08
+#define	TRS80_CPU_NEON		0x10
+
+TRS80_API unsigned int trs80_cpu_features(void);	/* TRS80_CPU_* */
+TRS80_API const char *trs80_kernels_name(void);		/* Kernels in use */
+
+
+/*
+ * Assembling EDTASM source into CMD files (1.3).
+ *
+ * A two-pass Z80 assembler for the lines of an EDTASM file, or of the
+ * same source as text, in Radio Shack EDTASM syntax: a label starting
+ * in the first column, the instruction, its operands and a ';'
+ * comment.  Lines starting with '*' are comments.  Directives are ORG,
+ * EQU, DEFL, DEFB, DEFW, DEFS, DEFM (or DB, DW, DS, DM), END and
+ * COND/ENDC; TITLE, SUBTTL, PAGE, LIST and NOLIST are accepted and
+ * ignored.  Expressions
+ * are evaluated strictly left to right, as EDTASM did, over + - * /
+ * & (and) ! (or) < (shift left, right if negative) and .AND. .OR.
+ * .XOR. .MOD. .SHL. .SHR. .NOT., with parentheses for grouping.
+ * Numbers are decimal or take an H, O/Q or B suffix; 'c' is a
+ * character and $ the location counter.
+ */
+
+#define	TRS80_ASM_MAXMSG	80
+
+/* Where assembly stopped. */
+struct trs80_asm_diag {
+	unsigned long	linenum;	/* EDTASM line number, or text line */
+	size_t		offset;		/* Of the line in the input */
+	char		msg[TRS80_ASM_MAXMSG];	/* e.g. "Undefined symbol
+						 * 'LOOP'" */
+};
+
+/* A run of bytes assembled to consecutive addresses. */
+struct trs80_asm_block {
+	unsigned int		addr;
+	const unsigned char	*data;
+	size_t			len;
+};
+
+struct trs80_asm;
+
+TRS80_API struct trs80_asm *trs80_asm_new(void);
+TRS80_API void trs80_asm_free(struct trs80_asm *a);
+
+/*
+ * Assemble a whole EDTASM file, or text with one source line per
+ * line (each optionally starting with a line number), replacing
+ * whatever a was holding.  On failure diag (if not NULL) says where
+ * and why.  The results stay valid until the next call.
+ */
+TRS80_API int trs80_asm_edtasm(struct trs80_asm *a, const void *buf,
+			       size_t len, struct trs80_asm_diag *diag);
+TRS80_API int trs80_asm_text(struct trs80_asm *a, const char *text,
+			     size_t len, struct trs80_asm_diag *diag);
+
+/* The assembled blocks, in the order they were assembled. */
+TRS80_API size_t trs80_asm_blocks(const struct trs80_asm *a,
+				  const struct trs80_asm_block **blocks);
+
+/* Returns 1 with the END address in *addr, 0 if END had none. */
+TRS80_API int trs80_asm_entry(const struct trs80_asm *a, unsigned int *addr);
+
+/* Returns 1 with the value of symbol name in *value, 0 if undefined. */
+TRS80_API int trs80_asm_symbol(const struct trs80_asm *a, const char *name,
+			       unsigned int *value);
+
+/*
+ * The CMD file: a file name record if the EDTASM file had a header,
+ * load blocks of up to 256 bytes and a transfer record to the END
+ * address, or to the first byte assembled if END had none.
+ */
+TRS80_API size_t trs80_asm_cmd_bound(const struct trs80_asm *a);
+TRS80_API int trs80_asm_cmd(const struct trs80_asm *a, void *out,
+			    size_t *outlen);
+
+
+/*
+ * Memory images (1.4).
+ *
+ * What a program leaves in the Z80's 64K once loaded, whether from a
+ * CMD file or straight from the assembler, with a bit per address
+ * telling which bytes were loaded at all.  Later loads overwrite
+ * earlier ones and addresses wrap at 64K, as on the real machine.
+ */
+
+#define	TRS80_IMAGE_SIZE	65536
+
+struct trs80_image {
+	unsigned char	mem[TRS80_IMAGE_SIZE];
+	unsigned char	loaded[TRS80_IMAGE_SIZE / 8];	/* LSB first */
+	int		has_xfer;
+	unsigned int	xfer_addr;
+};
+
+#define	TRS80_IMAGE_LOADED(img, addr) \
+	((img)->loaded[(addr) >> 3] >> ((addr) & 7) & 1)
+
+TRS80_API void trs80_image_clear(struct trs80_image *img);
+TRS80_API void trs80_image_load(struct trs80_image *img, unsigned int addr,
+				const void *data, size_t len);
+
+/* Load a CMD file's blocks and transfer address over img.  A
+ * truncated last block loads what there is of it. */
+TRS80_API int trs80_image_cmd(struct trs80_image *img, const void *buf,
+			      size_t len, struct trs80_error *err);
+
+/* Load what a has assembled, with the transfer address its CMD file
+ * would have. */
+TRS80_API void trs80_image_asm(struct trs80_image *img,
+			       const struct trs80_asm *a);
+
+enum trs80_range_kind {
+	TRS80_RANGE_SAME,	/* Loaded in both, same bytes */
+	TRS80_RANGE_DIFFER,	/* Loaded in both, different bytes */
+	TRS80_RANGE_ONLY_A,	/* Loaded in the first image only */
+	TRS80_RANGE_ONLY_B
+};
+
+struct trs80_range {
+	int		kind;		/* enum trs80_range_kind */
+	unsigned int	start;
+	unsigned int	len;		/* Up to TRS80_IMAGE_SIZE */
+};
+
+typedef int (*trs80_range_fn)(void *arg, const struct trs80_range *r);
+
+/*
+ * Walk the loaded addresses of a and b in order as maximal ranges of
+ * one kind, calling fn for each; addresses loaded in neither are
+ * skipped.  A non-zero return from fn stops the walk and is returned.
+ */
+TRS80_API int trs80_image_compare(const struct trs80_image *a,
+				  const struct trs80_image *b,
+				  trs80_range_fn fn, void *arg);
+
+
+/*
+ * Running Z80 code (1.5).
+ *
+ * An interpreter for the documented and the usual undocumented Z80
+ * instructions, counting T-states, over 64K of memory such as a
+ * struct trs80_image's.  There are no interrupts and no devices: input
+ * reads 0xFF and output goes nowhere unless the env says otherwise, and
+ * calls into ROM or DOS are handed to a trap function to stand in for.
+ */
+
+struct trs80_z80_regs {
+	unsigned int	af, bc, de, hl, ix, iy, sp, pc;
+	unsigned int	af2, bc2, de2, hl2;	/* The alternate set */
+	unsigned int	i, r;
+	unsigned int	iff1, iff2, im;
+};
+
+/* What a trap function wants done next. */
+enum trs80_z80_trap {
+	TRS80_Z80_RET,		/* Return to the caller, popping pc */
+	TRS80_Z80_JUMP,		/* Carry on at regs->pc, untrapped */
+	TRS80_Z80_STOP		/* End the run */
+};
+
+/* Why trs80_z80_run() returned. */
+enum trs80_z80_end {
+	TRS80_Z80_LIMIT,	/* Ran the T-states asked for */
+	TRS80_Z80_HALTED,	/* At a HALT, which nothing would end */
+	TRS80_Z80_STOPPED	/* A trap function said so */
+};
+
+/*
+ * Where the time went.  Each instruction's T-states are charged to its
+ * address, a trap's to the trapped address.  A jump back to or before
+ * itself counts as a loop at its target, loop_end being the furthest
+ * such jump.
+ */
+struct trs80_z80_profile {
+	unsigned long long	cycles[TRS80_IMAGE_SIZE];
+	unsigned long		loops[TRS80_IMAGE_SIZE];
+	unsigned short		loop_end[TRS80_IMAGE_SIZE];
+};
+
+/*
+ * A trap is taken when a jump, call, return or restart goes to an
+ * address marked in trap, or a run starts at one; code running into
+ * one in sequence just executes.  trap_fn gets the registers and
+ * memory to do as it likes with, adds what the call should cost to
+ * *tstates and returns an enum trs80_z80_trap.  With no trap_fn a trap
+ * returns at once.
+ */
+struct trs80_z80_env {
+	unsigned char	*mem;				/* 64K */
+	unsigned char	trap[TRS80_IMAGE_SIZE / 8];	/* LSB first */
+	int		(*trap_fn)(void *arg, struct trs80_z80_regs *regs,
+				   unsigned char *mem,
+				   unsigned long *tstates);
+	int		(*in)(void *arg, unsigned int port);
+	void		(*out)(void *arg, unsigned int port,
+			       unsigned int value);
+	void		*arg;
+	struct trs80_z80_profile *profile;		/* Or NULL */
+};
+
+#define	TRS80_Z80_TRAP(env, addr) \
+	((env)->trap[(addr) >> 3] |= 1 << ((addr) & 7))
+
+/*
+ * Run from regs->pc until at least limit T-states have gone by, leaving
+ * regs as the CPU was at the end and the T-states run in *tstates if
+ * that isn't NULL.  Returns an enum trs80_z80_end.  profile, if any,
+ * is added to, not cleared.
+ */
+TRS80_API int trs80_z80_run(struct trs80_z80_regs *regs,
+			    const struct trs80_z80_env *env,
+			    unsigned long long limit,
+			    unsigned long long *tstates);
+
+
+/*
+ * Snapshots (1.6).
+ *
+ * A program loaded and ready to run, for emulators to resume from:
+ * the registers, 64K of memory and which of it was loaded.  The format
+ * is described in snapshot.c and the README.
+ */
+
+#define	TRS80_SNAPSHOT_SIZE	(64 + TRS80_IMAGE_SIZE + TRS80_IMAGE_SIZE / 8)
+
+/* Set regs as DOS runs img's program: at its transfer address, with
+ * the stack DOS leaves and a return to @EXIT pushed onto it. */
+TRS80_API void trs80_image_start(struct trs80_image *img,
+				 struct trs80_z80_regs *regs);
+
+/* Write img and regs as a TRS80_SNAPSHOT_SIZE byte snapshot to out. */
+TRS80_API void trs80_image_snapshot(const struct trs80_image *img,
+				    const struct trs80_z80_regs *regs,
+				    void *out);
+
+
+/*
+ * Carving (1.7).
+ *
+ * Finding EDTASM and CMD files in raw bytes, such as a disk image whose
+ * directory is gone.  Candidates are found by a vectorized scan for the
+ * bytes files start with and checked with the parsers above, so what
+ * is found converts or loads cleanly.
+ */
+
+struct trs80_carved {
+	int		type;		/* TRS80_TYPE_EDTASM or _CMD */
+	size_t		offset;
+	size_t		len;
+	int		truncated;	/* EDTASM file without an end marker */
+};
+
+typedef int (*trs80_carve_fn)(void *arg, const struct trs80_carved *c);
+
+/*
+ * Call fn for each file found starting in [from, to) of buf, in order.
+ * The checks read on to len, so a file may run past to; scanning picks
+ * up again after each file found, so none overlap.  A non-zero return
+ * from fn stops the scan and is returned.
+ */
+TRS80_API int trs80_carve(const void *buf, size_t len, size_t from,
+			  size_t to, trs80_carve_fn fn, void *arg);
+
+
+/*
+ * Cassettes (1.8).
+ *
+ * Demodulating recordings of TRS-80 cassettes into CAS images, the
+ * bytes on the tape: for each recording a leader, a sync byte and the
+ * data.  Level II tapes are 500 baud, a clock pulse every 2 ms with
+ * another between for a 1 bit, behind a leader of 0x00 bytes and a
+ * 0xA5 sync byte.  Model III high speed tapes are 1500 baud, a cycle
+ * per bit, short for 1 and long for 0, behind 0x55 bytes and 0x7F.
+ * Bits go most significant first.
+ */
+
+#define	TRS80_CAS_LEADER	256	/* Leader bytes put out per recording */
+
+/* A PCM WAVE file's format and where its samples are. */
+struct trs80_wav {
+	unsigned int	rate;		/* Samples per second */
+	unsigned int	channels;
+	unsigned int	bits;		/* Per sample, 8 or 16 */
+	size_t		offset;		/* Of the sample data */
+	size_t		len;		/* Its length as the header gives it,
+					 * 0 or too much if still recording */
+};
+
+/* Read a PCM WAVE file's header from buf, which must hold all of it
+ * up to the sample data. */
+TRS80_API int trs80_wav_parse(const void *buf, size_t len,
+			      struct trs80_wav *wav);
+
+/* Convert the whole frames in len bytes of wav's sample data to 16 bit
+ * samples of the first channel in out.  Returns the number of them. */
+TRS80_API size_t trs80_wav_samples(const struct trs80_wav *wav,
+				   const void *in, size_t len, short *out);
+
+struct trs80_cas;
+
+/* A demodulator for rate (8000 or more) samples per second of a 500 or
+ * 1500 baud tape, or either if baud is 0.  NULL if out of memory or
+ * the rate or baud won't do. */
+TRS80_API struct trs80_cas *trs80_cas_new(unsigned int rate,
+					  unsigned int baud);
+TRS80_API void trs80_cas_free(struct trs80_cas *d);
+
+/* Output needed to demodulate n samples, however they are split up. */
+TRS80_API size_t trs80_cas_bound(size_t n);
+
+/*
+ * Demodulate the next n samples into out, which must have room for
+ * trs80_cas_bound(n) bytes; *outlen is set to the number produced.
+ * Each recording found is put out as a TRS80_CAS_LEADER byte leader
+ * and its sync byte, then its bytes as they come.  The level and
+ * timing thresholds follow the recording's, so a quiet, offset or
+ * stretched tape decodes as well as a clean one.
+ */
+TRS80_API int trs80_cas_decode(struct trs80_cas *d, const short *samples,
+			       size_t n, void *out, size_t *outlen);
+
+enum trs80_cas_kind {
+	TRS80_CAS_DATA,		/* Anything else */
+	TRS80_CAS_SYSTEM,	/* Machine language: 0x55 and a name */
+	TRS80_CAS_EDTASM,	/* 0xD3 and a name */
+	TRS80_CAS_BASIC		/* 0xD3 0xD3 0xD3 and a letter */
+};
+
+struct trs80_cas_file {
+	unsigned int		baud;		/* 500 or 1500 */
+	size_t			offset;		/* Of the leader */
+	const unsigned char	*data;		/* After the sync byte */
+	size_t			len;
+	int			kind;		/* enum trs80_cas_kind */
+	char			name[7];	/* Less trailing spaces */
+};
+
+typedef int (*trs80_cas_file_fn)(void *arg, const struct trs80_cas_file *f);
+
+/*
+ * Call fn for each recording in a CAS image, in order.  A recording's
+ * data runs to the end of its last block for a SYSTEM tape, otherwise
+ * to the next recording's leader.  A non-zero return from fn stops the
+ * walk and is returned.
+ */
+TRS80_API int trs80_cas_files(const void *buf, size_t len,
+			      trs80_cas_file_fn fn, void *arg);
+
+/* Convert a SYSTEM recording's data into a CMD file in out, which must
+ * have room for len + 2 bytes: a name record, a load block for each
+ * tape block, whose checksums are checked, and the transfer record. */
+TRS80_API int trs80_cas_cmd(const void *data, size_t len, void *out,
+			    size_t *outlen, struct trs80_error *err);
+
+
+/*
+ * Disk images (1.9).
+ *
+ * The files on JV1 and JV3 images of LDOS format floppies, the format
+ * LDOS, LS-DOS and most emulators' blank disks use.  An image is
+ * worked on in memory: opened or made new, written to any number of
+ * times and then taken whole with trs80_disk_image().
+ */
+
+#define	TRS80_DISK_JV1		1	/* Single density, single sided */
+#define	TRS80_DISK_JV3		3
+
+struct trs80_disk_geometry {
+	int		format;		/* TRS80_DISK_JV1 or _JV3 */
+	unsigned int	cylinders;	/* Up to 96 */
+	unsigned int	sides;		/* 1, or 2 for JV3 */
+	unsigned int	sectors;	/* A track: 10, or 18 for double
+					 * density JV3 */
+};
+
+struct trs80_disk_file {
+	char		name[13];	/* "NAME/EXT" */
+	size_t		len;
+	unsigned int	granules;
+	unsigned int	attr;		/* Directory attribute byte */
+};
+
+typedef int (*trs80_disk_file_fn)(void *arg,
+				  const struct trs80_disk_file *f);
+
+struct trs80_disk;
+
+/* Format a new image with an empty directory in its middle cylinder.
+ * name (up to 8 characters) and date ("MM/DD/YY") may be NULL. */
+TRS80_API int trs80_disk_new(struct trs80_disk **dp,
+			     const struct trs80_disk_geometry *g,
+			     const char *name, const char *date);
+
+/* Open a copy of the image in buf. */
+TRS80_API int trs80_disk_open(struct trs80_disk **dp, const void *buf,
+			      size_t len);
+TRS80_API void trs80_disk_free(struct trs80_disk *d);
+
+TRS80_API void trs80_disk_geometry(const struct trs80_disk *d,
+				   struct trs80_disk_geometry *g);
+
+/* The image as it stands, valid until the next call with d. */
+TRS80_API const void *trs80_disk_image(const struct trs80_disk *d,
+				       size_t *len);
+
+/*
+ * Write len bytes as file name ("NAME/EXT" or "NAME.EXT"), replacing
+ * any file of that name.  The granules are one run if one is free,
+ * and the directory entry's EOF is the exact length, so the file reads
+ * back with nothing after it.  TRS80_E_FULL leaves the disk as it was.
+ */
+TRS80_API int trs80_disk_write(struct trs80_disk *d, const char *name,
+			       const void *data, size_t len);
+
+/* Call fn for each file in the directory, in directory order.  A
+ * non-zero return from fn stops the walk and is returned. */
+TRS80_API int trs80_disk_files(const struct trs80_disk *d,
+			       trs80_disk_file_fn fn, void *arg);
+
+/* Read file name into out, which must have room for its length. */
+TRS80_API int trs80_disk_read(const struct trs80_disk *d, const char *name,
+			      void *out, size_t *outlen);
+
+TRS80_API unsigned int trs80_disk_free_granules(const struct trs80_disk *d);
+
+
+/*
+ * Disassembly (1.10).
+ */
+
+/*
+ * Write the Z80 instruction at addr in mem (64K, wrapping) to buf as
+ * text, in Zilog mnemonics with hex in the assembler's 0FFH style, and
+ * return its length in bytes, 1 to 4.  A byte that starts nothing the
+ * CPU would run as written comes out as DEFB.
+ */
+TRS80_API int trs80_z80_disasm(const unsigned char *mem, unsigned int addr,
+			       char *buf, size_t size);
+
+
+/*
+ * Packing (1.11).
+ *
+ * Self-extracting CMD files: what an image loads, compressed, behind a
+ * small depacker that puts it back and runs the program.  The format,
+ * LZ77 in whole bytes with a token per LDIR, is described in packer.c.
+ */
+
+#define	TRS80_PACK_ANY		0x10000	/* Let the depacker go anywhere */
+#define	TRS80_PACK_BOUND	(TRS80_IMAGE_SIZE / 256 * 260 + 4)
+
+/*
+ * Write img as a self-extracting CMD file to out, which must have room
+ * for TRS80_PACK_BOUND bytes: the depacker and packed data as load
+ * blocks at addr, or with TRS80_PACK_ANY at the lowest address from
+ * 5200H where they fit around what img loads, and a transfer record to
+ * the depacker.  It unpacks, puts back the registers DOS left and
+ * jumps to img's transfer address.  TRS80_E_INVAL if img has none,
+ * TRS80_E_RANGE if there is no room for the depacker or img loads over
+ * the stack DOS leaves, which the depacker uses.
+ */
+TRS80_API int trs80_image_pack(const struct trs80_image *img,
+			       unsigned int addr, void *out, size_t *outlen);
+
+/*
+ * Load a CMD file written by trs80_image_pack() over img and unpack it
+ * as its depacker would, leaving img as the original loads it: the
+ * depacker no longer marked loaded and the transfer address the
+ * original's.  TRS80_E_FORMAT if it isn't such a file.
+ */
+TRS80_API int trs80_image_unpack(struct trs80_image *img, const void *buf,
+				 size_t len, struct trs80_error *err);
+
+
+/*
+ * Writing CMD files (1.12).
+ *
+ * Programs built by other tools, as Intel HEX or flat binaries loaded
+ * into an image with trs80_image_load(), written out as CMD files.
+ */
+
+/* Room trs80_cmd_write() needs at most. */
+#define	TRS80_CMD_BOUND		(TRS80_IMAGE_SIZE / 256 * 260 + 2 * 257 + 4)
+
+/*
+ * Load the data records of an Intel HEX file over img, and take a
+ * start address record as img's transfer address.  Addresses must
+ * stay under 64K.  err->offset is that of the bad line, or of the bad
+ * digit in it.  TRS80_E_SYNTAX for a malformed line, TRS80_E_CHECKSUM
+ * for a bad checksum, TRS80_E_RANGE for an address past 64K and
+ * TRS80_E_HEADER for an unknown record type.
+ */
+TRS80_API int trs80_ihex_load(struct trs80_image *img, const void *buf,
+			      size_t len, struct trs80_error *err);
+
+/*
+ * Write what img loads as a CMD file to out, which must have room for
+ * TRS80_CMD_BOUND bytes: a file name and a comment record if name and
+ * comment (each up to 255 characters) aren't NULL or empty, the fewest
+ * load blocks that hold the loaded bytes, in address order, and a
+ * transfer record if img has a transfer address.  The same image
+ * always gives the same file.
+ */
+TRS80_API int trs80_cmd_write(const struct trs80_image *img,
+			      const char *name, const char *comment,
+			      void *out, size_t *outlen);
+
+
+/*
+ * LS-DOS libraries (1.13).
+ *
+ * Partitioned data sets and ISAM overlay files keep many CMD files,
+ * their members, behind a directory saying where each one starts, so
+ * any member can be gone to without reading those before it.
+ */
+
+struct trs80_cmd_member {
+	int		type;		/* TRS80_CMD_PDSENTRY or _ISAMENTRY */
+	unsigned int	index;		/* Its entry's place in the directory */
+	char		name[9];	/* A PDS member's, blanks trimmed */
+	unsigned int	number;		/* An ISAM member's */
+	unsigned int	xfer_addr;	/* An ISAM member's, from its entry */
+	size_t		entry;		/* Offset of its directory entry */
+	size_t		offset;		/* Of its first record */
+};
+
+/* A non-zero return stops the walk and is returned. */
+typedef int (*trs80_cmd_member_fn)(void *arg,
+				   const struct trs80_cmd_member *m);
+
+/*
+ * Call fn for each entry in the directory of the library in buf, in
+ * order, reading no further than the directory.  A member is parsed
+ * on its own with trs80_cmd_parse_flags() and TRS80_CMD_LSDOS from
+ * buf + m->offset, ending at its transfer or end-of-member record.
+ * TRS80_E_FORMAT if buf isn't a library, TRS80_E_RANGE (err->offset
+ * that of the entry) for an entry too short or pointing outside the
+ * file or back into the directory.
+ */
+TRS80_API int trs80_cmd_members(const void *buf, size_t len,
+				trs80_cmd_member_fn fn, void *arg,
+				struct trs80_error *err);
+
+
+/*
+ * Patching (1.14).
+ *
+ * LS-DOS style patch files applied to CMD files in place, the load
+ * blocks' bytes changed and nothing else.  A patch file, once read, is
+ * only read from, so one can be applied on many threads at once.
+ */
+
+struct trs80_patch;
+
+/* Where reading or applying a patch file stopped. */
+struct trs80_patch_diag {
+	unsigned long	linenum;	/* Of the patch line, 0 if none */
+	size_t		offset;		/* Of the bad character or byte */
+};
+
+TRS80_API struct trs80_patch *trs80_patch_new(void);
+TRS80_API void trs80_patch_free(struct trs80_patch *p);
+
+/*
+ * Read a patch file, replacing whatever p was holding: lines of
+ * Drr,bb=data to put data at byte bb of record rr of the file,
+ * Frr,bb=data to check it is there, X'aaaa'=data to put it where the
+ * program loads address aaaa and F'aaaa'=data to check it is there,
+ * numbers in hex and data in hex bytes or "quoted text".  Blank lines
+ * and lines starting with a period are passed over.  TRS80_E_SYNTAX
+ * with diag->offset that of the bad character in text.
+ */
+TRS80_API int trs80_patch_read(struct trs80_patch *p, const void *text,
+			       size_t len, struct trs80_patch_diag *diag);
+
+/* The patch lines read. */
+TRS80_API size_t trs80_patch_count(const struct trs80_patch *p);
+
+/*
+ * Apply p's lines in order to the CMD file in buf, setting *changed
+ * (if not NULL) to the bytes that differ after.  D and X patches may
+ * only change load block data, and an X patch goes into every block
+ * loading its address.  TRS80_E_RANGE if a patch falls outside the
+ * load data, diag->offset being its file offset, or its address if
+ * nothing loads it; TRS80_E_MISMATCH if an F patch doesn't match,
+ * diag->offset being that of the first differing byte.  A bad CMD file
+ * gives the parser's status with diag->linenum 0.  On failure buf is
+ * left as it was.
+ */
+TRS80_API int trs80_patch_apply(const struct trs80_patch *p, void *buf,
+				size_t len, size_t *changed,
+				struct trs80_patch_diag *diag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
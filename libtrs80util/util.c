@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Library version, error reporting and format identification.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "trs80util.h"
+
+
+unsigned int
+trs80util_version(void)
+{
+	return (TRS80UTIL_VERSION_MAJOR << 16) | TRS80UTIL_VERSION_MINOR;
+}
+
+
+const char *
+trs80_strerror(int status)
+{
+	switch (status) {
+	case TRS80_OK:
+		return "Success";
+	case TRS80_E_FORMAT:
+		return "Unexpected file format";
+	case TRS80_E_LINENUM:
+		return "Bad line number";
+	case TRS80_E_SEPARATOR:
+		return "Unexpected character following line number";
+	case TRS80_E_HEADER:
+		return "Unexpected header byte";
+	case TRS80_E_XFERLEN:
+		return "Unexpected transfer address length";
+	case TRS80_E_SPACE:
+		return "Output buffer too small";
+	case TRS80_E_NOMEM:
+		return "Out of memory";
+	case TRS80_E_INVAL:
+		return "Invalid argument";
+	case TRS80_E_SYNTAX:
+		return "Syntax error";
+	case TRS80_E_SYMBOL:
+		return "Bad symbol";
+	case TRS80_E_RANGE:
+		return "Value out of range";
+	case TRS80_E_CHECKSUM:
+		return "Bad checksum";
+	case TRS80_E_FULL:
+		return "Disk full";
+	case TRS80_E_NOFILE:
+		return "File not found";
+	case TRS80_E_MISMATCH:
+		return "Find bytes don't match";
+	default:
+		return "Unknown error";
+	}
+}
+
+
+int
+trs80_error_message(int status, const struct trs80_error *err, char *buf,
+		    size_t size)
+{
+	const char	*msg = trs80_strerror(status);
+
+	if (err) {
+		switch (status) {
+		case TRS80_E_SEPARATOR:
+			return snprintf(buf, size, "%s (%02x).", msg,
+					err->byte);
+		case TRS80_E_HEADER:
+			return snprintf(buf, size, "%s (0x%02x).", msg,
+					err->byte);
+		case TRS80_E_XFERLEN:
+			/* The length byte counts the two address bytes. */
+			return snprintf(buf, size, "%s (%d).", msg,
+					(int)(uint16_t)(err->byte - 2));
+		}
+	}
+
+	return snprintf(buf, size, "%s.", msg);
+}
+
+
+int
+trs80_identify(const void *buf, size_t len)
+{
+	static const struct trs80_edtasm_visitor	v = { NULL, NULL };
+	struct trs80_cmd_info				info;
+
+	if (len == 0)
+		return TRS80_TYPE_UNKNOWN;
+
+	if (trs80_edtasm_visit(buf, len, &v, NULL, NULL) == TRS80_OK)
+		return TRS80_TYPE_EDTASM;
+
+	if (trs80_cmd_parse(buf, len, NULL, NULL, &info, NULL) == TRS80_OK &&
+	    info.has_xfer)
+		return TRS80_TYPE_CMD;
+
+	return TRS80_TYPE_UNKNOWN;
+}
+
+
+const char *
+trs80_type_name(int type)
+{
+	switch (type) {
+	case TRS80_TYPE_EDTASM:
+		return "EDTASM";
+	case TRS80_TYPE_CMD:
+		return "CMD";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,1160 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * A Z80 interpreter, timed in T-states.
+ *
+ * Everything the CPU holds lives in locals of trs80_z80_run() while it
+ * runs, so that the compiler can keep it in registers: a store through
+ * the memory pointer could alias anything reached through a pointer,
+ * but never a local whose address isn't taken.  The registers only go
+ * back to the caller's struct around a trap and at the end.
+ *
+ * Each instruction is a case of one big switch, or of the CB, ED and
+ * DD/FD switches after a prefix.  An index prefix only has cases of its
+ * own for the instructions it changes, those using H, L or (HL); the
+ * rest run as unprefixed, 4 T-states later.  Control transfers check
+ * the trap map, so that the check costs nothing in straight line
+ * code.
+ *
+ * Flags are computed the usual way, including the two undocumented
+ * bits 3 and 5 of F where that is cheap.  There are no interrupts.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trs80util.h"
+
+
+#define	FC	0x01
+#define	FN	0x02
+#define	FP	0x04		/* Parity or overflow */
+#define	FX	0x08		/* Undocumented, bit 3 */
+#define	FH	0x10
+#define	FY	0x20		/* Undocumented, bit 5 */
+#define	FZ	0x40
+#define	FS	0x80
+
+#define	PENDING_TRAP	1
+#define	PENDING_HALT	2
+
+
+/* S, Z, bits 5 and 3, and parity of each byte value. */
+static const unsigned char Szp[256] = {
+	0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x08, 0x0c, 0x0c, 0x08, 0x0c, 0x08, 0x08, 0x0c,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x0c, 0x08, 0x08, 0x0c, 0x08, 0x0c, 0x0c, 0x08,
+	0x20, 0x24, 0x24, 0x20, 0x24, 0x20, 0x20, 0x24,
+	0x2c, 0x28, 0x28, 0x2c, 0x28, 0x2c, 0x2c, 0x28,
+	0x24, 0x20, 0x20, 0x24, 0x20, 0x24, 0x24, 0x20,
+	0x28, 0x2c, 0x2c, 0x28, 0x2c, 0x28, 0x28, 0x2c,
+	0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+	0x0c, 0x08, 0x08, 0x0c, 0x08, 0x0c, 0x0c, 0x08,
+	0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+	0x08, 0x0c, 0x0c, 0x08, 0x0c, 0x08, 0x08, 0x0c,
+	0x24, 0x20, 0x20, 0x24, 0x20, 0x24, 0x24, 0x20,
+	0x28, 0x2c, 0x2c, 0x28, 0x2c, 0x28, 0x28, 0x2c,
+	0x20, 0x24, 0x24, 0x20, 0x24, 0x20, 0x20, 0x24,
+	0x2c, 0x28, 0x28, 0x2c, 0x28, 0x2c, 0x2c, 0x28,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x8c, 0x88, 0x88, 0x8c, 0x88, 0x8c, 0x8c, 0x88,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x88, 0x8c, 0x8c, 0x88, 0x8c, 0x88, 0x88, 0x8c,
+	0xa4, 0xa0, 0xa0, 0xa4, 0xa0, 0xa4, 0xa4, 0xa0,
+	0xa8, 0xac, 0xac, 0xa8, 0xac, 0xa8, 0xa8, 0xac,
+	0xa0, 0xa4, 0xa4, 0xa0, 0xa4, 0xa0, 0xa0, 0xa4,
+	0xac, 0xa8, 0xa8, 0xac, 0xa8, 0xac, 0xac, 0xa8,
+	0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+	0x88, 0x8c, 0x8c, 0x88, 0x8c, 0x88, 0x88, 0x8c,
+	0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+	0x8c, 0x88, 0x88, 0x8c, 0x88, 0x8c, 0x8c, 0x88,
+	0xa0, 0xa4, 0xa4, 0xa0, 0xa4, 0xa0, 0xa0, 0xa4,
+	0xac, 0xa8, 0xa8, 0xac, 0xa8, 0xac, 0xac, 0xa8,
+	0xa4, 0xa0, 0xa0, 0xa4, 0xa0, 0xa4, 0xa4, 0xa0,
+	0xa8, 0xac, 0xac, 0xa8, 0xac, 0xa8, 0xa8, 0xac,
+};
+
+
+/*
+ * Memory and registers.
+ */
+
+#define	RD(a)		(mem[(a)])
+#define	WR(a, v)	(mem[(a)] = (v))
+#define	RD16(a)		(mem[(a)] | mem[((a) + 1) & 0xffff] << 8)
+#define	WR16(a, v)	do {						\
+				unsigned int	a_ = (a), v_ = (v);	\
+									\
+				mem[a_] = v_ & 0xff;			\
+				mem[(a_ + 1) & 0xffff] = v_ >> 8;	\
+			} while (0)
+
+#define	FETCH8(v)	do { (v) = mem[pc]; pc = (pc + 1) & 0xffff; } while (0)
+#define	FETCH16(v)	do { (v) = RD16(pc); pc = (pc + 2) & 0xffff; } while (0)
+#define	PUSH(v)		do { sp = (sp - 2) & 0xffff; WR16(sp, (v)); } while (0)
+#define	POP(v)		do { (v) = RD16(sp); sp = (sp + 2) & 0xffff; } while (0)
+
+#define	BC		(b << 8 | c)
+#define	DE		(d << 8 | e)
+#define	HL		(h << 8 | l)
+#define	SET_BC(v)	(b = (v) >> 8 & 0xff, c = (v) & 0xff)
+#define	SET_DE(v)	(d = (v) >> 8 & 0xff, e = (v) & 0xff)
+#define	SET_HL(v)	(h = (v) >> 8 & 0xff, l = (v) & 0xff)
+
+/* The index register halves, and (IX+d) or (IY+d). */
+#define	GET_XH		(xy >> 8)
+#define	GET_XL		(xy & 0xff)
+#define	SET_XH(v)	(xy = (xy & 0x00ff) | (v) << 8)
+#define	SET_XL(v)	(xy = (xy & 0xff00) | (v))
+#define	IDX(dis)	((xy + (((dis) ^ 0x80) - 0x80)) & 0xffff)
+
+#define	T(n)		(cost = (n))
+
+#define	TRAPPED(a)	(trap[(a) >> 3] >> ((a) & 7) & 1)
+
+/* A jump that may close a loop, when it goes back into the program. */
+#define	BRANCH(to)	do {						\
+				pc = (to);				\
+				if (TRAPPED(pc)) {			\
+					pending = PENDING_TRAP;		\
+				} else if (pc <= start && prof) {	\
+					++prof->loops[pc];		\
+					if (start > prof->loop_end[pc])	\
+						prof->loop_end[pc] = start; \
+				}					\
+			} while (0)
+
+/* Calls, returns and restarts. */
+#define	TRANSFER(to)	do {						\
+				pc = (to);				\
+				if (TRAPPED(pc))			\
+					pending = PENDING_TRAP;		\
+			} while (0)
+
+#define	CC(n)		((n) == 0 ? !(f & FZ) : (n) == 1 ? (f & FZ) :	\
+			 (n) == 2 ? !(f & FC) : (n) == 3 ? (f & FC) :	\
+			 (n) == 4 ? !(f & FP) : (n) == 5 ? (f & FP) :	\
+			 (n) == 6 ? !(f & FS) : (f & FS))
+
+
+/*
+ * Arithmetic.
+ */
+
+#define	ADD8(v)		do {						\
+				unsigned int	v_ = (v), r_ = a + v_;	\
+									\
+				f = (r_ & 0xa8) | ((r_ & 0xff) ? 0 : FZ) | \
+				    ((a ^ v_ ^ r_) & FH) |		\
+				    ((~(a ^ v_) & (a ^ r_) & 0x80) >> 5) | \
+				    (r_ >> 8);				\
+				a = r_ & 0xff;				\
+			} while (0)
+#define	ADC8(v)		do {						\
+				unsigned int	v_ = (v);		\
+				unsigned int	r_ = a + v_ + (f & FC);	\
+									\
+				f = (r_ & 0xa8) | ((r_ & 0xff) ? 0 : FZ) | \
+				    ((a ^ v_ ^ r_) & FH) |		\
+				    ((~(a ^ v_) & (a ^ r_) & 0x80) >> 5) | \
+				    (r_ >> 8);				\
+				a = r_ & 0xff;				\
+			} while (0)
+#define	SUB8(v)		do {						\
+				unsigned int	v_ = (v), r_ = a - v_;	\
+									\
+				f = (r_ & 0xa8) | ((r_ & 0xff) ? 0 : FZ) | \
+				    ((a ^ v_ ^ r_) & FH) |		\
+				    (((a ^ v_) & (a ^ r_) & 0x80) >> 5) | \
+				    FN | (r_ >> 8 & FC);		\
+				a = r_ & 0xff;				\
+			} while (0)
+#define	SBC8(v)		do {						\
+				unsigned int	v_ = (v);		\
+				unsigned int	r_ = a - v_ - (f & FC);	\
+									\
+				f = (r_ & 0xa8) | ((r_ & 0xff) ? 0 : FZ) | \
+				    ((a ^ v_ ^ r_) & FH) |		\
+				    (((a ^ v_) & (a ^ r_) & 0x80) >> 5) | \
+				    FN | (r_ >> 8 & FC);		\
+				a = r_ & 0xff;				\
+			} while (0)
+/* Bits 5 and 3 come from the operand, not the result. */
+#define	CP8(v)		do {						\
+				unsigned int	v_ = (v), r_ = a - v_;	\
+									\
+				f = (r_ & FS) | ((r_ & 0xff) ? 0 : FZ) |	\
+				    (v_ & (FY | FX)) |			\
+				    ((a ^ v_ ^ r_) & FH) |		\
+				    (((a ^ v_) & (a ^ r_) & 0x80) >> 5) | \
+				    FN | (r_ >> 8 & FC);		\
+			} while (0)
+#define	AND8(v)		(a &= (v), f = Szp[a] | FH)
+#define	XOR8(v)		(a ^= (v), f = Szp[a])
+#define	OR8(v)		(a |= (v), f = Szp[a])
+
+#define	INC8(x)		do {						\
+				(x) = ((x) + 1) & 0xff;			\
+				f = (f & FC) | (Szp[(x)] & ~FP) |	\
+				    (((x) & 0x0f) ? 0 : FH) |		\
+				    ((x) == 0x80 ? FP : 0);		\
+			} while (0)
+#define	DEC8(x)		do {						\
+				(x) = ((x) - 1) & 0xff;			\
+				f = (f & FC) | FN | (Szp[(x)] & ~FP) |	\
+				    (((x) & 0x0f) == 0x0f ? FH : 0) |	\
+				    ((x) == 0x7f ? FP : 0);		\
+			} while (0)
+
+/* ADD HL,rr and the like: S, Z and P/V are kept. */
+#define	ADD16(x, v)	do {						\
+				unsigned int	v_ = (v), r_ = (x) + v_; \
+									\
+				f = (f & (FS | FZ | FP)) |		\
+				    (r_ >> 8 & (FY | FX)) |		\
+				    (((x) ^ v_ ^ r_) >> 8 & FH) |	\
+				    (r_ >> 16);				\
+				(x) = r_ & 0xffff;			\
+			} while (0)
+
+
+/* ADC HL,v or SBC HL,v, returning the result. */
+static unsigned int
+adc16(unsigned int hl, unsigned int v, unsigned int *fp, int sub)
+{
+	unsigned int	f = *fp, r;
+
+	if (sub) {
+		r = hl - v - (f & FC);
+		f = FN | (((hl ^ v) & (hl ^ r) & 0x8000) >> 13);
+	} else {
+		r = hl + v + (f & FC);
+		f = (~(hl ^ v) & (hl ^ r) & 0x8000) >> 13;
+	}
+	f |= (r >> 8 & (FS | FY | FX)) | ((r & 0xffff) ? 0 : FZ) |
+	     (((hl ^ v ^ r) >> 8) & FH) | (r >> 16 & FC);
+	*fp = f;
+
+	return r & 0xffff;
+}
+
+
+/* The CB shifts and rotates: the result, with the new F above it. */
+static unsigned int
+shift(unsigned int op, unsigned int v, unsigned int f)
+{
+	unsigned int	r, cy;
+
+	switch (op & 7) {
+	case 0:	cy = v >> 7; r = v << 1 | cy; break;		/* RLC */
+	case 1:	cy = v & 1; r = v >> 1 | cy << 7; break;	/* RRC */
+	case 2:	cy = v >> 7; r = v << 1 | (f & FC); break;	/* RL */
+	case 3:	cy = v & 1; r = v >> 1 | (f & FC) << 7; break;	/* RR */
+	case 4:	cy = v >> 7; r = v << 1; break;			/* SLA */
+	case 5:	cy = v & 1; r = v >> 1 | (v & 0x80); break;	/* SRA */
+	case 6:	cy = v >> 7; r = v << 1 | 1; break;		/* SLL */
+	default: cy = v & 1; r = v >> 1; break;			/* SRL */
+	}
+	r &= 0xff;
+
+	return (Szp[r] | cy) << 8 | r;
+}
+
+
+static int
+default_in(void *arg, unsigned int port)
+{
+	(void)arg;
+	(void)port;
+
+	return 0xff;
+}
+
+
+static void
+default_out(void *arg, unsigned int port, unsigned int value)
+{
+	(void)arg;
+	(void)port;
+	(void)value;
+}
+
+
+/* The 8-bit register or (HL) numbered n, as in the opcodes. */
+#define	GET8(n, v)	do {						\
+				switch (n) {				\
+				case 0: (v) = b; break;			\
+				case 1: (v) = c; break;			\
+				case 2: (v) = d; break;			\
+				case 3: (v) = e; break;			\
+				case 4: (v) = h; break;			\
+				case 5: (v) = l; break;			\
+				case 6: (v) = RD(HL); break;		\
+				default: (v) = a; break;		\
+				}					\
+			} while (0)
+#define	SET8(n, v)	do {						\
+				switch (n) {				\
+				case 0: b = (v); break;			\
+				case 1: c = (v); break;			\
+				case 2: d = (v); break;			\
+				case 3: e = (v); break;			\
+				case 4: h = (v); break;			\
+				case 5: l = (v); break;			\
+				case 6: WR(HL, (v)); break;		\
+				default: a = (v); break;		\
+				}					\
+			} while (0)
+
+#define	GET16(n)	((n) == 0 ? BC : (n) == 1 ? DE : (n) == 2 ? HL : sp)
+#define	SET16(n, v)	do {						\
+				switch (n) {				\
+				case 0: SET_BC(v); break;		\
+				case 1: SET_DE(v); break;		\
+				case 2: SET_HL(v); break;		\
+				default: sp = (v); break;		\
+				}					\
+			} while (0)
+
+
+int
+trs80_z80_run(struct trs80_z80_regs *regs, const struct trs80_z80_env *env,
+	      unsigned long long limit, unsigned long long *tstates)
+{
+	unsigned char			*mem = env->mem;
+	const unsigned char		*trap = env->trap;
+	struct trs80_z80_profile	*prof = env->profile;
+	int		(*in)(void *, unsigned int) = env->in ? env->in :
+							       default_in;
+	void		(*out)(void *, unsigned int, unsigned int) =
+				env->out ? env->out : default_out;
+	unsigned int	a, f, b, c, d, e, h, l;
+	unsigned int	ix, iy, sp, pc, ir_i, r, r7;
+	unsigned int	af2, bc2, de2, hl2, iff1, iff2, im;
+	unsigned int	op, v, w, xy, pfx, start = 0, cost = 0;
+	unsigned long long	t = 0;
+	int		pending, end = TRS80_Z80_LIMIT;
+
+	a = regs->af >> 8 & 0xff;
+	f = regs->af & 0xff;
+	b = regs->bc >> 8 & 0xff;
+	c = regs->bc & 0xff;
+	d = regs->de >> 8 & 0xff;
+	e = regs->de & 0xff;
+	h = regs->hl >> 8 & 0xff;
+	l = regs->hl & 0xff;
+	ix = regs->ix & 0xffff;
+	iy = regs->iy & 0xffff;
+	sp = regs->sp & 0xffff;
+	pc = regs->pc & 0xffff;
+	af2 = regs->af2 & 0xffff;
+	bc2 = regs->bc2 & 0xffff;
+	de2 = regs->de2 & 0xffff;
+	hl2 = regs->hl2 & 0xffff;
+	ir_i = regs->i & 0xff;
+	r = regs->r & 0x7f;
+	r7 = regs->r & 0x80;
+	iff1 = regs->iff1;
+	iff2 = regs->iff2;
+	im = regs->im;
+
+#define	SAVE_REGS()	do {						\
+				regs->af = a << 8 | f;			\
+				regs->bc = BC;				\
+				regs->de = DE;				\
+				regs->hl = HL;				\
+				regs->ix = ix;				\
+				regs->iy = iy;				\
+				regs->sp = sp;				\
+				regs->pc = pc;				\
+				regs->af2 = af2;			\
+				regs->bc2 = bc2;			\
+				regs->de2 = de2;			\
+				regs->hl2 = hl2;			\
+				regs->i = ir_i;				\
+				regs->r = (r & 0x7f) | r7;		\
+				regs->iff1 = iff1;			\
+				regs->iff2 = iff2;			\
+				regs->im = im;				\
+			} while (0)
+
+	pending = TRAPPED(pc) ? PENDING_TRAP : 0;
+
+	while (t < limit) {
+		if (pending) {
+			unsigned long	tcost = 0;
+			int		act = TRS80_Z80_RET;
+
+			if (pending == PENDING_HALT) {
+				end = TRS80_Z80_HALTED;
+				break;
+			}
+			pending = 0;
+
+			if (env->trap_fn) {
+				SAVE_REGS();
+				act = env->trap_fn(env->arg, regs, mem, &tcost);
+				a = regs->af >> 8 & 0xff;
+				f = regs->af & 0xff;
+				b = regs->bc >> 8 & 0xff;
+				c = regs->bc & 0xff;
+				d = regs->de >> 8 & 0xff;
+				e = regs->de & 0xff;
+				h = regs->hl >> 8 & 0xff;
+				l = regs->hl & 0xff;
+				ix = regs->ix & 0xffff;
+				iy = regs->iy & 0xffff;
+				sp = regs->sp & 0xffff;
+				pc = regs->pc & 0xffff;
+			}
+			t += tcost;
+			if (prof)
+				prof->cycles[pc] += tcost;
+
+			if (act == TRS80_Z80_STOP) {
+				end = TRS80_Z80_STOPPED;
+				break;
+			}
+			if (act == TRS80_Z80_RET) {
+				POP(pc);
+				if (TRAPPED(pc))
+					pending = PENDING_TRAP;
+			}
+			continue;
+		}
+
+		start = pc;
+		FETCH8(op);
+		++r;
+
+execute:
+		switch (op) {
+		case 0x00: T(4); break;
+		case 0x01: FETCH16(v); SET_BC(v); T(10); break;
+		case 0x02: WR(BC, a); T(7); break;
+		case 0x03: v = (BC + 1) & 0xffff; SET_BC(v); T(6); break;
+		case 0x04: INC8(b); T(4); break;
+		case 0x05: DEC8(b); T(4); break;
+		case 0x06: FETCH8(b); T(7); break;
+		case 0x07:
+			a = (a << 1 | a >> 7) & 0xff;
+			f = (f & (FS | FZ | FP)) | (a & (FY | FX | FC));
+			T(4);
+			break;
+		case 0x08:
+			v = a << 8 | f;
+			a = af2 >> 8;
+			f = af2 & 0xff;
+			af2 = v;
+			T(4);
+			break;
+		case 0x09: v = HL; ADD16(v, BC); SET_HL(v); T(11); break;
+		case 0x0a: a = RD(BC); T(7); break;
+		case 0x0b: v = (BC - 1) & 0xffff; SET_BC(v); T(6); break;
+		case 0x0c: INC8(c); T(4); break;
+		case 0x0d: DEC8(c); T(4); break;
+		case 0x0e: FETCH8(c); T(7); break;
+		case 0x0f:
+			f = (f & (FS | FZ | FP)) | (a & FC);
+			a = (a >> 1 | a << 7) & 0xff;
+			f |= a & (FY | FX);
+			T(4);
+			break;
+
+		case 0x10:
+			FETCH8(v);
+			b = (b - 1) & 0xff;
+			if (b) {
+				BRANCH((pc + (v ^ 0x80) - 0x80) & 0xffff);
+				T(13);
+			} else {
+				T(8);
+			}
+			break;
+		case 0x11: FETCH16(v); SET_DE(v); T(10); break;
+		case 0x12: WR(DE, a); T(7); break;
+		case 0x13: v = (DE + 1) & 0xffff; SET_DE(v); T(6); break;
+		case 0x14: INC8(d); T(4); break;
+		case 0x15: DEC8(d); T(4); break;
+		case 0x16: FETCH8(d); T(7); break;
+		case 0x17:
+			v = a >> 7;
+			a = (a << 1 | (f & FC)) & 0xff;
+			f = (f & (FS | FZ | FP)) | (a & (FY | FX)) | v;
+			T(4);
+			break;
+		case 0x18:
+			FETCH8(v);
+			BRANCH((pc + (v ^ 0x80) - 0x80) & 0xffff);
+			T(12);
+			break;
+		case 0x19: v = HL; ADD16(v, DE); SET_HL(v); T(11); break;
+		case 0x1a: a = RD(DE); T(7); break;
+		case 0x1b: v = (DE - 1) & 0xffff; SET_DE(v); T(6); break;
+		case 0x1c: INC8(e); T(4); break;
+		case 0x1d: DEC8(e); T(4); break;
+		case 0x1e: FETCH8(e); T(7); break;
+		case 0x1f:
+			v = a & 1;
+			a = (a >> 1 | (f & FC) << 7) & 0xff;
+			f = (f & (FS | FZ | FP)) | (a & (FY | FX)) | v;
+			T(4);
+			break;
+
+		case 0x20: case 0x28: case 0x30: case 0x38:
+			FETCH8(v);
+			if (CC((op >> 3) & 3)) {
+				BRANCH((pc + (v ^ 0x80) - 0x80) & 0xffff);
+				T(12);
+			} else {
+				T(7);
+			}
+			break;
+		case 0x21: FETCH16(v); SET_HL(v); T(10); break;
+		case 0x22: FETCH16(w); WR16(w, HL); T(16); break;
+		case 0x23: v = (HL + 1) & 0xffff; SET_HL(v); T(6); break;
+		case 0x24: INC8(h); T(4); break;
+		case 0x25: DEC8(h); T(4); break;
+		case 0x26: FETCH8(h); T(7); break;
+		case 0x27: {
+			unsigned int	diff = 0, cy = f & FC;
+
+			if ((f & FH) || (a & 0x0f) > 9)
+				diff = 0x06;
+			if (cy || a > 0x99) {
+				diff |= 0x60;
+				cy = FC;
+			}
+			if (f & FN) {
+				v = (f & FH) && (a & 0x0f) < 6 ? FH : 0;
+				a = (a - diff) & 0xff;
+			} else {
+				v = (a & 0x0f) > 9 ? FH : 0;
+				a = (a + diff) & 0xff;
+			}
+			f = Szp[a] | (f & FN) | cy | v;
+			T(4);
+			break;
+		}
+		case 0x29: v = HL; ADD16(v, v); SET_HL(v); T(11); break;
+		case 0x2a: FETCH16(w); v = RD16(w); SET_HL(v); T(16); break;
+		case 0x2b: v = (HL - 1) & 0xffff; SET_HL(v); T(6); break;
+		case 0x2c: INC8(l); T(4); break;
+		case 0x2d: DEC8(l); T(4); break;
+		case 0x2e: FETCH8(l); T(7); break;
+		case 0x2f:
+			a ^= 0xff;
+			f = (f & (FS | FZ | FP | FC)) | FH | FN |
+			    (a & (FY | FX));
+			T(4);
+			break;
+
+		case 0x31: FETCH16(sp); T(10); break;
+		case 0x32: FETCH16(w); WR(w, a); T(13); break;
+		case 0x33: sp = (sp + 1) & 0xffff; T(6); break;
+		case 0x34: w = HL; v = RD(w); INC8(v); WR(w, v); T(11); break;
+		case 0x35: w = HL; v = RD(w); DEC8(v); WR(w, v); T(11); break;
+		case 0x36: FETCH8(v); WR(HL, v); T(10); break;
+		case 0x37:
+			f = (f & (FS | FZ | FP)) | (a & (FY | FX)) | FC;
+			T(4);
+			break;
+		case 0x39: v = HL; ADD16(v, sp); SET_HL(v); T(11); break;
+		case 0x3a: FETCH16(w); a = RD(w); T(13); break;
+		case 0x3b: sp = (sp - 1) & 0xffff; T(6); break;
+		case 0x3c: INC8(a); T(4); break;
+		case 0x3d: DEC8(a); T(4); break;
+		case 0x3e: FETCH8(a); T(7); break;
+		case 0x3f:
+			f = ((f & (FS | FZ | FP | FC)) | (f & FC) << 4 |
+			     (a & (FY | FX))) ^ FC;
+			T(4);
+			break;
+
+		case 0x40: T(4); break;
+		case 0x41: b = c; T(4); break;
+		case 0x42: b = d; T(4); break;
+		case 0x43: b = e; T(4); break;
+		case 0x44: b = h; T(4); break;
+		case 0x45: b = l; T(4); break;
+		case 0x46: b = RD(HL); T(7); break;
+		case 0x47: b = a; T(4); break;
+		case 0x48: c = b; T(4); break;
+		case 0x49: T(4); break;
+		case 0x4a: c = d; T(4); break;
+		case 0x4b: c = e; T(4); break;
+		case 0x4c: c = h; T(4); break;
+		case 0x4d: c = l; T(4); break;
+		case 0x4e: c = RD(HL); T(7); break;
+		case 0x4f: c = a; T(4); break;
+		case 0x50: d = b; T(4); break;
+		case 0x51: d = c; T(4); break;
+		case 0x52: T(4); break;
+		case 0x53: d = e; T(4); break;
+		case 0x54: d = h; T(4); break;
+		case 0x55: d = l; T(4); break;
+		case 0x56: d = RD(HL); T(7); break;
+		case 0x57: d = a; T(4); break;
+		case 0x58: e = b; T(4); break;
+		case 0x59: e = c; T(4); break;
+		case 0x5a: e = d; T(4); break;
+		case 0x5b: T(4); break;
+		case 0x5c: e = h; T(4); break;
+		case 0x5d: e = l; T(4); break;
+		case 0x5e: e = RD(HL); T(7); break;
+		case 0x5f: e = a; T(4); break;
+		case 0x60: h = b; T(4); break;
+		case 0x61: h = c; T(4); break;
+		case 0x62: h = d; T(4); break;
+		case 0x63: h = e; T(4); break;
+		case 0x64: T(4); break;
+		case 0x65: h = l; T(4); break;
+		case 0x66: h = RD(HL); T(7); break;
+		case 0x67: h = a; T(4); break;
+		case 0x68: l = b; T(4); break;
+		case 0x69: l = c; T(4); break;
+		case 0x6a: l = d; T(4); break;
+		case 0x6b: l = e; T(4); break;
+		case 0x6c: l = h; T(4); break;
+		case 0x6d: T(4); break;
+		case 0x6e: l = RD(HL); T(7); break;
+		case 0x6f: l = a; T(4); break;
+		case 0x70: WR(HL, b); T(7); break;
+		case 0x71: WR(HL, c); T(7); break;
+		case 0x72: WR(HL, d); T(7); break;
+		case 0x73: WR(HL, e); T(7); break;
+		case 0x74: WR(HL, h); T(7); break;
+		case 0x75: WR(HL, l); T(7); break;
+		case 0x77: WR(HL, a); T(7); break;
+		case 0x78: a = b; T(4); break;
+		case 0x79: a = c; T(4); break;
+		case 0x7a: a = d; T(4); break;
+		case 0x7b: a = e; T(4); break;
+		case 0x7c: a = h; T(4); break;
+		case 0x7d: a = l; T(4); break;
+		case 0x7e: a = RD(HL); T(7); break;
+		case 0x7f: T(4); break;
+		case 0x76:
+			pc = start;
+			pending = PENDING_HALT;
+			T(4);
+			break;
+
+		case 0x80: ADD8(b); T(4); break;
+		case 0x81: ADD8(c); T(4); break;
+		case 0x82: ADD8(d); T(4); break;
+		case 0x83: ADD8(e); T(4); break;
+		case 0x84: ADD8(h); T(4); break;
+		case 0x85: ADD8(l); T(4); break;
+		case 0x86: v = RD(HL); ADD8(v); T(7); break;
+		case 0x87: ADD8(a); T(4); break;
+		case 0x88: ADC8(b); T(4); break;
+		case 0x89: ADC8(c); T(4); break;
+		case 0x8a: ADC8(d); T(4); break;
+		case 0x8b: ADC8(e); T(4); break;
+		case 0x8c: ADC8(h); T(4); break;
+		case 0x8d: ADC8(l); T(4); break;
+		case 0x8e: v = RD(HL); ADC8(v); T(7); break;
+		case 0x8f: ADC8(a); T(4); break;
+		case 0x90: SUB8(b); T(4); break;
+		case 0x91: SUB8(c); T(4); break;
+		case 0x92: SUB8(d); T(4); break;
+		case 0x93: SUB8(e); T(4); break;
+		case 0x94: SUB8(h); T(4); break;
+		case 0x95: SUB8(l); T(4); break;
+		case 0x96: v = RD(HL); SUB8(v); T(7); break;
+		case 0x97: SUB8(a); T(4); break;
+		case 0x98: SBC8(b); T(4); break;
+		case 0x99: SBC8(c); T(4); break;
+		case 0x9a: SBC8(d); T(4); break;
+		case 0x9b: SBC8(e); T(4); break;
+		case 0x9c: SBC8(h); T(4); break;
+		case 0x9d: SBC8(l); T(4); break;
+		case 0x9e: v = RD(HL); SBC8(v); T(7); break;
+		case 0x9f: SBC8(a); T(4); break;
+		case 0xa0: AND8(b); T(4); break;
+		case 0xa1: AND8(c); T(4); break;
+		case 0xa2: AND8(d); T(4); break;
+		case 0xa3: AND8(e); T(4); break;
+		case 0xa4: AND8(h); T(4); break;
+		case 0xa5: AND8(l); T(4); break;
+		case 0xa6: v = RD(HL); AND8(v); T(7); break;
+		case 0xa7: AND8(a); T(4); break;
+		case 0xa8: XOR8(b); T(4); break;
+		case 0xa9: XOR8(c); T(4); break;
+		case 0xaa: XOR8(d); T(4); break;
+		case 0xab: XOR8(e); T(4); break;
+		case 0xac: XOR8(h); T(4); break;
+		case 0xad: XOR8(l); T(4); break;
+		case 0xae: v = RD(HL); XOR8(v); T(7); break;
+		case 0xaf: XOR8(a); T(4); break;
+		case 0xb0: OR8(b); T(4); break;
+		case 0xb1: OR8(c); T(4); break;
+		case 0xb2: OR8(d); T(4); break;
+		case 0xb3: OR8(e); T(4); break;
+		case 0xb4: OR8(h); T(4); break;
+		case 0xb5: OR8(l); T(4); break;
+		case 0xb6: v = RD(HL); OR8(v); T(7); break;
+		case 0xb7: OR8(a); T(4); break;
+		case 0xb8: CP8(b); T(4); break;
+		case 0xb9: CP8(c); T(4); break;
+		case 0xba: CP8(d); T(4); break;
+		case 0xbb: CP8(e); T(4); break;
+		case 0xbc: CP8(h); T(4); break;
+		case 0xbd: CP8(l); T(4); break;
+		case 0xbe: v = RD(HL); CP8(v); T(7); break;
+		case 0xbf: CP8(a); T(4); break;
+
+		case 0xc0: case 0xc8: case 0xd0: case 0xd8:
+		case 0xe0: case 0xe8: case 0xf0: case 0xf8:
+			if (CC((op >> 3) & 7)) {
+				POP(v);
+				TRANSFER(v);
+				T(11);
+			} else {
+				T(5);
+			}
+			break;
+		case 0xc1: POP(v); SET_BC(v); T(10); break;
+		case 0xd1: POP(v); SET_DE(v); T(10); break;
+		case 0xe1: POP(v); SET_HL(v); T(10); break;
+		case 0xf1: POP(v); a = v >> 8; f = v & 0xff; T(10); break;
+		case 0xc2: case 0xca: case 0xd2: case 0xda:
+		case 0xe2: case 0xea: case 0xf2: case 0xfa:
+			FETCH16(v);
+			if (CC((op >> 3) & 7))
+				BRANCH(v);
+			T(10);
+			break;
+		case 0xc3: FETCH16(v); BRANCH(v); T(10); break;
+		case 0xc4: case 0xcc: case 0xd4: case 0xdc:
+		case 0xe4: case 0xec: case 0xf4: case 0xfc:
+			FETCH16(v);
+			if (CC((op >> 3) & 7)) {
+				PUSH(pc);
+				TRANSFER(v);
+				T(17);
+			} else {
+				T(10);
+			}
+			break;
+		case 0xc5: PUSH(BC); T(11); break;
+		case 0xd5: PUSH(DE); T(11); break;
+		case 0xe5: PUSH(HL); T(11); break;
+		case 0xf5: PUSH(a << 8 | f); T(11); break;
+		case 0xc6: FETCH8(v); ADD8(v); T(7); break;
+		case 0xce: FETCH8(v); ADC8(v); T(7); break;
+		case 0xd6: FETCH8(v); SUB8(v); T(7); break;
+		case 0xde: FETCH8(v); SBC8(v); T(7); break;
+		case 0xe6: FETCH8(v); AND8(v); T(7); break;
+		case 0xee: FETCH8(v); XOR8(v); T(7); break;
+		case 0xf6: FETCH8(v); OR8(v); T(7); break;
+		case 0xfe: FETCH8(v); CP8(v); T(7); break;
+		case 0xc7: case 0xcf: case 0xd7: case 0xdf:
+		case 0xe7: case 0xef: case 0xf7: case 0xff:
+			PUSH(pc);
+			TRANSFER(op & 0x38);
+			T(11);
+			break;
+		case 0xc9: POP(v); TRANSFER(v); T(10); break;
+		case 0xcd: FETCH16(v); PUSH(pc); TRANSFER(v); T(17); break;
+
+		case 0xcb:
+			FETCH8(op);
+			++r;
+			GET8(op & 7, v);
+			if (op < 0x40) {
+				v = shift(op >> 3, v, f);
+				f = v >> 8;
+				v &= 0xff;
+				SET8(op & 7, v);
+				T((op & 7) == 6 ? 15 : 8);
+			} else if (op < 0x80) {
+				w = 1 << ((op >> 3) & 7);
+				f = (f & FC) | FH | (v & (FY | FX)) |
+				    (v & w ? (w & FS) : FZ | FP);
+				T((op & 7) == 6 ? 12 : 8);
+			} else {
+				w = 1 << ((op >> 3) & 7);
+				v = op < 0xc0 ? v & ~w : v | w;
+				SET8(op & 7, v);
+				T((op & 7) == 6 ? 15 : 8);
+			}
+			break;
+
+		case 0xd3:
+			FETCH8(v);
+			out(env->arg, a << 8 | v, a);
+			T(11);
+			break;
+		case 0xd9:
+			v = BC; SET_BC(bc2); bc2 = v;
+			v = DE; SET_DE(de2); de2 = v;
+			v = HL; SET_HL(hl2); hl2 = v;
+			T(4);
+			break;
+		case 0xdb:
+			FETCH8(v);
+			a = in(env->arg, a << 8 | v) & 0xff;
+			T(11);
+			break;
+
+		case 0xe3:
+			v = RD16(sp);
+			WR16(sp, HL);
+			SET_HL(v);
+			T(19);
+			break;
+		case 0xe9: TRANSFER(HL); T(4); break;
+		case 0xeb:
+			v = d; d = h; h = v;
+			v = e; e = l; l = v;
+			T(4);
+			break;
+
+		case 0xf3: iff1 = iff2 = 0; T(4); break;
+		case 0xf9: sp = HL; T(6); break;
+		case 0xfb: iff1 = iff2 = 1; T(4); break;
+
+		case 0xed:
+			FETCH8(op);
+			++r;
+			goto extended;
+
+		case 0xdd:
+		case 0xfd:
+			pfx = op;
+			xy = op == 0xdd ? ix : iy;
+			FETCH8(op);
+			++r;
+			goto indexed;
+		}
+		goto account;
+
+		/*
+		 * ED prefixed.
+		 */
+extended:
+		T(8);
+		if (op >= 0x40 && op < 0x80) {
+			unsigned int	n = (op >> 3) & 7;
+
+			switch (op & 7) {
+			case 0:		/* IN r,(C); IN F,(C) sets flags only */
+				v = in(env->arg, BC) & 0xff;
+				f = (f & FC) | Szp[v];
+				if (n != 6)
+					SET8(n, v);
+				T(12);
+				break;
+			case 1:		/* OUT (C),r; OUT (C),0 */
+				if (n == 6)
+					v = 0;
+				else
+					GET8(n, v);
+				out(env->arg, BC, v);
+				T(12);
+				break;
+			case 2:		/* SBC HL,rr; ADC HL,rr */
+				v = adc16(HL, GET16(n >> 1), &f, !(n & 1));
+				SET_HL(v);
+				T(15);
+				break;
+			case 3:		/* LD (nn),rr; LD rr,(nn) */
+				FETCH16(w);
+				if (n & 1) {
+					v = RD16(w);
+					SET16(n >> 1, v);
+				} else {
+					WR16(w, GET16(n >> 1));
+				}
+				T(20);
+				break;
+			case 4:		/* NEG */
+				v = a;
+				a = 0;
+				SUB8(v);
+				break;
+			case 5:		/* RETN, RETI */
+				iff1 = iff2;
+				POP(v);
+				TRANSFER(v);
+				T(14);
+				break;
+			case 6:
+				im = (n & 3) == 2 ? 1 : (n & 3) == 3 ? 2 : 0;
+				break;
+			default:
+				switch (n) {
+				case 0: ir_i = a; T(9); break;
+				case 1: r = a & 0x7f; r7 = a & 0x80; T(9); break;
+				case 2:
+					a = ir_i;
+					f = (f & FC) | (Szp[a] & ~FP) |
+					    (iff2 ? FP : 0);
+					T(9);
+					break;
+				case 3:
+					a = (r & 0x7f) | r7;
+					f = (f & FC) | (Szp[a] & ~FP) |
+					    (iff2 ? FP : 0);
+					T(9);
+					break;
+				case 4:		/* RRD */
+					w = HL;
+					v = RD(w);
+					WR(w, (a << 4 | v >> 4) & 0xff);
+					a = (a & 0xf0) | (v & 0x0f);
+					f = (f & FC) | Szp[a];
+					T(18);
+					break;
+				case 5:		/* RLD */
+					w = HL;
+					v = RD(w);
+					WR(w, (v << 4 | (a & 0x0f)) & 0xff);
+					a = (a & 0xf0) | v >> 4;
+					f = (f & FC) | Szp[a];
+					T(18);
+					break;
+				}
+				break;
+			}
+		} else if ((op & 0xe4) == 0xa0) {
+			/* Block instructions: bit 3 goes down, bit 4
+			 * repeats by running the instruction again. */
+			int		down = op & 0x08, rep = op & 0x10;
+			unsigned int	step = down ? 0xffff : 1;
+			unsigned int	bc = (BC - 1) & 0xffff;
+
+			T(16);
+			switch (op & 3) {
+			case 0:		/* LDI */
+				v = RD(HL);
+				WR(DE, v);
+				w = (DE + step) & 0xffff; SET_DE(w);
+				w = (HL + step) & 0xffff; SET_HL(w);
+				SET_BC(bc);
+				v += a;
+				f = (f & (FS | FZ | FC)) | (bc ? FP : 0) |
+				    (v & FX) | (v << 4 & FY);
+				if (rep && bc) {
+					pc = start;
+					T(21);
+				}
+				break;
+			case 1:		/* CPI */
+				v = RD(HL);
+				w = (a - v) & 0xff;
+				f = (f & FC) | FN | ((a ^ v ^ w) & FH) |
+				    (w & FS) | (w ? 0 : FZ) | (bc ? FP : 0);
+				v = w - ((f & FH) ? 1 : 0);
+				f |= (v & FX) | (v << 4 & FY);
+				w = (HL + step) & 0xffff; SET_HL(w);
+				SET_BC(bc);
+				if (rep && bc && !(f & FZ)) {
+					pc = start;
+					T(21);
+				}
+				break;
+			case 2:		/* INI */
+				v = in(env->arg, BC) & 0xff;
+				WR(HL, v);
+				w = (HL + step) & 0xffff; SET_HL(w);
+				b = (b - 1) & 0xff;
+				f = (Szp[b] & ~FP) | FN | (f & FC);
+				if (rep && b) {
+					pc = start;
+					T(21);
+				}
+				break;
+			default:	/* OUTI */
+				v = RD(HL);
+				b = (b - 1) & 0xff;
+				out(env->arg, BC, v);
+				w = (HL + step) & 0xffff; SET_HL(w);
+				f = (Szp[b] & ~FP) | FN | (f & FC);
+				if (rep && b) {
+					pc = start;
+					T(21);
+				}
+				break;
+			}
+		}
+		goto account;
+
+		/*
+		 * DD and FD prefixed: xy is IX or IY.
+		 */
+indexed:
+		switch (op) {
+		case 0x09: ADD16(xy, BC); T(15); break;
+		case 0x19: ADD16(xy, DE); T(15); break;
+		case 0x29: ADD16(xy, xy); T(15); break;
+		case 0x39: ADD16(xy, sp); T(15); break;
+		case 0x21: FETCH16(xy); T(14); break;
+		case 0x22: FETCH16(w); WR16(w, xy); T(20); break;
+		case 0x23: xy = (xy + 1) & 0xffff; T(10); break;
+		case 0x24: v = GET_XH; INC8(v); SET_XH(v); T(8); break;
+		case 0x25: v = GET_XH; DEC8(v); SET_XH(v); T(8); break;
+		case 0x26: FETCH8(v); SET_XH(v); T(11); break;
+		case 0x2a: FETCH16(w); xy = RD16(w); T(20); break;
+		case 0x2b: xy = (xy - 1) & 0xffff; T(10); break;
+		case 0x2c: v = GET_XL; INC8(v); SET_XL(v); T(8); break;
+		case 0x2d: v = GET_XL; DEC8(v); SET_XL(v); T(8); break;
+		case 0x2e: FETCH8(v); SET_XL(v); T(11); break;
+		case 0x34:
+			FETCH8(w);
+			w = IDX(w);
+			v = RD(w);
+			INC8(v);
+			WR(w, v);
+			T(23);
+			break;
+		case 0x35:
+			FETCH8(w);
+			w = IDX(w);
+			v = RD(w);
+			DEC8(v);
+			WR(w, v);
+			T(23);
+			break;
+		case 0x36: FETCH8(w); FETCH8(v); WR(IDX(w), v); T(19); break;
+
+		case 0x44: b = GET_XH; T(8); break;
+		case 0x45: b = GET_XL; T(8); break;
+		case 0x46: FETCH8(v); b = RD(IDX(v)); T(19); break;
+		case 0x4c: c = GET_XH; T(8); break;
+		case 0x4d: c = GET_XL; T(8); break;
+		case 0x4e: FETCH8(v); c = RD(IDX(v)); T(19); break;
+		case 0x54: d = GET_XH; T(8); break;
+		case 0x55: d = GET_XL; T(8); break;
+		case 0x56: FETCH8(v); d = RD(IDX(v)); T(19); break;
+		case 0x5c: e = GET_XH; T(8); break;
+		case 0x5d: e = GET_XL; T(8); break;
+		case 0x5e: FETCH8(v); e = RD(IDX(v)); T(19); break;
+		case 0x60: SET_XH(b); T(8); break;
+		case 0x61: SET_XH(c); T(8); break;
+		case 0x62: SET_XH(d); T(8); break;
+		case 0x63: SET_XH(e); T(8); break;
+		case 0x64: SET_XH(GET_XH); T(8); break;
+		case 0x65: SET_XH(GET_XL); T(8); break;
+		case 0x66: FETCH8(v); h = RD(IDX(v)); T(19); break;
+		case 0x67: SET_XH(a); T(8); break;
+		case 0x68: SET_XL(b); T(8); break;
+		case 0x69: SET_XL(c); T(8); break;
+		case 0x6a: SET_XL(d); T(8); break;
+		case 0x6b: SET_XL(e); T(8); break;
+		case 0x6c: SET_XL(GET_XH); T(8); break;
+		case 0x6d: SET_XL(GET_XL); T(8); break;
+		case 0x6e: FETCH8(v); l = RD(IDX(v)); T(19); break;
+		case 0x6f: SET_XL(a); T(8); break;
+		case 0x70: FETCH8(v); WR(IDX(v), b); T(19); break;
+		case 0x71: FETCH8(v); WR(IDX(v), c); T(19); break;
+		case 0x72: FETCH8(v); WR(IDX(v), d); T(19); break;
+		case 0x73: FETCH8(v); WR(IDX(v), e); T(19); break;
+		case 0x74: FETCH8(v); WR(IDX(v), h); T(19); break;
+		case 0x75: FETCH8(v); WR(IDX(v), l); T(19); break;
+		case 0x77: FETCH8(v); WR(IDX(v), a); T(19); break;
+		case 0x7c: a = GET_XH; T(8); break;
+		case 0x7d: a = GET_XL; T(8); break;
+		case 0x7e: FETCH8(v); a = RD(IDX(v)); T(19); break;
+
+		case 0x84: v = GET_XH; ADD8(v); T(8); break;
+		case 0x85: v = GET_XL; ADD8(v); T(8); break;
+		case 0x86: FETCH8(v); v = RD(IDX(v)); ADD8(v); T(19); break;
+		case 0x8c: v = GET_XH; ADC8(v); T(8); break;
+		case 0x8d: v = GET_XL; ADC8(v); T(8); break;
+		case 0x8e: FETCH8(v); v = RD(IDX(v)); ADC8(v); T(19); break;
+		case 0x94: v = GET_XH; SUB8(v); T(8); break;
+		case 0x95: v = GET_XL; SUB8(v); T(8); break;
+		case 0x96: FETCH8(v); v = RD(IDX(v)); SUB8(v); T(19); break;
+		case 0x9c: v = GET_XH; SBC8(v); T(8); break;
+		case 0x9d: v = GET_XL; SBC8(v); T(8); break;
+		case 0x9e: FETCH8(v); v = RD(IDX(v)); SBC8(v); T(19); break;
+		case 0xa4: v = GET_XH; AND8(v); T(8); break;
+		case 0xa5: v = GET_XL; AND8(v); T(8); break;
+		case 0xa6: FETCH8(v); v = RD(IDX(v)); AND8(v); T(19); break;
+		case 0xac: v = GET_XH; XOR8(v); T(8); break;
+		case 0xad: v = GET_XL; XOR8(v); T(8); break;
+		case 0xae: FETCH8(v); v = RD(IDX(v)); XOR8(v); T(19); break;
+		case 0xb4: v = GET_XH; OR8(v); T(8); break;
+		case 0xb5: v = GET_XL; OR8(v); T(8); break;
+		case 0xb6: FETCH8(v); v = RD(IDX(v)); OR8(v); T(19); break;
+		case 0xbc: v = GET_XH; CP8(v); T(8); break;
+		case 0xbd: v = GET_XL; CP8(v); T(8); break;
+		case 0xbe: FETCH8(v); v = RD(IDX(v)); CP8(v); T(19); break;
+
+		case 0xcb:
+			/* DD CB d op: on (xy+d), the result also going to
+			 * a register unless that is (HL). */
+			FETCH8(w);
+			w = IDX(w);
+			FETCH8(op);
+			v = RD(w);
+			if (op < 0x40) {
+				v = shift(op >> 3, v, f);
+				f = v >> 8;
+				v &= 0xff;
+			} else if (op < 0x80) {
+				unsigned int	bit = 1 << ((op >> 3) & 7);
+
+				f = (f & FC) | FH | (w >> 8 & (FY | FX)) |
+				    (v & bit ? (bit & FS) : FZ | FP);
+				T(20);
+				break;
+			} else {
+				unsigned int	bit = 1 << ((op >> 3) & 7);
+
+				v = op < 0xc0 ? v & ~bit : v | bit;
+			}
+			WR(w, v);
+			if ((op & 7) != 6)
+				SET8(op & 7, v);
+			T(23);
+			break;
+
+		case 0xe1: POP(xy); T(14); break;
+		case 0xe3:
+			v = RD16(sp);
+			WR16(sp, xy);
+			xy = v;
+			T(23);
+			break;
+		case 0xe5: PUSH(xy); T(15); break;
+		case 0xe9: TRANSFER(xy); T(8); break;
+		case 0xf9: sp = xy; T(10); break;
+
+		case 0xdd:
+		case 0xfd:
+		case 0xed:
+			/* The prefix is lost: it was a 4 T-state NOP. */
+			pc = (pc - 1) & 0xffff;
+			--r;
+			T(4);
+			break;
+
+		default:
+			/* As unprefixed, the prefix costing 4 more. */
+			t += 4;
+			if (prof)
+				prof->cycles[start] += 4;
+			goto execute;
+		}
+		if (pfx == 0xdd)
+			ix = xy;
+		else
+			iy = xy;
+
+account:
+		t += cost;
+		if (prof)
+			prof->cycles[start] += cost;
+	}
+
+	SAVE_REGS();
+	if (tstates)
+		*tstates = t;
+
+	return end;
+}
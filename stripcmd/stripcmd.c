@@ -13,8 +13,18 @@
  * docs I found, comment records are limited to 127 characters, but
  * I've found CMD files with records that exceed that, so I'll assume
  * a new limit of 255.  Could they have a size of 0 represent 256?
+ *
+ * LS-DOS libraries, partitioned data sets and ISAM overlay files, are
+ * CMD files one after another behind a directory of where each starts.
+ * The whole library is checked and stripped like any CMD file, and a
+ * member can be listed, checked or taken out on its own by going
+ * straight to it through the directory.
  */
 
+#ifdef HAVE_SPLICE
+#define	_GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -24,42 +34,82 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "trs80util.h"
+
+#ifdef HAVE_SPLICE
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_FMEMOPEN
+#include "batch.h"
+#endif
+
+#ifdef TRS80_MULTICALL
+#include "trs80.h"
+#endif
+
+
+#ifdef HAVE_FMEMOPEN
+#define	ARCHIVE_OPTS	"abJ:o:"
+#define	ARCHIVE_USAGE	"a"
+#else
+#define	ARCHIVE_OPTS	""
+#define	ARCHIVE_USAGE	""
+#endif
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	OPTIONS		"e:l:qtx" ARCHIVE_OPTS JOBS_OPTS
 
 #define	BLK_LEN(n)	((n) < 3 ? (n) + 254 : (n) - 2)
+#define	LEN_BYTE(n)	(((n) + 2) & 0xff)	/* The inverse */
 
-#define	FNAME_SIZE	0xff
-#define	COMMENT_SIZE	0xff
+/* Where a directory entry's triad at p says its member starts. */
+#define	TRIAD(p)	(((size_t)((p)[1] | (p)[2] << 8) << 8) + (p)[0])
 
-enum cmd_header {
-	LOADBLK	 = 0x01,
-	XFERADDR = 0x02,
-	FNAMEREC = 0x05,
-	COMMREC  = 0x1f		/* L/LS-DOS specific */
-};
+#define	SECTOR		256
+#define	MAX_BLOCK	256		/* Load block data */
 
-enum cmd_state {
-	CMD_HDR,
-	LOADBLK_LEN,
-	LOADBLK_ADDRLO,
-	LOADBLK_ADDRHI,
-	XFER_LEN,
-	XFER_ADDRLO,
-	XFER_ADDRHI,
-	FNAMEREC_LEN,
-	FNAMEREC_NAME,
-	COMMREC_LEN,
-	COMMREC_STRING,
-	SKIP_BYTES,
-	EXTRA_BYTES
+enum layout {
+	LAYOUT_NONE,
+	LAYOUT_PACK,		/* Fewest sectors */
+	LAYOUT_ALIGN		/* And no record header split between two */
 };
 
-
-int	Quiet = 0;
-FILE	*InputFile;
-FILE	*OutputFile;
+/*
+ * Everything one run needs, from the command line.  Nothing else is
+ * kept between calls, so runs and the jobs within them can go on side
+ * by side in one process.
+ */
+struct strip_opts {
+	FILE		*infile;
+	FILE		*outfile;	/* NULL if not stripping */
+	FILE		*rptfile;
+	FILE		*errfile;
+	int		quiet;
+	int		snapshot;	/* Write a snapshot, not the CMD file */
+	int		layout;		/* enum layout */
+	const char	*member;	/* Only this library member, or NULL */
+	int		table;		/* List the library's members */
+	int		jobs;
+	int		archives;
+	int		batch;
+	const char	*batch_output;
+	const char	*journal;	/* Batch journal, or NULL */
+	char		**operands;
+	int		noperands;
+};
 
 
-void
+static void
 vfatal(int exitval, const char *fmsg, va_list ap)
 {
 	vfprintf(stderr, fmsg, ap);
@@ -67,7 +117,7 @@ vfatal(int exitval, const char *fmsg, va_list ap)
 }
 
 
-void
+static void
 fatal(int exitval, const char *fmsg, ...)
 {
 	va_list ap;
@@ -78,192 +128,1266 @@ fatal(int exitval, const char *fmsg, ...)
 }
 
 
-void
+static void
 usage(const char *pgmname)
 {
 	static const char usage_str[] =
-		"Usage: %s [-q] [{cmd_file|-} [out_file]]\n"
+		"Usage: %s [-" ARCHIVE_USAGE "qtx]" JOBS_USAGE " [-e member]"
+			" [-l layout]\n"
+		"           [{cmd_file|-} [{out_file|-}]]\n"
+#ifdef HAVE_FMEMOPEN
+		"       %s -b [-aqtx]" JOBS_USAGE " [-e member] [-J journal] "
+			"[-l layout]\n"
+		"           [-o out_archive] cmd_file...\n"
+#endif
 		"Options:\n"
-		"\t-q\tRun quietly (repeat for more quiet)\n";
+#ifdef HAVE_FMEMOPEN
+		"\t-a\tInput is a tar or zip archive "
+			"(out_file is a tar or zip archive)\n"
+		"\t-b\tBatch mode, check every input\n"
+#endif
+		"\t-e\tCheck, and write out as a CMD file, only the LS-DOS "
+			"library\n"
+		"\t\tmember with this name or ISAM number\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tCheck with jobs threads (0 = one per CPU)\n"
+#endif
+#ifdef HAVE_FMEMOPEN
+		"\t-J\tSkip the inputs the journal has as done, and add to it\n"
+#endif
+		"\t-l\tRewrite the load blocks to load from the fewest "
+			"sectors\n"
+		"\t\t(pack), also keeping record headers within one (align)\n"
+#ifdef HAVE_FMEMOPEN
+		"\t-o\tBatch output tar or zip (.zip) archive of "
+			"stripped files\n"
+#endif
+		"\t-q\tRun quietly (repeat for more quiet)\n"
+		"\t-t\tList and check each member of an LS-DOS library\n"
+		"\t-x\tWrite an emulator snapshot of the loaded program "
+			"instead\n";
 
-	fatal(1, usage_str, pgmname);
+	fatal(1, usage_str, pgmname, pgmname);
 }
 
 
-int
-process_file(FILE *infile, FILE *outfile)
-{
-	int		ch;
-	enum cmd_state	state = CMD_HDR;
-	uint16_t	load_addr = 0;
-	uint16_t	xfer_addr = 0;
-	char		fname[FNAME_SIZE+1];
-	uint8_t		fname_len = 0;
-	unsigned int	fname_idx = 0;
-	char		comment[COMMENT_SIZE+1];
-	uint8_t		comment_len = 0;
-	unsigned int	comment_idx = 0;
-	unsigned int	chskip = 0;
-	unsigned int	extra_bytes = 0;
-
-	while ((ch = fgetc(infile)) != -1) {
-		if ((state != EXTRA_BYTES) && OutputFile)
-			fwrite(&ch, 1, 1, OutputFile);
-
-		switch(state) {
-		case CMD_HDR:
-			switch ((enum cmd_header)ch) {
-			case LOADBLK:
-				state = LOADBLK_LEN;
-				break;
-			case XFERADDR:
-				state = XFER_LEN;
-				break;
-			case FNAMEREC:
-				state = FNAMEREC_LEN;
-				break;
-			case COMMREC:
-				state = COMMREC_LEN;
-				break;
-			default:
-				fprintf(stderr,
-					"Unexpected header byte (0x%02x).\n",
-					ch);
-					return 2;
-				break;
+/*
+ * Read all of infile into a malloc()ed buffer.  Returns 0 on success,
+ * -1 on failure with errno set.
+ */
+
+static int
+read_file(FILE *infile, unsigned char **bufp, size_t *lenp)
+{
+	unsigned char	*buf = NULL, *nbuf;
+	size_t		len = 0, cap = 0, n;
+
+	do {
+		if (len == cap) {
+			cap = cap ? cap * 2 : 64 * 1024;
+			if (!(nbuf = realloc(buf, cap))) {
+				free(buf);
+				return -1;
 			}
-			break;
+			buf = nbuf;
+		}
+		n = fread(buf + len, 1, cap - len, infile);
+		len += n;
+	} while (n > 0);
 
-		case LOADBLK_LEN:
-			chskip = (uint16_t)BLK_LEN(ch);
-			state = LOADBLK_ADDRLO;
-			break;
+	if (ferror(infile)) {
+		free(buf);
+		return -1;
+	}
 
-		case LOADBLK_ADDRLO:
-			load_addr = ch;
-			state = LOADBLK_ADDRHI;
-			break;
+	*bufp = buf;
+	*lenp = len;
 
-		case LOADBLK_ADDRHI:
-			load_addr |= ch << 8;
-			if (!Quiet)
-				printf("Load address == 0x%04x "
-					"(len == 0x%02x)\n",
-					(int)load_addr, (int)chskip);
-			state = SKIP_BYTES;
-			break;
+	return 0;
+}
 
-		case XFER_LEN:
-			chskip = (uint16_t)(ch - 2);
-			state = XFER_ADDRLO;
-			break;
 
-		case XFER_ADDRLO:
-			xfer_addr = ch;
-			state = XFER_ADDRHI;
-			break;
+static int
+report_record(void *arg, const struct trs80_cmd_record *rec)
+{
+	FILE	*rptfile = arg;
+	int	n;
 
-		case XFER_ADDRHI:
-			xfer_addr |= ch << 8;
-			if (!Quiet)
-				printf("Transfer address == 0x%04x\n",
-					(int)xfer_addr);
-			if (chskip != 0) {
-				fprintf(stderr, "Unexpected transfer "
-					"address length (%d).\n", (int)chskip);
-				return 2;
-			}
-			extra_bytes = 0;
-			state = EXTRA_BYTES;
+	switch (rec->type) {
+	case TRS80_CMD_LOADBLK:
+		fprintf(rptfile, "Load address == 0x%04x (len == 0x%02x)\n",
+			rec->addr, (unsigned int)rec->len);
+		break;
+
+	case TRS80_CMD_XFERADDR:
+		fprintf(rptfile, "Transfer address == 0x%04x\n", rec->addr);
+		break;
+
+	case TRS80_CMD_FNAMEREC:
+		/* Remove trailing spaces? */
+		fprintf(rptfile, "Filename = \"%.*s\"\n",
+			(int)rec->len, (const char *)rec->data);
+		break;
+
+	case TRS80_CMD_COMMREC:
+		/* Translate ^Ms and other non-printable characters
+		 * to newlines? */
+		fprintf(rptfile, "Comment = \"%.*s\"\n",
+			(int)rec->len, (const char *)rec->data);
+		break;
+
+	case TRS80_CMD_YANKED:
+		fprintf(rptfile, "Yanked block at 0x%04x (len == 0x%02x)\n",
+			rec->addr, (unsigned int)rec->len);
+		break;
+
+	case TRS80_CMD_ENDMEMBER:
+		fprintf(rptfile, "End of member\n");
+		break;
+
+	case TRS80_CMD_PDSHEADER:
+		fprintf(rptfile, "PDS header = \"%.*s\"\n",
+			(int)rec->len, (const char *)rec->data);
+		break;
+
+	case TRS80_CMD_PATCHNAME:
+		fprintf(rptfile, "Patch name = \"%.*s\"\n",
+			(int)rec->len, (const char *)rec->data);
+		break;
+
+	case TRS80_CMD_PDSENTRY:
+		for (n = 8; n > 0 && rec->data[n - 1] == ' '; --n)
+			;
+		fprintf(rptfile, "PDS member = \"%.*s\" at offset %zu\n",
+			n, (const char *)rec->data, TRIAD(rec->data + 8));
+		break;
+
+	case TRS80_CMD_ISAMENTRY:
+		fprintf(rptfile, "ISAM member = %u at offset %zu, "
+			"transfer address == 0x%04x\n", rec->data[0],
+			TRIAD(rec->data + 3),
+			rec->data[1] | rec->data[2] << 8);
+		break;
+
+	case TRS80_CMD_PDSEND:
+	case TRS80_CMD_ISAMEND:
+		fprintf(rptfile, "End of directory\n");
+		break;
+	}
+
+	return 0;
+}
+
+
+/* Only a library is parsed with the LS-DOS records, so a stray one in
+ * an ordinary CMD file is still a bad header byte. */
+static unsigned int
+parse_flags(const unsigned char *buf, size_t len)
+{
+	return len > 0 && (buf[0] == TRS80_CMD_PDSHEADER ||
+			   buf[0] == TRS80_CMD_ISAMENTRY) ? TRS80_CMD_LSDOS : 0;
+}
+
+
+/*
+ * Check the CMD file in buf, setting *endp to the length of it less
+ * any trailing junk.  The report, less detail the quieter it is, goes
+ * to rptfile and diagnostics to errfile.
+ */
+
+int
+strip_buffer(const unsigned char *buf, size_t len, size_t *endp,
+	     FILE *rptfile, FILE *errfile, int quiet)
+{
+	struct trs80_cmd_info	info;
+	struct trs80_error	err;
+	int			ret;
+
+	ret = trs80_cmd_parse_flags(buf, len, parse_flags(buf, len),
+				    quiet ? NULL : report_record, rptfile,
+				    &info, &err);
+	*endp = info.end;
+
+	if (ret != TRS80_OK) {
+		char	msg[128];
+
+		trs80_error_message(ret, &err, msg, sizeof(msg));
+		fprintf(errfile, "%s\n", msg);
+		return 2;
+	}
+
+	if (quiet < 2) {
+		if (info.extra)
+			fprintf(rptfile, "Found %u extraneous bytes at end "
+				"of file.\n", (unsigned int)info.extra);
+
+		fprintf(rptfile, "CMD file looks good!\n");
+	}
+
+	return 0;
+}
+
+
+#ifdef HAVE_SPLICE
+/*
+ * Zero-copy stripping of a piped input.
+ *
+ * Every byte the parser looks at ends up in the output, even the one
+ * with a bad record type, except for what follows the transfer record.
+ * So the input can be passed on to the output with splice() record by
+ * record as it's parsed, and only the record headers, file names and
+ * comments ever reach us: tee() copies them from the head of the input
+ * pipe into a pipe of our own, where they are read without consuming
+ * the input.  Load block data goes straight from one pipe to the other.
+ *
+ * tee() only sees what the writer has put in the pipe so far, so if a
+ * header isn't all there yet the part that is gets passed on, to make
+ * way for the rest.  That never goes past the transfer record, since a
+ * record's header is looked at in full before anything beyond it.
+ */
+
+#define	SP_MAX_REC	(2 + 255)	/* A file name or comment record */
+
+struct strip_pipe {
+	int		in;
+	int		out;
+	int		peek[2];	/* Our pipe tee() copies into */
+	unsigned char	rec[SP_MAX_REC];
+	size_t		seen;		/* Bytes of the record in rec */
+	size_t		sent;		/* Bytes of the record passed on */
+	size_t		pos;		/* Offset of the record */
+};
+
+
+/* Pass the next n bytes of input to fd.  Returns the count passed on,
+ * short only at the end of input, or -1. */
+static ssize_t
+sp_send(int in, int fd, size_t n)
+{
+	size_t	done = 0;
+
+	while (done < n) {
+		ssize_t	k = splice(in, NULL, fd, NULL, n - done,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (k == 0)
 			break;
+		done += k;
+	}
 
-		case FNAMEREC_LEN:
-			fname_len = ch;
-			if (fname_len > FNAME_SIZE) {
-				fprintf(stderr,
-					"Unexpected file name size (0x%02x).\n",
-					(int)fname_len);
-				return 2;
-			}
-			fname_idx = 0;
-			state = FNAMEREC_NAME;
+	return done;
+}
+
+
+/*
+ * Make the first n bytes of the current record available in sp->rec.
+ * Returns the count available, short only at the end of input, or -1.
+ * The first tee() of a run fails with EINVAL if the input isn't a pipe
+ * after all, before anything has been consumed.
+ */
+
+static ssize_t
+sp_look(struct strip_pipe *sp, size_t n)
+{
+	while (sp->seen < n) {
+		ssize_t	k, r;
+		size_t	got;
+
+		k = tee(sp->in, sp->peek[1], n - sp->sent, 0);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (k == 0)
 			break;
 
-		case FNAMEREC_NAME:
-			fname[fname_idx++] = ch;
-			if (fname_idx == fname_len) {
-				/* Remove trailing spaces? */
-				fname[fname_idx] = '\0';
-				if (!Quiet)
-					printf("Filename = \"%s\"\n", fname);
-				state = CMD_HDR;
+		for (got = 0; got < (size_t)k; got += r) {
+			r = read(sp->peek[0], sp->rec + sp->sent + got,
+				 k - got);
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR) {
+					r = 0;
+					continue;
+				}
+				return -1;
 			}
-			break;
+		}
+
+		if (sp->sent + k > sp->seen)
+			sp->seen = sp->sent + k;
+
+		if (sp->seen < n) {
+			if (sp_send(sp->in, sp->out, sp->seen - sp->sent) < 0)
+				return -1;
+			sp->sent = sp->seen;
+		}
+	}
+
+	return sp->seen;
+}
+
+
+/* Pass on what's left of a record len bytes long and start the next.
+ * Returns 1 if the input ended first, 0 if not, or -1. */
+static int
+sp_next(struct strip_pipe *sp, size_t len)
+{
+	size_t	want = len - sp->sent;
+	ssize_t	k = sp_send(sp->in, sp->out, want);
+
+	if (k < 0)
+		return -1;
+
+	sp->pos += sp->sent + k;
+	sp->seen = sp->sent = 0;
 
-		case COMMREC_LEN:
-			comment_len = ch;
-			if (comment_len > COMMENT_SIZE) {
-				fprintf(stderr,
-					"Unexpected comment size (0x%02x).\n",
-					(int)comment_len);
-				return 2;
+	return (size_t)k < want;
+}
+
+
+/*
+ * Count and throw away the rest of the input, as if it had been read
+ * like a regular file's.
+ */
+
+static ssize_t
+sp_drain(int in)
+{
+	char	buf[4096];
+	ssize_t	total = 0, k;
+	int	null = open("/dev/null", O_WRONLY);
+
+	if (null != -1) {
+		total = sp_send(in, null, SSIZE_MAX);
+		close(null);
+		if (total >= 0)
+			return total;
+		total = 0;
+	}
+
+	while ((k = read(in, buf, sizeof(buf))) != 0) {
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += k;
+	}
+
+	return total;
+}
+
+
+/*
+ * Parse the pipe in, passing it on to the pipe out up to the end of
+ * the transfer record, with the same report and diagnostics as
+ * strip_buffer().  Returns -1 if the input turns out not to be a pipe,
+ * or to be a library whose end only its directory knows, before
+ * anything has been taken from it.
+ */
+
+static int
+strip_pipe(int in, int out, FILE *rptfile, FILE *errfile, int quiet)
+{
+	struct strip_pipe	sp;
+	struct trs80_cmd_record	rec;
+	struct trs80_error	err;
+	ssize_t			n, extra = 0;
+	int			st = TRS80_OK;
+	int			r = 0, e;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.in = in;
+	sp.out = out;
+	if (pipe(sp.peek))
+		return -1;
+
+	if (sp_look(&sp, 1) == 1 && (sp.rec[0] == TRS80_CMD_PDSHEADER ||
+				     sp.rec[0] == TRS80_CMD_ISAMENTRY)) {
+		close(sp.peek[0]);
+		close(sp.peek[1]);
+		return -1;
+	}
+
+	while ((n = sp_look(&sp, 2)) > 0) {
+		rec.type = sp.rec[0];
+		rec.offset = sp.pos;
+		rec.addr = 0;
+		rec.data = NULL;
+		rec.len = 0;
+		rec.avail = 0;
+
+		switch (rec.type) {
+		case TRS80_CMD_LOADBLK:
+		case TRS80_CMD_XFERADDR:
+			if ((n = sp_look(&sp, 4)) < 4)
+				break;
+			rec.addr = sp.rec[2] | (sp.rec[3] << 8);
+			if (rec.type != TRS80_CMD_XFERADDR) {
+				rec.len = BLK_LEN(sp.rec[1]);
+				rec.avail = rec.len;
 			}
-			comment_idx = 0;
-			state = COMMREC_STRING;
-			break;
+			if (!quiet)
+				report_record(rptfile, &rec);
 
-		case COMMREC_STRING:
-			comment[comment_idx++] = ch;
-			if (comment_idx == comment_len) {
-				comment[comment_idx] = '\0';
-				/* Translate ^Ms and other non-printable
-				 * characters to newlines? */
-				if (!Quiet)
-					printf("Comment = \"%s\"\n", comment);
-				state = CMD_HDR;
+			if (rec.type != TRS80_CMD_XFERADDR) {
+				if ((r = sp_next(&sp, 4 + rec.len)) != 0)
+					break;
+				continue;
 			}
-			break;
 
-		case SKIP_BYTES:
-			if (--chskip == 0)
-				state = CMD_HDR;
-			break;
+			if (sp.rec[1] != 2) {
+				st = TRS80_E_XFERLEN;
+				err.offset = sp.pos + 3;
+				err.byte = sp.rec[1];
+			}
+			if ((r = sp_next(&sp, 4)) == 0 &&
+			    (extra = sp_drain(in)) < 0)
+				r = -1;
+			goto done;
 
-		case EXTRA_BYTES:
-			++extra_bytes;
-			break;
+		case TRS80_CMD_FNAMEREC:
+		case TRS80_CMD_COMMREC:
+			rec.len = sp.rec[1];
+			if ((n = sp_look(&sp, 2 + rec.len)) < 2 + (ssize_t)rec.len)
+				break;
+			rec.data = sp.rec + 2;
+			rec.avail = rec.len;
+			if (!quiet)
+				report_record(rptfile, &rec);
+			if ((r = sp_next(&sp, 2 + rec.len)) != 0)
+				break;
+			continue;
 
 		default:
-			fprintf(stderr, "Unexpected state == %d\n", (int)state);
-			return 3;
+			st = TRS80_E_HEADER;
+			err.offset = sp.pos;
+			err.byte = rec.type;
+			if ((r = sp_next(&sp, 1)) == 0 && sp_drain(in) < 0)
+				r = -1;
+			goto done;
+		}
+
+		/* Cut short by the end of input, or failed. */
+		if (r == 0 && n >= 0)
+			r = sp_next(&sp, n);
+		break;
+	}
+
+	if (n < 0)
+		r = -1;
+
+done:
+	e = errno;
+	close(sp.peek[0]);
+	close(sp.peek[1]);
+
+	if (r < 0) {
+		if (e == EINVAL && sp.pos == 0 && sp.sent == 0)
+			return -1;
+		fprintf(errfile, "Error passing input to output file, "
+			"%s (%d)\n", strerror(e), e);
+		return 3;
+	}
+
+	if (st != TRS80_OK) {
+		char	msg[128];
+
+		trs80_error_message(st, &err, msg, sizeof(msg));
+		fprintf(errfile, "%s\n", msg);
+		return 2;
+	}
+
+	if (quiet < 2) {
+		if (extra)
+			fprintf(rptfile, "Found %u extraneous bytes at end "
+				"of file.\n", (unsigned int)extra);
+
+		fprintf(rptfile, "CMD file looks good!\n");
+	}
+
+	return 0;
+}
+
+
+/* Returns 1 if fd is a pipe. */
+static int
+is_pipe(int fd)
+{
+	struct stat	st;
+
+	return fd != -1 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+#endif
+
+
+/*
+ * Load the CMD file in buf as DOS would and write a snapshot of it,
+ * ready to run from its transfer address, to outfile.
+ */
+
+static int
+write_snapshot(const unsigned char *buf, size_t len, FILE *outfile,
+	       FILE *errfile)
+{
+	struct trs80_image	*img;
+	struct trs80_z80_regs	regs;
+	struct trs80_error	err;
+	unsigned char		*snap;
+	char			msg[128];
+	int			st, ret = 0;
+
+	img = malloc(sizeof(*img));
+	snap = malloc(TRS80_SNAPSHOT_SIZE);
+	if (!img || !snap) {
+		fprintf(errfile, "Out of memory.\n");
+		ret = 3;
+		goto out;
+	}
+
+	trs80_image_clear(img);
+	if ((st = trs80_image_cmd(img, buf, len, &err)) != TRS80_OK) {
+		trs80_error_message(st, &err, msg, sizeof(msg));
+		fprintf(errfile, "%s\n", msg);
+		ret = 2;
+	} else if (!img->has_xfer) {
+		fprintf(errfile, "No transfer address for a snapshot.\n");
+		ret = 2;
+	} else {
+		trs80_image_start(img, &regs);
+		trs80_image_snapshot(img, &regs, snap);
+		fwrite(snap, 1, TRS80_SNAPSHOT_SIZE, outfile);
+	}
+
+out:
+	free(snap);
+	free(img);
+
+	return ret;
+}
+
+
+/*
+ * Relayout.
+ *
+ * DOS loads a CMD file through a one sector buffer, reading each
+ * sector of it in turn, so the sectors read are the sectors the file
+ * takes up to its transfer record, and the fewest come from the fewest
+ * bytes.  Consecutive load blocks that carry on where the one before
+ * left off are taken as one run and cut again into blocks as full as
+ * BLK_LEN() allows; everything else stays where it was, in the same
+ * order, so the program loads exactly as before.
+ *
+ * The align layout also keeps every record header within one sector,
+ * for loaders that want a header whole before reading on.  A header
+ * that would straddle two sectors is pushed past the boundary by
+ * splitting the last few bytes of the load block before it into a
+ * block of their own, whose header then ends the sector, or failing
+ * that by a comment record filling the gap.
+ */
+
+struct relayout {
+	unsigned char	*out;
+	size_t		len;
+	size_t		cap;
+	int		align;
+	size_t		last;		/* Offset of the last record */
+	int		last_type;
+	unsigned char	*run;		/* The load blocks being joined */
+	size_t		run_len;
+	size_t		run_cap;
+	unsigned int	run_addr;
+	int		failed;
+};
+
+
+/* Room for n more bytes of output, or NULL. */
+static unsigned char *
+rl_room(struct relayout *rl, size_t n)
+{
+	if (rl->len + n > rl->cap) {
+		size_t		cap = rl->cap ? rl->cap * 2 : 4096;
+		unsigned char	*p;
+
+		while (cap < rl->len + n)
+			cap *= 2;
+		if (!(p = realloc(rl->out, cap))) {
+			rl->failed = 1;
+			return NULL;
+		}
+		rl->out = p;
+		rl->cap = cap;
+	}
+
+	return rl->out + rl->len;
+}
+
+
+/* Make a header of hlen bytes at the end of the output fit in one
+ * sector, if it wouldn't. */
+static void
+rl_fit(struct relayout *rl, size_t hlen)
+{
+	size_t		off = rl->len % SECTOR;
+	size_t		split, n;
+	unsigned char	*p;
+
+	if (!rl->align || off + hlen <= SECTOR)
+		return;
+
+	/* Split the block before so its tail's header ends the sector. */
+	split = off - (SECTOR - 4);
+	if (rl->last_type == TRS80_CMD_LOADBLK && rl->len > 0 &&
+	    (n = BLK_LEN(rl->out[rl->last + 1])) > split) {
+		unsigned int	addr;
+
+		if (!rl_room(rl, 4))
+			return;
+		p = rl->out + rl->last;
+		addr = (p[2] | p[3] << 8) + n - split;
+		p[1] = LEN_BYTE(n - split);
+
+		p = rl->out + rl->len - split;
+		memmove(p + 4, p, split);
+		p[0] = TRS80_CMD_LOADBLK;
+		p[1] = LEN_BYTE(split);
+		p[2] = addr & 0xff;
+		p[3] = addr >> 8 & 0xff;
+		rl->last = rl->len - split;
+		rl->len += 4;
+		return;
+	}
+
+	/* Or fill the gap with a comment, if it takes a header. */
+	if (SECTOR - off >= 2 && (p = rl_room(rl, SECTOR - off))) {
+		n = SECTOR - off - 2;
+		p[0] = TRS80_CMD_COMMREC;
+		p[1] = n;
+		memset(p + 2, ' ', n);
+		rl->last = rl->len;
+		rl->last_type = TRS80_CMD_COMMREC;
+		rl->len += SECTOR - off;
+	}
+}
+
+
+/* Add a record: a header of hlen bytes then n bytes of data. */
+static void
+rl_record(struct relayout *rl, const unsigned char *hdr, size_t hlen,
+	  const unsigned char *data, size_t n)
+{
+	unsigned char	*p;
+
+	rl_fit(rl, hlen);
+	if (!(p = rl_room(rl, hlen + n)))
+		return;
+	memcpy(p, hdr, hlen);
+	if (n)
+		memcpy(p + hlen, data, n);
+	rl->last = rl->len;
+	rl->last_type = hdr[0];
+	rl->len += hlen + n;
+}
+
+
+/* Write out the run of load blocks, if any, as full blocks. */
+static void
+rl_flush(struct relayout *rl)
+{
+	size_t	done, n;
+
+	for (done = 0; done < rl->run_len; done += n) {
+		unsigned int	addr = (rl->run_addr + done) & 0xffff;
+		unsigned char	hdr[4];
+
+		n = rl->run_len - done;
+		if (n > MAX_BLOCK)
+			n = MAX_BLOCK;
+		hdr[0] = TRS80_CMD_LOADBLK;
+		hdr[1] = LEN_BYTE(n);
+		hdr[2] = addr & 0xff;
+		hdr[3] = addr >> 8;
+		rl_record(rl, hdr, 4, rl->run + done, n);
+	}
+	rl->run_len = 0;
+}
+
+
+static int
+rl_visit(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct relayout	*rl = arg;
+	unsigned char	hdr[4];
+
+	if (rec->type == TRS80_CMD_LOADBLK) {
+		/* Join it to the run if it carries straight on. */
+		if (rl->run_len &&
+		    ((rl->run_addr + rl->run_len) & 0xffff) != rec->addr)
+			rl_flush(rl);
+		if (rl->run_len + rec->avail > rl->run_cap) {
+			size_t		cap = rl->run_cap ? rl->run_cap * 2 :
+							    4096;
+			unsigned char	*p;
+
+			while (cap < rl->run_len + rec->avail)
+				cap *= 2;
+			if (!(p = realloc(rl->run, cap)))
+				return TRS80_E_NOMEM;
+			rl->run = p;
+			rl->run_cap = cap;
 		}
+		if (!rl->run_len)
+			rl->run_addr = rec->addr;
+		memcpy(rl->run + rl->run_len, rec->data, rec->avail);
+		rl->run_len += rec->avail;
+		return 0;
+	}
+
+	rl_flush(rl);
+	hdr[0] = rec->type;
+	if (rec->type == TRS80_CMD_XFERADDR) {
+		hdr[1] = 2;
+		hdr[2] = rec->addr & 0xff;
+		hdr[3] = rec->addr >> 8;
+		rl_record(rl, hdr, 4, NULL, 0);
+	} else if (rec->type == TRS80_CMD_YANKED) {
+		hdr[1] = LEN_BYTE(rec->len);
+		hdr[2] = rec->addr & 0xff;
+		hdr[3] = rec->addr >> 8;
+		rl_record(rl, hdr, 4, rec->data, rec->len);
+	} else {
+		hdr[1] = rec->len;
+		rl_record(rl, hdr, 2, rec->data, rec->len);
+	}
+
+	return rl->failed ? TRS80_E_NOMEM : 0;
+}
+
+
+/* What loading the len bytes of a CMD file at buf reads: its sectors,
+ * and the record headers split between two of them. */
+struct sector_count {
+	unsigned long	sectors;
+	unsigned long	split;
+};
+
+static int
+count_record(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct sector_count	*sc = arg;
+	size_t			hlen;
+
+	hlen = rec->type == TRS80_CMD_LOADBLK ||
+	       rec->type == TRS80_CMD_YANKED ||
+	       rec->type == TRS80_CMD_XFERADDR ? 4 : 2;
+	if (rec->offset / SECTOR != (rec->offset + hlen - 1) / SECTOR)
+		++sc->split;
+
+	return 0;
+}
+
+static void
+count_sectors(const unsigned char *buf, size_t len, struct sector_count *sc)
+{
+	memset(sc, 0, sizeof(*sc));
+	trs80_cmd_parse(buf, len, count_record, sc, NULL, NULL);
+	sc->sectors = (len + SECTOR - 1) / SECTOR;
+}
+
+
+/*
+ * Write the stripped CMD file in buf, len bytes, to outfile relaid out
+ * as layout says, reporting the sectors it loads from before and after
+ * to rptfile.
+ */
+
+static int
+write_relayout(const unsigned char *buf, size_t len, int layout, int quiet,
+	       FILE *outfile, FILE *rptfile, FILE *errfile)
+{
+	struct relayout		rl;
+	struct sector_count	before, after;
+	struct trs80_cmd_info	info;
+	int			st;
+
+	/* Moving a member would leave its directory entry behind. */
+	if (trs80_cmd_members(buf, len, NULL, NULL, NULL) != TRS80_E_FORMAT) {
+		fprintf(errfile, "Can't relay out an LS-DOS library.\n");
+		return 2;
+	}
+
+	memset(&rl, 0, sizeof(rl));
+	rl.align = layout == LAYOUT_ALIGN;
+	rl.last_type = -1;
+
+	st = trs80_cmd_parse(buf, len, rl_visit, &rl, &info, NULL);
+	if (st == TRS80_OK && info.truncated) {
+		fprintf(errfile, "Can't relay out a file cut short.\n");
+		free(rl.run);
+		free(rl.out);
+		return 2;
+	}
+	if (st == TRS80_OK)
+		rl_flush(&rl);
+	if (st != TRS80_OK || rl.failed) {
+		fprintf(errfile, "Out of memory.\n");
+		free(rl.run);
+		free(rl.out);
+		return 3;
+	}
+
+	if (quiet < 2) {
+		count_sectors(buf, len, &before);
+		count_sectors(rl.out, rl.len, &after);
+		fprintf(rptfile, "Sectors to load == %lu (%lu header%s split), "
+			"relaid out == %lu (%lu header%s split)\n",
+			before.sectors, before.split,
+			before.split == 1 ? "" : "s", after.sectors,
+			after.split, after.split == 1 ? "" : "s");
+	}
+	fwrite(rl.out, 1, rl.len, outfile);
+
+	free(rl.run);
+	free(rl.out);
+
+	return 0;
+}
+
+
+/*
+ * LS-DOS library members.
+ *
+ * Each member is gone to through the directory and parsed from where
+ * its entry says it starts, so none before it is read to get there.
+ */
+
+struct member_find {
+	const char		*key;
+	struct trs80_cmd_member	m;
+};
+
+struct member_check {
+	FILE		*rptfile;	/* For its records, if not NULL */
+	int		last_type;	/* Of its last record */
+	size_t		last;		/* Offset of it in the member */
+};
+
+struct member_list {
+	const unsigned char	*buf;
+	size_t			len;
+	FILE			*rptfile;
+	FILE			*errfile;
+	int			ret;
+};
+
+
+static void
+print_member(FILE *f, const struct trs80_cmd_member *m)
+{
+	if (m->type == TRS80_CMD_ISAMENTRY)
+		fprintf(f, "ISAM member %u", m->number);
+	else
+		fprintf(f, "PDS member \"%s\"", m->name);
+}
+
+
+/* Stop at the member named, or numbered, key. */
+static int
+find_member(void *arg, const struct trs80_cmd_member *m)
+{
+	struct member_find	*f = arg;
+	const char		*k = f->key;
+	unsigned long		n;
+	char			*ep;
+	size_t			i;
+
+	if (m->type == TRS80_CMD_ISAMENTRY) {
+		n = strtoul(k, &ep, 0);
+		if (*ep || ep == k || n != m->number)
+			return 0;
+	} else {
+		for (i = 0; k[i] && toupper((unsigned char)k[i]) ==
+				    toupper((unsigned char)m->name[i]); ++i)
+			;
+		if (k[i] || m->name[i])
+			return 0;
 	}
+	f->m = *m;
+
+	return 1;
+}
+
+
+static int
+member_record(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct member_check	*mc = arg;
+
+	mc->last_type = rec->type;
+	mc->last = rec->offset;
+
+	return mc->rptfile ? report_record(mc->rptfile, rec) : 0;
+}
+
 
-	if (Quiet < 2) {
-		if (extra_bytes)
-			printf("Found %u extraneous bytes at end of file.\n",
-				extra_bytes);
+/*
+ * Parse member m of the library in buf on its own.  It must end in a
+ * transfer or end-of-member record before the file does.
+ */
+
+static int
+check_member(const unsigned char *buf, size_t len,
+	     const struct trs80_cmd_member *m, struct trs80_cmd_info *info,
+	     struct member_check *mc, FILE *errfile)
+{
+	struct trs80_error	err;
+	int			st;
+
+	mc->last_type = -1;
+	mc->last = 0;
+	st = trs80_cmd_parse_flags(buf + m->offset, len - m->offset,
+				   TRS80_CMD_LSDOS, member_record, mc, info,
+				   &err);
+	if (st != TRS80_OK) {
+		char	msg[128];
 
-		printf("CMD file looks good!\n");
+		trs80_error_message(st, &err, msg, sizeof(msg));
+		print_member(errfile, m);
+		fprintf(errfile, ": %s\n", msg);
+		return 2;
+	}
+	if (info->truncated || (mc->last_type != TRS80_CMD_XFERADDR &&
+				mc->last_type != TRS80_CMD_ENDMEMBER)) {
+		print_member(errfile, m);
+		fprintf(errfile, " runs off the end of the file.\n");
+		return 2;
 	}
 
 	return 0;
 }
 
 
+static int
+library_error(int st, const struct trs80_error *err, FILE *errfile)
+{
+	char	msg[128];
+
+	if (st == TRS80_E_FORMAT) {
+		fprintf(errfile, "Not an LS-DOS library.\n");
+	} else {
+		trs80_error_message(st, err, msg, sizeof(msg));
+		fprintf(errfile, "Bad library directory entry, %s\n", msg);
+	}
+
+	return 2;
+}
+
+
+static int
+list_member(void *arg, const struct trs80_cmd_member *m)
+{
+	struct member_list	*ml = arg;
+	struct member_check	mc;
+	struct trs80_cmd_info	info;
+
+	mc.rptfile = NULL;
+	if (check_member(ml->buf, ml->len, m, &info, &mc, ml->errfile)) {
+		ml->ret = 2;
+		return 0;
+	}
+
+	print_member(ml->rptfile, m);
+	fprintf(ml->rptfile, " at offset %zu, %zu bytes", m->offset,
+		info.end);
+	if (info.has_xfer)
+		fprintf(ml->rptfile, ", transfer address == 0x%04x",
+			info.xfer_addr);
+	else if (m->type == TRS80_CMD_ISAMENTRY)
+		fprintf(ml->rptfile, ", transfer address == 0x%04x",
+			m->xfer_addr);
+	fprintf(ml->rptfile, "\n");
+
+	return 0;
+}
+
+
+/* List and check every member of the library in buf. */
+static int
+list_members(const unsigned char *buf, size_t len, FILE *rptfile,
+	     FILE *errfile)
+{
+	struct member_list	ml;
+	struct trs80_error	err;
+	int			st;
+
+	ml.buf = buf;
+	ml.len = len;
+	ml.rptfile = rptfile;
+	ml.errfile = errfile;
+	ml.ret = 0;
+	if ((st = trs80_cmd_members(buf, len, list_member, &ml, &err)))
+		return library_error(st, &err, errfile);
+
+	return ml.ret;
+}
+
+
+/*
+ * Find member key of the library in buf and make a CMD file of it
+ * alone in a malloc()ed *outp: its records as they are, except that an
+ * ISAM member's end-of-member record becomes a transfer record to the
+ * address its entry gives, so it runs on its own.
+ */
+
+static int
+extract_member(const unsigned char *buf, size_t len, const char *key,
+	       unsigned char **outp, size_t *outlenp, FILE *rptfile,
+	       FILE *errfile, int quiet)
+{
+	struct member_find	f;
+	struct member_check	mc;
+	struct trs80_cmd_info	info;
+	struct trs80_error	err;
+	unsigned char		*out;
+	size_t			n;
+	int			st, ret;
+
+	f.key = key;
+	if ((st = trs80_cmd_members(buf, len, find_member, &f, &err)) < 0)
+		return library_error(st, &err, errfile);
+	if (st == 0) {
+		fprintf(errfile, "No member '%s' in the library.\n", key);
+		return 2;
+	}
+
+	mc.rptfile = quiet ? NULL : rptfile;
+	if ((ret = check_member(buf, len, &f.m, &info, &mc, errfile)))
+		return ret;
+
+	n = info.end;
+	if (f.m.type == TRS80_CMD_ISAMENTRY &&
+	    mc.last_type == TRS80_CMD_ENDMEMBER)
+		n = mc.last;
+	if (!(out = malloc(n + 4))) {
+		fprintf(errfile, "Out of memory.\n");
+		return 3;
+	}
+	memcpy(out, buf + f.m.offset, n);
+	if (n < info.end) {
+		out[n++] = TRS80_CMD_XFERADDR;
+		out[n++] = 2;
+		out[n++] = f.m.xfer_addr & 0xff;
+		out[n++] = f.m.xfer_addr >> 8;
+	}
+
+	if (quiet < 2) {
+		print_member(rptfile, &f.m);
+		fprintf(rptfile, " looks good!\n");
+	}
+	*outp = out;
+	*outlenp = n;
+
+	return 0;
+}
+
+
+/*
+ * Parse infile, copying it less any trailing junk to outfile if not
+ * NULL, or writing its snapshot there.  With a member asked for, it's
+ * that member alone that is checked and written.
+ */
+
+static int
+process_file(const struct strip_opts *o, FILE *infile, FILE *outfile,
+	     FILE *rptfile, FILE *errfile)
+{
+	unsigned char	*buf;
+	size_t		len, end;
+	int		ret = 0, st;
+
+#ifdef HAVE_SPLICE
+	if (outfile && !o->snapshot && !o->layout && !o->member &&
+	    !o->table && is_pipe(fileno(infile)) &&
+	    is_pipe(fileno(outfile)) && fflush(outfile) == 0 &&
+	    (ret = strip_pipe(fileno(infile), fileno(outfile), rptfile,
+			      errfile, o->quiet)) >= 0)
+		return ret;
+#endif
+
+	if (read_file(infile, &buf, &len)) {
+		fprintf(errfile, "Error reading input file, %s (%d)\n",
+			strerror(errno), errno);
+		return 3;
+	}
+
+	if (o->member) {
+		unsigned char	*mbuf = NULL;
+
+		ret = extract_member(buf, len, o->member, &mbuf, &end,
+				     rptfile, errfile, o->quiet);
+		free(buf);
+		if (ret)
+			return ret;
+		buf = mbuf;
+	} else {
+		/* The table stands in for the records' report. */
+		if (o->table)
+			ret = list_members(buf, len, rptfile, errfile);
+		st = strip_buffer(buf, len, &end, rptfile, errfile,
+				  ret ? 2 : o->table && !o->quiet ? 1 :
+				  o->quiet);
+		if (ret == 0)
+			ret = st;
+	}
+
+	if (outfile && o->snapshot) {
+		if (ret == 0)
+			ret = write_snapshot(buf, end, outfile, errfile);
+	} else if (outfile && o->layout) {
+		if (ret == 0)
+			ret = write_relayout(buf, end, o->layout, o->quiet,
+					     outfile, rptfile, errfile);
+	} else if (outfile) {
+		fwrite(buf, 1, end, outfile);
+	}
+	free(buf);
+
+	return ret;
+}
+
+
+#ifdef HAVE_FMEMOPEN
+static int
+strip_job(struct batch_job *job)
+{
+	const struct strip_opts	*o = job->arg;
+
+	if (!o->quiet)
+		fprintf(job->rpt, "Member = \"%s\"\n", job->name);
+
+	return process_file(o, job->in, job->out, job->rpt, job->err);
+}
+
+
+/*
+ * Check every input, or every file in every archive, through the
+ * batch machinery.  Stripped files go to the output archive, if any,
+ * under the input names; files that fail to parse are left out.
+ */
+
+static int
+process_batch(const struct strip_opts *o)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct batch_opts	opts;
+
+	opts.fn = strip_job;
+	opts.arg = (void *)o;
+	opts.jobs = o->jobs;
+	opts.archives = o->archives;
+	opts.suffix = o->snapshot ? ".SNP" : NULL;
+	opts.outfile = o->outfile;
+	opts.rptfile = o->rptfile;
+	opts.errfile = o->errfile;
+	opts.journal = o->journal;
+
+	if (o->batch)
+		opts.output = o->batch_output ?
+				batch_output_for(o->batch_output) : BATCH_NONE;
+	else if (o->noperands > 1)
+		opts.output = batch_output_for(o->operands[1]);
+	else
+		opts.output = BATCH_NONE;
+
+	if (!o->batch)
+		return batch_run(&opts, o->noperands ? o->operands :
+						       stdin_operand, 1);
+
+	return batch_run(&opts, o->operands, o->noperands);
+}
+#endif
+
+
 /*
  * Returns 0 on success, -1 on failure.
  */
 
 static int
-process_args(int argc, char **argv)
+process_args(struct strip_opts *o, int argc, char **argv)
 {
 	int	opt;
 
-	while ((opt = getopt(argc, argv, "q")) != -1) {
+	memset(o, 0, sizeof(*o));
+	o->jobs = 1;
+	o->rptfile = stdout;
+	o->errfile = stderr;
+
+	while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
 		switch (opt) {
+#ifdef HAVE_FMEMOPEN
+		case 'a':
+			o->archives = 1;
+			break;
+
+		case 'b':
+			o->batch = 1;
+			break;
+
+		case 'J':
+			o->journal = optarg;
+			break;
+
+		case 'o':
+			o->batch_output = optarg;
+			break;
+
+#endif
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			char	*ep;
+			long	jobs = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || jobs < 0 || jobs > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				return -1;
+			}
+			o->jobs = (int)jobs;
+			break;
+		}
+
+#endif
+		case 'e':
+			o->member = optarg;
+			break;
+
+		case 'l':
+			if (!strcmp(optarg, "pack")) {
+				o->layout = LAYOUT_PACK;
+			} else if (!strcmp(optarg, "align")) {
+				o->layout = LAYOUT_ALIGN;
+			} else {
+				fprintf(stderr, "Bad layout '%s'.\n\n", optarg);
+				return -1;
+			}
+			break;
+
 		case 'q':
-			++Quiet;
+			++o->quiet;
+			break;
+
+		case 't':
+			o->table = 1;
+			break;
+
+		case 'x':
+			o->snapshot = 1;
 			break;
 
 		default:
@@ -272,47 +1396,132 @@ process_args(int argc, char **argv)
 		}
 	}
 
-	if ((argc - optind) > 2) {
+	o->operands = argv + optind;
+	o->noperands = argc - optind;
+
+	if (o->batch && o->noperands == 0) {
+		fprintf(stderr, "No input files.\n\n");
+		return -1;
+	}
+
+	if (!o->batch && o->batch_output) {
+		fprintf(stderr, "Option -o requires -b.\n\n");
+		return -1;
+	}
+
+	if (o->journal && !o->batch && !o->archives) {
+		fprintf(stderr, "Option -J requires -a or -b.\n\n");
+		return -1;
+	}
+
+	if (o->snapshot && (o->batch ? !o->batch_output : o->noperands < 2)) {
+		fprintf(stderr, "Option -x needs an output file.\n\n");
+		return -1;
+	}
+
+	if (o->layout && (o->batch ? !o->batch_output : o->noperands < 2)) {
+		fprintf(stderr, "Option -l needs an output file.\n\n");
+		return -1;
+	}
+
+	if (o->layout && o->snapshot) {
+		fprintf(stderr, "Options -l and -x don't go together.\n\n");
+		return -1;
+	}
+
+	if (o->member && o->table) {
+		fprintf(stderr, "Options -e and -t don't go together.\n\n");
+		return -1;
+	}
+
+	if (!o->batch && o->noperands > 2) {
 		fprintf(stderr, "Too many operands.\n\n");
 		return -1;
 	}
 
-	if (((argc - optind) > 0) &&
-	    (argv[optind][0] != '-') &&
-	    (argv[optind][1] != '\0')) {
-		const char	*ifile = argv[optind];
+	/* Batch and archive inputs are opened as they are processed. */
+	if (o->batch || o->archives) {
+		o->infile = NULL;
+	} else if ((o->noperands > 0) &&
+	    (o->operands[0][0] != '-') &&
+	    (o->operands[0][1] != '\0')) {
+		const char	*ifile = o->operands[0];
 		FILE		*ifp;
 
 		if ((ifp = fopen(ifile, "r"))) {
-			InputFile = ifp;
+			o->infile = ifp;
 		} else {
 			fprintf(stderr, "Failed to open file '%s', %s (%d)\n\n",
 				ifile,  strerror(errno), errno);
 			return -1;
 		}
 	} else {
-		InputFile = stdin;
+		o->infile = stdin;
 	}
 
-	if ((argc - optind) > 1) {
-		const char	*ofile = argv[optind+1];
+	if (o->batch ? o->batch_output != NULL : o->noperands > 1) {
+		const char	*ofile = o->batch ? o->batch_output :
+						    o->operands[1];
 		FILE		*ofp;
 
-		if ((ofp = fopen(ofile, "w+"))) {
-			OutputFile = ofp;
+		/* A journaled batch carries on the last run's output. */
+		if (!o->batch && strcmp(ofile, "-") == 0) {
+			/* Keep the report out of the stripped file. */
+			o->outfile = stdout;
+			o->rptfile = stderr;
+		} else if ((ofp = fopen(ofile, o->journal ? "a+" : "w+"))) {
+			o->outfile = ofp;
 		} else {
 			fprintf(stderr, "Failed to open file '%s', %s (%d)\n\n",
 				ofile,  strerror(errno), errno);
 			return -1;
 		}
 	} else {
-		OutputFile = 0;
+		o->outfile = NULL;
 	}
 
 	return 0;
 }
 
 
+/*
+ * Carry out one run.  Returns an exit status as for main(), with any
+ * diagnostics written to o->errfile.
+ */
+
+static int
+run(const struct strip_opts *o)
+{
+	int	ret;
+
+#ifdef HAVE_FMEMOPEN
+	if (o->batch || o->archives)
+		ret = process_batch(o);
+	else
+#endif
+	ret = process_file(o, o->infile, o->outfile, o->rptfile, o->errfile);
+
+	if (ret == 0 && o->outfile) {
+		/* We think we succeeded, but let's be sure. */
+
+		if (ferror(o->outfile)) {
+			fprintf(o->errfile,
+				"Error detected after writing output file.\n");
+			return 3;
+		}
+
+		if (fclose(o->outfile) == EOF) {
+			fprintf(o->errfile, "Error detected when closing "
+				"output file, %s (%d)\n",
+				strerror(errno), errno);
+			return 3;
+		}
+	}
+
+	return ret;
+}
+
+
 /*
  * Exit --
  *      0: Success
@@ -322,25 +1531,16 @@ process_args(int argc, char **argv)
  */
 
 int
+#ifdef TRS80_MULTICALL
+stripcmd_main(int argc, char **argv)
+#else
 main(int argc, char **argv)
+#endif
 {
-	int	ret = 0;
+	struct strip_opts	opts;
 
-	if (process_args(argc, argv))
+	if (process_args(&opts, argc, argv))
 		usage(argv[0]);
 
-	ret = process_file(InputFile, OutputFile);
-
-	if (ret == 0 && OutputFile) {
-		/* We think we succeeded, but let's be sure. */
-
-		if (ferror(OutputFile))
-			fatal(3, "Error detected after writing output file.\n");
-
-		if (fclose(OutputFile) == EOF)
-			fatal(3, "Error detected when closing output file, "
-					"%s (%d)\n", strerror(errno), errno);
-	}
-
-	return ret;
+	return run(&opts);
 }
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * What the tests share: a check that reports where it failed and
+ * counts, so a test goes on to the end and then exits 1 if any did.
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+
+static int	failures;
+
+#define	CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: failed: %s\n",		\
+				__FILE__, __LINE__, #cond);		\
+			++failures;					\
+		}							\
+	} while (0)
+
+/* The exit status of a test, with a line saying how it went. */
+static int
+check_done(const char *name)
+{
+	if (failures)
+		printf("%s: %d failed\n", name, failures);
+	else
+		printf("%s: ok\n", name);
+
+	return failures != 0;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Copyright 2023, Quentin L. Barnes
+#
+# Check that a journaled batch run (-J) that is stopped part way and
+# run again ends up with every input in its output archive, once.
+#
+# Usage: resume.sh stripcmd_binary
+#
+# A run over half the inputs, with junk then added after its output
+# and a torn record after its journal as a run that died would leave,
+# is carried on over all of them and must give what one run gives.
+# A run that is killed once its journal has a checkpoint is carried
+# on the same way.  Zip output, which can't be carried on, must be
+# refused.
+
+if [ $# -ne 1 ]; then
+	echo "Usage: $0 stripcmd_binary" >&2
+	exit 1
+fi
+
+case $1 in
+/*)	strip=$1 ;;
+*)	strip=$PWD/$1 ;;
+esac
+files=20000
+fail=0
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf -- "$dir"' EXIT
+trap 'exit 1' HUP INT TERM
+
+cd "$dir" || exit 1
+mkdir in || exit 1
+
+# Small CMD files, each with three bytes of junk to strip.
+i=0
+while [ $i -lt $files ]; do
+	printf '\001\005\000\130\076\001\311\002\002\000\130\032\032\032' \
+		>in/f$i.CMD
+	i=$((i + 1))
+done
+
+# The first half of the inputs, in the order the shell lists them.
+set -- in/*.CMD
+half=
+i=0
+for f; do
+	[ $i -lt $((files / 2)) ] && half="$half $f"
+	i=$((i + 1))
+done
+
+ls in/*.CMD | sort >want
+
+fail() {
+	echo "FAIL: $*"
+	fail=1
+}
+
+# check name status expected_status: the archive must list every input
+# once and extract cleanly.
+check() {
+	[ "$2" -eq "$3" ] || fail "$1: exit status $2, not $3"
+	tar tf "$1" >list 2>/dev/null || fail "$1: unreadable"
+	[ "$(sort list | uniq -d)" ] && fail "$1: inputs added twice"
+	sort list | cmp -s - want || fail "$1: inputs missing"
+	tar xOf "$1" >/dev/null 2>&1 || fail "$1: doesn't extract"
+}
+
+"$strip" -b -qq -j 1 -o ref.tar in/*.CMD
+check ref.tar $? 0
+
+# Stopped after a checkpoint, with unjournaled output and a torn
+# journal record after it.
+# shellcheck disable=SC2086
+"$strip" -b -qq -j 1 -J half.jnl -o half.tar $half
+printf 'junk after the checkpoint' >>half.tar
+printf 'torn' >>half.jnl
+"$strip" -b -qq -j 1 -J half.jnl -o half.tar in/*.CMD
+check half.tar $? 0
+cmp -s half.tar ref.tar || fail "half.tar: differs from one run's"
+
+# Killed once the journal has its first checkpoint.
+"$strip" -b -qq -j 1 -J kill.jnl -o kill.tar in/*.CMD &
+pid=$!
+while kill -0 $pid 2>/dev/null &&
+      [ "$( (wc -c <kill.jnl) 2>/dev/null || echo 0)" -le 16 ]; do
+	sleep 0.01 2>/dev/null || sleep 1
+done
+kill -9 $pid 2>/dev/null
+wait $pid 2>/dev/null
+"$strip" -b -qq -j 0 -J kill.jnl -o kill.tar in/*.CMD
+check kill.tar $? 0
+
+# A zip archive can't be carried on.
+"$strip" -b -qq -J zip.jnl -o out.zip in/f1.CMD 2>/dev/null
+[ $? -eq 1 ] || fail "zip output with a journal not refused"
+
+[ $fail -eq 0 ] && echo "resume: ok"
+exit $fail
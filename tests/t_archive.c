@@ -0,0 +1,414 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Tests of the archive readers and the inflater: archives made by the
+ * writer, then cut short or with headers broken, pax headers good and
+ * malformed, and deflated zip members good, truncated and corrupt.
+ */
+
+#define	_GNU_SOURCE		/* memmem(), open_memstream() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "archive.h"
+#include "inflate.h"
+#include "check.h"
+
+
+#define	TAR_BLOCK	512
+#define	NAMES_MAX	2048
+
+/* The deflated members' text, as "%05d LD A,(IX+%d)\r" for i * 10 and
+ * i % 7 for i from 0 to 39, by zlib at level 9 (dynamic codes). */
+static const unsigned char dynamic_data[] = {
+	0x65, 0xcd, 0xbd, 0x0d, 0x42, 0x51, 0x0c, 0x43, 0xe1, 0x09, 0xd8,
+	0xe1, 0x95, 0x20, 0x28, 0x62, 0xe7, 0xfe, 0x96, 0x48, 0x34, 0x48,
+	0x0c, 0xc0, 0xfe, 0x93, 0xf0, 0x94, 0x2a, 0x38, 0xee, 0x7c, 0x9a,
+	0xcf, 0xec, 0xdc, 0xf1, 0x79, 0x1d, 0xcf, 0xc7, 0xf5, 0xfd, 0xbd,
+	0xdb, 0xed, 0x72, 0x7e, 0xa4, 0x82, 0x28, 0x4c, 0x85, 0x51, 0x3c,
+	0x15, 0x8f, 0xd2, 0x52, 0x69, 0x51, 0x7a, 0x2a, 0x3d, 0xca, 0x48,
+	0x65, 0x44, 0x99, 0x45, 0x5f, 0x45, 0xdf, 0xaa, 0xc3, 0x54, 0x07,
+	0x54, 0x07, 0x55, 0x87, 0xab, 0x8e, 0xa6, 0x3a, 0xba, 0xea, 0x18,
+	0x45, 0x9f, 0x45, 0x5f, 0x45, 0xdf, 0xaa, 0xd3, 0x54, 0x27, 0x54,
+	0x27, 0x55, 0xa7, 0xab, 0xce, 0xa6, 0x3a, 0xbb, 0xea, 0x1c, 0x45,
+	0x9f, 0x45, 0x5f, 0x45, 0xdf, 0xaa, 0xbb, 0xa9, 0xee, 0x50, 0xdd,
+	0xa9, 0xba, 0xbb, 0xea, 0xde, 0x54, 0xf7, 0xae, 0xba, 0x8f, 0xa2,
+	0xcf, 0xa2, 0xaf, 0xa2, 0xef, 0x7f, 0xfd, 0x07
+};
+#define	DYNAMIC_CRC	0xdf7b4ecbUL
+
+/* "LD A,(HL)\r" 12 times then "RET\r", with the fixed codes. */
+static const unsigned char fixed_data[] = {
+	0xf3, 0x71, 0x51, 0x70, 0xd4, 0xd1, 0xf0, 0xf0, 0xd1, 0xe4, 0xf5,
+	0xa1, 0x2b, 0x2b, 0xc8, 0x35, 0x84, 0x17, 0x00
+};
+#define	FIXED_CRC	0x280a3e88UL
+
+
+static void
+put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8 & 0xff;
+}
+
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+
+/* An archive holding a.CMD ("abc") then b.CMD ("defg"), malloc()ed. */
+static unsigned char *
+make_archive(enum ar_format format, size_t *len)
+{
+	struct ar_writer	*aw;
+	char			*buf;
+	FILE			*fp;
+
+	if (!(fp = open_memstream(&buf, len)) ||
+	    !(aw = ar_create(fp, format)) ||
+	    ar_add(aw, "a.CMD", "abc", 3, 0, 0644) ||
+	    ar_add(aw, "b.CMD", "defg", 4, 0, 0644) ||
+	    ar_finish(aw) || fclose(fp)) {
+		fputs("Can't make a test archive\n", stderr);
+		exit(3);
+	}
+
+	return (unsigned char *)buf;
+}
+
+
+/*
+ * Read the archive of len bytes in buf, listing its members in names
+ * as "name=data" separated by blanks.  Returns the last ar_next()
+ * result, with its message in *errmsg if it is -1, or -2 with
+ * ar_open()'s message.
+ */
+static int
+read_archive(const void *buf, size_t len, char *names, const char **errmsg)
+{
+	struct ar_reader	*ar;
+	struct ar_member	m;
+	size_t			n;
+	FILE			*fp;
+	int			ret;
+
+	*errmsg = NULL;
+	names[0] = '\0';
+
+	if (!(fp = fmemopen((void *)buf, len, "r"))) {
+		perror("fmemopen");
+		exit(3);
+	}
+	if (!(ar = ar_open(fp, errmsg))) {
+		fclose(fp);
+		return -2;
+	}
+
+	while ((ret = ar_next(ar, &m)) == 1) {
+		n = strlen(names);
+		snprintf(names + n, NAMES_MAX - n, "%s%s=%.*s",
+			 n ? " " : "", m.name, (int)m.size, (char *)m.data);
+	}
+	if (ret < 0)
+		*errmsg = ar_error(ar);
+
+	ar_close(ar);
+	fclose(fp);
+
+	return ret;
+}
+
+
+/* Whether reading the archive gives ret, with the names and, for an
+ * error, the message given. */
+static int
+reads_as(const void *buf, size_t len, int ret, const char *names,
+	 const char *errmsg)
+{
+	char		got[NAMES_MAX];
+	const char	*msg;
+
+	if (read_archive(buf, len, got, &msg) != ret ||
+	    strcmp(got, names) ||
+	    (errmsg && (!msg || strcmp(msg, errmsg)))) {
+		fprintf(stderr, "read: \"%s\" (%s)\n", got,
+			msg ? msg : "no error");
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static void
+test_tar(void)
+{
+	unsigned char	*tar, *bad;
+	size_t		len;
+
+	tar = make_archive(AR_TAR, &len);
+	if (!(bad = malloc(len)))
+		exit(3);
+
+	CHECK(reads_as(tar, len, 0, "a.CMD=abc b.CMD=defg", NULL));
+
+	/* Without the end-of-archive blocks. */
+	CHECK(reads_as(tar, 4 * TAR_BLOCK, 0, "a.CMD=abc b.CMD=defg", NULL));
+
+	CHECK(reads_as(tar, TAR_BLOCK + 100, -1, "",
+		       "Truncated tar member"));
+	CHECK(reads_as(tar, 2 * TAR_BLOCK + 300, -1, "a.CMD=abc",
+		       "Truncated tar header"));
+
+	memcpy(bad, tar, len);
+	bad[2 * TAR_BLOCK] = 'c';
+	CHECK(reads_as(bad, len, -1, "a.CMD=abc", "Bad tar header checksum"));
+
+	CHECK(reads_as("Not an archive", 14, -2, "",
+		       "Not a tar or zip archive"));
+
+	free(bad);
+	free(tar);
+}
+
+
+/* A pax extended header of the len bytes at rec put before the tar
+ * archive, of tarlen bytes, in out. */
+static size_t
+pax_archive(unsigned char *out, const unsigned char *tar, size_t tarlen,
+	    const char *rec, size_t len)
+{
+	unsigned char	*hdr = out;
+	unsigned int	sum = 0;
+	size_t		i;
+
+	memcpy(hdr, tar, TAR_BLOCK);
+	hdr[156] = 'x';
+	snprintf((char *)hdr + 124, 12, "%011o", (unsigned int)len);
+	memset(hdr + 148, ' ', 8);
+	for (i = 0; i < TAR_BLOCK; ++i)
+		sum += hdr[i];
+	snprintf((char *)hdr + 148, 8, "%06o", sum);
+	hdr[155] = ' ';
+
+	memset(out + TAR_BLOCK, 0, TAR_BLOCK);
+	memcpy(out + TAR_BLOCK, rec, len);
+	memcpy(out + 2 * TAR_BLOCK, tar, tarlen);
+
+	return 2 * TAR_BLOCK + tarlen;
+}
+
+
+static void
+test_pax(void)
+{
+	static const struct {
+		const char	*rec;
+		const char	*names;
+	} tests[] = {
+		{ "21 path=dir/long.CMD\n", "dir/long.CMD=abc b.CMD=defg" },
+		{ "13 mtime=1.5\n21 path=dir/long.CMD\n",
+		  "dir/long.CMD=abc b.CMD=defg" },
+		/* Malformed records end the header. */
+		{ "99 path=dir/long.CMD\n", "a.CMD=abc b.CMD=defg" },
+		{ "21 path=dir/long.CMDx", "a.CMD=abc b.CMD=defg" },
+		{ "7 path\n", "a.CMD=abc b.CMD=defg" },
+		{ "3 \n", "a.CMD=abc b.CMD=defg" },
+		{ "21path=dir/long.CMD\n", "a.CMD=abc b.CMD=defg" },
+		{ "0 path=dir/long.CMD\n", "a.CMD=abc b.CMD=defg" }
+	};
+	unsigned char	*tar, *pax;
+	size_t		len, plen, i;
+
+	tar = make_archive(AR_TAR, &len);
+	if (!(pax = malloc(len + 2 * TAR_BLOCK)))
+		exit(3);
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		plen = pax_archive(pax, tar, len, tests[i].rec,
+				   strlen(tests[i].rec));
+		CHECK(reads_as(pax, plen, 0, tests[i].names, NULL));
+	}
+
+	/* A pax header cut short. */
+	pax_archive(pax, tar, len, tests[0].rec, strlen(tests[0].rec));
+	CHECK(reads_as(pax, TAR_BLOCK + 10, -1, "", "Truncated tar member"));
+
+	free(pax);
+	free(tar);
+}
+
+
+static void
+test_zip(void)
+{
+	unsigned char	*zip, *bad, *second;
+	size_t		len, off;
+
+	zip = make_archive(AR_ZIP, &len);
+	if (!(bad = malloc(len)))
+		exit(3);
+	second = memmem(zip + 4, len - 4, "PK\3\4", 4);
+	CHECK(second != NULL);
+	if (!second)
+		goto out;
+	off = second - zip;
+
+	CHECK(reads_as(zip, len, 0, "a.CMD=abc b.CMD=defg", NULL));
+
+	CHECK(reads_as(zip, 20, -1, "", "Truncated zip local header"));
+	CHECK(reads_as(zip, 30 + 5 + 1, -1, "", "Truncated zip member"));
+	CHECK(reads_as(zip, off, -1, "a.CMD=abc", "Truncated zip file"));
+
+	memcpy(bad, zip, len);
+	bad[off] = 'X';
+	CHECK(reads_as(bad, len, -1, "a.CMD=abc", "Bad zip local header"));
+
+	memcpy(bad, zip, len);
+	bad[30 + 5] ^= 1;
+	CHECK(reads_as(bad, len, -1, "", "Zip member failed CRC check"));
+
+	memcpy(bad, zip, len);
+	bad[8] = 99;
+	CHECK(reads_as(bad, len, -1, "",
+		       "Unsupported zip compression method"));
+
+	memcpy(bad, zip, len);
+	bad[6] |= 1;
+	CHECK(reads_as(bad, len, -1, "",
+		       "Encrypted zip members are not supported"));
+
+out:
+	free(bad);
+	free(zip);
+}
+
+
+/* A zip archive in out of one member, d.ASM, deflated to the len bytes
+ * at data, then the start of a central directory. */
+static size_t
+deflated_archive(unsigned char *out, const unsigned char *data, size_t len,
+		 uint32_t crc, size_t usize)
+{
+	memcpy(out, "PK\3\4", 4);
+	put16(out + 4, 20);		/* Version needed */
+	put16(out + 6, 0);		/* Flags */
+	put16(out + 8, 8);		/* Deflated */
+	put16(out + 10, 0);		/* Time */
+	put16(out + 12, 0x21);		/* Date, 1 Jan 1980 */
+	put32(out + 14, crc);
+	put32(out + 18, (uint32_t)len);
+	put32(out + 22, (uint32_t)usize);
+	put16(out + 26, 5);		/* Name length */
+	put16(out + 28, 0);		/* Extra length */
+	memcpy(out + 30, "d.ASM", 5);
+	memcpy(out + 35, data, len);
+	memcpy(out + 35 + len, "PK\1\2", 4);
+
+	return 35 + len + 4;
+}
+
+
+static void
+test_deflated(void)
+{
+	unsigned char	zip[64 + sizeof(dynamic_data)];
+	char		text[1024], names[NAMES_MAX];
+	size_t		len, n = 0;
+	int		i;
+
+	for (i = 0; i < 12; ++i)
+		n += sprintf(text + n, "LD A,(HL)\r");
+	n += sprintf(text + n, "RET\r");
+	snprintf(names, sizeof(names), "d.ASM=%s", text);
+	len = deflated_archive(zip, fixed_data, sizeof(fixed_data),
+			       FIXED_CRC, n);
+	CHECK(reads_as(zip, len, 0, names, NULL));
+
+	for (i = n = 0; i < 40; ++i)
+		n += sprintf(text + n, "%05d LD A,(IX+%d)\r", i * 10, i % 7);
+	snprintf(names, sizeof(names), "d.ASM=%s", text);
+	len = deflated_archive(zip, dynamic_data, sizeof(dynamic_data),
+			       DYNAMIC_CRC, n);
+	CHECK(reads_as(zip, len, 0, names, NULL));
+
+	CHECK(reads_as(zip, 35 + 40, -1, "", "Truncated zip member"));
+
+	len = deflated_archive(zip, dynamic_data, sizeof(dynamic_data),
+			       DYNAMIC_CRC ^ 1, n);
+	CHECK(reads_as(zip, len, -1, "", "Zip member failed CRC check"));
+
+	/* Block type 3, which there isn't. */
+	zip[35] |= 0x06;
+	CHECK(reads_as(zip, len, -1, "", "Corrupt deflated zip member"));
+}
+
+
+/* Inflate the len bytes at in, into out if it is not NULL. */
+static int
+inflate_buf(const void *in, size_t len, char *out)
+{
+	unsigned char	*buf;
+	size_t		outlen, cap = 1;
+	FILE		*fp;
+	int		ret;
+
+	if (!(fp = fmemopen((void *)in, len, "r")) || !(buf = malloc(cap))) {
+		perror("fmemopen");
+		exit(3);
+	}
+	ret = inflate_stream(fp, &buf, &outlen, &cap);
+	if (out) {
+		memcpy(out, buf, outlen);
+		out[outlen] = '\0';
+	}
+	free(buf);
+	fclose(fp);
+
+	return ret;
+}
+
+
+static void
+test_inflate(void)
+{
+	/* Stored blocks: the length, then its complement. */
+	static const unsigned char	stored[] = {
+		0x01, 0x03, 0x00, 0xfc, 0xff, 'a', 'b', 'c'
+	};
+	static const unsigned char	bad_nlen[] = {
+		0x01, 0x03, 0x00, 0x00, 0x00, 'a', 'b', 'c'
+	};
+	/* A fixed block copying from before the start of the output. */
+	static const unsigned char	too_far[] = { 0x03, 0x02, 0x00 };
+	char				out[16];
+
+	CHECK(inflate_buf(stored, sizeof(stored), out) == 0 &&
+	      !strcmp(out, "abc"));
+	CHECK(inflate_buf(stored, sizeof(stored) - 1, NULL) == -1);
+	CHECK(inflate_buf(stored, 2, NULL) == -1);
+	CHECK(inflate_buf(bad_nlen, sizeof(bad_nlen), NULL) == -2);
+	CHECK(inflate_buf(too_far, sizeof(too_far), NULL) == -2);
+	CHECK(inflate_buf(dynamic_data, sizeof(dynamic_data) / 2, NULL) == -1);
+}
+
+
+int
+main(void)
+{
+	test_tar();
+	test_pax();
+	test_zip();
+	test_deflated();
+	test_inflate();
+
+	return check_done("t_archive");
+}
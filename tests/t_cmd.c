@@ -0,0 +1,216 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Tests of trs80_cmd_parse() and trs80_cmd_parse_flags() on plain CMD
+ * files and LS-DOS libraries, and of trs80_cmd_members() on the
+ * libraries' directories.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trs80util.h"
+#include "check.h"
+
+
+/* A PDS: its header, entries for ALPHA (at 38) and BETA (at 47), the
+ * end of the directory, then ALPHA ending in an end-of-member record,
+ * BETA in a transfer record, and two bytes of junk. */
+static const unsigned char pds[] = {
+	0x06, 0x08, 'T', 'E', 'S', 'T', 'P', 'D', 'S', ' ',
+	0x0c, 0x0b, 'A', 'L', 'P', 'H', 'A', ' ', ' ', ' ', 38, 0, 0,
+	0x0c, 0x0b, 'B', 'E', 'T', 'A', ' ', ' ', ' ', ' ', 47, 0, 0,
+	0x0e, 0x00,
+	0x01, 0x05, 0x00, 0x58, 0x3e, 0x01, 0xc9,
+	0x04, 0x00,
+	0x01, 0x04, 0x00, 0x60, 0xaa, 0xbb,
+	0x02, 0x02, 0x00, 0x60,
+	0x1a, 0x1a
+};
+
+/* ISAM overlays 1 (at 18, entered at 7000) and 2 (at 27, at 7100),
+ * each a load block and a transfer record, then three bytes of junk. */
+static const unsigned char isam[] = {
+	0x08, 0x06, 0x01, 0x00, 0x70, 18, 0, 0,
+	0x08, 0x06, 0x02, 0x00, 0x71, 27, 0, 0,
+	0x0a, 0x00,
+	0x01, 0x03, 0x00, 0x70, 0xc9,
+	0x02, 0x02, 0x00, 0x70,
+	0x01, 0x03, 0x00, 0x71, 0xc9,
+	0x02, 0x02, 0x00, 0x71,
+	0x1a, 0x1a, 0x1a
+};
+
+/* A plain CMD file with an end-of-member record in it. */
+static const unsigned char stray_end[] = {
+	0x01, 0x03, 0x00, 0x70, 0xc9,
+	0x04, 0x00,
+	0x02, 0x02, 0x00, 0x70
+};
+
+/* A plain CMD file with a PDS directory entry in it. */
+static const unsigned char stray_entry[] = {
+	0x01, 0x03, 0x00, 0x70, 0xc9,
+	0x0c, 0x0b, 'A', 'L', 'P', 'H', 'A', ' ', ' ', ' ', 0, 0, 0,
+	0x02, 0x02, 0x00, 0x70
+};
+
+
+/* Whether parsing with flags gives status ret, for an error at offset
+ * off, else with end and extra as given. */
+static int
+parses_as(const unsigned char *buf, size_t len, unsigned int flags,
+	  int ret, size_t end, size_t extra, size_t off)
+{
+	struct trs80_cmd_info	info;
+	struct trs80_error	err;
+	int			got;
+
+	got = flags ? trs80_cmd_parse_flags(buf, len, flags, NULL, NULL,
+					    &info, &err) :
+		      trs80_cmd_parse(buf, len, NULL, NULL, &info, &err);
+	if (got != ret ||
+	    (ret == TRS80_OK && (info.end != end || info.extra != extra ||
+				 info.truncated)) ||
+	    (ret != TRS80_OK && (err.offset != off || err.byte != buf[off]))) {
+		fprintf(stderr, "parse: %d, end %zu extra %zu, at %zu\n",
+			got, info.end, info.extra,
+			ret != TRS80_OK ? err.offset : 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+struct members {
+	int			n;
+	struct trs80_cmd_member	m[4];
+};
+
+
+static int
+add_member(void *arg, const struct trs80_cmd_member *m)
+{
+	struct members	*ms = arg;
+
+	if (ms->n == 4)
+		return -1;
+	ms->m[ms->n++] = *m;
+
+	return 0;
+}
+
+
+static void
+test_pds(void)
+{
+	struct trs80_cmd_info	info;
+	struct members		ms;
+
+	/* Only with TRS80_CMD_LSDOS is it a library. */
+	CHECK(parses_as(pds, sizeof(pds), 0, TRS80_E_HEADER, 0, 0, 0));
+	CHECK(parses_as(pds, sizeof(pds), TRS80_CMD_LSDOS, TRS80_OK,
+			sizeof(pds) - 2, 2, 0));
+	CHECK(trs80_cmd_parse_flags(pds, sizeof(pds), TRS80_CMD_LSDOS, NULL,
+				    NULL, &info, NULL) == TRS80_OK &&
+	      info.has_xfer && info.xfer_addr == 0x6000);
+
+	/* Cut short inside its last member. */
+	CHECK(trs80_cmd_parse_flags(pds, 45, TRS80_CMD_LSDOS, NULL, NULL,
+				    &info, NULL) == TRS80_OK &&
+	      info.truncated && info.end == 45);
+
+	memset(&ms, 0, sizeof(ms));
+	CHECK(trs80_cmd_members(pds, sizeof(pds), add_member, &ms,
+				NULL) == TRS80_OK);
+	CHECK(ms.n == 2);
+	CHECK(ms.m[0].type == TRS80_CMD_PDSENTRY && ms.m[0].index == 0 &&
+	      !strcmp(ms.m[0].name, "ALPHA") && ms.m[0].entry == 10 &&
+	      ms.m[0].offset == 38);
+	CHECK(ms.m[1].index == 1 && !strcmp(ms.m[1].name, "BETA") &&
+	      ms.m[1].entry == 23 && ms.m[1].offset == 47);
+
+	/* Each member on its own, up to its end-of-member or transfer. */
+	CHECK(parses_as(pds + 38, sizeof(pds) - 38, TRS80_CMD_LSDOS,
+			TRS80_OK, 9, sizeof(pds) - 38 - 9, 0));
+	CHECK(parses_as(pds + 47, sizeof(pds) - 47, TRS80_CMD_LSDOS,
+			TRS80_OK, 10, 2, 0));
+	CHECK(parses_as(pds + 47, sizeof(pds) - 47, 0, TRS80_OK, 10, 2, 0));
+}
+
+
+static void
+test_isam(void)
+{
+	struct trs80_cmd_info	info;
+	struct trs80_error	err;
+	struct members		ms;
+	unsigned char		bad[sizeof(isam)];
+
+	CHECK(parses_as(isam, sizeof(isam), 0, TRS80_E_HEADER, 0, 0, 0));
+	CHECK(parses_as(isam, sizeof(isam), TRS80_CMD_LSDOS, TRS80_OK,
+			sizeof(isam) - 3, 3, 0));
+	CHECK(trs80_cmd_parse_flags(isam, sizeof(isam), TRS80_CMD_LSDOS,
+				    NULL, NULL, &info, NULL) == TRS80_OK &&
+	      info.xfer_addr == 0x7000);
+
+	memset(&ms, 0, sizeof(ms));
+	CHECK(trs80_cmd_members(isam, sizeof(isam), add_member, &ms,
+				NULL) == TRS80_OK);
+	CHECK(ms.n == 2);
+	CHECK(ms.m[0].type == TRS80_CMD_ISAMENTRY && ms.m[0].number == 1 &&
+	      ms.m[0].xfer_addr == 0x7000 && ms.m[0].offset == 18);
+	CHECK(ms.m[1].number == 2 && ms.m[1].xfer_addr == 0x7100 &&
+	      ms.m[1].entry == 8 && ms.m[1].offset == 27);
+
+	/* An entry pointing past the end of the file, or into the
+	 * directory. */
+	memcpy(bad, isam, sizeof(isam));
+	bad[13] = sizeof(isam);
+	CHECK(trs80_cmd_members(bad, sizeof(bad), NULL, NULL,
+				&err) == TRS80_E_RANGE && err.offset == 8);
+	bad[13] = 4;
+	CHECK(trs80_cmd_members(bad, sizeof(bad), NULL, NULL,
+				&err) == TRS80_E_RANGE && err.offset == 8);
+
+	/* An entry too short for its fields. */
+	memcpy(bad, isam, sizeof(isam));
+	bad[9] = 0x03;
+	CHECK(trs80_cmd_members(bad, sizeof(bad), NULL, NULL,
+				&err) == TRS80_E_RANGE && err.offset == 8);
+	CHECK(parses_as(bad, sizeof(bad), TRS80_CMD_LSDOS, TRS80_E_RANGE,
+			0, 0, 9));
+
+	CHECK(trs80_cmd_members(stray_end, sizeof(stray_end), NULL, NULL,
+				NULL) == TRS80_E_FORMAT);
+}
+
+
+static void
+test_plain(void)
+{
+	/* LS-DOS records are bad header bytes in a plain file, as they
+	 * always were, unless asked for. */
+	CHECK(parses_as(stray_end, sizeof(stray_end), 0, TRS80_E_HEADER,
+			0, 0, 5));
+	CHECK(parses_as(stray_end, sizeof(stray_end), TRS80_CMD_LSDOS,
+			TRS80_OK, 7, 4, 0));
+
+	/* Directory records only in a library. */
+	CHECK(parses_as(stray_entry, sizeof(stray_entry), 0, TRS80_E_HEADER,
+			0, 0, 5));
+	CHECK(parses_as(stray_entry, sizeof(stray_entry), TRS80_CMD_LSDOS,
+			TRS80_E_HEADER, 0, 0, 5));
+}
+
+
+int
+main(void)
+{
+	test_pds();
+	test_isam();
+	test_plain();
+
+	return check_done("t_cmd");
+}
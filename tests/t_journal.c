@@ -0,0 +1,165 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Tests of the batch journal: what a run syncs is there for the next
+ * with its mark, what it doesn't sync isn't, and a torn or corrupt
+ * tail, as a run that died leaves, is cut back to the last good mark.
+ */
+
+#define	_POSIX_C_SOURCE	200809L	/* mkdtemp() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "check.h"
+
+
+#define	HDR	16		/* Journal header and record sizes */
+#define	REC	16
+
+
+static char	path[64];
+
+
+static struct journal *
+open_journal(void)
+{
+	struct journal	*j;
+	const char	*msg;
+
+	if (!(j = journal_open(path, &msg))) {
+		perror(msg ? msg : path);
+		exit(3);
+	}
+
+	return j;
+}
+
+
+static long
+file_size(void)
+{
+	struct stat	st;
+
+	return stat(path, &st) ? -1 : (long)st.st_size;
+}
+
+
+/* Write len bytes at off in the journal, or at its end if off is -1. */
+static void
+poke(long off, const void *buf, size_t len)
+{
+	int	fd;
+
+	if ((fd = open(path, O_WRONLY)) == -1 ||
+	    pwrite(fd, buf, len, off < 0 ? file_size() : off) != (ssize_t)len ||
+	    close(fd)) {
+		perror(path);
+		exit(3);
+	}
+}
+
+
+static void
+test_keys(void)
+{
+	uint64_t	k = journal_key(NULL, "a/b.CMD", 100, 1000);
+
+	CHECK(k == journal_key(NULL, "a/b.CMD", 100, 1000));
+	CHECK(k != journal_key(NULL, "a/b.CMD", 101, 1000));
+	CHECK(k != journal_key(NULL, "a/b.CMD", 100, 1001));
+	CHECK(k != journal_key(NULL, "a/c.CMD", 100, 1000));
+	CHECK(k != journal_key("a", "b.CMD", 100, 1000));
+	CHECK(journal_key("x.tar", "b.CMD", 3, 0) !=
+	      journal_key("x.ta", "rb.CMD", 3, 0));
+}
+
+
+static void
+test_resume(void)
+{
+	struct journal	*j;
+	uint64_t	mark;
+
+	/* A new journal has no mark. */
+	j = open_journal();
+	CHECK(!journal_mark(j, &mark));
+	CHECK(journal_lookup(j, 1) == -1);
+
+	/* Two checkpoints, then a record that isn't synced. */
+	journal_add(j, 1, 0);
+	journal_add(j, 2, 2);
+	CHECK(journal_sync(j, 100) == 0);
+	journal_add(j, 3, 1);
+	CHECK(journal_sync(j, 200) == 0);
+	journal_add(j, 4, 0);
+	CHECK(journal_close(j) == 0);
+	CHECK(file_size() == HDR + 5 * REC);
+
+	j = open_journal();
+	CHECK(journal_mark(j, &mark) && mark == 200);
+	CHECK(journal_lookup(j, 1) == 0);
+	CHECK(journal_lookup(j, 2) == 2);
+	CHECK(journal_lookup(j, 3) == 1);
+	CHECK(journal_lookup(j, 4) == -1);
+
+	/* A sync with nothing new and the same mark writes nothing. */
+	CHECK(journal_sync(j, 200) == 0);
+	CHECK(journal_close(j) == 0);
+	CHECK(file_size() == HDR + 5 * REC);
+
+	/* A record torn off part way is cut off. */
+	poke(-1, "torn", 4);
+	j = open_journal();
+	CHECK(journal_mark(j, &mark) && mark == 200);
+	CHECK(journal_lookup(j, 3) == 1);
+	CHECK(journal_close(j) == 0);
+	CHECK(file_size() == HDR + 5 * REC);
+
+	/* A corrupt record ends the journal, back to the mark before it. */
+	poke(HDR + 3 * REC, "\x7f", 1);
+	j = open_journal();
+	CHECK(journal_mark(j, &mark) && mark == 100);
+	CHECK(journal_lookup(j, 2) == 2);
+	CHECK(journal_lookup(j, 3) == -1);
+	CHECK(journal_close(j) == 0);
+	CHECK(file_size() == HDR + 3 * REC);
+}
+
+
+static void
+test_not_journal(void)
+{
+	const char	*msg;
+
+	poke(0, "Not a journal, just some text", 29);
+	CHECK(!journal_open(path, &msg) && msg &&
+	      !strcmp(msg, "Not a journal file"));
+}
+
+
+int
+main(void)
+{
+	char	dir[] = "/tmp/t_journal.XXXXXX";
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 3;
+	}
+	snprintf(path, sizeof(path), "%s/jnl", dir);
+
+	test_keys();
+	test_resume();
+	test_not_journal();
+
+	unlink(path);
+	rmdir(dir);
+
+	return check_done("t_journal");
+}
@@ -0,0 +1,479 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 carve: recover EDTASM and CMD files from raw disk images.
+ *
+ * Each image is mapped into memory and cut into pieces that the
+ * threads take in turn, each running trs80_carve() over its piece.  A
+ * file may start in one piece and run on into the next, where that
+ * piece's thread knows nothing of it, so the finds are put back in
+ * order afterwards and any starting inside an earlier file dropped.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "archive.h"
+#include "batch.h"
+
+
+#define	PIECE		(16 * 1024 * 1024)	/* Bytes a thread takes */
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	CARVE_OPTIONS	"o:" JOBS_OPTS
+
+
+struct piece {
+	size_t			from;
+	size_t			to;
+	struct trs80_carved	*found;
+	size_t			nfound;
+	size_t			cap;
+	int			failed;		/* Out of memory */
+};
+
+struct carve {
+	const unsigned char	*buf;
+	size_t			len;
+	struct piece		*pieces;
+	size_t			npieces;
+	size_t			next;		/* Next piece to carve */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		lock;
+#endif
+};
+
+struct image {
+	const char	*name;
+	unsigned char	*buf;
+	size_t		len;
+	int		mapped;
+	long		mtime;
+};
+
+
+static void
+carve_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s" JOBS_USAGE " [-o out_archive] image...\n"
+		"Finds EDTASM and CMD files in raw disk images.\n"
+		"Options:\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tRun with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-o\tExtract the files into a tar or zip (.zip) "
+			"archive\n",
+		pgmname);
+
+	exit(1);
+}
+
+
+/*
+ * Images.
+ */
+
+static int
+open_image(struct image *img, const char *name)
+{
+	struct stat	st;
+	int		fd = 0, ret = 2;
+	size_t		cap = 0;
+
+	memset(img, 0, sizeof(*img));
+	img->name = name;
+
+	if (strcmp(name, "-") && (fd = open(name, O_RDONLY)) == -1) {
+		fprintf(stderr, "Can't open '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		return 2;
+	}
+
+	if (fstat(fd, &st) == 0) {
+		img->mtime = (long)st.st_mtime;
+		if (S_ISREG(st.st_mode) && st.st_size > 0) {
+			void	*p = mmap(NULL, st.st_size, PROT_READ,
+					  MAP_PRIVATE, fd, 0);
+
+			if (p != MAP_FAILED) {
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				img->buf = p;
+				img->len = st.st_size;
+				img->mapped = 1;
+				if (fd)
+					close(fd);
+				return 0;
+			}
+		}
+	}
+
+	/* A pipe, or something else that won't map. */
+	for (;;) {
+		ssize_t	n;
+
+		if (img->len == cap) {
+			unsigned char	*p;
+
+			cap = cap ? cap * 2 : PIECE;
+			if (!(p = realloc(img->buf, cap))) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			img->buf = p;
+		}
+		if ((n = read(fd, img->buf + img->len, cap - img->len)) > 0) {
+			img->len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0) {
+			if (fd)
+				close(fd);
+			return 0;
+		}
+		fprintf(stderr, "Error reading '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		break;
+	}
+
+	if (fd)
+		close(fd);
+	free(img->buf);
+	img->buf = NULL;
+
+	return ret;
+}
+
+
+static void
+close_image(struct image *img)
+{
+	if (img->mapped)
+		munmap(img->buf, img->len);
+	else
+		free(img->buf);
+}
+
+
+/*
+ * Carving.
+ */
+
+static int
+add_found(void *arg, const struct trs80_carved *c)
+{
+	struct piece	*pc = arg;
+
+	if (pc->nfound == pc->cap) {
+		size_t			cap = pc->cap ? pc->cap * 2 : 64;
+		struct trs80_carved	*p;
+
+		if (!(p = realloc(pc->found, cap * sizeof(*p)))) {
+			pc->failed = 1;
+			return 1;
+		}
+		pc->found = p;
+		pc->cap = cap;
+	}
+	pc->found[pc->nfound++] = *c;
+
+	return 0;
+}
+
+
+static void *
+carve_worker(void *arg)
+{
+	struct carve	*cv = arg;
+
+	for (;;) {
+		struct piece	*pc;
+		size_t		i;
+
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&cv->lock);
+#endif
+		i = cv->next++;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&cv->lock);
+#endif
+
+		if (i >= cv->npieces)
+			break;
+		pc = &cv->pieces[i];
+		trs80_carve(cv->buf, cv->len, pc->from, pc->to, add_found, pc);
+	}
+
+	return NULL;
+}
+
+
+/* Carve img into its pieces' found lists.  Returns 0 or 3. */
+static int
+carve_image(struct carve *cv, const struct image *img, int jobs)
+{
+	size_t	i;
+
+	memset(cv, 0, sizeof(*cv));
+	cv->buf = img->buf;
+	cv->len = img->len;
+	cv->npieces = (img->len + PIECE - 1) / PIECE;
+	if (!(cv->pieces = calloc(cv->npieces ? cv->npieces : 1,
+				  sizeof(*cv->pieces)))) {
+		cv->npieces = 0;
+		return 3;
+	}
+	for (i = 0; i < cv->npieces; ++i) {
+		cv->pieces[i].from = i * (size_t)PIECE;
+		cv->pieces[i].to = i == cv->npieces - 1 ? img->len :
+				   (i + 1) * (size_t)PIECE;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (jobs == 0)
+		jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if ((size_t)jobs > cv->npieces)
+		jobs = (int)cv->npieces;
+
+	if (jobs > 1) {
+		pthread_t	*tids;
+		int		k, started = 0;
+
+		if (!(tids = calloc(jobs, sizeof(*tids))))
+			return 3;
+		pthread_mutex_init(&cv->lock, NULL);
+		for (k = 0; k < jobs; ++k, ++started)
+			if (pthread_create(&tids[k], NULL, carve_worker, cv))
+				break;
+		/* Whatever threads there are, this one helps. */
+		carve_worker(cv);
+		for (k = 0; k < started; ++k)
+			pthread_join(tids[k], NULL);
+		pthread_mutex_destroy(&cv->lock);
+		free(tids);
+	} else
+#else
+	(void)jobs;
+#endif
+	carve_worker(cv);
+
+	for (i = 0; i < cv->npieces; ++i)
+		if (cv->pieces[i].failed)
+			return 3;
+
+	return 0;
+}
+
+
+/* The name in a file's header or name record, if it has one. */
+static void
+carved_name(const unsigned char *p, const struct trs80_carved *c,
+	    char *name, size_t size)
+{
+	size_t	n = 0, i;
+
+	name[0] = '\0';
+	if (c->type == TRS80_TYPE_EDTASM && p[0] == 0xd3)
+		n = 6, ++p;
+	else if (c->type == TRS80_TYPE_CMD && p[0] == TRS80_CMD_FNAMEREC)
+		n = p[1], p += 2;
+
+	for (i = 0; i < n && i < size - 1 && p[i] >= 0x20 && p[i] < 0x7f;
+	     ++i)
+		name[i] = p[i];
+	while (i > 0 && name[i - 1] == ' ')
+		--i;
+	name[i] = '\0';
+}
+
+
+static const char *
+base_name(const char *path)
+{
+	const char	*p = strrchr(path, '/');
+
+	if (!strcmp(path, "-"))
+		return "stdin";
+
+	return p ? p + 1 : path;
+}
+
+
+/* Report img's files, adding them to aw if not NULL. */
+static int
+report(const struct carve *cv, const struct image *img,
+       struct ar_writer *aw)
+{
+	size_t	i, k, end = 0;
+
+	for (i = 0; i < cv->npieces; ++i) {
+		const struct piece	*pc = &cv->pieces[i];
+
+		for (k = 0; k < pc->nfound; ++k) {
+			const struct trs80_carved	*c = &pc->found[k];
+			const unsigned char	*p = img->buf + c->offset;
+			char			name[64], path[4096];
+
+			if (c->offset < end)
+				continue;
+			end = c->offset + c->len;
+
+			carved_name(p, c, name, sizeof(name));
+			printf("%s: %010zx  %-6s %8zu%s%s%s\n", img->name,
+			       c->offset, trs80_type_name(c->type), c->len,
+			       name[0] ? "  " : "", name,
+			       c->truncated ? " (truncated)" : "");
+
+			if (!aw)
+				continue;
+			snprintf(path, sizeof(path), "%s/%010zx.%s",
+				 base_name(img->name), c->offset,
+				 c->type == TRS80_TYPE_CMD ? "CMD" : "ASM");
+			if (ar_add(aw, path, p, c->len, img->mtime, 0644)) {
+				fprintf(stderr,
+					"Error writing output archive.\n");
+				return 3;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static void
+free_carve(struct carve *cv)
+{
+	size_t	i;
+
+	for (i = 0; i < cv->npieces; ++i)
+		free(cv->pieces[i].found);
+	free(cv->pieces);
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+carve_main(int argc, char **argv)
+{
+	const char		*output = NULL;
+	FILE			*outfile = NULL;
+	struct ar_writer	*aw = NULL;
+	int			opt, ret = 0, jobs = 1, i;
+
+	while ((opt = getopt(argc, argv, CARVE_OPTIONS)) != -1) {
+		switch (opt) {
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			char	*ep;
+			long	v = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || v < 0 || v > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				carve_usage(argv[0]);
+			}
+			jobs = (int)v;
+			break;
+		}
+#endif
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			carve_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "No disk images.\n\n");
+		carve_usage(argv[0]);
+	}
+
+	if (output) {
+		if (!(outfile = fopen(output, "wb"))) {
+			fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+				output, strerror(errno), errno);
+			return 1;
+		}
+		if (!(aw = ar_create(outfile, batch_output_for(output) ==
+						BATCH_ZIP ? AR_ZIP : AR_TAR))) {
+			fprintf(stderr, "Out of memory.\n");
+			fclose(outfile);
+			return 3;
+		}
+	}
+
+	for (i = optind; i < argc && ret != 3; ++i) {
+		struct image	img;
+		struct carve	cv;
+		int		r;
+
+		if ((r = open_image(&img, argv[i]))) {
+			if (r > ret)
+				ret = r;
+			continue;
+		}
+
+		if ((r = carve_image(&cv, &img, jobs)))
+			fprintf(stderr, "Out of memory.\n");
+		else
+			r = report(&cv, &img, aw);
+		if (r > ret)
+			ret = r;
+
+		free_carve(&cv);
+		close_image(&img);
+	}
+
+	if (aw && ar_finish(aw) && ret != 3) {
+		fprintf(stderr, "Error writing output archive.\n");
+		ret = 3;
+	}
+	if (outfile && fclose(outfile) == EOF && ret != 3) {
+		fprintf(stderr, "Error closing output archive, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	return ret;
+}
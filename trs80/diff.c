@@ -0,0 +1,674 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 diff: compare two versions of a program by what they load.
+ *
+ * Two CMD files can load the same bytes through quite different
+ * blocks, so comparing the files says little.  Each is loaded into a
+ * 64K memory image instead, and the images are walked with
+ * trs80_image_compare() as ranges that differ or are loaded by only
+ * one of them, shown in hex or, with -d, disassembled with some
+ * instructions of context around them.
+ *
+ * In batch mode the old versions are the members of one archive and
+ * the new versions those of another, paired by name.  The old ones are
+ * read first and kept in name order; the new ones then go through the
+ * batch machinery, each compared on a worker thread with its old
+ * version found by binary search, and the reports come out in the
+ * new archive's order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "batch.h"
+
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	DIFF_OPTIONS	"bC:dq" JOBS_OPTS
+
+#define	HEX_LINE	16		/* Bytes per line of hex */
+#define	CONTEXT		2		/* Default instructions of context */
+
+
+struct old_file {
+	char		*name;
+	unsigned char	*data;
+	size_t		size;
+	int		bad;		/* Not a CMD file, already said */
+	int		seen;
+};
+
+struct diff {
+	int		batch;
+	int		disasm;
+	int		quiet;
+	unsigned int	context;
+
+	struct old_file	*olds;		/* By name once loaded */
+	size_t		nolds;
+	size_t		oldcap;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+#endif
+};
+
+/* One side of a comparison. */
+struct side {
+	struct trs80_image	img;
+	unsigned char		starts[TRS80_IMAGE_SIZE / 8];	/* -d */
+	int			swept;
+};
+
+/* The ranges of a comparison that aren't the same. */
+struct changes {
+	struct trs80_range	*v;
+	size_t			n;
+	size_t			cap;
+	unsigned long		bytes[4];	/* By enum trs80_range_kind */
+};
+
+
+static void
+diff_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-dq] [-C lines] old_cmd new_cmd\n"
+		"       %s -b [-dq]" JOBS_USAGE " [-C lines] old_archive "
+			"new_archive\n"
+		"Compares CMD files by the memory they load.\n"
+		"Options:\n"
+		"\t-b\tCompare the like-named members of two tar or zip "
+			"archives\n"
+		"\t-C\tWith -d, instructions of context (default %d)\n"
+		"\t-d\tDisassemble the changes instead of showing hex\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tCompare with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-q\tOnly say which files differ and by how much\n",
+		pgmname, pgmname, CONTEXT);
+
+	exit(1);
+}
+
+
+static void
+lock(struct diff *d)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&d->lock);
+#else
+	(void)d;
+#endif
+}
+
+
+static void
+unlock(struct diff *d)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&d->lock);
+#else
+	(void)d;
+#endif
+}
+
+
+/* Whether data is a CMD file, saying why not on errfile. */
+static int
+check_cmd(const unsigned char *data, size_t size, FILE *errfile)
+{
+	struct trs80_error	err;
+	char			msg[128];
+	int			st;
+
+	if (trs80_identify(data, size) != TRS80_TYPE_CMD) {
+		fprintf(errfile, "Not a CMD file.\n");
+		return 2;
+	}
+	if ((st = trs80_cmd_parse(data, size, NULL, NULL, NULL, &err))) {
+		trs80_error_message(st, &err, msg, sizeof(msg));
+		fprintf(errfile, "%s\n", msg);
+		return 2;
+	}
+
+	return 0;
+}
+
+
+/* Keep a copy of an old version.  Runs on the batch's threads. */
+static int
+diff_load(struct batch_job *job)
+{
+	struct diff	*d = job->arg;
+	struct old_file	f;
+	int		ret = 0;
+
+	memset(&f, 0, sizeof(f));
+	f.bad = check_cmd(job->data, job->size, job->err);
+	f.size = job->size;
+	if (!(f.name = strdup(job->name)) ||
+	    !(f.data = malloc(job->size ? job->size : 1))) {
+		free(f.name);
+		fprintf(job->err, "Out of memory.\n");
+		return 3;
+	}
+	memcpy(f.data, job->data, job->size);
+
+	lock(d);
+	if (d->nolds == d->oldcap) {
+		size_t		cap = d->oldcap ? d->oldcap * 2 : 64;
+		struct old_file	*p;
+
+		if ((p = realloc(d->olds, cap * sizeof(*p)))) {
+			d->olds = p;
+			d->oldcap = cap;
+		}
+	}
+	if (d->nolds < d->oldcap)
+		d->olds[d->nolds++] = f;
+	else
+		ret = 3;
+	unlock(d);
+
+	if (ret) {
+		fprintf(job->err, "Out of memory.\n");
+		free(f.data);
+		free(f.name);
+	}
+
+	return ret ? ret : f.bad;
+}
+
+
+static int
+cmp_old(const void *a, const void *b)
+{
+	return strcmp(((const struct old_file *)a)->name,
+		      ((const struct old_file *)b)->name);
+}
+
+
+static struct old_file *
+find_old(struct diff *d, const char *name)
+{
+	size_t	lo = 0, hi = d->nolds;
+
+	while (lo < hi) {
+		size_t	mid = lo + (hi - lo) / 2;
+		int	c = strcmp(name, d->olds[mid].name);
+
+		if (c == 0)
+			return &d->olds[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+
+static int
+add_change(void *arg, const struct trs80_range *r)
+{
+	struct changes	*c = arg;
+
+	c->bytes[r->kind] += r->len;
+	if (r->kind == TRS80_RANGE_SAME)
+		return 0;
+
+	if (c->n == c->cap) {
+		size_t			cap = c->cap ? c->cap * 2 : 64;
+		struct trs80_range	*p;
+
+		if (!(p = realloc(c->v, cap * sizeof(*p))))
+			return TRS80_E_NOMEM;
+		c->v = p;
+		c->cap = cap;
+	}
+	c->v[c->n++] = *r;
+
+	return 0;
+}
+
+
+/*
+ * Disassembly.
+ */
+
+#define	IS_START(s, addr)	((s)->starts[(addr) >> 3] >> ((addr) & 7) & 1)
+
+/* Mark where instructions start, disassembling each loaded run from
+ * its first byte. */
+static void
+sweep(struct side *s)
+{
+	unsigned int	addr, p;
+	char		text[32];
+
+	memset(s->starts, 0, sizeof(s->starts));
+	for (addr = 0; addr < TRS80_IMAGE_SIZE; ++addr) {
+		if (!TRS80_IMAGE_LOADED(&s->img, addr) ||
+		    (addr > 0 && TRS80_IMAGE_LOADED(&s->img, addr - 1)))
+			continue;
+		for (p = addr; p < TRS80_IMAGE_SIZE &&
+			       TRS80_IMAGE_LOADED(&s->img, p); ) {
+			s->starts[p >> 3] |= 1 << (p & 7);
+			p += trs80_z80_disasm(s->img.mem, p, text,
+					      sizeof(text));
+		}
+	}
+	s->swept = 1;
+}
+
+
+/* The instruction start before addr in s's run, or addr if none. */
+static unsigned int
+prev_start(const struct side *s, unsigned int addr)
+{
+	unsigned int	p = addr;
+
+	while (p > 0 && TRS80_IMAGE_LOADED(&s->img, p - 1)) {
+		--p;
+		if (IS_START(s, p))
+			return p;
+	}
+
+	return addr;
+}
+
+
+/* Print the instruction at addr with mark in front, and return the
+ * address after it. */
+static unsigned int
+print_insn(const struct side *s, unsigned int addr, int mark, FILE *fp)
+{
+	char	text[32], hex[16];
+	int	n, i;
+
+	n = trs80_z80_disasm(s->img.mem, addr, text, sizeof(text));
+	for (i = 0; i < n; ++i)
+		sprintf(hex + i * 3, "%02x ",
+			s->img.mem[(addr + i) & (TRS80_IMAGE_SIZE - 1)]);
+	fprintf(fp, "%c%04x  %-12s %s\n", mark, addr, hex, text);
+
+	return addr + n;
+}
+
+
+/* Where the code covering addr starts: the instruction addr is inside
+ * of, if there is one. */
+static unsigned int
+code_start(const struct side *s, unsigned int addr)
+{
+	unsigned int	p;
+
+	if (IS_START(s, addr))
+		return addr;
+	p = prev_start(s, addr);
+
+	return p != addr && addr - p < 4 ? p : addr;
+}
+
+
+/* The instructions of s covering start to end, after mark.  Returns
+ * the address after the last. */
+static unsigned int
+print_code(const struct side *s, unsigned int start, unsigned int end,
+	   int mark, FILE *fp)
+{
+	unsigned int	addr = code_start(s, start);
+
+	while (addr <= end)
+		addr = print_insn(s, addr, mark, fp);
+
+	return addr;
+}
+
+
+/* Up to n instructions of s before addr. */
+static void
+print_before(const struct side *s, unsigned int addr, unsigned int n,
+	     FILE *fp)
+{
+	unsigned int	p = addr, i;
+
+	for (i = 0; i < n; ++i) {
+		unsigned int	q = prev_start(s, p);
+
+		if (q == p)
+			break;
+		p = q;
+	}
+	while (p < addr)
+		p = print_insn(s, p, ' ', fp);
+}
+
+
+/* Up to n instructions of s from addr on, while they're loaded. */
+static void
+print_after(const struct side *s, unsigned int addr, unsigned int n,
+	    FILE *fp)
+{
+	unsigned int	i;
+
+	for (i = 0; i < n && addr < TRS80_IMAGE_SIZE &&
+		    TRS80_IMAGE_LOADED(&s->img, addr); ++i)
+		addr = print_insn(s, addr, ' ', fp);
+}
+
+
+/* The bytes of s from start to end in hex, after mark. */
+static void
+print_hex(const struct side *s, unsigned int start, unsigned int end,
+	  int mark, FILE *fp)
+{
+	unsigned int	addr;
+
+	for (addr = start; addr <= end; ++addr) {
+		if (addr == start || (addr - start) % HEX_LINE == 0)
+			fprintf(fp, "%s%c%04x ", addr == start ? "" : "\n",
+				mark, addr);
+		fprintf(fp, " %02x", s->img.mem[addr]);
+	}
+	fprintf(fp, "\n");
+}
+
+
+/*
+ * Reporting.
+ */
+
+static const char *const Kind_Names[4] = {
+	"same", "differ", "old only", "new only"
+};
+
+static void
+print_xfer(const struct trs80_image *img, FILE *fp)
+{
+	if (img->has_xfer)
+		fprintf(fp, "%04x", img->xfer_addr);
+	else
+		fprintf(fp, "none");
+}
+
+
+/* Report old against new, named old_name and new_name.  Nothing is
+ * said if they load the same. */
+static int
+report(const struct diff *d, struct side *old, struct side *new,
+       const char *old_name, const char *new_name, FILE *fp)
+{
+	struct changes	c;
+	size_t		i;
+	int		xfer;
+
+	memset(&c, 0, sizeof(c));
+	if (trs80_image_compare(&old->img, &new->img, add_change, &c)) {
+		free(c.v);
+		return 3;
+	}
+
+	xfer = old->img.has_xfer != new->img.has_xfer ||
+	       old->img.xfer_addr != new->img.xfer_addr;
+	if (c.n == 0 && !xfer) {
+		free(c.v);
+		return 0;
+	}
+
+	if (d->quiet) {
+		unsigned long	n = c.bytes[TRS80_RANGE_DIFFER];
+
+		if (d->batch)
+			fprintf(fp, "%s:", new_name);
+		else
+			fprintf(fp, "%s %s:", old_name, new_name);
+		fprintf(fp, " %lu byte%s changed, %lu old only, %lu new only",
+			n, n == 1 ? "" : "s", c.bytes[TRS80_RANGE_ONLY_A],
+			c.bytes[TRS80_RANGE_ONLY_B]);
+		if (xfer)
+			fprintf(fp, ", transfer address changed");
+		fprintf(fp, "\n");
+		free(c.v);
+		return 0;
+	}
+
+	fprintf(fp, "--- %s\n+++ %s\n", old_name, new_name);
+	if (xfer) {
+		fprintf(fp, "@@ transfer address @@\n-");
+		print_xfer(&old->img, fp);
+		fprintf(fp, "\n+");
+		print_xfer(&new->img, fp);
+		fprintf(fp, "\n");
+	}
+
+	if (d->disasm) {
+		if (!old->swept)
+			sweep(old);
+		if (!new->swept)
+			sweep(new);
+	}
+
+	for (i = 0; i < c.n; ++i) {
+		const struct trs80_range	*r = &c.v[i];
+		unsigned int			end = r->start + r->len - 1;
+		int				in_old, in_new;
+
+		in_old = r->kind != TRS80_RANGE_ONLY_B;
+		in_new = r->kind != TRS80_RANGE_ONLY_A;
+
+		fprintf(fp, "@@ %04x-%04x %s @@\n", r->start, end,
+			Kind_Names[r->kind]);
+		if (d->disasm) {
+			/* Context comes from the old version where it has
+			 * the range, the new one otherwise. */
+			struct side	*ctx = in_old ? old : new;
+			unsigned int	next = 0;
+
+			print_before(ctx, code_start(ctx, r->start),
+				     d->context, fp);
+			if (in_old)
+				next = print_code(old, r->start, end, '-', fp);
+			if (in_new) {
+				unsigned int	n;
+
+				n = print_code(new, r->start, end, '+', fp);
+				if (!in_old)
+					next = n;
+			}
+			print_after(ctx, next, d->context, fp);
+		} else {
+			if (in_old)
+				print_hex(old, r->start, end, '-', fp);
+			if (in_new)
+				print_hex(new, r->start, end, '+', fp);
+		}
+	}
+
+	free(c.v);
+
+	return 0;
+}
+
+
+/* Compare one new version with its old one.  Runs on the batch's
+ * threads. */
+static int
+diff_compare(struct batch_job *job)
+{
+	struct diff	*d = job->arg;
+	struct old_file	*old;
+	struct side	*s;
+	int		ret;
+
+	if (!d->batch)
+		old = &d->olds[0];
+	else if (!(old = find_old(d, job->name))) {
+		fprintf(job->rpt, "%s: new only\n", job->name);
+		return 0;
+	}
+	lock(d);
+	old->seen = 1;
+	unlock(d);
+
+	if (old->bad || (ret = check_cmd(job->data, job->size, job->err)))
+		return old->bad ? 0 : ret;
+
+	if (!(s = calloc(2, sizeof(*s)))) {
+		fprintf(job->err, "Out of memory.\n");
+		return 3;
+	}
+
+	/* Both parse, so both load. */
+	trs80_image_clear(&s[0].img);
+	trs80_image_cmd(&s[0].img, old->data, old->size, NULL);
+	trs80_image_clear(&s[1].img);
+	trs80_image_cmd(&s[1].img, job->data, job->size, NULL);
+	if ((ret = report(d, &s[0], &s[1], old->name, job->name, job->rpt)))
+		fprintf(job->err, "Out of memory.\n");
+
+	free(s);
+
+	return ret;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+diff_main(int argc, char **argv)
+{
+	struct batch_opts	opts;
+	struct diff		d;
+	size_t			i;
+	int			opt, ret, r, jobs = 1;
+
+	memset(&d, 0, sizeof(d));
+	d.context = CONTEXT;
+
+	while ((opt = getopt(argc, argv, DIFF_OPTIONS)) != -1) {
+		char	*ep;
+		long	v;
+
+		switch (opt) {
+		case 'b':
+			d.batch = 1;
+			break;
+
+		case 'C':
+			v = strtol(optarg, &ep, 10);
+			if (*ep || ep == optarg || v < 0 || v > 1000) {
+				fprintf(stderr, "Bad context '%s'.\n\n",
+					optarg);
+				diff_usage(argv[0]);
+			}
+			d.context = (unsigned int)v;
+			break;
+
+		case 'd':
+			d.disasm = 1;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j':
+			v = strtol(optarg, &ep, 10);
+			if (*ep || ep == optarg || v < 0 || v > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				diff_usage(argv[0]);
+			}
+			jobs = (int)v;
+			break;
+#endif
+
+		case 'q':
+			d.quiet = 1;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			diff_usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, "Need an old and a new %s.\n\n",
+			d.batch ? "archive" : "file");
+		diff_usage(argv[0]);
+	}
+	if (!strcmp(argv[optind], "-") && !strcmp(argv[optind + 1], "-")) {
+		fprintf(stderr, "Only one of the two can be stdin.\n\n");
+		diff_usage(argv[0]);
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&d.lock, NULL);
+#endif
+
+	memset(&opts, 0, sizeof(opts));
+	opts.fn = diff_load;
+	opts.arg = &d;
+	opts.jobs = jobs;
+	opts.archives = d.batch;
+	opts.output = BATCH_NONE;
+	opts.errfile = stderr;
+
+	/* A bad old file only spoils its own comparison in batch mode. */
+	ret = batch_run(&opts, argv + optind, 1);
+	if (ret == 3 || (!d.batch && (ret || d.nolds != 1))) {
+		if (ret == 0)
+			ret = 3;
+	} else {
+		qsort(d.olds, d.nolds, sizeof(*d.olds), cmp_old);
+
+		opts.fn = diff_compare;
+		opts.rptfile = stdout;
+		if ((r = batch_run(&opts, argv + optind + 1, 1)) > ret)
+			ret = r;
+
+		for (i = 0; d.batch && i < d.nolds; ++i)
+			if (!d.olds[i].seen)
+				printf("%s: old only\n", d.olds[i].name);
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	for (i = 0; i < d.nolds; ++i) {
+		free(d.olds[i].name);
+		free(d.olds[i].data);
+	}
+	free(d.olds);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&d.lock);
+#endif
+
+	return ret;
+}
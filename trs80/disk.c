@@ -0,0 +1,458 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 disk: write host files into JV1 and JV3 disk images.
+ *
+ * The image is read whole, every file is written into it in memory
+ * and the result replaces it in one write, so a file that doesn't fit
+ * leaves the image as it was.  CMD files go in less any trailing junk
+ * and EDTASM files up to their end of file byte, so each one's
+ * directory entry ends it where its last record does; with -e, text
+ * files are EDTASM-encoded first.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+
+
+#define	DISK_OPTIONS	"2delN:n:t:"
+
+#define	EOFCHAR		0x1a
+
+
+struct disk_opts {
+	int		encode;
+	int		list;
+	const char	*format;	/* -n: a new image */
+	const char	*name;
+	unsigned int	tracks;
+	unsigned int	sides;
+	int		dd;
+};
+
+
+static void
+disk_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-2del] [-n jv1|jv3] [-t tracks] [-N name] image "
+			"[[NAME/EXT=]file...]\n"
+		"Writes files into a JV1 or JV3 image of an LDOS format "
+			"disk.\n"
+		"Options:\n"
+		"\t-2\tWith -n jv3, two sided\n"
+		"\t-d\tWith -n jv3, double density\n"
+		"\t-e\tEDTASM-encode text files (as NAME/ASM)\n"
+		"\t-l\tList the directory when done\n"
+		"\t-N\tWith -n, the disk's name (default DATA)\n"
+		"\t-n\tMake a new image instead of updating one\n"
+		"\t-t\tWith -n, the number of tracks (default 35 for jv1, "
+			"40 for jv3)\n",
+		pgmname);
+
+	exit(1);
+}
+
+
+/* Read all of a file into a new malloc()ed buffer. */
+static int
+read_input(const char *name, unsigned char **bufp, size_t *lenp)
+{
+	FILE		*fp;
+	unsigned char	*buf = NULL;
+	size_t		len = 0, cap = 0;
+	int		ret = 0;
+
+	if (!(fp = fopen(name, "rb"))) {
+		fprintf(stderr, "Can't open '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		return 2;
+	}
+
+	for (;;) {
+		size_t	n;
+
+		if (len == cap) {
+			unsigned char	*p;
+
+			cap = cap ? cap * 2 : 65536;
+			if (!(p = realloc(buf, cap))) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			buf = p;
+		}
+		if ((n = fread(buf + len, 1, cap - len, fp)) == 0)
+			break;
+		len += n;
+	}
+
+	if (ret == 0 && ferror(fp)) {
+		fprintf(stderr, "Error reading '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		ret = 2;
+	}
+	fclose(fp);
+
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+	*bufp = buf;
+	*lenp = len;
+
+	return 0;
+}
+
+
+/*
+ * The DOS name for a host file: its base name less anything but
+ * letters and digits, up to 8 characters, and up to 3 of its
+ * extension.  Returns -1 if that doesn't start with a letter.
+ */
+static int
+host_name(const char *path, const char *ext, char *name)
+{
+	const char	*base = strrchr(path, '/');
+	const char	*dot;
+	int		n = 0, k;
+
+	base = base ? base + 1 : path;
+	dot = strrchr(base, '.');
+
+	for (; *base && base != dot && n < 8; ++base) {
+		int	ch = (unsigned char)*base;
+
+		if (ch >= 'a' && ch <= 'z')
+			ch -= 'a' - 'A';
+		if ((ch >= 'A' && ch <= 'Z') || (n && ch >= '0' && ch <= '9'))
+			name[n++] = ch;
+	}
+	if (n == 0)
+		return -1;
+
+	if (!ext && dot)
+		ext = dot + 1;
+	for (k = 0; ext && *ext && k < 3; ++ext) {
+		int	ch = (unsigned char)*ext;
+
+		if (ch >= 'a' && ch <= 'z')
+			ch -= 'a' - 'A';
+		if ((ch >= 'A' && ch <= 'Z') || (k && ch >= '0' && ch <= '9')) {
+			if (k++ == 0)
+				name[n++] = '/';
+			name[n++] = ch;
+		}
+	}
+	name[n] = '\0';
+
+	return 0;
+}
+
+
+/*
+ * Write one NAME/EXT=file operand into d.  CMD files lose any junk
+ * after their transfer record and EDTASM files any after their end of
+ * file byte; text is encoded if asked.  Returns an exit status.
+ */
+static int
+put_file(struct trs80_disk *d, const struct disk_opts *o, const char *arg)
+{
+	const char	*eq = strchr(arg, '='), *path = eq ? eq + 1 : arg;
+	unsigned char	*buf, *data, *enc = NULL;
+	size_t		len, dlen;
+	char		name[16], note[64], msg[80];
+	int		ret, type;
+
+	if ((ret = read_input(path, &buf, &len)))
+		return ret;
+	data = buf;
+	dlen = len;
+	note[0] = '\0';
+
+	type = trs80_identify(buf, len);
+	if (type == TRS80_TYPE_CMD) {
+		struct trs80_cmd_info	info;
+
+		trs80_cmd_parse(buf, len, NULL, NULL, &info, NULL);
+		dlen = info.end;
+	} else if (type == TRS80_TYPE_EDTASM) {
+		unsigned char	*eof = memchr(buf, EOFCHAR, len);
+
+		if (eof)
+			dlen = eof + 1 - buf;
+	}
+
+	if (eq) {
+		if ((size_t)(eq - arg) >= sizeof(name)) {
+			fprintf(stderr, "Bad DOS file name in '%s'.\n", arg);
+			free(buf);
+			return 1;
+		}
+		memcpy(name, arg, eq - arg);
+		name[eq - arg] = '\0';
+	} else if (host_name(path, type == TRS80_TYPE_UNKNOWN && o->encode ?
+					"ASM" : NULL, name)) {
+		fprintf(stderr, "Can't make a DOS file name of '%s'; "
+			"give one as NAME/EXT=%s\n", path, path);
+		free(buf);
+		return 1;
+	}
+
+	if (type == TRS80_TYPE_UNKNOWN && o->encode) {
+		struct trs80_error	err;
+		char			stem[7];
+
+		/* The header holds the name without its extension. */
+		snprintf(stem, sizeof(stem), "%.*s", (int)strcspn(name, "/."),
+			 name);
+		if (!(enc = malloc(trs80_edtasm_encode_bound(len)))) {
+			fprintf(stderr, "Out of memory.\n");
+			free(buf);
+			return 3;
+		}
+		if ((ret = trs80_edtasm_encode(buf, len, stem, 0, enc, &dlen,
+					       &err))) {
+			trs80_error_message(ret, &err, msg, sizeof(msg));
+			fprintf(stderr, "'%s': %s Offset = %zu\n", path, msg,
+				err.offset);
+			free(enc);
+			free(buf);
+			return 2;
+		}
+		data = enc;
+		strcpy(note, "  (encoded)");
+	} else if (dlen < len)
+		snprintf(note, sizeof(note), "  (%zu bytes after the end "
+			 "dropped)", len - dlen);
+
+	if ((ret = trs80_disk_write(d, name, data, dlen))) {
+		trs80_error_message(ret, NULL, msg, sizeof(msg));
+		if (ret == TRS80_E_INVAL)
+			fprintf(stderr, "Bad DOS file name '%s'.\n", name);
+		else
+			fprintf(stderr, "'%s': %s\n", path, msg);
+		ret = ret == TRS80_E_INVAL ? 1 : 2;
+	} else
+		printf("%-12s %8zu  %s%s\n", name, dlen, path, note);
+
+	free(enc);
+	free(buf);
+
+	return ret;
+}
+
+
+static int
+list_file(void *arg, const struct trs80_disk_file *f)
+{
+	(void)arg;
+	printf("%-12s %8zu  %3u granule%s%s%s\n", f->name, f->len,
+	       f->granules, f->granules == 1 ? "" : "s",
+	       f->attr & 0x40 ? "  SYS" : "", f->attr & 0x08 ? "  INV" : "");
+
+	return 0;
+}
+
+
+static int
+new_disk(const struct disk_opts *o, struct trs80_disk **dp)
+{
+	struct trs80_disk_geometry	g;
+	char				date[9];
+	time_t				now = time(NULL);
+	int				ret;
+
+	if (!strcmp(o->format, "jv1")) {
+		g.format = TRS80_DISK_JV1;
+		if (o->sides != 1 || o->dd) {
+			fprintf(stderr, "JV1 images are single sided and "
+				"single density.\n\n");
+			return 1;
+		}
+	} else if (!strcmp(o->format, "jv3"))
+		g.format = TRS80_DISK_JV3;
+	else {
+		fprintf(stderr, "Unknown image format '%s'.\n\n", o->format);
+		return 1;
+	}
+	g.cylinders = o->tracks ? o->tracks :
+		      g.format == TRS80_DISK_JV1 ? 35 : 40;
+	g.sides = o->sides;
+	g.sectors = o->dd ? 18 : 10;
+
+	strftime(date, sizeof(date), "%m/%d/%y", localtime(&now));
+	if ((ret = trs80_disk_new(dp, &g, o->name, date))) {
+		fprintf(stderr, ret == TRS80_E_INVAL ?
+			"Can't make a disk of %u tracks.\n\n" :
+			"Out of memory.\n", g.cylinders);
+		return ret == TRS80_E_INVAL ? 1 : 3;
+	}
+
+	return 0;
+}
+
+
+/* Replace image with d's, through a temporary file beside it. */
+static int
+save_disk(const struct trs80_disk *d, const char *image)
+{
+	const void	*buf;
+	size_t		len;
+	char		tmp[4096];
+	FILE		*fp;
+
+	buf = trs80_disk_image(d, &len);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", image);
+	if (!(fp = fopen(tmp, "wb"))) {
+		fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+			tmp, strerror(errno), errno);
+		return 2;
+	}
+	if (fwrite(buf, 1, len, fp) != len || fclose(fp) == EOF) {
+		fprintf(stderr, "Error writing '%s', %s (%d)\n",
+			tmp, strerror(errno), errno);
+		remove(tmp);
+		return 3;
+	}
+	if (rename(tmp, image)) {
+		fprintf(stderr, "Can't rename '%s' to '%s', %s (%d)\n",
+			tmp, image, strerror(errno), errno);
+		remove(tmp);
+		return 3;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+disk_main(int argc, char **argv)
+{
+	struct disk_opts	o;
+	struct trs80_disk	*d;
+	const char		*image;
+	int			opt, ret = 0, i;
+
+	memset(&o, 0, sizeof(o));
+	o.sides = 1;
+
+	while ((opt = getopt(argc, argv, DISK_OPTIONS)) != -1) {
+		switch (opt) {
+		case '2':
+			o.sides = 2;
+			break;
+
+		case 'd':
+			o.dd = 1;
+			break;
+
+		case 'e':
+			o.encode = 1;
+			break;
+
+		case 'l':
+			o.list = 1;
+			break;
+
+		case 'N':
+			o.name = optarg;
+			break;
+
+		case 'n':
+			o.format = optarg;
+			break;
+
+		case 't': {
+			char	*ep;
+			long	v = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || v < 2 || v > 96) {
+				fprintf(stderr, "Bad track count '%s'.\n\n",
+					optarg);
+				disk_usage(argv[0]);
+			}
+			o.tracks = (unsigned int)v;
+			break;
+		}
+
+		default:
+			fprintf(stderr, "\n");
+			disk_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "No disk image.\n\n");
+		disk_usage(argv[0]);
+	}
+	image = argv[optind++];
+
+	if (o.format) {
+		if ((ret = new_disk(&o, &d))) {
+			if (ret == 1)
+				disk_usage(argv[0]);
+			return ret;
+		}
+	} else {
+		unsigned char	*buf;
+		size_t		len;
+
+		if ((ret = read_input(image, &buf, &len)))
+			return ret;
+		ret = trs80_disk_open(&d, buf, len);
+		free(buf);
+		if (ret) {
+			if (ret == TRS80_E_NOMEM)
+				fprintf(stderr, "Out of memory.\n");
+			else
+				fprintf(stderr, "'%s' is not a JV1 or JV3 "
+					"image of an LDOS format disk.\n",
+					image);
+			return ret == TRS80_E_NOMEM ? 3 : 2;
+		}
+		if (optind == argc)
+			o.list = 1;
+	}
+
+	for (i = optind; i < argc && ret == 0; ++i)
+		ret = put_file(d, &o, argv[i]);
+
+	/* All or nothing: the image is only replaced if every file went
+	 * in. */
+	if (ret == 0 && (o.format || optind < argc))
+		ret = save_disk(d, image);
+
+	if (ret == 0 && o.list) {
+		if (optind < argc)
+			printf("\n");
+		trs80_disk_files(d, list_file, NULL);
+		printf("%u granules free\n", trs80_disk_free_granules(d));
+	}
+
+	trs80_disk_free(d);
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	return ret;
+}
@@ -0,0 +1,872 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 match: which sources built which binaries.
+ *
+ * Every input is read once, through the batch machinery, and reduced
+ * to a sparse load image: a CMD file from its load blocks, anything
+ * else by assembling it in memory as EDTASM source.  Each image also
+ * gets fingerprints, a hash for every 16-byte aligned group of
+ * addresses it loads, taken over the group's address, which of its
+ * bytes are loaded and their values.
+ *
+ * Pairing every source with every binary is then a lookup per source
+ * fingerprint in one sorted index of all the binaries' fingerprints.
+ * Only binaries sharing at least one group with a source have the two
+ * images compared in full, and the sources are shared out among the
+ * threads for that, each with its own scratch images.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "batch.h"
+
+
+#define	GROUP		16		/* Addresses per fingerprint */
+#define	NGROUPS		(TRS80_IMAGE_SIZE / GROUP)
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	MATCH_OPTIONS	"ap:v" JOBS_OPTS
+
+
+struct run {
+	unsigned int	addr;
+	unsigned int	len;
+};
+
+/* The result of comparing a source with one binary. */
+struct pair {
+	size_t			bin;		/* Index into binaries */
+	unsigned long		count[4];	/* By enum trs80_range_kind */
+	int			xfer_differs;
+	int			keep_ranges;	/* -v */
+	struct trs80_range	*ranges;
+	size_t			nranges;
+	size_t			rangecap;
+};
+
+struct input {
+	char		*name;
+	int		is_cmd;
+	int		has_xfer;
+	unsigned int	xfer_addr;
+	struct run	*runs;
+	size_t		nruns;
+	unsigned char	*data;		/* The runs' bytes, one after another */
+	uint32_t	*fps;		/* Sorted, no duplicates */
+	size_t		nfps;
+	struct pair	*pairs;		/* Sources: best first */
+	size_t		npairs;
+	int		failed;		/* Pairs couldn't be recorded */
+};
+
+/* An entry in the binaries' fingerprint index. */
+struct fp_entry {
+	uint32_t	fp;
+	uint32_t	bin;
+};
+
+struct match {
+	int		percent;
+	int		verbose;
+	int		jobs;
+
+	struct input	**inputs;	/* As loaded, in any order */
+	size_t		ninputs;
+	size_t		inputcap;
+
+	struct input	**sources;	/* By name */
+	size_t		nsources;
+	struct input	**binaries;	/* By name */
+	size_t		nbinaries;
+	struct fp_entry	*index;
+	size_t		nindex;
+
+	size_t		next;		/* Next source to pair up */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+#endif
+};
+
+
+static void
+match_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-av]" JOBS_USAGE " [-p percent] file...\n"
+		"Pairs every EDTASM source with the CMD files whose loaded "
+			"bytes it\n"
+		"assembles to.\n"
+		"Options:\n"
+		"\t-a\tInputs are tar or zip archives (stdin if none)\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tRun with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-p\tReport pairs with at least percent of their loaded "
+			"bytes\n"
+		"\t\tthe same (default 50)\n"
+		"\t-v\tList the same and differing address ranges\n",
+		pgmname);
+
+	exit(1);
+}
+
+
+static void
+lock(struct match *m)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&m->lock);
+#else
+	(void)m;
+#endif
+}
+
+
+static void
+unlock(struct match *m)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&m->lock);
+#else
+	(void)m;
+#endif
+}
+
+
+static void
+free_input(struct input *in)
+{
+	size_t	i;
+
+	if (!in)
+		return;
+
+	for (i = 0; i < in->npairs; ++i)
+		free(in->pairs[i].ranges);
+	free(in->pairs);
+	free(in->fps);
+	free(in->data);
+	free(in->runs);
+	free(in->name);
+	free(in);
+}
+
+
+/*
+ * Images.
+ */
+
+static unsigned int
+group_bits(const struct trs80_image *img, unsigned int g)
+{
+	return img->loaded[g * 2] | img->loaded[g * 2 + 1] << 8;
+}
+
+
+static uint32_t
+fingerprint(const struct trs80_image *img, unsigned int g, unsigned int bits)
+{
+	const unsigned char	*p = &img->mem[g * GROUP];
+	uint32_t		h = 2166136261U;
+	int			i;
+
+	h = (h ^ g) * 16777619U;
+	for (i = 0; i < GROUP; ++i)
+		if (bits >> i & 1)
+			h = (h ^ (p[i] | (unsigned int)i << 8)) * 16777619U;
+
+	return h;
+}
+
+
+static int
+cmp_fp(const void *a, const void *b)
+{
+	uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* The first address from addr on that is loaded, or isn't if loaded
+ * is 0, or the end of the image.  Whole bytes of the map at a time. */
+static unsigned int
+next_edge(const struct trs80_image *img, unsigned int addr, int loaded)
+{
+	unsigned char	skip = loaded ? 0x00 : 0xff;
+
+	while (addr < TRS80_IMAGE_SIZE) {
+		if ((addr & 7) == 0 && img->loaded[addr >> 3] == skip)
+			addr += 8;
+		else if (TRS80_IMAGE_LOADED(img, addr) == loaded)
+			return addr;
+		else
+			++addr;
+	}
+
+	return TRS80_IMAGE_SIZE;
+}
+
+
+/* Keep img's loaded bytes and fingerprints in in.  Returns -1 if out
+ * of memory. */
+static int
+save_image(struct input *in, const struct trs80_image *img)
+{
+	unsigned int	addr, end, g;
+	size_t		nbytes = 0, nruns = 0, i, j;
+	uint32_t	*fps;
+
+	/* Count first, so each array is allocated once. */
+	for (addr = 0; addr < TRS80_IMAGE_SIZE; addr = end) {
+		addr = next_edge(img, addr, 1);
+		end = next_edge(img, addr, 0);
+		if (end > addr) {
+			++nruns;
+			nbytes += end - addr;
+		}
+	}
+
+	in->runs = malloc((nruns ? nruns : 1) * sizeof(*in->runs));
+	in->data = malloc(nbytes ? nbytes : 1);
+	in->fps = malloc(NGROUPS * sizeof(*in->fps));
+	if (!in->runs || !in->data || !in->fps)
+		return -1;
+
+	for (addr = 0, nbytes = 0; addr < TRS80_IMAGE_SIZE; addr = end) {
+		addr = next_edge(img, addr, 1);
+		end = next_edge(img, addr, 0);
+		if (end > addr) {
+			in->runs[in->nruns].addr = addr;
+			in->runs[in->nruns++].len = end - addr;
+			memcpy(in->data + nbytes, &img->mem[addr], end - addr);
+			nbytes += end - addr;
+		}
+	}
+
+	for (g = 0; g < NGROUPS; ++g) {
+		unsigned int	bits = group_bits(img, g);
+
+		if (bits)
+			in->fps[in->nfps++] = fingerprint(img, g, bits);
+	}
+
+	/* Groups hash apart nearly always, but duplicates must go. */
+	if (in->nfps)
+		qsort(in->fps, in->nfps, sizeof(*in->fps), cmp_fp);
+	for (i = j = 0; i < in->nfps; ++i)
+		if (j == 0 || in->fps[i] != in->fps[j - 1])
+			in->fps[j++] = in->fps[i];
+	in->nfps = j;
+	if (j && (fps = realloc(in->fps, j * sizeof(*fps))))
+		in->fps = fps;
+
+	in->has_xfer = img->has_xfer;
+	in->xfer_addr = img->xfer_addr;
+
+	return 0;
+}
+
+
+static void
+load_image(const struct input *in, struct trs80_image *img)
+{
+	const unsigned char	*p = in->data;
+	size_t			i;
+
+	trs80_image_clear(img);
+	for (i = 0; i < in->nruns; ++i) {
+		trs80_image_load(img, in->runs[i].addr, p, in->runs[i].len);
+		p += in->runs[i].len;
+	}
+	img->has_xfer = in->has_xfer;
+	img->xfer_addr = in->xfer_addr;
+}
+
+
+/* Runs on the batch's worker threads. */
+static int
+match_load(struct batch_job *job)
+{
+	struct match		*m = job->arg;
+	struct trs80_image	*img;
+	struct input		*in;
+	int			ret = 0;
+
+	if (!(img = malloc(sizeof(*img))) ||
+	    !(in = calloc(1, sizeof(*in)))) {
+		free(img);
+		fprintf(job->err, "Out of memory.\n");
+		return 3;
+	}
+	trs80_image_clear(img);
+
+	if (trs80_identify(job->data, job->size) == TRS80_TYPE_CMD) {
+		struct trs80_error	err;
+		char			msg[128];
+		int			st;
+
+		in->is_cmd = 1;
+		st = trs80_image_cmd(img, job->data, job->size, &err);
+		if (st != TRS80_OK) {
+			trs80_error_message(st, &err, msg, sizeof(msg));
+			fprintf(job->err, "%s\n", msg);
+			ret = 2;
+		}
+	} else {
+		struct trs80_asm	*a;
+
+		if (!(a = trs80_asm_new())) {
+			fprintf(job->err, "Out of memory.\n");
+			ret = 3;
+		} else if (!(ret = asm_source(a, job->data, job->size,
+					      job->err))) {
+			trs80_image_asm(img, a);
+		}
+		trs80_asm_free(a);
+	}
+
+	if (ret == 0 && (!(in->name = strdup(job->name)) ||
+			 save_image(in, img))) {
+		fprintf(job->err, "Out of memory.\n");
+		ret = 3;
+	}
+	free(img);
+
+	if (ret == 0) {
+		lock(m);
+		if (m->ninputs == m->inputcap) {
+			size_t		cap = m->inputcap ? m->inputcap * 2 : 64;
+			struct input	**p;
+
+			if ((p = realloc(m->inputs, cap * sizeof(*p)))) {
+				m->inputs = p;
+				m->inputcap = cap;
+			}
+		}
+		if (m->ninputs < m->inputcap)
+			m->inputs[m->ninputs++] = in;
+		else
+			ret = 3;
+		unlock(m);
+
+		if (ret)
+			fprintf(job->err, "Out of memory.\n");
+	}
+
+	if (ret)
+		free_input(in);
+
+	return ret;
+}
+
+
+/*
+ * Pairing.
+ */
+
+static int
+cmp_name(const void *a, const void *b)
+{
+	const struct input	*x = *(struct input *const *)a;
+	const struct input	*y = *(struct input *const *)b;
+
+	return strcmp(x->name, y->name);
+}
+
+
+static int
+cmp_index(const void *a, const void *b)
+{
+	const struct fp_entry	*x = a, *y = b;
+
+	if (x->fp != y->fp)
+		return x->fp < y->fp ? -1 : 1;
+
+	return x->bin < y->bin ? -1 : x->bin > y->bin;
+}
+
+
+/* Split the inputs by kind, in name order, and index the binaries. */
+static int
+build_index(struct match *m)
+{
+	size_t	i, j, n = 0;
+
+	if (m->ninputs)
+		qsort(m->inputs, m->ninputs, sizeof(*m->inputs), cmp_name);
+
+	m->sources = malloc((m->ninputs + 1) * sizeof(*m->sources));
+	m->binaries = malloc((m->ninputs + 1) * sizeof(*m->binaries));
+	if (!m->sources || !m->binaries)
+		return -1;
+
+	for (i = 0; i < m->ninputs; ++i) {
+		if (m->inputs[i]->is_cmd) {
+			m->binaries[m->nbinaries++] = m->inputs[i];
+			n += m->inputs[i]->nfps;
+		} else {
+			m->sources[m->nsources++] = m->inputs[i];
+		}
+	}
+
+	if (!(m->index = malloc((n + 1) * sizeof(*m->index))))
+		return -1;
+
+	for (i = 0; i < m->nbinaries; ++i) {
+		for (j = 0; j < m->binaries[i]->nfps; ++j) {
+			m->index[m->nindex].fp = m->binaries[i]->fps[j];
+			m->index[m->nindex++].bin = i;
+		}
+	}
+	if (m->nindex)
+		qsort(m->index, m->nindex, sizeof(*m->index), cmp_index);
+
+	return 0;
+}
+
+
+/* The first index entry for fp, or nindex if there is none. */
+static size_t
+find_fp(const struct match *m, uint32_t fp)
+{
+	size_t	lo = 0, hi = m->nindex;
+
+	while (lo < hi) {
+		size_t	mid = lo + (hi - lo) / 2;
+
+		if (m->index[mid].fp < fp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < m->nindex && m->index[lo].fp == fp ? lo : m->nindex;
+}
+
+
+static int
+add_range(void *arg, const struct trs80_range *r)
+{
+	struct pair	*p = arg;
+
+	p->count[r->kind] += r->len;
+
+	if (!p->keep_ranges)
+		return 0;
+
+	if (p->nranges == p->rangecap) {
+		size_t			cap = p->rangecap ? p->rangecap * 2 : 16;
+		struct trs80_range	*nr;
+
+		if (!(nr = realloc(p->ranges, cap * sizeof(*nr))))
+			return -1;
+		p->ranges = nr;
+		p->rangecap = cap;
+	}
+	p->ranges[p->nranges++] = *r;
+
+	return 0;
+}
+
+
+static unsigned long
+pair_total(const struct pair *p)
+{
+	return p->count[0] + p->count[1] + p->count[2] + p->count[3];
+}
+
+
+static int
+cmp_pair(const void *a, const void *b)
+{
+	const struct pair	*x = a, *y = b;
+
+	if (x->count[TRS80_RANGE_SAME] != y->count[TRS80_RANGE_SAME])
+		return x->count[TRS80_RANGE_SAME] >
+		       y->count[TRS80_RANGE_SAME] ? -1 : 1;
+
+	return x->bin < y->bin ? -1 : x->bin > y->bin;
+}
+
+
+/* Scratch space for one thread pairing up sources. */
+struct pairer {
+	struct match		*m;
+	struct trs80_image	src;
+	struct trs80_image	bin;
+	unsigned int		*hits;		/* Per binary */
+	size_t			*touched;	/* Binaries with hits */
+};
+
+
+static int
+cmp_size(const void *a, const void *b)
+{
+	size_t	x = *(const size_t *)a, y = *(const size_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* Compare s with every binary sharing a fingerprint with it. */
+static int
+pair_source(struct pairer *w, struct input *s)
+{
+	struct match	*m = w->m;
+	size_t		ntouched = 0, i, k, npairs = 0;
+
+	for (i = 0; i < s->nfps; ++i)
+		for (k = find_fp(m, s->fps[i]);
+		     k < m->nindex && m->index[k].fp == s->fps[i]; ++k)
+			if (w->hits[m->index[k].bin]++ == 0)
+				w->touched[ntouched++] = m->index[k].bin;
+
+	if (!ntouched)
+		return 0;
+
+	qsort(w->touched, ntouched, sizeof(*w->touched), cmp_size);
+	i = 0;
+	if (!(s->pairs = calloc(ntouched, sizeof(*s->pairs))))
+		goto fail;
+
+	load_image(s, &w->src);
+	for (i = 0; i < ntouched; ++i) {
+		struct pair	*p = &s->pairs[npairs];
+		struct input	*b = m->binaries[w->touched[i]];
+
+		w->hits[w->touched[i]] = 0;
+
+		memset(p, 0, sizeof(*p));
+		p->bin = w->touched[i];
+		p->keep_ranges = m->verbose;
+		load_image(b, &w->bin);
+		if (trs80_image_compare(&w->src, &w->bin, add_range, p)) {
+			free(p->ranges);
+			goto fail;
+		}
+		if (p->count[TRS80_RANGE_SAME] * 100 <
+		    pair_total(p) * (unsigned long)m->percent) {
+			free(p->ranges);
+			continue;
+		}
+		p->xfer_differs = s->has_xfer && b->has_xfer &&
+				  s->xfer_addr != b->xfer_addr;
+		++npairs;
+	}
+	s->npairs = npairs;
+
+	if (s->npairs)
+		qsort(s->pairs, s->npairs, sizeof(*s->pairs), cmp_pair);
+
+	return 0;
+
+fail:
+	for (; i < ntouched; ++i)
+		w->hits[w->touched[i]] = 0;
+	s->npairs = npairs;
+	s->failed = 1;
+
+	return -1;
+}
+
+
+static void *
+pair_worker(void *arg)
+{
+	struct pairer	*w = arg;
+	struct match	*m = w->m;
+
+	for (;;) {
+		size_t	i;
+
+		lock(m);
+		i = m->next++;
+		unlock(m);
+
+		if (i >= m->nsources)
+			break;
+		pair_source(w, m->sources[i]);
+	}
+
+	return NULL;
+}
+
+
+static struct pairer *
+new_pairer(struct match *m)
+{
+	struct pairer	*w;
+	size_t		n = m->nbinaries ? m->nbinaries : 1;
+
+	if (!(w = malloc(sizeof(*w))))
+		return NULL;
+
+	w->m = m;
+	w->hits = calloc(n, sizeof(*w->hits));
+	w->touched = malloc(n * sizeof(*w->touched));
+	if (!w->hits || !w->touched) {
+		free(w->hits);
+		free(w->touched);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+
+static void
+free_pairer(struct pairer *w)
+{
+	if (w) {
+		free(w->hits);
+		free(w->touched);
+		free(w);
+	}
+}
+
+
+/* Pair up every source, on m->jobs threads.  Returns -1 if out of
+ * memory before any work could start. */
+static int
+pair_all(struct match *m)
+{
+	struct pairer	**w;
+	int		n = 1, i, ret = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_t	*tids;
+
+	n = m->jobs;
+	if (n == 0) {
+		long	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		n = cpus > 0 ? (int)cpus : 1;
+	}
+	if ((size_t)n > m->nsources)
+		n = m->nsources ? (int)m->nsources : 1;
+#endif
+
+	if (!(w = calloc(n, sizeof(*w))))
+		return -1;
+	for (i = 0; i < n; ++i) {
+		if (!(w[i] = new_pairer(m))) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	if (n > 1 && (tids = malloc(n * sizeof(*tids)))) {
+		int	started;
+
+		for (started = 0; started < n; ++started)
+			if (pthread_create(&tids[started], NULL, pair_worker,
+					   w[started]))
+				break;
+		/* The main thread works too if any couldn't start. */
+		if (started < n)
+			pair_worker(w[0]);
+		for (i = 0; i < started; ++i)
+			pthread_join(tids[i], NULL);
+		free(tids);
+		goto out;
+	}
+#endif
+
+	pair_worker(w[0]);
+
+out:
+	for (i = 0; i < n; ++i)
+		free_pairer(w[i]);
+	free(w);
+
+	return ret;
+}
+
+
+/*
+ * Reporting.
+ */
+
+static const char *const Range_Names[] = {
+	"same",
+	"differ",
+	"source only",
+	"binary only"
+};
+
+
+static int
+report(const struct match *m, FILE *fp)
+{
+	size_t	i, j, k;
+	int	ret = 0;
+
+	for (i = 0; i < m->nsources; ++i) {
+		const struct input	*s = m->sources[i];
+
+		if (s->failed) {
+			fprintf(stderr, "%s: Out of memory.\n", s->name);
+			ret = 3;
+		}
+
+		if (!s->npairs && !s->failed)
+			fprintf(fp, "%s: no match\n", s->name);
+
+		for (j = 0; j < s->npairs; ++j) {
+			const struct pair	*p = &s->pairs[j];
+			unsigned long		total = pair_total(p);
+			unsigned long		same;
+
+			same = p->count[TRS80_RANGE_SAME];
+			fprintf(fp, "%s: %s: %lu of %lu bytes the same "
+				"(%lu%%)%s\n", s->name,
+				m->binaries[p->bin]->name, same, total,
+				same * 100 / total,
+				p->xfer_differs ? ", transfer address differs" :
+						  "");
+
+			for (k = 0; k < p->nranges; ++k)
+				fprintf(fp, "\t%04x-%04x  %s\n",
+					p->ranges[k].start,
+					p->ranges[k].start +
+					p->ranges[k].len - 1,
+					Range_Names[p->ranges[k].kind]);
+		}
+	}
+
+	return ret;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+match_main(int argc, char **argv)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct batch_opts	opts;
+	struct match		m;
+	size_t			i;
+	int			opt, ret, r;
+
+	memset(&m, 0, sizeof(m));
+	memset(&opts, 0, sizeof(opts));
+	m.percent = 50;
+	m.jobs = 1;
+
+	while ((opt = getopt(argc, argv, MATCH_OPTIONS)) != -1) {
+		char	*ep;
+		long	v;
+
+		switch (opt) {
+		case 'a':
+			opts.archives = 1;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j':
+			v = strtol(optarg, &ep, 10);
+			if (*ep || ep == optarg || v < 0 || v > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				match_usage(argv[0]);
+			}
+			m.jobs = (int)v;
+			break;
+#endif
+
+		case 'p':
+			v = strtol(optarg, &ep, 10);
+			if (*ep || ep == optarg || v < 0 || v > 100) {
+				fprintf(stderr, "Bad percentage '%s'.\n\n",
+					optarg);
+				match_usage(argv[0]);
+			}
+			m.percent = (int)v;
+			break;
+
+		case 'v':
+			m.verbose = 1;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			match_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc && !opts.archives) {
+		fprintf(stderr, "No input files.\n\n");
+		match_usage(argv[0]);
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&m.lock, NULL);
+#endif
+
+	opts.fn = match_load;
+	opts.arg = &m;
+	opts.jobs = m.jobs;
+	opts.output = BATCH_NONE;
+	opts.errfile = stderr;
+
+	if (optind == argc)
+		ret = batch_run(&opts, stdin_operand, 1);
+	else
+		ret = batch_run(&opts, argv + optind, argc - optind);
+
+	if (ret != 3) {
+		if (build_index(&m) || pair_all(&m)) {
+			fprintf(stderr, "Out of memory.\n");
+			ret = 3;
+		} else if ((r = report(&m, stdout)) > ret) {
+			ret = r;
+		}
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	for (i = 0; i < m.ninputs; ++i)
+		free_input(m.inputs[i]);
+	free(m.inputs);
+	free(m.sources);
+	free(m.binaries);
+	free(m.index);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&m.lock);
+#endif
+
+	return ret;
+}
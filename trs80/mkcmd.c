@@ -0,0 +1,494 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 mkcmd: build CMD files from what cross-assemblers put out.
+ *
+ * Each input is Intel HEX, told by the ':' it starts with, or a flat
+ * binary with the address it loads at.  They are loaded in turn into a
+ * 64K image, later ones over earlier ones as the DOS loader would, and
+ * the image written with trs80_cmd_write(): the fewest load blocks, in
+ * address order, so the same inputs always give the same file.
+ *
+ * Without -b all the inputs make one CMD file, on stdout unless -o
+ * says otherwise, so mkcmd can sit at the end of a pipeline.  With -b
+ * each input, or each member of the archives with -a, makes its own,
+ * on the batch's worker threads, collected into a tar or zip archive.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "batch.h"
+
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	MKCMD_OPTIONS	"abc:l:Nn:o:x:" JOBS_OPTS
+
+#define	NO_ADDR		0x10000
+
+
+struct mkcmd_opts {
+	unsigned int	load;		/* For flat binaries, or NO_ADDR */
+	unsigned int	xfer;		/* Or NO_ADDR */
+	const char	*name;
+	const char	*comment;
+	int		file_names;	/* Name records from the inputs' */
+};
+
+
+static void
+mkcmd_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-N] [-n name] [-c comment] [-l addr] [-x addr] "
+			"[-o out_cmd]\n"
+		"\t\tfile[@addr]...\n"
+		"       %s -b [-aN]" JOBS_USAGE " [-c comment] [-l addr] "
+			"[-x addr] -o out_archive\n"
+		"\t\tfile...\n"
+		"Builds CMD files from Intel HEX files and flat binaries.\n"
+		"Options:\n"
+		"\t-a\tInputs are tar or zip archives (stdin if none)\n"
+		"\t-b\tMake a CMD file of each input, into a tar or zip "
+			"(.zip) archive\n"
+		"\t-c\tAdd a comment record\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tBuild with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-l\tLoad flat binaries without @addr at addr (hex)\n"
+		"\t-N\tAdd a file name record made from the (first) "
+			"input's name\n"
+		"\t-n\tAdd a file name record of name\n"
+		"\t-o\tOutput file, default stdout\n"
+		"\t-x\tTransfer address (hex), default the HEX file's start "
+			"address\n"
+		"\t\tor the first input's load address\n",
+		pgmname, pgmname);
+
+	exit(1);
+}
+
+
+static int
+parse_addr(const char *s, unsigned int *addr)
+{
+	char		*ep;
+	unsigned long	v = strtoul(s, &ep, 16);
+
+	if (*ep || ep == s || v >= TRS80_IMAGE_SIZE)
+		return -1;
+	*addr = (unsigned int)v;
+
+	return 0;
+}
+
+
+/* The name record for an input: its base name's letters and digits,
+ * as trs80 disk names files, up to 8. */
+static void
+file_name(const char *path, char *name)
+{
+	const char	*base = strrchr(path, '/');
+	const char	*dot;
+	int		n = 0;
+
+	base = base ? base + 1 : path;
+	dot = strrchr(base, '.');
+
+	for (; *base && base != dot && n < 8; ++base) {
+		int	ch = (unsigned char)*base;
+
+		if (ch >= 'a' && ch <= 'z')
+			ch -= 'a' - 'A';
+		if ((ch >= 'A' && ch <= 'Z') || (n && ch >= '0' && ch <= '9'))
+			name[n++] = ch;
+	}
+	name[n] = '\0';
+}
+
+
+/*
+ * Load one input over img, a flat binary at addr unless it is Intel
+ * HEX.  *first is set to where it loads if it isn't yet.  Diagnostics
+ * start with what.  Returns an exit status.
+ */
+static int
+load_input(struct trs80_image *img, const unsigned char *data, size_t len,
+	   unsigned int addr, unsigned int *first, const char *what,
+	   FILE *errfile)
+{
+	struct trs80_error	err;
+	char			msg[128];
+	size_t			line, i;
+	int			st;
+
+	if (len > 0 && data[0] == ':') {
+		struct trs80_image	*hex;
+
+		/* A HEX file's own loads give its first address. */
+		if (!(hex = malloc(sizeof(*hex)))) {
+			fprintf(errfile, "Out of memory.\n");
+			return 3;
+		}
+		trs80_image_clear(hex);
+		if ((st = trs80_ihex_load(hex, data, len, &err))) {
+			for (line = 1, i = 0; i < err.offset; ++i)
+				line += data[i] == '\n';
+			trs80_error_message(st, &err, msg, sizeof(msg));
+			fprintf(errfile, "%s%s Line = %zu\n", what, msg, line);
+			free(hex);
+			return 2;
+		}
+		for (i = 0; i < TRS80_IMAGE_SIZE; ++i) {
+			if (!TRS80_IMAGE_LOADED(hex, i))
+				continue;
+			if (*first == NO_ADDR)
+				*first = (unsigned int)i;
+			img->mem[i] = hex->mem[i];
+			img->loaded[i >> 3] |= 1 << (i & 7);
+		}
+		if (hex->has_xfer && !img->has_xfer) {
+			img->has_xfer = 1;
+			img->xfer_addr = hex->xfer_addr;
+		}
+		free(hex);
+
+		return 0;
+	}
+
+	if (addr == NO_ADDR) {
+		fprintf(errfile, "%sNot Intel HEX, and no load address for "
+				 "a flat binary.\n", what);
+		return 1;
+	}
+	if (len > TRS80_IMAGE_SIZE - addr) {
+		fprintf(errfile, "%s%zu bytes at %04X go past 64K.\n", what,
+			len, addr);
+		return 2;
+	}
+	trs80_image_load(img, addr, data, len);
+	if (*first == NO_ADDR)
+		*first = addr;
+
+	return 0;
+}
+
+
+/* Write img as a CMD file to out.  Returns an exit status. */
+static int
+write_cmd(struct trs80_image *img, const struct mkcmd_opts *o,
+	  const char *name, unsigned int first, FILE *out, FILE *errfile)
+{
+	unsigned char	*buf;
+	size_t		len;
+	int		st;
+
+	if (first == NO_ADDR) {
+		fprintf(errfile, "Nothing to load.\n");
+		return 2;
+	}
+	if (o->xfer != NO_ADDR) {
+		img->has_xfer = 1;
+		img->xfer_addr = o->xfer;
+	} else if (!img->has_xfer) {
+		img->has_xfer = 1;
+		img->xfer_addr = first;
+	}
+
+	if (!(buf = malloc(TRS80_CMD_BOUND))) {
+		fprintf(errfile, "Out of memory.\n");
+		return 3;
+	}
+	if ((st = trs80_cmd_write(img, name, o->comment, buf, &len))) {
+		fprintf(errfile, "%s.\n", trs80_strerror(st));
+		free(buf);
+		return 3;
+	}
+	fwrite(buf, 1, len, out);
+	free(buf);
+
+	return 0;
+}
+
+
+/* One input to one CMD file.  Runs on the batch's threads. */
+static int
+mkcmd_job(struct batch_job *job)
+{
+	const struct mkcmd_opts	*o = job->arg;
+	struct trs80_image	*img;
+	unsigned int		first = NO_ADDR;
+	char			name[9];
+	int			ret;
+
+	if (!(img = malloc(sizeof(*img)))) {
+		fprintf(job->err, "Out of memory.\n");
+		return 3;
+	}
+	trs80_image_clear(img);
+
+	file_name(job->name, name);
+	if (!(ret = load_input(img, job->data, job->size, o->load, &first,
+			       "", job->err)))
+		ret = write_cmd(img, o, o->file_names && *name ? name : NULL,
+				first, job->out, job->err);
+	free(img);
+
+	return ret;
+}
+
+
+/* Read all of a file, or stdin for "-", into a new malloc()ed
+ * buffer. */
+static int
+read_input(const char *name, unsigned char **bufp, size_t *lenp)
+{
+	FILE		*fp = stdin;
+	unsigned char	*buf = NULL;
+	size_t		len = 0, cap = 0;
+	int		ret = 0;
+
+	if (strcmp(name, "-") && !(fp = fopen(name, "rb"))) {
+		fprintf(stderr, "Can't open '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		return 2;
+	}
+
+	for (;;) {
+		size_t	n;
+
+		if (len == cap) {
+			unsigned char	*p;
+
+			cap = cap ? cap * 2 : 65536;
+			if (!(p = realloc(buf, cap))) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			buf = p;
+		}
+		if ((n = fread(buf + len, 1, cap - len, fp)) == 0)
+			break;
+		len += n;
+	}
+
+	if (ret == 0 && ferror(fp)) {
+		fprintf(stderr, "Error reading '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		ret = 2;
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+	*bufp = buf;
+	*lenp = len;
+
+	return 0;
+}
+
+
+/* All the operands, each file[@addr], into one CMD file. */
+static int
+mkcmd_one(const struct mkcmd_opts *o, char **operands, int n, FILE *out)
+{
+	struct trs80_image	*img;
+	unsigned int		first = NO_ADDR;
+	char			name[9], path[4096], what[4100];
+	int			i, ret = 0;
+
+	if (!(img = malloc(sizeof(*img)))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 3;
+	}
+	trs80_image_clear(img);
+
+	for (i = 0; i < n && !ret; ++i) {
+		const char	*at = strrchr(operands[i], '@');
+		unsigned int	addr = o->load;
+		unsigned char	*buf;
+		size_t		len;
+
+		snprintf(path, sizeof(path), "%s", operands[i]);
+		if (at && !parse_addr(at + 1, &addr))
+			path[at - operands[i]] = '\0';
+		if (i == 0)
+			file_name(path, name);
+
+		if ((ret = read_input(path, &buf, &len)))
+			break;
+		snprintf(what, sizeof(what), "'%s': ", path);
+		ret = load_input(img, buf, len, addr, &first, what, stderr);
+		free(buf);
+	}
+
+	if (!ret)
+		ret = write_cmd(img, o, o->name ? o->name : o->file_names &&
+				*name ? name : NULL, first, out, stderr);
+	free(img);
+
+	return ret;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+mkcmd_main(int argc, char **argv)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct mkcmd_opts	o;
+	struct batch_opts	opts;
+	const char		*output = NULL;
+	FILE			*outfile = stdout;
+	int			opt, ret, batch = 0;
+
+	memset(&o, 0, sizeof(o));
+	o.load = o.xfer = NO_ADDR;
+	memset(&opts, 0, sizeof(opts));
+	opts.jobs = 1;
+
+	while ((opt = getopt(argc, argv, MKCMD_OPTIONS)) != -1) {
+		switch (opt) {
+		case 'a':
+			opts.archives = 1;
+			break;
+
+		case 'b':
+			batch = 1;
+			break;
+
+		case 'c':
+			o.comment = optarg;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			char	*ep;
+			long	jobs = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || jobs < 0 || jobs > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				mkcmd_usage(argv[0]);
+			}
+			opts.jobs = (int)jobs;
+			break;
+		}
+#endif
+
+		case 'l':
+		case 'x':
+			if (parse_addr(optarg,
+				       opt == 'l' ? &o.load : &o.xfer)) {
+				fprintf(stderr, "Bad address '%s'.\n\n",
+					optarg);
+				mkcmd_usage(argv[0]);
+			}
+			break;
+
+		case 'N':
+			o.file_names = 1;
+			break;
+
+		case 'n':
+			o.name = optarg;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			mkcmd_usage(argv[0]);
+		}
+	}
+
+	if ((o.name && strlen(o.name) > 255) ||
+	    (o.comment && strlen(o.comment) > 255)) {
+		fprintf(stderr, "Names and comments are up to 255 "
+				"characters.\n\n");
+		mkcmd_usage(argv[0]);
+	}
+	if (batch) {
+		if (o.name) {
+			fprintf(stderr, "-n doesn't go with -b; -N names each "
+					"file after its input.\n\n");
+			mkcmd_usage(argv[0]);
+		}
+		if (!output) {
+			fprintf(stderr, "-b needs an output archive.\n\n");
+			mkcmd_usage(argv[0]);
+		}
+		if (optind == argc && !opts.archives) {
+			fprintf(stderr, "No input files.\n\n");
+			mkcmd_usage(argv[0]);
+		}
+	} else {
+		if (opts.archives) {
+			fprintf(stderr, "-a goes with -b.\n\n");
+			mkcmd_usage(argv[0]);
+		}
+		if (optind == argc) {
+			fprintf(stderr, "No input files.\n\n");
+			mkcmd_usage(argv[0]);
+		}
+	}
+
+	if (output && !(outfile = fopen(output, "wb"))) {
+		fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+			output, strerror(errno), errno);
+		return 1;
+	}
+
+	if (!batch)
+		ret = mkcmd_one(&o, argv + optind, argc - optind, outfile);
+	else {
+		opts.fn = mkcmd_job;
+		opts.arg = &o;
+		opts.outfile = outfile;
+		opts.errfile = stderr;
+		opts.suffix = ".CMD";
+		opts.output = batch_output_for(output);
+
+		if (optind == argc)
+			ret = batch_run(&opts, stdin_operand, 1);
+		else
+			ret = batch_run(&opts, argv + optind, argc - optind);
+	}
+
+	if (fflush(outfile) == EOF || ferror(outfile) ||
+	    (outfile != stdout && fclose(outfile) == EOF)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+	/* A file that failed leaves nothing behind. */
+	if (output && !batch && ret)
+		unlink(output);
+
+	return ret;
+}
@@ -0,0 +1,723 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 overlap: where CMD files' loads overlap, and which can be in
+ * memory together.
+ *
+ * Every input is read once, through the batch machinery, and reduced
+ * to the address ranges its load blocks cover, merged and in order.
+ * All of the ranges go into one interval tree: sorted by start, with
+ * each node of the implicit balanced tree over the array holding the
+ * furthest end below it, so a query skips any subtree ending before
+ * the range asked about.  Finding every pairwise overlap is then a
+ * query per range, and asking what can load alongside a driver costs
+ * a query per range of the driver, however many files there are.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "batch.h"
+
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	OVERLAP_OPTIONS	"ac:ir:v" JOBS_OPTS
+
+#define	MAX_SET		64		/* Files in one coexistence query */
+
+
+/* Addresses start to end, inclusive. */
+struct span {
+	unsigned int	start;
+	unsigned int	end;
+	unsigned int	file;		/* Index into the sorted inputs */
+};
+
+struct input {
+	char		*name;
+	struct span	*spans;		/* Merged, in address order */
+	size_t		nspans;
+	size_t		cap;
+};
+
+struct overlap {
+	unsigned int	lo;		/* -r window */
+	unsigned int	hi;
+
+	struct input	**inputs;	/* By name once loaded */
+	size_t		ninputs;
+	size_t		inputcap;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	lock;
+#endif
+
+	/* The interval tree. */
+	struct span	*tree;
+	unsigned int	*maxend;	/* Furthest end in each subtree */
+	size_t		ntree;
+};
+
+/* What queries found: overlaps with a file, by file then address. */
+struct hits {
+	struct span	*v;		/* file is the other file */
+	size_t		n;
+	size_t		cap;
+	int		failed;
+};
+
+
+static void
+overlap_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-aiv]" JOBS_USAGE " [-c file]... [-r lo-hi] "
+			"file...\n"
+		"Reports where CMD files' loads overlap.\n"
+		"Options:\n"
+		"\t-a\tInputs are tar or zip archives (stdin if none)\n"
+		"\t-c\tList the files that can load alongside file (repeat "
+			"for a set)\n"
+		"\t-i\tRead sets of files to ask about, a line each, from "
+			"stdin\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tRun with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-r\tOnly consider addresses lo to hi (hex)\n"
+		"\t-v\tWith -c or -i, also list the files that can't and "
+			"where\n",
+		pgmname);
+
+	exit(1);
+}
+
+
+static void
+free_input(struct input *in)
+{
+	if (in) {
+		free(in->spans);
+		free(in->name);
+		free(in);
+	}
+}
+
+
+/*
+ * Loading.
+ */
+
+/* Add start-end to in's spans, clipped to the -r window. */
+static int
+add_span(const struct overlap *o, struct input *in, unsigned int start,
+	 unsigned int end)
+{
+	if (start < o->lo)
+		start = o->lo;
+	if (end > o->hi)
+		end = o->hi;
+	if (start > end)
+		return 0;
+
+	if (in->nspans == in->cap) {
+		size_t		cap = in->cap ? in->cap * 2 : 16;
+		struct span	*p;
+
+		if (!(p = realloc(in->spans, cap * sizeof(*p))))
+			return -1;
+		in->spans = p;
+		in->cap = cap;
+	}
+	in->spans[in->nspans].start = start;
+	in->spans[in->nspans++].end = end;
+
+	return 0;
+}
+
+
+struct loader {
+	const struct overlap	*o;
+	struct input		*in;
+};
+
+static int
+load_block(void *arg, const struct trs80_cmd_record *rec)
+{
+	struct loader	*l = arg;
+	unsigned int	end;
+
+	if (rec->type != TRS80_CMD_LOADBLK || rec->avail == 0)
+		return 0;
+
+	/* Loads wrap at 64K, as on the machine. */
+	end = rec->addr + rec->avail - 1;
+	if (end >= TRS80_IMAGE_SIZE)
+		return add_span(l->o, l->in, rec->addr, TRS80_IMAGE_SIZE - 1) ||
+		       add_span(l->o, l->in, 0, end - TRS80_IMAGE_SIZE) ?
+			TRS80_E_NOMEM : 0;
+
+	return add_span(l->o, l->in, rec->addr, end) ? TRS80_E_NOMEM : 0;
+}
+
+
+static int
+cmp_span(const void *a, const void *b)
+{
+	const struct span	*x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+
+	return x->end < y->end ? -1 : x->end > y->end;
+}
+
+
+/* Sort and merge in's spans. */
+static void
+merge_spans(struct input *in)
+{
+	size_t	i, n = 0;
+
+	if (in->nspans)
+		qsort(in->spans, in->nspans, sizeof(*in->spans), cmp_span);
+	for (i = 0; i < in->nspans; ++i) {
+		if (n > 0 && in->spans[i].start <= in->spans[n - 1].end + 1) {
+			if (in->spans[i].end > in->spans[n - 1].end)
+				in->spans[n - 1].end = in->spans[i].end;
+		} else
+			in->spans[n++] = in->spans[i];
+	}
+	in->nspans = n;
+}
+
+
+/* Runs on the batch's worker threads. */
+static int
+overlap_load(struct batch_job *job)
+{
+	struct overlap		*o = job->arg;
+	struct trs80_cmd_info	info;
+	struct trs80_error	err;
+	struct loader		l;
+	struct input		*in;
+	char			msg[128];
+	int			st, ret = 0;
+
+	if (trs80_identify(job->data, job->size) != TRS80_TYPE_CMD) {
+		fprintf(job->err, "Not a CMD file.\n");
+		return 2;
+	}
+
+	if (!(in = calloc(1, sizeof(*in))) || !(in->name = strdup(job->name))) {
+		free(in);
+		fprintf(job->err, "Out of memory.\n");
+		return 3;
+	}
+
+	l.o = o;
+	l.in = in;
+	st = trs80_cmd_parse(job->data, job->size, load_block, &l, &info,
+			     &err);
+	if (st == TRS80_E_NOMEM) {
+		fprintf(job->err, "Out of memory.\n");
+		free_input(in);
+		return 3;
+	} else if (st != TRS80_OK) {
+		trs80_error_message(st, &err, msg, sizeof(msg));
+		fprintf(job->err, "%s\n", msg);
+		free_input(in);
+		return 2;
+	}
+	merge_spans(in);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&o->lock);
+#endif
+	if (o->ninputs == o->inputcap) {
+		size_t		cap = o->inputcap ? o->inputcap * 2 : 64;
+		struct input	**p;
+
+		if ((p = realloc(o->inputs, cap * sizeof(*p)))) {
+			o->inputs = p;
+			o->inputcap = cap;
+		}
+	}
+	if (o->ninputs < o->inputcap)
+		o->inputs[o->ninputs++] = in;
+	else
+		ret = 3;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&o->lock);
+#endif
+
+	if (ret) {
+		fprintf(job->err, "Out of memory.\n");
+		free_input(in);
+	}
+
+	return ret;
+}
+
+
+/*
+ * The interval tree.
+ */
+
+static int
+cmp_name(const void *a, const void *b)
+{
+	const struct input	*x = *(struct input *const *)a;
+	const struct input	*y = *(struct input *const *)b;
+
+	return strcmp(x->name, y->name);
+}
+
+
+static unsigned int
+build_node(struct overlap *o, size_t lo, size_t hi)
+{
+	size_t		mid = lo + (hi - lo) / 2;
+	unsigned int	end, e;
+
+	if (lo >= hi)
+		return 0;
+
+	end = o->tree[mid].end;
+	if ((e = build_node(o, lo, mid)) > end)
+		end = e;
+	if ((e = build_node(o, mid + 1, hi)) > end)
+		end = e;
+
+	return o->maxend[mid] = end;
+}
+
+
+/* Put the inputs in name order and every span in the tree. */
+static int
+build_tree(struct overlap *o)
+{
+	size_t	i, j, n = 0;
+
+	if (o->ninputs)
+		qsort(o->inputs, o->ninputs, sizeof(*o->inputs), cmp_name);
+	for (i = 0; i < o->ninputs; ++i)
+		n += o->inputs[i]->nspans;
+
+	o->tree = malloc((n + 1) * sizeof(*o->tree));
+	o->maxend = malloc((n + 1) * sizeof(*o->maxend));
+	if (!o->tree || !o->maxend)
+		return -1;
+
+	for (i = 0; i < o->ninputs; ++i) {
+		for (j = 0; j < o->inputs[i]->nspans; ++j) {
+			o->inputs[i]->spans[j].file = i;
+			o->tree[o->ntree++] = o->inputs[i]->spans[j];
+		}
+	}
+	if (o->ntree)
+		qsort(o->tree, o->ntree, sizeof(*o->tree), cmp_span);
+	build_node(o, 0, o->ntree);
+
+	return 0;
+}
+
+
+static void
+add_hit(struct hits *h, unsigned int file, unsigned int start,
+	unsigned int end)
+{
+	if (h->n == h->cap) {
+		size_t		cap = h->cap ? h->cap * 2 : 256;
+		struct span	*p;
+
+		if (!(p = realloc(h->v, cap * sizeof(*p)))) {
+			h->failed = 1;
+			return;
+		}
+		h->v = p;
+		h->cap = cap;
+	}
+	h->v[h->n].file = file;
+	h->v[h->n].start = start;
+	h->v[h->n++].end = end;
+}
+
+
+/*
+ * Add to h every span in [lo, hi) of the tree overlapping q, other
+ * than those of files skip says to leave out, as the addresses they
+ * share.
+ */
+static void
+query(const struct overlap *o, size_t lo, size_t hi, const struct span *q,
+      const unsigned char *skip, struct hits *h)
+{
+	while (lo < hi) {
+		size_t			mid = lo + (hi - lo) / 2;
+		const struct span	*s = &o->tree[mid];
+
+		if (o->maxend[mid] < q->start)
+			return;
+		query(o, lo, mid, q, skip, h);
+		if (s->start > q->end)
+			return;
+		if (s->end >= q->start && !skip[s->file])
+			add_hit(h, s->file, s->start > q->start ? s->start :
+					    q->start,
+				s->end < q->end ? s->end : q->end);
+		lo = mid + 1;
+	}
+}
+
+
+static int
+cmp_hit(const void *a, const void *b)
+{
+	const struct span	*x = a, *y = b;
+
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+
+	return cmp_span(a, b);
+}
+
+
+/* Sort h by file and address and merge what touches. */
+static void
+merge_hits(struct hits *h)
+{
+	size_t	i, n = 0;
+
+	if (h->n)
+		qsort(h->v, h->n, sizeof(*h->v), cmp_hit);
+	for (i = 0; i < h->n; ++i) {
+		struct span	*p = n ? &h->v[n - 1] : NULL;
+
+		if (p && p->file == h->v[i].file &&
+		    h->v[i].start <= p->end + 1) {
+			if (h->v[i].end > p->end)
+				p->end = h->v[i].end;
+		} else
+			h->v[n++] = h->v[i];
+	}
+	h->n = n;
+}
+
+
+/* Print the ranges of h's hits from *ip on that are with one file. */
+static void
+print_ranges(const struct hits *h, size_t *ip, FILE *fp)
+{
+	unsigned long	bytes = 0;
+	size_t		i = *ip;
+	unsigned int	file = h->v[i].file;
+
+	for (; i < h->n && h->v[i].file == file; ++i) {
+		fprintf(fp, " %04x-%04x", h->v[i].start, h->v[i].end);
+		bytes += h->v[i].end - h->v[i].start + 1;
+	}
+	fprintf(fp, " (%lu byte%s)\n", bytes, bytes == 1 ? "" : "s");
+	*ip = i;
+}
+
+
+/*
+ * Reporting.
+ */
+
+/* Every pair of files whose loads overlap, and where. */
+static int
+report_all(const struct overlap *o, FILE *fp)
+{
+	unsigned char	*skip;
+	struct hits	h;
+	size_t		f, i, k;
+
+	if (!(skip = calloc(o->ninputs + 1, 1)))
+		return 3;
+	memset(&h, 0, sizeof(h));
+
+	for (f = 0; f < o->ninputs && !h.failed; ++f) {
+		const struct input	*in = o->inputs[f];
+
+		/* Each pair is reported once, from its first file. */
+		skip[f] = 1;
+		h.n = 0;
+		for (i = 0; i < in->nspans; ++i)
+			query(o, 0, o->ntree, &in->spans[i], skip, &h);
+		merge_hits(&h);
+
+		for (k = 0; k < h.n; ) {
+			fprintf(fp, "%s: %s:", in->name,
+				o->inputs[h.v[k].file]->name);
+			print_ranges(&h, &k, fp);
+		}
+	}
+
+	free(h.v);
+	free(skip);
+
+	return h.failed ? 3 : 0;
+}
+
+
+/* The input named name, or a path ending in "/name". */
+static int
+find_input(const struct overlap *o, const char *name)
+{
+	size_t	i, n = strlen(name);
+
+	for (i = 0; i < o->ninputs; ++i) {
+		const char	*s = o->inputs[i]->name;
+		size_t		len = strlen(s);
+
+		if (!strcmp(s, name) ||
+		    (len > n && s[len - n - 1] == '/' &&
+		     !strcmp(s + len - n, name)))
+			return (int)i;
+	}
+
+	return -1;
+}
+
+
+/* The files that can load alongside all of names, and with -v those
+ * that can't. */
+static int
+report_set(const struct overlap *o, char **names, int nnames, int verbose,
+	   FILE *fp)
+{
+	unsigned char	*skip;
+	struct hits	h;
+	size_t		f, i, k;
+	int		n, ret = 0;
+
+	if (!(skip = calloc(o->ninputs + 1, 1)))
+		return 3;
+	memset(&h, 0, sizeof(h));
+
+	for (n = 0; n < nnames; ++n) {
+		int	x = find_input(o, names[n]);
+
+		if (x < 0) {
+			fprintf(stderr, "%s: Not among the inputs.\n",
+				names[n]);
+			ret = 1;
+		} else
+			skip[x] = 1;
+	}
+
+	for (n = 0; n < nnames && ret == 0; ++n) {
+		const struct input	*in = o->inputs[find_input(o, names[n])];
+
+		for (i = 0; i < in->nspans; ++i)
+			query(o, 0, o->ntree, &in->spans[i], skip, &h);
+	}
+	if (ret || h.failed) {
+		free(h.v);
+		free(skip);
+		return ret ? ret : 3;
+	}
+	merge_hits(&h);
+
+	/* The files with hits are the ones that can't. */
+	for (k = 0; k < h.n; ++k)
+		skip[h.v[k].file] = 2;
+	for (f = 0; f < o->ninputs; ++f)
+		if (!skip[f])
+			fprintf(fp, "%s\n", o->inputs[f]->name);
+
+	for (k = 0; verbose && k < h.n; ) {
+		fprintf(fp, "%s: overlaps", o->inputs[h.v[k].file]->name);
+		print_ranges(&h, &k, fp);
+	}
+
+	free(h.v);
+	free(skip);
+
+	return 0;
+}
+
+
+/* Answer a set of names a line from stdin, until end of file. */
+static int
+interactive(const struct overlap *o, int verbose)
+{
+	char	line[4096];
+	int	ret = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		char	*names[MAX_SET], *save, *tok;
+		int	n = 0, r;
+
+		for (tok = strtok_r(line, " \t\r\n", &save); tok && n < MAX_SET;
+		     tok = strtok_r(NULL, " \t\r\n", &save))
+			names[n++] = tok;
+		if (n == 0)
+			continue;
+
+		if ((r = report_set(o, names, n, verbose, stdout)) == 3)
+			return 3;
+		if (r > ret)
+			ret = r;
+		printf("\n");
+		fflush(stdout);
+	}
+
+	return ret;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+overlap_main(int argc, char **argv)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct batch_opts	opts;
+	struct overlap		o;
+	char			*set[MAX_SET];
+	size_t			i;
+	int			opt, ret, r, nset = 0, inter = 0, verbose = 0;
+	int			jobs = 1;
+
+	memset(&o, 0, sizeof(o));
+	memset(&opts, 0, sizeof(opts));
+	o.hi = TRS80_IMAGE_SIZE - 1;
+
+	while ((opt = getopt(argc, argv, OVERLAP_OPTIONS)) != -1) {
+		char	*ep;
+		long	v;
+
+		switch (opt) {
+		case 'a':
+			opts.archives = 1;
+			break;
+
+		case 'c':
+			if (nset == MAX_SET) {
+				fprintf(stderr, "Too many -c files.\n\n");
+				overlap_usage(argv[0]);
+			}
+			set[nset++] = optarg;
+			break;
+
+		case 'i':
+			inter = 1;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j':
+			v = strtol(optarg, &ep, 10);
+			if (*ep || ep == optarg || v < 0 || v > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				overlap_usage(argv[0]);
+			}
+			jobs = (int)v;
+			break;
+#endif
+
+		case 'r': {
+			unsigned long	lo, hi;
+
+			lo = strtoul(optarg, &ep, 16);
+			if (ep == optarg || *ep != '-' ||
+			    (hi = strtoul(ep + 1, &ep, 16), *ep) ||
+			    lo > hi || hi >= TRS80_IMAGE_SIZE) {
+				fprintf(stderr, "Bad address range '%s'.\n\n",
+					optarg);
+				overlap_usage(argv[0]);
+			}
+			o.lo = lo;
+			o.hi = hi;
+			break;
+		}
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			overlap_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc && !opts.archives) {
+		fprintf(stderr, "No input files.\n\n");
+		overlap_usage(argv[0]);
+	}
+	if (inter && optind == argc) {
+		fprintf(stderr, "With -i the archives must be named.\n\n");
+		overlap_usage(argv[0]);
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&o.lock, NULL);
+#endif
+
+	opts.fn = overlap_load;
+	opts.arg = &o;
+	opts.jobs = jobs;
+	opts.output = BATCH_NONE;
+	opts.errfile = stderr;
+
+	if (optind == argc)
+		ret = batch_run(&opts, stdin_operand, 1);
+	else
+		ret = batch_run(&opts, argv + optind, argc - optind);
+
+	if (ret != 3) {
+		if (build_tree(&o))
+			r = 3;
+		else if (nset)
+			r = report_set(&o, set, nset, verbose, stdout);
+		else if (inter)
+			r = interactive(&o, verbose);
+		else
+			r = report_all(&o, stdout);
+		if (r == 3)
+			fprintf(stderr, "Out of memory.\n");
+		if (r > ret)
+			ret = r;
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	for (i = 0; i < o.ninputs; ++i)
+		free_input(o.inputs[i]);
+	free(o.inputs);
+	free(o.tree);
+	free(o.maxend);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&o.lock);
+#endif
+
+	return ret;
+}
@@ -0,0 +1,363 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 pack: compress CMD files into self-extracting ones.
+ *
+ * Each file is loaded into a 64K image and written again with
+ * trs80_image_pack() as its loaded bytes compressed behind a depacker.
+ * Nothing is kept unless it is proven to come back the same twice
+ * over: unpacked on the host with trs80_image_unpack(), and by running
+ * the depacker itself on the Z80 interpreter until it jumps to the
+ * program, both of which must leave the original image.  A file that
+ * doesn't get smaller is kept as it was.
+ *
+ * In batch mode the files go through the batch machinery, packed on
+ * worker threads and collected in input order into a tar or zip
+ * archive, or only reported on.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "batch.h"
+
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	PACK_OPTIONS	"abo:qs:" JOBS_OPTS
+
+#define	RUN_LIMIT	1000000000ULL	/* T-states the depacker may take */
+#define	CLOCK_HZ	1774000.0	/* A Model I's */
+
+
+struct pack_opts {
+	unsigned int	addr;		/* Of the depacker, or TRS80_PACK_ANY */
+	int		quiet;
+};
+
+
+static void
+pack_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-q] [-s addr] in_cmd out_cmd\n"
+		"       %s -b [-aq]" JOBS_USAGE " [-s addr] [-o out_archive] "
+			"file...\n"
+		"Compresses CMD files into self-extracting ones.\n"
+		"Options:\n"
+		"\t-a\tInputs are tar or zip archives (stdin if none)\n"
+		"\t-b\tPack many files into a tar or zip (.zip) archive, "
+			"or with\n"
+		"\t\tno -o only report how well they pack\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tPack with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-q\tDon't report on each file\n"
+		"\t-s\tPut the depacker at addr (hex), default the first "
+			"room from 5200\n",
+		pgmname, pgmname);
+
+	exit(1);
+}
+
+
+/* Stop where the depacker jumps to the program. */
+static int
+arrived(void *arg, struct trs80_z80_regs *regs, unsigned char *mem,
+	unsigned long *tstates)
+{
+	(void)arg;
+	(void)regs;
+	(void)mem;
+	(void)tstates;
+
+	return TRS80_Z80_STOP;
+}
+
+
+static int
+differs(void *arg, const struct trs80_range *r)
+{
+	(void)arg;
+
+	return r->kind != TRS80_RANGE_SAME;
+}
+
+
+/*
+ * Run the depacker in packed, which img must have been loaded from,
+ * and check that it leaves orig's bytes in place and goes to orig's
+ * transfer address as DOS would have.  *t is set to how long it took.
+ */
+static int
+run_check(struct trs80_image *img, const struct trs80_image *orig,
+	  unsigned long long *t)
+{
+	struct trs80_z80_env	*env;
+	struct trs80_z80_regs	regs, start;
+	unsigned int		addr;
+	int			end, ok;
+
+	if (!(env = calloc(1, sizeof(*env))))
+		return -1;
+	env->mem = img->mem;
+	env->trap_fn = arrived;
+	TRS80_Z80_TRAP(env, orig->xfer_addr);
+
+	trs80_image_start(img, &regs);
+	start = regs;
+	end = trs80_z80_run(&regs, env, RUN_LIMIT, t);
+	free(env);
+
+	ok = end == TRS80_Z80_STOPPED && regs.pc == orig->xfer_addr &&
+	     regs.sp == start.sp && regs.af == start.af &&
+	     regs.bc == start.bc && regs.de == start.de &&
+	     regs.hl == start.hl;
+
+	for (addr = 0; ok && addr < TRS80_IMAGE_SIZE; ++addr)
+		if (TRS80_IMAGE_LOADED(orig, addr) &&
+		    img->mem[addr] != orig->mem[addr])
+			ok = 0;
+
+	return ok ? 0 : 1;
+}
+
+
+/* Runs on the batch's threads. */
+static int
+pack_job(struct batch_job *job)
+{
+	const struct pack_opts	*o = job->arg;
+	struct trs80_image	*orig, *img;
+	struct trs80_error	err;
+	unsigned char		*out = NULL;
+	unsigned long long	t = 0;
+	char			msg[128];
+	size_t			n;
+	int			st, ret = 0;
+
+	orig = malloc(sizeof(*orig));
+	img = malloc(sizeof(*img));
+	if (!orig || !img || !(out = malloc(TRS80_PACK_BOUND))) {
+		fprintf(job->err, "Out of memory.\n");
+		ret = 3;
+		goto out;
+	}
+
+	if (trs80_identify(job->data, job->size) != TRS80_TYPE_CMD) {
+		fprintf(job->err, "Not a CMD file.\n");
+		ret = 2;
+		goto out;
+	}
+	trs80_image_clear(orig);
+	if ((st = trs80_image_cmd(orig, job->data, job->size, &err))) {
+		trs80_error_message(st, &err, msg, sizeof(msg));
+		fprintf(job->err, "%s\n", msg);
+		ret = 2;
+		goto out;
+	}
+	if (!orig->has_xfer) {
+		fprintf(job->err, "No transfer address to run the program "
+				  "at.\n");
+		ret = 2;
+		goto out;
+	}
+
+	if ((st = trs80_image_pack(orig, o->addr, out, &n))) {
+		if (st == TRS80_E_RANGE) {
+			fprintf(job->err, "No room for the depacker%s or "
+				"its stack.\n",
+				o->addr == TRS80_PACK_ANY ? "" : " there");
+			ret = 2;
+		} else {
+			fprintf(job->err, "%s.\n", trs80_strerror(st));
+			ret = 3;
+		}
+		goto out;
+	}
+
+	/* Both ways back must give the original. */
+	trs80_image_clear(img);
+	if (trs80_image_unpack(img, out, n, NULL) ||
+	    img->xfer_addr != orig->xfer_addr ||
+	    trs80_image_compare(orig, img, differs, NULL)) {
+		fprintf(job->err, "Unpacking on the host doesn't give the "
+				  "original back.\n");
+		ret = 3;
+		goto out;
+	}
+	trs80_image_clear(img);
+	trs80_image_cmd(img, out, n, NULL);
+	if ((st = run_check(img, orig, &t))) {
+		fprintf(job->err, st < 0 ? "Out of memory.\n" :
+			"The depacker doesn't give the original back.\n");
+		ret = 3;
+		goto out;
+	}
+
+	if (n >= job->size) {
+		if (!o->quiet)
+			fprintf(job->rpt, "%s: %zu bytes, no smaller packed, "
+				"kept as it was\n", job->name, job->size);
+		if (job->out)
+			fwrite(job->data, 1, job->size, job->out);
+	} else {
+		if (!o->quiet)
+			fprintf(job->rpt, "%s: %zu -> %zu bytes (%d%%), "
+				"unpacks in %llu T-states (%.2f s)\n",
+				job->name, job->size, n,
+				(int)(n * 100 / job->size), t, t / CLOCK_HZ);
+		if (job->out)
+			fwrite(out, 1, n, job->out);
+	}
+
+out:
+	free(orig);
+	free(img);
+	free(out);
+
+	return ret;
+}
+
+
+int
+pack_main(int argc, char **argv)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct pack_opts	po;
+	struct batch_opts	opts;
+	const char		*output = NULL;
+	FILE			*outfile = NULL;
+	int			opt, ret, batch = 0;
+
+	memset(&po, 0, sizeof(po));
+	po.addr = TRS80_PACK_ANY;
+	memset(&opts, 0, sizeof(opts));
+	opts.jobs = 1;
+
+	while ((opt = getopt(argc, argv, PACK_OPTIONS)) != -1) {
+		char		*ep;
+		unsigned long	v;
+
+		switch (opt) {
+		case 'a':
+			opts.archives = 1;
+			break;
+
+		case 'b':
+			batch = 1;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			long	jobs = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || jobs < 0 || jobs > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				pack_usage(argv[0]);
+			}
+			opts.jobs = (int)jobs;
+			break;
+		}
+#endif
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			po.quiet = 1;
+			break;
+
+		case 's':
+			v = strtoul(optarg, &ep, 16);
+			if (*ep || ep == optarg || v >= TRS80_IMAGE_SIZE) {
+				fprintf(stderr, "Bad address '%s'.\n\n",
+					optarg);
+				pack_usage(argv[0]);
+			}
+			po.addr = (unsigned int)v;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			pack_usage(argv[0]);
+		}
+	}
+
+	if (batch) {
+		if (optind == argc && !opts.archives) {
+			fprintf(stderr, "No input files.\n\n");
+			pack_usage(argv[0]);
+		}
+	} else {
+		if (opts.archives || output) {
+			fprintf(stderr, "-a and -o go with -b.\n\n");
+			pack_usage(argv[0]);
+		}
+		if (argc - optind != 2) {
+			fprintf(stderr, "Need an input and an output file."
+				"\n\n");
+			pack_usage(argv[0]);
+		}
+		output = argv[optind + 1];
+	}
+
+	if (output && !(outfile = fopen(output, "wb"))) {
+		fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+			output, strerror(errno), errno);
+		return 1;
+	}
+
+	opts.fn = pack_job;
+	opts.arg = &po;
+	opts.outfile = outfile;
+	opts.rptfile = stdout;
+	opts.errfile = stderr;
+	opts.suffix = batch ? ".CMD" : NULL;
+	if (!output)
+		opts.output = BATCH_NONE;
+	else if (batch)
+		opts.output = batch_output_for(output);
+	else
+		opts.output = BATCH_CONCAT;
+
+	if (!batch)
+		ret = batch_run(&opts, argv + optind, 1);
+	else if (optind == argc)
+		ret = batch_run(&opts, stdin_operand, 1);
+	else
+		ret = batch_run(&opts, argv + optind, argc - optind);
+
+	if (outfile) {
+		if (ferror(outfile) || fclose(outfile) == EOF) {
+			fprintf(stderr, "Error writing output file, %s (%d)\n",
+				strerror(errno), errno);
+			if (ret == 0)
+				ret = 3;
+		}
+		/* A single file that failed leaves nothing behind. */
+		if (!batch && ret)
+			unlink(output);
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	return ret;
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 patch: apply an LS-DOS style patch file to CMD files.
+ *
+ * The patch file is read once with trs80_patch_read() and applied to
+ * each CMD file in place with trs80_patch_apply(), so a patched file
+ * is the same size as the original with only load block bytes
+ * changed.  A file whose find bytes don't match, or that a patch
+ * doesn't fit, is left out; it is most likely another version of the
+ * program.
+ *
+ * In batch mode the files go through the batch machinery, patched on
+ * worker threads sharing the one patch file and collected in input
+ * order into a tar or zip archive, or only checked.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "batch.h"
+
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	PATCH_OPTIONS	"abo:q" JOBS_OPTS
+
+
+struct patch_opts {
+	const struct trs80_patch	*patch;
+	int				quiet;
+};
+
+
+static void
+patch_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-q] fix_file in_cmd [out_cmd]\n"
+		"       %s -b [-aq]" JOBS_USAGE " [-o out_archive] fix_file "
+			"file...\n"
+		"Applies an LS-DOS patch file (D, F and X'...' lines) to CMD "
+			"files.\n"
+		"Options:\n"
+		"\t-a\tInputs are tar or zip archives (stdin if none)\n"
+		"\t-b\tPatch many files into a tar or zip (.zip) archive, "
+			"or with\n"
+		"\t\tno -o only check that the patches fit\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tPatch with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-q\tDon't report on each file\n",
+		pgmname, pgmname);
+
+	exit(1);
+}
+
+
+/* Read all of a file into a new malloc()ed buffer. */
+static int
+read_input(const char *name, unsigned char **bufp, size_t *lenp)
+{
+	FILE		*fp;
+	unsigned char	*buf = NULL;
+	size_t		len = 0, cap = 0;
+	int		ret = 0;
+
+	if (!(fp = fopen(name, "rb"))) {
+		fprintf(stderr, "Can't open '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		return 2;
+	}
+
+	for (;;) {
+		size_t	n;
+
+		if (len == cap) {
+			unsigned char	*p;
+
+			cap = cap ? cap * 2 : 65536;
+			if (!(p = realloc(buf, cap))) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			buf = p;
+		}
+		if ((n = fread(buf + len, 1, cap - len, fp)) == 0)
+			break;
+		len += n;
+	}
+
+	if (ret == 0 && ferror(fp)) {
+		fprintf(stderr, "Error reading '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		ret = 2;
+	}
+	fclose(fp);
+
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+	*bufp = buf;
+	*lenp = len;
+
+	return 0;
+}
+
+
+/* Runs on the batch's threads. */
+static int
+patch_job(struct batch_job *job)
+{
+	const struct patch_opts	*o = job->arg;
+	struct trs80_patch_diag	diag;
+	unsigned char		*buf;
+	size_t			n;
+	int			st;
+
+	if (!(buf = malloc(job->size ? job->size : 1))) {
+		fprintf(job->err, "Out of memory.\n");
+		return 3;
+	}
+	memcpy(buf, job->data, job->size);
+
+	if ((st = trs80_patch_apply(o->patch, buf, job->size, &n, &diag))) {
+		if (st == TRS80_E_NOMEM)
+			fprintf(job->err, "Out of memory.\n");
+		else if (diag.linenum == 0)
+			fprintf(job->err, "%s.\n", trs80_strerror(st));
+		else if (st == TRS80_E_RANGE)
+			fprintf(job->err, "Line %lu: 0x%04zx isn't in any load "
+				"block.\n", diag.linenum, diag.offset);
+		else
+			fprintf(job->err, "Line %lu: %s at offset 0x%04zx.\n",
+				diag.linenum, trs80_strerror(st), diag.offset);
+		free(buf);
+		return st == TRS80_E_NOMEM ? 3 : 2;
+	}
+
+	if (!o->quiet)
+		fprintf(job->rpt, "%s: %zu byte%s changed\n", job->name, n,
+			n == 1 ? "" : "s");
+	if (job->out)
+		fwrite(buf, 1, job->size, job->out);
+	free(buf);
+
+	return 0;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error (bad patch file, or patches that don't fit)
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+patch_main(int argc, char **argv)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct patch_opts	po;
+	struct batch_opts	opts;
+	struct trs80_patch	*patch;
+	struct trs80_patch_diag	diag;
+	const char		*output = NULL;
+	FILE			*outfile = NULL;
+	unsigned char		*text;
+	size_t			len;
+	int			opt, ret, st, batch = 0;
+
+	memset(&po, 0, sizeof(po));
+	memset(&opts, 0, sizeof(opts));
+	opts.jobs = 1;
+
+	while ((opt = getopt(argc, argv, PATCH_OPTIONS)) != -1) {
+		switch (opt) {
+		case 'a':
+			opts.archives = 1;
+			break;
+
+		case 'b':
+			batch = 1;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			char	*ep;
+			long	jobs = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || jobs < 0 || jobs > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				patch_usage(argv[0]);
+			}
+			opts.jobs = (int)jobs;
+			break;
+		}
+#endif
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			po.quiet = 1;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			patch_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "No patch file.\n\n");
+		patch_usage(argv[0]);
+	}
+	if (batch) {
+		if (optind + 1 == argc && !opts.archives) {
+			fprintf(stderr, "No input files.\n\n");
+			patch_usage(argv[0]);
+		}
+	} else {
+		if (opts.archives || output) {
+			fprintf(stderr, "-a and -o go with -b.\n\n");
+			patch_usage(argv[0]);
+		}
+		if (argc - optind < 2 || argc - optind > 3) {
+			fprintf(stderr, "Need a patch file, an input file and "
+				"maybe an output file.\n\n");
+			patch_usage(argv[0]);
+		}
+		if (argc - optind == 3)
+			output = argv[optind + 2];
+	}
+
+	if ((ret = read_input(argv[optind], &text, &len)))
+		return ret;
+	if (!(patch = trs80_patch_new())) {
+		fprintf(stderr, "Out of memory.\n");
+		free(text);
+		return 3;
+	}
+	st = trs80_patch_read(patch, text, len, &diag);
+	free(text);
+	if (st) {
+		if (st == TRS80_E_NOMEM)
+			fprintf(stderr, "Out of memory.\n");
+		else
+			fprintf(stderr, "'%s', line %lu: %s.\n", argv[optind],
+				diag.linenum, trs80_strerror(st));
+		trs80_patch_free(patch);
+		return st == TRS80_E_NOMEM ? 3 : 2;
+	}
+	++optind;
+
+	if (output && !(outfile = fopen(output, "wb"))) {
+		fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+			output, strerror(errno), errno);
+		trs80_patch_free(patch);
+		return 1;
+	}
+
+	po.patch = patch;
+	opts.fn = patch_job;
+	opts.arg = &po;
+	opts.outfile = outfile;
+	opts.rptfile = stdout;
+	opts.errfile = stderr;
+	if (!output)
+		opts.output = BATCH_NONE;
+	else if (batch)
+		opts.output = batch_output_for(output);
+	else
+		opts.output = BATCH_CONCAT;
+
+	if (!batch)
+		ret = batch_run(&opts, argv + optind, 1);
+	else if (optind == argc)
+		ret = batch_run(&opts, stdin_operand, 1);
+	else
+		ret = batch_run(&opts, argv + optind, argc - optind);
+	trs80_patch_free(patch);
+
+	if (outfile) {
+		if (ferror(outfile) || fclose(outfile) == EOF) {
+			fprintf(stderr, "Error writing output file, %s (%d)\n",
+				strerror(errno), errno);
+			if (ret == 0)
+				ret = 3;
+		}
+		/* A single file that failed leaves nothing behind. */
+		if (!batch && ret)
+			unlink(output);
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	return ret;
+}
@@ -0,0 +1,492 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 profile: where a program spends its time.
+ *
+ * The program is loaded as it would be, from a CMD file or by
+ * assembling its source, and run from its transfer address for a number
+ * of T-states with nothing else in the machine.  Calls into ROM and the
+ * resident DOS are trapped and stood in for: the ones that end a
+ * program stop the run, the keyboard always has ENTER to give, and the
+ * rest return at once at a nominal cost.  Anything the program loaded
+ * itself over those areas runs as it is.
+ *
+ * The report lists the instructions with the most T-states, the loops
+ * they make up, and the calls that were trapped.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+
+
+#define	PROFILE_OPTIONS	"n:st:"
+
+#define	DEFAULT_TSTATES	100000000ULL
+#define	DEFAULT_TOP	20
+#define	CALL_COST	100		/* T-states for a call stood in for */
+#define	CLOCK_MHZ	1.77408		/* Model I */
+
+#define	DOS_EXIT	0x402d
+#define	DOS_ABORT	0x4030
+#define	ROM_KBD		0x002b
+#define	ROM_KEY		0x0049
+#define	SVC		0x0028		/* RST 28H, LS-DOS 6 */
+#define	SVC_EXIT	22
+#define	SVC_ABORT	21
+
+
+struct profile {
+	struct trs80_z80_profile	prof;
+	unsigned long		calls[TRS80_IMAGE_SIZE];
+	unsigned int		stop_addr;
+};
+
+/* The trapped ranges: ROM, and DOS below where programs load. */
+static const struct {
+	unsigned int	start;
+	unsigned int	end;
+} Trapped[] = {
+	{ 0x0000, 0x3000 },
+	{ 0x4000, 0x5200 },
+};
+
+static const struct {
+	unsigned int	addr;
+	const char	*name;
+} Call_Names[] = {
+	{ 0x0000, "reset" },
+	{ 0x0028, "SVC" },
+	{ 0x002b, "@KBD" },
+	{ 0x0033, "@DSP" },
+	{ 0x003b, "@PRT" },
+	{ 0x0049, "@KEY" },
+	{ 0x0060, "@PAUSE" },
+	{ 0x01c9, "@CLS" },
+	{ 0x402d, "@EXIT" },
+	{ 0x4030, "@ABORT" },
+	{ 0x4409, "@ERROR" },
+	{ 0x440d, "@DEBUG" },
+	{ 0x4420, "@INIT" },
+	{ 0x4424, "@OPEN" },
+	{ 0x4428, "@CLOSE" },
+	{ 0x442c, "@KILL" },
+	{ 0x4436, "@READ" },
+	{ 0x4439, "@WRITE" },
+	{ 0x4467, "@DSPLY" },
+	{ 0x446a, "@PRINT" },
+};
+
+
+static void
+profile_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-s] [-n tstates] [-t count] file\n"
+		"Runs a CMD file or EDTASM source from its transfer address "
+			"and reports\n"
+		"where the time went.\n"
+		"Options:\n"
+		"\t-n\tRun for tstates T-states (default %llu)\n"
+		"\t-s\tReport how fast the interpreter ran\n"
+		"\t-t\tList the top count addresses and loops (default %d)\n",
+		pgmname, DEFAULT_TSTATES, DEFAULT_TOP);
+
+	exit(1);
+}
+
+
+static const char *
+call_name(unsigned int addr)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(Call_Names) / sizeof(Call_Names[0]); ++i)
+		if (Call_Names[i].addr == addr)
+			return Call_Names[i].name;
+
+	return "";
+}
+
+
+static int
+stand_in(void *arg, struct trs80_z80_regs *regs, unsigned char *mem,
+	 unsigned long *tstates)
+{
+	struct profile	*p = arg;
+	unsigned int	a = regs->af >> 8;
+
+	(void)mem;
+
+	++p->calls[regs->pc];
+	*tstates = CALL_COST;
+
+	switch (regs->pc) {
+	case 0x0000:
+	case DOS_EXIT:
+	case DOS_ABORT:
+		p->stop_addr = regs->pc;
+		return TRS80_Z80_STOP;
+
+	case SVC:
+		if (a == SVC_EXIT || a == SVC_ABORT) {
+			p->stop_addr = regs->pc;
+			return TRS80_Z80_STOP;
+		}
+		break;
+
+	case ROM_KBD:
+		regs->af &= 0x00ff;
+		break;
+
+	case ROM_KEY:
+		regs->af = (regs->af & 0x00ff) | 0x0d00;
+		break;
+	}
+
+	return TRS80_Z80_RET;
+}
+
+
+/* Read all of a file, or stdin for "-", into a new malloc()ed buffer. */
+static int
+read_input(const char *name, unsigned char **bufp, size_t *lenp)
+{
+	FILE		*fp = stdin;
+	unsigned char	*buf = NULL;
+	size_t		len = 0, cap = 0;
+	int		ret = 0;
+
+	if (strcmp(name, "-") && !(fp = fopen(name, "rb"))) {
+		fprintf(stderr, "Can't open '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		return 2;
+	}
+
+	for (;;) {
+		size_t	n;
+
+		if (len == cap) {
+			unsigned char	*p;
+
+			cap = cap ? cap * 2 : 65536;
+			if (!(p = realloc(buf, cap))) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			buf = p;
+		}
+		if ((n = fread(buf + len, 1, cap - len, fp)) == 0)
+			break;
+		len += n;
+	}
+
+	if (ret == 0 && ferror(fp)) {
+		fprintf(stderr, "Error reading '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		ret = 2;
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+	*bufp = buf;
+	*lenp = len;
+
+	return 0;
+}
+
+
+static int
+load(const char *name, struct trs80_image *img)
+{
+	unsigned char	*buf;
+	size_t		len;
+	int		ret;
+
+	if ((ret = read_input(name, &buf, &len)))
+		return ret;
+
+	trs80_image_clear(img);
+	if (trs80_identify(buf, len) == TRS80_TYPE_CMD) {
+		struct trs80_error	err;
+		char			msg[128];
+		int			st;
+
+		st = trs80_image_cmd(img, buf, len, &err);
+		if (st != TRS80_OK) {
+			trs80_error_message(st, &err, msg, sizeof(msg));
+			fprintf(stderr, "%s: %s\n", name, msg);
+			ret = 2;
+		}
+	} else {
+		struct trs80_asm	*a;
+
+		if (!(a = trs80_asm_new())) {
+			fprintf(stderr, "Out of memory.\n");
+			ret = 3;
+		} else if (!(ret = asm_source(a, buf, len, stderr))) {
+			trs80_image_asm(img, a);
+		}
+		trs80_asm_free(a);
+	}
+	free(buf);
+
+	if (ret == 0 && !img->has_xfer) {
+		fprintf(stderr, "%s: No transfer address.\n", name);
+		ret = 2;
+	}
+
+	return ret;
+}
+
+
+/*
+ * Reports.
+ */
+
+struct loop {
+	unsigned int		start;
+	unsigned int		end;
+	unsigned long		count;
+	unsigned long long	cycles;
+};
+
+struct spot {
+	unsigned int		addr;
+	unsigned long long	cycles;
+};
+
+
+static int
+cmp_spot(const void *a, const void *b)
+{
+	const struct spot	*x = a, *y = b;
+
+	return x->cycles > y->cycles ? -1 : x->cycles < y->cycles;
+}
+
+
+static int
+cmp_loop(const void *a, const void *b)
+{
+	const struct loop	*x = a, *y = b;
+
+	return x->cycles > y->cycles ? -1 : x->cycles < y->cycles;
+}
+
+
+static double
+percent(unsigned long long part, unsigned long long whole)
+{
+	return whole ? 100.0 * part / whole : 0.0;
+}
+
+
+static int
+report(FILE *fp, const char *name, const struct profile *p, int end,
+       const struct trs80_z80_regs *regs, unsigned long long t, int top)
+{
+	const struct trs80_z80_profile	*prof = &p->prof;
+	struct spot	*spots;
+	struct loop	*loops;
+	size_t		nspots = 0, nloops = 0, i;
+	unsigned int	addr;
+
+	spots = malloc(TRS80_IMAGE_SIZE * sizeof(*spots));
+	loops = malloc(TRS80_IMAGE_SIZE * sizeof(*loops));
+	if (!spots || !loops) {
+		free(spots);
+		free(loops);
+		fprintf(stderr, "Out of memory.\n");
+		return 3;
+	}
+
+	fprintf(fp, "%s: ", name);
+	switch (end) {
+	case TRS80_Z80_HALTED:
+		fprintf(fp, "halted at %04x", regs->pc);
+		break;
+	case TRS80_Z80_STOPPED:
+		fprintf(fp, "exited through %04x %s", p->stop_addr,
+			call_name(p->stop_addr));
+		break;
+	default:
+		fprintf(fp, "still running at %04x", regs->pc);
+		break;
+	}
+	fprintf(fp, " after %llu T-states (%.3f s at %g MHz)\n",
+		t, t / (CLOCK_MHZ * 1e6), CLOCK_MHZ);
+
+	for (addr = 0; addr < TRS80_IMAGE_SIZE; ++addr) {
+		if (prof->cycles[addr] && !p->calls[addr]) {
+			spots[nspots].addr = addr;
+			spots[nspots++].cycles = prof->cycles[addr];
+		}
+		if (prof->loops[addr]) {
+			struct loop	*l = &loops[nloops++];
+			unsigned int	a;
+
+			l->start = addr;
+			l->end = prof->loop_end[addr];
+			l->count = prof->loops[addr];
+			l->cycles = 0;
+			for (a = l->start; a <= l->end; ++a)
+				l->cycles += prof->cycles[a];
+		}
+	}
+
+	qsort(spots, nspots, sizeof(*spots), cmp_spot);
+	qsort(loops, nloops, sizeof(*loops), cmp_loop);
+
+	fprintf(fp, "\nT-states by address:\n");
+	for (i = 0; i < nspots && i < (size_t)top; ++i)
+		fprintf(fp, "\t%04x  %14llu  %5.1f%%\n", spots[i].addr,
+			spots[i].cycles, percent(spots[i].cycles, t));
+
+	if (nloops) {
+		fprintf(fp, "\nHot loops:\n");
+		for (i = 0; i < nloops && i < (size_t)top; ++i)
+			fprintf(fp, "\t%04x-%04x  %14llu  %5.1f%%  "
+				    "%lu times\n",
+				loops[i].start, loops[i].end, loops[i].cycles,
+				percent(loops[i].cycles, t), loops[i].count);
+	}
+
+	for (addr = 0, i = 0; addr < TRS80_IMAGE_SIZE; ++addr) {
+		if (!p->calls[addr])
+			continue;
+		if (i++ == 0)
+			fprintf(fp, "\nROM and DOS calls:\n");
+		fprintf(fp, "\t%04x  %-8s %10lu\n", addr, call_name(addr),
+			p->calls[addr]);
+	}
+
+	free(spots);
+	free(loops);
+
+	return 0;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+profile_main(int argc, char **argv)
+{
+	struct trs80_image	*img;
+	struct trs80_z80_env	*env;
+	struct trs80_z80_regs	regs;
+	struct profile		*p;
+	struct timespec		t0, t1;
+	unsigned long long	limit = DEFAULT_TSTATES, t = 0;
+	int			opt, ret, end, speed = 0, top = DEFAULT_TOP;
+	size_t			i;
+
+	while ((opt = getopt(argc, argv, PROFILE_OPTIONS)) != -1) {
+		char	*ep;
+
+		switch (opt) {
+		case 'n':
+			errno = 0;
+			limit = strtoull(optarg, &ep, 10);
+			if (*ep || ep == optarg || errno || !limit) {
+				fprintf(stderr, "Bad T-state count '%s'.\n\n",
+					optarg);
+				profile_usage(argv[0]);
+			}
+			break;
+
+		case 's':
+			speed = 1;
+			break;
+
+		case 't':
+			top = (int)strtol(optarg, &ep, 10);
+			if (*ep || ep == optarg || top < 1) {
+				fprintf(stderr, "Bad count '%s'.\n\n", optarg);
+				profile_usage(argv[0]);
+			}
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			profile_usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "%s.\n\n", optind == argc ? "No input file" :
+			"Too many input files");
+		profile_usage(argv[0]);
+	}
+
+	img = malloc(sizeof(*img));
+	env = calloc(1, sizeof(*env));
+	p = calloc(1, sizeof(*p));
+	if (!img || !env || !p) {
+		fprintf(stderr, "Out of memory.\n");
+		ret = 3;
+		goto out;
+	}
+
+	if ((ret = load(argv[optind], img)))
+		goto out;
+
+	for (i = 0; i < sizeof(Trapped) / sizeof(Trapped[0]); ++i) {
+		unsigned int	addr;
+
+		for (addr = Trapped[i].start; addr < Trapped[i].end; ++addr)
+			if (!TRS80_IMAGE_LOADED(img, addr))
+				TRS80_Z80_TRAP(env, addr);
+	}
+	env->mem = img->mem;
+	env->trap_fn = stand_in;
+	env->arg = p;
+	env->profile = &p->prof;
+
+	trs80_image_start(img, &regs);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	end = trs80_z80_run(&regs, env, limit, &t);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ret = report(stdout, argv[optind], p, end, &regs, t, top);
+
+	if (speed) {
+		double	secs = (t1.tv_sec - t0.tv_sec) +
+			       (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+		printf("\n%llu T-states in %.3f s: %.0f MHz\n", t, secs,
+		       secs > 0 ? t / secs / 1e6 : 0.0);
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+out:
+	free(img);
+	free(env);
+	free(p);
+
+	return ret;
+}
@@ -0,0 +1,523 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * trs80 tape: the recordings on cassette tapes, from WAVE files of
+ * them or CAS images.
+ *
+ * A WAVE file is read and demodulated a buffer at a time, so a whole
+ * side of a tape never has to be in memory as samples, only the CAS
+ * image it comes to.  Each recording is then reported and, with -o,
+ * written into a tar or zip archive: SYSTEM tapes as CMD files, the
+ * rest as they are on the tape, which for EDTASM is what edtasmcvt
+ * reads.  The pipe command's tape stage does the same for the first
+ * recording of each input, to hand to the next stage.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+#include "archive.h"
+#include "batch.h"
+
+
+#define	TAPE_OPTIONS	"b:co:"
+
+#define	IOBUF		(256 * 1024)	/* Bytes read at a time */
+#define	SAMPLES		(64 * 1024)	/* Converted at a time */
+
+
+struct tape {
+	unsigned char	*cas;		/* The CAS image */
+	size_t		len;
+	size_t		cap;
+};
+
+struct report {
+	const char		*name;
+	struct ar_writer	*aw;
+	unsigned int		count;
+	int			ret;
+};
+
+
+static void
+tape_usage(const char *pgmname)
+{
+	fprintf(stderr,
+		"Usage: %s [-c] [-b baud] [-o out_archive] file...\n"
+		"Lists the recordings in cassette WAVE files or CAS images.\n"
+		"Options:\n"
+		"\t-b\tThe tapes are 500 or 1500 baud (default either)\n"
+		"\t-c\tWith -o, write each tape as a CAS image instead\n"
+		"\t-o\tExtract the recordings into a tar or zip (.zip) "
+			"archive\n",
+		pgmname);
+
+	exit(1);
+}
+
+
+/* Make room for n more bytes of CAS image.  Returns 0 or -1. */
+static int
+tape_room(struct tape *t, size_t n)
+{
+	unsigned char	*p;
+	size_t		cap = t->cap ? t->cap : IOBUF;
+
+	if (t->cap - t->len >= n)
+		return 0;
+	while (cap - t->len < n)
+		cap *= 2;
+	if (!(p = realloc(t->cas, cap)))
+		return -1;
+	t->cas = p;
+	t->cap = cap;
+
+	return 0;
+}
+
+
+/* Demodulate len bytes of wav's sample data onto t. */
+static int
+demodulate(struct trs80_cas *d, const struct trs80_wav *wav,
+	   const unsigned char *in, size_t len, short *samples,
+	   struct tape *t)
+{
+	size_t	frame = wav->channels * (wav->bits / 8);
+
+	while (len >= frame) {
+		size_t	take = len / frame < SAMPLES ? len / frame : SAMPLES;
+		size_t	n, outlen;
+
+		n = trs80_wav_samples(wav, in, take * frame, samples);
+		if (tape_room(t, trs80_cas_bound(n)))
+			return -1;
+		trs80_cas_decode(d, samples, n, t->cas + t->len, &outlen);
+		t->len += outlen;
+		in += take * frame;
+		len -= take * frame;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Read a tape from fd into t: demodulated if it is a WAVE file, as it
+ * is otherwise.  Returns an exit status.
+ */
+static int
+read_tape(int fd, const char *name, unsigned int baud, struct tape *t)
+{
+	unsigned char		*buf;
+	short			*samples = NULL;
+	struct trs80_cas	*d = NULL;
+	struct trs80_wav	wav;
+	size_t			have = 0, left = 0;
+	int			wave = -1, ret = 0;
+
+	if (!(buf = malloc(IOBUF))) {
+		fprintf(stderr, "Out of memory.\n");
+		return 3;
+	}
+
+	for (;;) {
+		ssize_t	n = read(fd, buf + have, IOBUF - have);
+		size_t	use, frame;
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "Error reading '%s', %s (%d)\n",
+				name, strerror(errno), errno);
+			ret = 2;
+			break;
+		}
+		have += n;
+
+		/* The header has to be in the first buffer full. */
+		if (wave < 0 && n > 0 && have < IOBUF)
+			continue;
+		if (wave < 0) {
+			wave = trs80_wav_parse(buf, have, &wav) == TRS80_OK;
+			if (!wave && have >= 4 && !memcmp(buf, "RIFF", 4)) {
+				fprintf(stderr, "'%s' is not a PCM WAVE file "
+					"of 8 or 16 bit samples.\n", name);
+				ret = 2;
+				break;
+			}
+			if (wave) {
+				if (!(d = trs80_cas_new(wav.rate, baud)) ||
+				    !(samples = malloc(SAMPLES *
+						       sizeof(*samples)))) {
+					fprintf(stderr, "'%s': can't "
+						"demodulate %u samples a "
+						"second.\n", name, wav.rate);
+					ret = d ? 3 : 2;
+					break;
+				}
+				left = wav.len ? wav.len : (size_t)-1;
+				have -= wav.offset;
+				memmove(buf, buf + wav.offset, have);
+			}
+		}
+
+		if (!wave) {
+			/* A CAS image, kept as it is. */
+			if (tape_room(t, have)) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			memcpy(t->cas + t->len, buf, have);
+			t->len += have;
+			have = 0;
+		} else {
+			frame = wav.channels * (wav.bits / 8);
+			use = have < left ? have : left;
+			use -= use % frame;
+			if (demodulate(d, &wav, buf, use, samples, t)) {
+				fprintf(stderr, "Out of memory.\n");
+				ret = 3;
+				break;
+			}
+			left -= use;
+			have -= use;
+			memmove(buf, buf + use, have);
+			if (left < frame)
+				break;
+		}
+
+		if (n == 0)
+			break;
+	}
+
+	trs80_cas_free(d);
+	free(samples);
+	free(buf);
+
+	return ret;
+}
+
+
+/* The file a recording makes: a CMD file for SYSTEM, else its data. */
+static int
+tape_file(const struct trs80_cas_file *f, unsigned char **outp,
+	  size_t *outlenp, FILE *errfile)
+{
+	struct trs80_error	err;
+	char			msg[80];
+	int			status;
+
+	*outp = NULL;
+	*outlenp = 0;
+
+	if (f->kind != TRS80_CAS_SYSTEM) {
+		if (!(*outp = malloc(f->len ? f->len : 1))) {
+			fprintf(errfile, "Out of memory.\n");
+			return 3;
+		}
+		memcpy(*outp, f->data, f->len);
+		*outlenp = f->len;
+		return 0;
+	}
+
+	if (!(*outp = malloc(f->len + 2))) {
+		fprintf(errfile, "Out of memory.\n");
+		return 3;
+	}
+	if ((status = trs80_cas_cmd(f->data, f->len, *outp, outlenp, &err))) {
+		trs80_error_message(status, &err, msg, sizeof(msg));
+		fprintf(errfile, "%s Offset = %zu\n", msg, err.offset);
+		free(*outp);
+		*outp = NULL;
+		return 2;
+	}
+
+	return 0;
+}
+
+
+static int
+first_file(void *arg, const struct trs80_cas_file *f)
+{
+	*(struct trs80_cas_file *)arg = *f;
+
+	return 1;
+}
+
+
+/* The pipe command's tape stage. */
+int
+tape_buffer(const unsigned char *in, size_t len, unsigned char **outp,
+	    size_t *outlenp, FILE *errfile)
+{
+	struct trs80_cas_file	f;
+	struct trs80_wav	wav;
+	struct tape		t;
+	int			ret;
+
+	*outp = NULL;
+	*outlenp = 0;
+	memset(&t, 0, sizeof(t));
+
+	if (trs80_wav_parse(in, len, &wav) == TRS80_OK) {
+		struct trs80_cas	*d;
+		short			*samples;
+		size_t			n = len - wav.offset;
+
+		if (wav.len && wav.len < n)
+			n = wav.len;
+		if (!(d = trs80_cas_new(wav.rate, 0))) {
+			fprintf(errfile, "Can't demodulate %u samples a "
+				"second.\n", wav.rate);
+			return 2;
+		}
+		if (!(samples = malloc(SAMPLES * sizeof(*samples))) ||
+		    demodulate(d, &wav, in + wav.offset, n, samples, &t)) {
+			fprintf(errfile, "Out of memory.\n");
+			free(samples);
+			trs80_cas_free(d);
+			free(t.cas);
+			return 3;
+		}
+		free(samples);
+		trs80_cas_free(d);
+		in = t.cas;
+		len = t.len;
+	}
+
+	if (trs80_cas_files(in, len, first_file, &f) != 1) {
+		fprintf(errfile, "No recordings found.\n");
+		free(t.cas);
+		return 2;
+	}
+	ret = tape_file(&f, outp, outlenp, errfile);
+	free(t.cas);
+
+	return ret;
+}
+
+
+static const char *
+kind_name(int kind)
+{
+	switch (kind) {
+	case TRS80_CAS_SYSTEM:
+		return "SYSTEM";
+	case TRS80_CAS_EDTASM:
+		return "EDTASM";
+	case TRS80_CAS_BASIC:
+		return "BASIC";
+	default:
+		return "data";
+	}
+}
+
+
+static const char *
+kind_ext(int kind)
+{
+	switch (kind) {
+	case TRS80_CAS_SYSTEM:
+		return "CMD";
+	case TRS80_CAS_EDTASM:
+		return "ASM";
+	case TRS80_CAS_BASIC:
+		return "BAS";
+	default:
+		return "DAT";
+	}
+}
+
+
+static const char *
+base_name(const char *path)
+{
+	const char	*p = strrchr(path, '/');
+
+	if (!strcmp(path, "-"))
+		return "stdin";
+
+	return p ? p + 1 : path;
+}
+
+
+static int
+report_file(void *arg, const struct trs80_cas_file *f)
+{
+	struct report	*r = arg;
+	unsigned char	*out;
+	size_t		outlen;
+	char		path[4096];
+	int		ret;
+
+	++r->count;
+	printf("%s: %2u  %4u baud  %-6s %-6s %8zu\n", r->name, r->count,
+	       f->baud, kind_name(f->kind), f->name, f->len);
+
+	if (!r->aw)
+		return 0;
+
+	fflush(stdout);
+	if ((ret = tape_file(f, &out, &outlen, stderr))) {
+		if (ret > r->ret)
+			r->ret = ret;
+		return ret == 3;
+	}
+
+	snprintf(path, sizeof(path), "%s/%02u%s%s.%s", base_name(r->name),
+		 r->count, f->name[0] ? "-" : "", f->name, kind_ext(f->kind));
+	ret = ar_add(r->aw, path, out, outlen, 0, 0644);
+	free(out);
+	if (ret) {
+		fprintf(stderr, "Error writing output archive.\n");
+		r->ret = 3;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Report on and extract the recordings in one tape. */
+static int
+do_tape(const char *name, unsigned int baud, int whole,
+	struct ar_writer *aw)
+{
+	struct report	r;
+	struct tape	t;
+	int		fd = 0, ret;
+
+	if (strcmp(name, "-") && (fd = open(name, O_RDONLY)) == -1) {
+		fprintf(stderr, "Can't open '%s', %s (%d)\n",
+			name, strerror(errno), errno);
+		return 2;
+	}
+
+	memset(&t, 0, sizeof(t));
+	ret = read_tape(fd, name, baud, &t);
+	if (fd)
+		close(fd);
+	if (ret) {
+		free(t.cas);
+		return ret;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.name = name;
+	r.aw = whole ? NULL : aw;
+	trs80_cas_files(t.cas, t.len, report_file, &r);
+	ret = r.ret;
+
+	if (r.count == 0) {
+		fprintf(stderr, "%s: No recordings found.\n", name);
+		ret = 2;
+	} else if (whole && aw) {
+		char	path[4096];
+
+		snprintf(path, sizeof(path), "%s.CAS", base_name(name));
+		if (ar_add(aw, path, t.cas, t.len, 0, 0644)) {
+			fprintf(stderr, "Error writing output archive.\n");
+			ret = 3;
+		}
+	}
+
+	free(t.cas);
+
+	return ret;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+tape_main(int argc, char **argv)
+{
+	const char		*output = NULL;
+	FILE			*outfile = NULL;
+	struct ar_writer	*aw = NULL;
+	unsigned int		baud = 0;
+	int			opt, ret = 0, whole = 0, i;
+
+	while ((opt = getopt(argc, argv, TAPE_OPTIONS)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (strcmp(optarg, "500") && strcmp(optarg, "1500")) {
+				fprintf(stderr, "Bad baud rate '%s'.\n\n",
+					optarg);
+				tape_usage(argv[0]);
+			}
+			baud = (unsigned int)atoi(optarg);
+			break;
+
+		case 'c':
+			whole = 1;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			tape_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "No input files.\n\n");
+		tape_usage(argv[0]);
+	}
+
+	if (output) {
+		if (!(outfile = fopen(output, "wb"))) {
+			fprintf(stderr, "Failed to open file '%s', %s (%d)\n",
+				output, strerror(errno), errno);
+			return 1;
+		}
+		if (!(aw = ar_create(outfile, batch_output_for(output) ==
+						BATCH_ZIP ? AR_ZIP : AR_TAR))) {
+			fprintf(stderr, "Out of memory.\n");
+			fclose(outfile);
+			return 3;
+		}
+	}
+
+	for (i = optind; i < argc && ret != 3; ++i) {
+		int	r = do_tape(argv[i], baud, whole, aw);
+
+		if (r > ret)
+			ret = r;
+	}
+
+	if (aw && ar_finish(aw) && ret != 3) {
+		fprintf(stderr, "Error writing output archive.\n");
+		ret = 3;
+	}
+	if (outfile && fclose(outfile) == EOF && ret != 3) {
+		fprintf(stderr, "Error closing output archive, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		fprintf(stderr, "Error writing output, %s (%d)\n",
+			strerror(errno), errno);
+		ret = 3;
+	}
+
+	return ret;
+}
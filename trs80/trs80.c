@@ -0,0 +1,442 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * Multi-call binary for the TRS-80 utilities.
+ *
+ * Run as "trs80 command [args...]", or through a link named after one
+ * of the original utilities, which then behaves exactly like it.
+ *
+ * The pipe command runs a chain of stages over every input, handing
+ * each stage's result straight to the next in memory, so a file is
+ * read and parsed once however many steps it goes through.  Inputs
+ * can be files or members of tar and zip archives, and results can be
+ * collected into one archive, as in the utilities' batch modes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trs80util.h"
+#include "trs80.h"
+
+#ifdef HAVE_FMEMOPEN
+#include "batch.h"
+#endif
+
+
+#define	MAX_STAGES	8
+
+#ifdef HAVE_PTHREAD
+#define	JOBS_OPTS	"j:"
+#define	JOBS_USAGE	" [-j jobs]"
+#else
+#define	JOBS_OPTS	""
+#define	JOBS_USAGE	""
+#endif
+
+#define	PIPE_OPTIONS	"acfo:qs" JOBS_OPTS
+
+
+static void
+vfatal(int exitval, const char *fmsg, va_list ap)
+{
+	vfprintf(stderr, fmsg, ap);
+	exit(exitval);
+}
+
+
+static void
+fatal(int exitval, const char *fmsg, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmsg);
+	vfatal(exitval, fmsg, ap);
+	va_end(ap);
+}
+
+
+#ifdef HAVE_FMEMOPEN
+enum stage {
+	STAGE_IDENTIFY,
+	STAGE_EDTASM,
+	STAGE_STRIP,
+	STAGE_ASM,
+	STAGE_TAPE,
+	STAGE_AUTO
+};
+
+static const char *const Stage_Names[] = {
+	"identify",
+	"edtasm",
+	"strip",
+	"asm",
+	"tape",
+	"auto"
+};
+
+struct pipe_opts {
+	unsigned int	flags;		/* TRS80_EDTASM_* */
+	int		quiet;
+	int		nstages;
+	enum stage	stages[MAX_STAGES];
+};
+
+
+static void
+pipe_usage(const char *pgmname)
+{
+	static const char usage_str[] =
+		"Usage: %s [-acfqs]" JOBS_USAGE " [-o out_archive] "
+			"stage[,stage...] file...\n"
+		"Stages:\n"
+		"\tidentify  Report each input's type\n"
+		"\tedtasm    Convert an EDTASM file to text\n"
+		"\tstrip     Strip trailing junk from a CMD file\n"
+		"\tasm       Assemble EDTASM source into a CMD file\n"
+		"\ttape      Take the first file off a cassette recording "
+			"or CAS image\n"
+		"\tauto      edtasm or strip, as the input needs\n"
+		"Options:\n"
+		"\t-a\tInputs are tar or zip archives (stdin if none)\n"
+		"\t-c\tConvert to newer EDTASM format\n"
+		"\t-f\tShow EDTASM file header if present\n"
+#ifdef HAVE_PTHREAD
+		"\t-j\tRun with jobs threads (0 = one per CPU)\n"
+#endif
+		"\t-o\tOutput tar or zip (.zip) archive, default the "
+			"results one\n"
+		"\t\tafter another to stdout (none if the last stage "
+			"is identify)\n"
+		"\t-q\tReport on CMD files quietly (repeat for more quiet)\n"
+		"\t-s\tStrip EDTASM line numbers\n";
+
+	fatal(1, usage_str, pgmname);
+}
+
+
+/* Returns 0 on success, -1 on a bad stage list. */
+static int
+parse_stages(struct pipe_opts *o, char *list)
+{
+	char	*name, *save;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		int	i;
+
+		for (i = 0; i <= STAGE_AUTO; ++i)
+			if (!strcmp(name, Stage_Names[i]))
+				break;
+
+		if (i > STAGE_AUTO) {
+			fprintf(stderr, "Unknown stage '%s'.\n\n", name);
+			return -1;
+		}
+		if (o->nstages == MAX_STAGES) {
+			fprintf(stderr, "Too many stages.\n\n");
+			return -1;
+		}
+		o->stages[o->nstages++] = i;
+	}
+
+	if (o->nstages == 0) {
+		fprintf(stderr, "No stages.\n\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Run every stage over one input.  data always points at the current
+ * result: the input itself, a prefix of it after strip, or a buffer of
+ * converted text after edtasm, of a CMD file after asm, or of the file
+ * taken off a tape.
+ */
+
+static int
+pipe_job(struct batch_job *job)
+{
+	const struct pipe_opts	*o = job->arg;
+	const unsigned char	*data = job->data;
+	size_t			len = job->size;
+	unsigned char		*buf = NULL;
+	int			i, ret = 0;
+
+	for (i = 0; i < o->nstages && ret == 0; ++i) {
+		enum stage	stage = o->stages[i];
+		int		type;
+
+		if (stage == STAGE_IDENTIFY || stage == STAGE_AUTO) {
+			type = trs80_identify(data, len);
+
+			if (stage == STAGE_IDENTIFY) {
+				fprintf(job->rpt, "%s: %s\n", job->name,
+					trs80_type_name(type));
+				continue;
+			}
+
+			if (type == TRS80_TYPE_UNKNOWN) {
+				fprintf(job->err, "Unrecognized file type.\n");
+				ret = 2;
+				break;
+			}
+			stage = type == TRS80_TYPE_CMD ? STAGE_STRIP :
+							 STAGE_EDTASM;
+		}
+
+		switch (stage) {
+		case STAGE_EDTASM: {
+			unsigned char	*out;
+
+			ret = edtasm_buffer(data, len, o->flags, &out, &len,
+					    job->err);
+			free(buf);
+			data = buf = out;
+			break;
+		}
+
+		case STAGE_ASM: {
+			unsigned char	*out;
+
+			ret = asm_buffer(data, len, &out, &len, job->err);
+			free(buf);
+			data = buf = out;
+			break;
+		}
+
+		case STAGE_TAPE: {
+			unsigned char	*out;
+
+			ret = tape_buffer(data, len, &out, &len, job->err);
+			free(buf);
+			data = buf = out;
+			break;
+		}
+
+		case STAGE_STRIP:
+			if (!o->quiet)
+				fprintf(job->rpt, "Member = \"%s\"\n",
+					job->name);
+			ret = strip_buffer(data, len, &len, job->rpt,
+					   job->err, o->quiet);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (ret == 0 && job->out)
+		fwrite(data, 1, len, job->out);
+	free(buf);
+
+	return ret;
+}
+
+
+static int
+pipe_main(int argc, char **argv)
+{
+	static char		*stdin_operand[] = { "-" };
+	struct pipe_opts	po;
+	struct batch_opts	opts;
+	const char		*output = NULL;
+	FILE			*outfile = stdout;
+	int			i, opt, ret;
+
+	memset(&po, 0, sizeof(po));
+	memset(&opts, 0, sizeof(opts));
+	opts.jobs = 1;
+
+	while ((opt = getopt(argc, argv, PIPE_OPTIONS)) != -1) {
+		switch (opt) {
+		case 'a':
+			opts.archives = 1;
+			break;
+
+		case 'c':
+			po.flags |= TRS80_EDTASM_NEWER;
+			break;
+
+		case 'f':
+			po.flags |= TRS80_EDTASM_HEADER;
+			break;
+
+#ifdef HAVE_PTHREAD
+		case 'j': {
+			char	*ep;
+			long	jobs = strtol(optarg, &ep, 10);
+
+			if (*ep || ep == optarg || jobs < 0 || jobs > 1024) {
+				fprintf(stderr, "Bad job count '%s'.\n\n",
+					optarg);
+				pipe_usage(argv[0]);
+			}
+			opts.jobs = (int)jobs;
+			break;
+		}
+#endif
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'q':
+			++po.quiet;
+			break;
+
+		case 's':
+			po.flags |= TRS80_EDTASM_NOLINENUMS;
+			break;
+
+		default:
+			fprintf(stderr, "\n");
+			pipe_usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "No stages.\n\n");
+		pipe_usage(argv[0]);
+	}
+	if (parse_stages(&po, argv[optind++]))
+		pipe_usage(argv[0]);
+
+	if (optind == argc && !opts.archives) {
+		fprintf(stderr, "No input files.\n\n");
+		pipe_usage(argv[0]);
+	}
+
+	if (output && !(outfile = fopen(output, "w+")))
+		fatal(1, "Failed to open file '%s', %s (%d)\n",
+			output, strerror(errno), errno);
+
+	opts.fn = pipe_job;
+	opts.arg = &po;
+	opts.outfile = outfile;
+	opts.rptfile = stdout;
+	opts.errfile = stderr;
+
+	/* Whatever follows asm, the results are CMD files. */
+	for (i = 0; i < po.nstages; ++i)
+		if (po.stages[i] == STAGE_ASM)
+			opts.suffix = ".CMD";
+
+	if (output)
+		opts.output = batch_output_for(output);
+	else if (po.stages[po.nstages - 1] == STAGE_IDENTIFY)
+		opts.output = BATCH_NONE;
+	else
+		opts.output = BATCH_CONCAT;
+
+	if (optind == argc)
+		ret = batch_run(&opts, stdin_operand, 1);
+	else
+		ret = batch_run(&opts, argv + optind, argc - optind);
+
+	if (ret == 0) {
+		/* We think we succeeded, but let's be sure. */
+
+		if (ferror(outfile))
+			fatal(3, "Error detected after writing output file.\n");
+
+		if (fclose(outfile) == EOF)
+			fatal(3, "Error detected when closing output file, "
+					"%s (%d)\n", strerror(errno), errno);
+	}
+
+	return ret;
+}
+#endif
+
+
+static const struct command {
+	const char	*name;
+	int		(*main)(int argc, char **argv);
+	const char	*help;
+} Commands[] = {
+	{ "edtasm",	edtasmcvt_main,	"Convert EDTASM files (edtasmcvt)" },
+	{ "stripcmd",	stripcmd_main,	"Check and strip CMD files" },
+	{ "profile",	profile_main,	"Run a program and report its hot spots" },
+	{ "disk",	disk_main,	"Write files into JV1 and JV3 disk images" },
+#ifdef HAVE_FMEMOPEN
+	{ "pipe",	pipe_main,	"Run stages over inputs in memory" },
+	{ "match",	match_main,	"Pair EDTASM sources with CMD files" },
+	{ "carve",	carve_main,	"Recover files from raw disk images" },
+	{ "tape",	tape_main,	"Decode cassette recordings and CAS images" },
+	{ "overlap",	overlap_main,	"Find where CMD files' loads overlap" },
+	{ "diff",	diff_main,	"Compare CMD files by the memory they load" },
+	{ "pack",	pack_main,	"Make self-extracting CMD files" },
+	{ "mkcmd",	mkcmd_main,	"Build CMD files from Intel HEX and binaries" },
+	{ "patch",	patch_main,	"Apply LS-DOS patch files to CMD files" },
+#endif
+	/* Names the binary answers to through links. */
+	{ "edtasmcvt",	edtasmcvt_main,	NULL },
+	{ NULL }
+};
+
+
+static void
+usage(const char *pgmname)
+{
+	const struct command	*c;
+
+	fprintf(stderr, "Usage: %s command [args...]\n"
+			"Commands:\n", pgmname);
+
+	for (c = Commands; c->name; ++c)
+		if (c->help)
+			fprintf(stderr, "\t%-10s%s\n", c->name, c->help);
+
+	exit(1);
+}
+
+
+static const struct command *
+find_command(const char *name)
+{
+	const struct command	*c;
+
+	for (c = Commands; c->name; ++c)
+		if (!strcmp(c->name, name))
+			return c;
+
+	return NULL;
+}
+
+
+/*
+ * Exit --
+ * 	0: Success
+ * 	1: User error (bad args)
+ * 	2: Input file error
+ * 	3: Internal error (bad programmer!)
+ */
+
+int
+main(int argc, char **argv)
+{
+	const struct command	*c;
+	const char		*base;
+
+	base = strrchr(argv[0], '/');
+	base = base ? base + 1 : argv[0];
+
+	if ((c = find_command(base)))
+		return c->main(argc, argv);
+
+	if (argc < 2 || !(c = find_command(argv[1]))) {
+		if (argc >= 2)
+			fprintf(stderr, "Unknown command '%s'.\n\n", argv[1]);
+		usage(base);
+	}
+
+	return c->main(argc - 1, argv + 1);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2023, Quentin L. Barnes
+ *
+ * What the utilities export when built into the trs80 multi-call
+ * binary (with TRS80_MULTICALL defined).
+ */
+
+#ifndef TRS80_H
+#define TRS80_H
+
+#include <stdio.h>
+
+#include "trs80util.h"
+
+
+/* The utilities' main()s, and the commands only trs80 has. */
+int edtasmcvt_main(int argc, char **argv);
+int stripcmd_main(int argc, char **argv);
+int match_main(int argc, char **argv);
+int profile_main(int argc, char **argv);
+int carve_main(int argc, char **argv);
+int tape_main(int argc, char **argv);
+int disk_main(int argc, char **argv);
+int overlap_main(int argc, char **argv);
+int diff_main(int argc, char **argv);
+int pack_main(int argc, char **argv);
+int mkcmd_main(int argc, char **argv);
+int patch_main(int argc, char **argv);
+
+/*
+ * Their cores, working on buffers in memory.  All return an exit
+ * status as for main() and write diagnostics to errfile.
+ */
+
+/* Decode an EDTASM file into a new malloc()ed buffer. */
+int edtasm_buffer(const unsigned char *in, size_t len, unsigned int flags,
+		  unsigned char **outp, size_t *outlenp, FILE *errfile);
+
+/* Assemble an EDTASM file or source text with a, or into a new
+ * malloc()ed CMD file. */
+int asm_source(struct trs80_asm *a, const unsigned char *in, size_t len,
+	       FILE *errfile);
+int asm_buffer(const unsigned char *in, size_t len, unsigned char **outp,
+	       size_t *outlenp, FILE *errfile);
+
+/* Report on a CMD file, setting *endp to its length less any junk. */
+int strip_buffer(const unsigned char *buf, size_t len, size_t *endp,
+		 FILE *rptfile, FILE *errfile, int quiet);
+
+/* Take the first file off a WAVE recording or CAS image of a tape into
+ * a new malloc()ed buffer, a SYSTEM tape as a CMD file. */
+int tape_buffer(const unsigned char *in, size_t len, unsigned char **outp,
+		size_t *outlenp, FILE *errfile);
+
+#endif